@@ -0,0 +1,483 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : cmpsc311_assocarr.c
+//  Description    : This is the implementation of the CMPSC311 associative
+//                   array support library.  The array is an open addressing
+//                   hash table with linear probing, so inserts, finds and
+//                   deletes take constant time however many keys it holds.
+//
+//                   Important: the iterator walks the slots of the table, so
+//                   keys come back in no particular order.  Deleting during
+//                   a walk is safe (slots never move on delete), inserting is
+//                   not (the table may grow and rehash).
+//
+//  Author         : Patrick McDaniel
+//  Change Log     :
+//
+//     01/25/20 - Created the intial version of the associate array
+//                implementation
+//     10/18/26 - Replaced the sorted linked list with an open addressing
+//                hash table
+//
+
+// Includes
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <cmpsc311_log.h>
+#include <cmpsc311_assocarr.h>
+
+// Defines
+#define AA_MIN_CAPACITY 16 // slots of a table on its first insert
+
+// Marks a slot whose key was deleted, probes continue past it
+static char aaDeletedKey;
+#define AA_DELETED ((void *)&aaDeletedKey)
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : aaMix
+// Description  : Spread the bits of a key hash so that similar keys (small
+//                integers, aligned pointers) land in different slots
+//
+// Inputs       : h - the hash from the callback
+// Outputs      : the mixed hash
+
+static unsigned long aaMix( unsigned long h ) {
+    uint64_t z = (uint64_t)h;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return( (unsigned long)(z ^ (z >> 31)) );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : aaHash
+// Description  : Hash a key, every key hashes the same with no callback
+//
+// Inputs       : ar - the array
+//                key - the key
+// Outputs      : the mixed hash
+
+static unsigned long aaHash( AssocArray *ar, void *key ) {
+    return( aaMix(ar->keyHash ? ar->keyHash(key) : 0) );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : aaFindSlot
+// Description  : Find the slot holding a key
+//
+// Inputs       : ar - the array
+//                key - the key
+//                hash - its mixed hash
+// Outputs      : the slot index, -1 if the key is not there
+
+static int aaFindSlot( AssocArray *ar, void *key, unsigned long hash ) {
+
+    // Local variables
+    AssocArrayElement *el;
+    int mask = ar->capacity - 1, i;
+
+    // Probe until an empty slot, skipping deleted ones
+    if ( ar->capacity == 0 ) {
+        return( -1 );
+    }
+    for ( i = (int)(hash & mask); ar->elements[i].key != NULL; i = (i + 1) & mask ) {
+        el = &ar->elements[i];
+        if ( (el->key != AA_DELETED) && (el->hash == hash) &&
+             (ar->keyCompare(el->key, key) == 0) ) {
+            return( i );
+        }
+    }
+    return( -1 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : aaResize
+// Description  : Move the elements into a table of a new size, dropping the
+//                deleted slots
+//
+// Inputs       : ar - the array
+//                capacity - the new number of slots, a power of two
+// Outputs      : 0 if successful, -1 if failure
+
+static int aaResize( AssocArray *ar, int capacity ) {
+
+    // Local variables
+    AssocArrayElement *old = ar->elements, *el;
+    int oldcap = ar->capacity, mask = capacity - 1, i, j;
+
+    // Allocate the new slots, all empty
+    if ( (ar->elements = calloc(capacity, sizeof(AssocArrayElement))) == NULL ) {
+        ar->elements = old;
+        logMessage( LOG_ERROR_LEVEL, "Failed allocating associative array of %d slots", capacity );
+        return( -1 );
+    }
+    ar->capacity = capacity;
+    ar->noDeleted = 0;
+
+    // Re-insert every live element, the stored hash saves calling back
+    for ( i = 0; i < oldcap; i++ ) {
+        el = &old[i];
+        if ( (el->key != NULL) && (el->key != AA_DELETED) ) {
+            for ( j = (int)(el->hash & mask); ar->elements[j].key != NULL; j = (j + 1) & mask );
+            ar->elements[j] = *el;
+        }
+    }
+    free( old );
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : init_assoc
+// Description  : Initialize the array structure, with the hash matching
+//                one of the generic key callbacks
+//
+// Inputs       : arr - the array to initialize
+//                kcb - the key compare callback
+//                vcb - the value compare callback
+// Outputs      : 0 if successful, -1 if failure
+
+int init_assoc( AssocArray *arr, compareCallback kcb, compareCallback vcb ) {
+
+    // Local variables
+    hashCallback hcb = NULL;
+
+    // Pick the hash for the generic compares, others get a constant hash
+    if ( kcb == stringCompareCallback ) {
+        hcb = stringHashCallback;
+    } else if ( (kcb == int32CompareCallback) || (kcb == uint32CompareCallback) ) {
+        hcb = int32HashCallback;
+    } else if ( (kcb == int8CompareCallback) || (kcb == uint8CompareCallback) ) {
+        hcb = int8HashCallback;
+    } else if ( kcb == pointerCompareCallback ) {
+        hcb = pointerHashCallback;
+    }
+    return( init_assoc_hash(arr, kcb, vcb, hcb) );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : init_assoc_hash
+// Description  : Initialize the array structure with a key hash callback
+//
+// Inputs       : arr - the array to initialize
+//                kcb - the key compare callback
+//                vcb - the value compare callback
+//                hcb - the key hash callback, NULL to hash every key the
+//                      same (correct, but each operation walks the table)
+// Outputs      : 0 if successful, -1 if failure
+
+int init_assoc_hash( AssocArray *arr, compareCallback kcb, compareCallback vcb, hashCallback hcb ) {
+    memset( arr, 0x0, sizeof(AssocArray) );
+    arr->keyCompare = kcb;
+    arr->valCompare = vcb;
+    arr->keyHash = hcb;
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : insert_assoc
+// Description  : Insert a K/V into the associative array
+//
+// Inputs       : ar - the array
+//                key - the key, not NULL
+//                val - the value
+// Outputs      : 0 if successful, -1 if failure (or the key is already there)
+
+int insert_assoc( AssocArray *ar, void *key, void *val ) {
+
+    // Local variables
+    unsigned long hash;
+    int capacity, mask, i, slot = -1;
+
+    // Check the key, rebuild the table past three quarters full (only
+    // dropping the deleted slots if the elements fill under half of it)
+    if ( key == NULL ) {
+        return( -1 );
+    }
+    if ( (ar->noElements + ar->noDeleted + 1) * 4 > ar->capacity * 3 ) {
+        capacity = ((ar->noElements + 1) * 2 > ar->capacity) ? ar->capacity * 2 : ar->capacity;
+        if ( aaResize(ar, capacity ? capacity : AA_MIN_CAPACITY) ) {
+            return( -1 );
+        }
+    }
+
+    // Probe for the key, remembering the first reusable slot
+    hash = aaHash( ar, key );
+    mask = ar->capacity - 1;
+    for ( i = (int)(hash & mask); ar->elements[i].key != NULL; i = (i + 1) & mask ) {
+        if ( ar->elements[i].key == AA_DELETED ) {
+            if ( slot == -1 ) {
+                slot = i;
+            }
+        } else if ( (ar->elements[i].hash == hash) &&
+                    (ar->keyCompare(ar->elements[i].key, key) == 0) ) {
+            return( -1 );
+        }
+    }
+    if ( slot == -1 ) {
+        slot = i;
+    } else {
+        ar->noDeleted--;
+    }
+
+    // Fill the slot
+    ar->elements[slot].key = key;
+    ar->elements[slot].value = val;
+    ar->elements[slot].hash = hash;
+    ar->noElements++;
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : delete_assoc
+// Description  : Remove a key/value pair by key
+//
+// Inputs       : ar - the array
+//                key - the key
+// Outputs      : 0 if successful, -1 if failure (not found)
+
+int delete_assoc( AssocArray *ar, void *key ) {
+
+    // Local variables
+    int slot;
+
+    // Find the key, leave a marker so later keys are still found
+    if ( (key == NULL) || ((slot = aaFindSlot(ar, key, aaHash(ar, key))) == -1) ) {
+        return( -1 );
+    }
+    ar->elements[slot].key = AA_DELETED;
+    ar->elements[slot].value = NULL;
+    ar->noElements--;
+    ar->noDeleted++;
+
+    // Once empty, no marker is needed
+    if ( ar->noElements == 0 ) {
+        memset( ar->elements, 0x0, sizeof(AssocArrayElement) * ar->capacity );
+        ar->noDeleted = 0;
+    }
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : find_assoc
+// Description  : Find a value by the key in the table
+//
+// Inputs       : ar - the array
+//                key - the key
+// Outputs      : the value, NULL if not found
+
+void * find_assoc( AssocArray *ar, void *key ) {
+
+    // Local variables
+    int slot;
+
+    if ( (key == NULL) || (ar->noElements == 0) ||
+         ((slot = aaFindSlot(ar, key, aaHash(ar, key))) == -1) ) {
+        return( NULL );
+    }
+    return( ar->elements[slot].value );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : clear_assoc
+// Description  : Clear out the entire array
+//
+// Inputs       : ar - the array
+//                freeKeys - free the keys
+//                freeValues - free the values
+// Outputs      : 0 if successful, -1 if failure
+
+int clear_assoc( AssocArray *ar, int freeKeys, int freeValues ) {
+
+    // Local variables
+    int i;
+
+    // Free what was asked for, then the slots
+    for ( i = 0; i < ar->capacity; i++ ) {
+        if ( (ar->elements[i].key != NULL) && (ar->elements[i].key != AA_DELETED) ) {
+            if ( freeKeys ) {
+                free( ar->elements[i].key );
+            }
+            if ( freeValues ) {
+                free( ar->elements[i].value );
+            }
+        }
+    }
+    free( ar->elements );
+    ar->elements = NULL;
+    ar->capacity = ar->noElements = ar->noDeleted = ar->iterator = 0;
+    return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : nextIterator
+// Description  : Get the next value in the iterator, in no particular order
+//
+// Inputs       : ar - the array
+//                key - place for the key, NULL past the last element
+//                value - place for the value, NULL past the last element
+//                reset - start again from the first element
+// Outputs      : 0 if successful, -1 if failure
+
+int nextIterator( AssocArray *ar, void **key, void **value, int reset ) {
+
+    // Start over if asked, then move to the next live slot
+    if ( reset ) {
+        ar->iterator = 0;
+    }
+    while ( ar->iterator < ar->capacity ) {
+        AssocArrayElement *el = &ar->elements[ar->iterator++];
+        if ( (el->key != NULL) && (el->key != AA_DELETED) ) {
+            *key = el->key;
+            *value = el->value;
+            return( 0 );
+        }
+    }
+    *key = *value = NULL;
+    return( 0 );
+}
+
+/* Generic Callback Functions */
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : *CompareCallback
+// Description  : Compare two keys/values, the result is below, at or above
+//                zero as the first is less than, equal to or greater than
+//                the second
+//
+// Inputs       : arga - the first
+//                argb - the second
+// Outputs      : the comparison
+
+int int32CompareCallback( void *arga, void *argb ) {
+    int32_t a = *(int32_t *)arga, b = *(int32_t *)argb;
+    return( (a > b) - (a < b) );
+}
+
+int uint32CompareCallback( void *arga, void *argb ) {
+    uint32_t a = *(uint32_t *)arga, b = *(uint32_t *)argb;
+    return( (a > b) - (a < b) );
+}
+
+int int8CompareCallback( void *arga, void *argb ) {
+    return( *(int8_t *)arga - *(int8_t *)argb );
+}
+
+int uint8CompareCallback( void *arga, void *argb ) {
+    return( *(uint8_t *)arga - *(uint8_t *)argb );
+}
+
+int stringCompareCallback( void *arga, void *argb ) {
+    return( strcmp((char *)arga, (char *)argb) );
+}
+
+int pointerCompareCallback( void *arga, void *argb ) {
+    return( (arga > argb) - (arga < argb) );
+}
+
+/* Generic Hash Functions */
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : *HashCallback
+// Description  : Hash a key for the matching compare callback
+//
+// Inputs       : arg - the key
+// Outputs      : the hash
+
+unsigned long int32HashCallback( void *arg ) {
+    return( *(uint32_t *)arg );
+}
+
+unsigned long int8HashCallback( void *arg ) {
+    return( *(uint8_t *)arg );
+}
+
+unsigned long stringHashCallback( void *arg ) {
+
+    // FNV-1a over the bytes of the string
+    const unsigned char *s = (const unsigned char *)arg;
+    uint64_t h = 0xcbf29ce484222325ull;
+    while ( *s ) {
+        h = (h ^ *s++) * 0x100000001b3ull;
+    }
+    return( (unsigned long)h );
+}
+
+unsigned long pointerHashCallback( void *arg ) {
+    return( (unsigned long)(uintptr_t)arg );
+}
+
+/* Unit tests */
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_test_assoc
+// Description  : Unit test the associative array implementation
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int unit_test_assoc( void ) {
+
+    // Local variables
+    AssocArray ar;
+    uint32_t keys[1024];
+    void *key, *value;
+    int i, seen;
+
+    // Insert the keys, checking duplicates are refused
+    init_assoc( &ar, uint32CompareCallback, pointerCompareCallback );
+    for ( i = 0; i < 1024; i++ ) {
+        keys[i] = (uint32_t)i * 2654435761u;
+        if ( insert_assoc(&ar, &keys[i], &keys[i]) || !insert_assoc(&ar, &keys[i], NULL) ) {
+            logMessage( LOG_ERROR_LEVEL, "Associative array unit test failed inserting key %d", i );
+            return( -1 );
+        }
+    }
+
+    // Delete every other key, then check finds and the iterator
+    for ( i = 0; i < 1024; i += 2 ) {
+        if ( delete_assoc(&ar, &keys[i]) || !delete_assoc(&ar, &keys[i]) ) {
+            logMessage( LOG_ERROR_LEVEL, "Associative array unit test failed deleting key %d", i );
+            return( -1 );
+        }
+    }
+    for ( i = 0; i < 1024; i++ ) {
+        if ( find_assoc(&ar, &keys[i]) != ((i % 2) ? &keys[i] : NULL) ) {
+            logMessage( LOG_ERROR_LEVEL, "Associative array unit test failed finding key %d", i );
+            return( -1 );
+        }
+    }
+    seen = 0;
+    for ( nextIterator(&ar, &key, &value, 1); key != NULL; nextIterator(&ar, &key, &value, 0) ) {
+        if ( key != value ) {
+            logMessage( LOG_ERROR_LEVEL, "Associative array unit test failed iterating" );
+            return( -1 );
+        }
+        seen++;
+    }
+    if ( (seen != 512) || (ar.noElements != 512) ) {
+        logMessage( LOG_ERROR_LEVEL, "Associative array unit test saw %d of 512 keys", seen );
+        return( -1 );
+    }
+
+    // Clean up, return successfully
+    clear_assoc( &ar, 0, 0 );
+    logMessage( LOG_INFO_LEVEL, "Associative array unit test completed successfully." );
+    return( 0 );
+}
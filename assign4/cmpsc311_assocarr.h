@@ -14,6 +14,8 @@
 //
 //     01/25/20 - Created the intial version of the associate array 
 //                implementation
+//     10/18/26 - Replaced the sorted linked list with an open addressing
+//                hash table, keys now need a hash callback as well
 //
 
 // Type definitions
@@ -21,27 +23,36 @@
 // Call back for the comparison of the keys and values
 typedef int (*compareCallback)(void *, void *);
 
-// Associate array element structure
+// Call back for hashing the keys, equal keys must hash the same
+typedef unsigned long (*hashCallback)(void *);
+
+// Associate array element structure (one slot of the table)
 typedef struct aaElement {
-    void             *key;     // THe key for this element
+    void             *key;     // THe key for this element, NULL if empty
     void             *value;   // The value for this element
-    struct aaElement *next;    // Pointer to next element in array
+    unsigned long     hash;    // The (mixed) hash of the key
 } AssocArrayElement;
 
 // Associative array structure
 typedef struct  {
     compareCallback    keyCompare;  // Function pointer for compare keys
     compareCallback    valCompare;  // Function pointer for value compares
+    hashCallback       keyHash;     // Function pointer for hashing keys
     int                noElements;  // Number of elements
-    AssocArrayElement *elements;    // The elements of the array
-    AssocArrayElement *iterator;    // The iterator for the array
+    int                noDeleted;   // Number of deleted slots still probed
+    int                capacity;    // Number of slots, a power of two
+    AssocArrayElement *elements;    // The slots of the array
+    int                iterator;    // The next slot for the iterator
 } AssocArray;
 
 //
 // Interfaces for the associatuve array
 
 int init_assoc( AssocArray *arr, compareCallback kcb, compareCallback vcb );
-    // Initialize the array structure
+    // Initialize the array structure, hashing to match a generic key callback
+
+int init_assoc_hash( AssocArray *arr, compareCallback kcb, compareCallback vcb, hashCallback hcb );
+    // Initialize the array structure with a key hash callback
 
 int insert_assoc( AssocArray *ar, void *key, void *val );
     // Insert a K/V into the associative array
@@ -78,6 +89,20 @@ int stringCompareCallback( void *arga, void *argb );
 int pointerCompareCallback( void *arga, void *argb );
     // Usable callback for generic pointers (order by address)
 
+/* Generic Hash Functions */
+
+unsigned long int32HashCallback( void *arg );
+    // Usable hash for 32-bit integer keys (signed or not)
+
+unsigned long int8HashCallback( void *arg );
+    // Usable hash for 8-bit integer keys (signed or not)
+
+unsigned long stringHashCallback( void *arg );
+    // Usable hash for "C" string keys
+
+unsigned long pointerHashCallback( void *arg );
+    // Usable hash for generic pointer keys (by address)
+
 /* Unit tests */
 
 int unit_test_assoc( void );
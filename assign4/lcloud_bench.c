@@ -0,0 +1,565 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : lcloud_bench.c
+//  Description    : These are the microbenchmarks of the LionCloud hot
+//                   paths: the block cache, the register frames, lcread
+//                   and lcwrite over the in-memory devices of
+//                   lcloud_memdev.c, and the association array. Inputs come
+//                   from a fixed seed and every benchmark reports the median
+//                   of its repeats, as JSON on stdout.
+//
+//   Author        : Tzu Chieh Huang
+//   Last Modified : 18th Oct 2026
+//
+
+// Include Files
+#include <cmpsc311_log.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Project Includes
+#include <cmpsc311_assocarr.h>
+#include <lcloud_cache.h>
+#include <lcloud_filesys.h>
+#include <lcloud_hist.h>
+
+// Defines
+#define LCLOUD_BENCH_ARGUMENTS "hvl:r:n:"
+#define LC_BENCH_REPEATS 5
+#define LC_BENCH_MAX_REPEATS 101
+#define LC_BENCH_SEED 0x6c636c6f7564ull
+#define LC_BENCH_CACHE_OPS 100000
+#define LC_BENCH_REGS_OPS 10000000
+#define LC_BENCH_ASSOC_OPS 1000000
+#define LC_BENCH_FILE_SIZE (1 << 20) // the file lcread and lcwrite work on
+#define LC_BENCH_RAND_OPS 4096
+#define USAGE                                                                  \
+    "USAGE: lcloud_bench [-h] [-v] [-l <logfile>] [-r <repeats>]\n"            \
+    "                    [-n <name>]\n"                                        \
+    "\n"                                                                       \
+    "where:\n"                                                                 \
+    "    -h - help mode (display this message)\n"                              \
+    "    -v - verbose output\n"                                                \
+    "    -l - write log messages to the filename <logfile>\n"                  \
+    "    -r - timed repeats of every benchmark, the median is reported\n"      \
+    "         (default 5)\n"                                                   \
+    "    -n - only run the benchmarks whose name contains <name>\n"            \
+    "\n"
+
+// Type definitions
+typedef uint64_t (*bench_body)(void* arg); // runs once, returns the ops done
+
+typedef struct {
+    int capacity; // cache lines
+    int hit_pct; // percent of the lookups that hit
+    int update; // puts replace cached blocks, rather than evict
+    uint16_t* secs; // the keys, in order
+    uint16_t* blks;
+    int nkeys;
+    int next; // next new block, so inserts never hit
+} bench_cache;
+
+typedef struct {
+    LcFHandle fh;
+    size_t size; // bytes per op
+    int nops;
+    size_t* offsets; // random ops only
+    char* buf;
+} bench_file;
+
+typedef struct {
+    AssocArray arr;
+    char** probes; // copies of the keys to look up
+    int nprobes;
+} bench_assoc;
+
+// Register frame functions of lcloud_filesys.c
+LCloudRegisterFrame create_lcloud_registers(int b0, int b1, int c0, int c1, int c2, int d0, int d1);
+void extract_lcloud_registers(LCloudRegisterFrame lcloud_reg, int* b0, int* b1, int* c0, int* c1, int* c2,
+    int* d0, int* d1);
+
+//
+// Global Data
+
+int bench_repeats = LC_BENCH_REPEATS;
+const char* bench_filter = NULL;
+int bench_count = 0; // benchmarks reported so far
+uint64_t bench_rng = LC_BENCH_SEED;
+volatile uint64_t bench_sink; // keeps the optimizer from dropping work
+
+//
+// Functions
+
+// Function     : bench_random
+// Description  : the next value of a splitmix64 generator
+// Inputs       : none
+// Outputs      : a random 64 bit value
+static uint64_t bench_random(void)
+{
+    uint64_t z = (bench_rng += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+// Function     : bench_compare
+// Description  : order two timings for qsort
+// Inputs       : a, b - the timings
+// Outputs      : -1, 0 or 1
+static int bench_compare(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_run
+// Description  : Run a benchmark once to warm up, then time its repeats and
+//                print the result
+//
+// Inputs       : name - the benchmark
+//                params - its parameters, as the members of a JSON object
+//                body - the timed work
+//                arg - passed to the body
+//                bytes - bytes moved per op, 0 if none
+// Outputs      : none
+
+void bench_run(const char* name, const char* params, bench_body body, void* arg, size_t bytes)
+{
+    uint64_t times[LC_BENCH_MAX_REPEATS], start, ops = 0;
+    double median, best;
+    int r;
+
+    if (bench_filter != NULL && strstr(name, bench_filter) == NULL) {
+        return;
+    }
+
+    body(arg);
+    for (r = 0; r < bench_repeats; r++) {
+        start = lcloud_hist_now();
+        ops = body(arg);
+        times[r] = lcloud_hist_now() - start;
+    }
+    qsort(times, bench_repeats, sizeof(uint64_t), bench_compare);
+    median = (double)times[bench_repeats / 2] / ops;
+    best = (double)times[0] / ops;
+
+    printf("%s\n    {\"name\": \"%s\", \"params\": {%s}, \"ops\": %llu, \"ns_per_op\": %.2f, "
+           "\"min_ns_per_op\": %.2f, \"ops_per_sec\": %.0f",
+        bench_count++ ? "," : "", name, params, (unsigned long long)ops, median, best, 1e9 / median);
+    if (bytes) {
+        printf(", \"mb_per_sec\": %.2f", (double)bytes * 1e3 / median);
+    }
+    printf("}");
+    fflush(stdout);
+    logMessage(LOG_INFO_LEVEL, "Benchmark %s {%s}: %.2f ns/op", name, params, median);
+}
+
+// Function     : bench_cache_get
+// Description  : look up the keys in the cache
+// Inputs       : arg - the bench_cache
+// Outputs      : the ops done
+static uint64_t bench_cache_get(void* arg)
+{
+    bench_cache* b = (bench_cache*)arg;
+    uintptr_t found = 0;
+    int i;
+
+    for (i = 0; i < b->nkeys; i++) {
+        found += (uintptr_t)lcloud_getcache(0, b->secs[i], b->blks[i]);
+    }
+    bench_sink += found;
+    return b->nkeys;
+}
+
+// Function     : bench_cache_put
+// Description  : put blocks in the cache, cached ones or new ones
+// Inputs       : arg - the bench_cache
+// Outputs      : the ops done
+static uint64_t bench_cache_put(void* arg)
+{
+    bench_cache* b = (bench_cache*)arg;
+    char block[LC_DEVICE_BLOCK_SIZE];
+    int i;
+
+    memset(block, 'b', sizeof(block));
+    for (i = 0; i < b->nkeys; i++) {
+        if (b->update) {
+            lcloud_putcache(0, b->secs[i], b->blks[i], block);
+        } else {
+            lcloud_putcache(0, 1 + b->next / 65536, b->next % 65536, block);
+            b->next++;
+        }
+    }
+    return b->nkeys;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_cache_all
+// Description  : Benchmark cache lookups and puts over cache sizes and hit
+//                rates
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int bench_cache_all(void)
+{
+    static const int capacities[] = { 64, 256, 1024 }, hit_pcts[] = { 100, 90, 50 };
+    char block[LC_DEVICE_BLOCK_SIZE], params[128];
+    bench_cache b;
+    int c, h, i, update;
+
+    memset(block, 'c', sizeof(block));
+    b.nkeys = LC_BENCH_CACHE_OPS;
+    b.secs = (uint16_t*)malloc(b.nkeys * sizeof(uint16_t));
+    b.blks = (uint16_t*)malloc(b.nkeys * sizeof(uint16_t));
+    if (b.secs == NULL || b.blks == NULL) {
+        logMessage(LOG_ERROR_LEVEL, "Failure allocating the cache benchmark keys");
+        free(b.secs);
+        free(b.blks);
+        return (-1);
+    }
+
+    for (c = 0; c < (int)(sizeof(capacities) / sizeof(int)); c++) {
+        b.capacity = capacities[c];
+
+        // Blocks 0 to capacity-1 of sector 0 stay cached, misses look up
+        // sector 1, which never is
+        if (lcloud_initcache(b.capacity)) {
+            return (-1);
+        }
+        for (i = 0; i < b.capacity; i++) {
+            lcloud_putcache(0, 0, i, block);
+        }
+        for (h = 0; h < (int)(sizeof(hit_pcts) / sizeof(int)); h++) {
+            b.hit_pct = hit_pcts[h];
+            for (i = 0; i < b.nkeys; i++) {
+                b.secs[i] = (int)(bench_random() % 100) < b.hit_pct ? 0 : 1;
+                b.blks[i] = bench_random() % b.capacity;
+            }
+            snprintf(params, sizeof(params), "\"capacity\": %d, \"hit_rate\": %.2f", b.capacity, b.hit_pct / 100.0);
+            bench_run("cache_get", params, bench_cache_get, &b, 0);
+        }
+
+        // Updates hit cached blocks, inserts always evict one
+        for (i = 0; i < b.nkeys; i++) {
+            b.secs[i] = 0;
+            b.blks[i] = bench_random() % b.capacity;
+        }
+        for (update = 1; update >= 0; update--) {
+            b.update = update;
+            b.next = 0;
+            snprintf(params, sizeof(params), "\"capacity\": %d, \"mode\": \"%s\"", b.capacity,
+                update ? "update" : "insert");
+            bench_run("cache_put", params, bench_cache_put, &b, 0);
+        }
+        lcloud_closecache();
+    }
+
+    free(b.secs);
+    free(b.blks);
+    return (0);
+}
+
+// Function     : bench_regs_encode
+// Description  : build block transfer register frames
+// Inputs       : arg - unused
+// Outputs      : the ops done
+static uint64_t bench_regs_encode(void* arg)
+{
+    LCloudRegisterFrame acc = 0;
+    int i;
+
+    for (i = 0; i < LC_BENCH_REGS_OPS; i++) {
+        acc ^= create_lcloud_registers(0, 0, LC_BLOCK_XFER, i & 0xf, i & 1, (i >> 4) & 0xff, i & 0xffff);
+    }
+    bench_sink += acc;
+    return LC_BENCH_REGS_OPS;
+}
+
+// Function     : bench_regs_decode
+// Description  : split register frames into their fields
+// Inputs       : arg - the frames, LC_BENCH_REGS_OPS of them
+// Outputs      : the ops done
+static uint64_t bench_regs_decode(void* arg)
+{
+    LCloudRegisterFrame* frames = (LCloudRegisterFrame*)arg;
+    int b0, b1, c0, c1, c2, d0, d1, i;
+    uint64_t acc = 0;
+
+    for (i = 0; i < LC_BENCH_REGS_OPS; i++) {
+        extract_lcloud_registers(frames[i], &b0, &b1, &c0, &c1, &c2, &d0, &d1);
+        acc += b0 + b1 + c0 + c1 + c2 + d0 + d1;
+    }
+    bench_sink += acc;
+    return LC_BENCH_REGS_OPS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_regs_all
+// Description  : Benchmark building and splitting register frames
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int bench_regs_all(void)
+{
+    LCloudRegisterFrame* frames;
+    int i;
+
+    bench_run("regs_encode", "", bench_regs_encode, NULL, 0);
+
+    frames = (LCloudRegisterFrame*)malloc(LC_BENCH_REGS_OPS * sizeof(LCloudRegisterFrame));
+    if (frames == NULL) {
+        logMessage(LOG_ERROR_LEVEL, "Failure allocating the register frames");
+        return (-1);
+    }
+    for (i = 0; i < LC_BENCH_REGS_OPS; i++) {
+        frames[i] = bench_random();
+    }
+    bench_run("regs_decode", "", bench_regs_decode, frames, 0);
+    free(frames);
+    return (0);
+}
+
+// Function     : bench_file_seq
+// Description  : read or write the whole file in order
+// Inputs       : arg - the bench_file, size is the op size
+//                write - 1 to write, 0 to read
+// Outputs      : the ops done
+static uint64_t bench_file_seq(bench_file* b, int write)
+{
+    int i;
+
+    lcseek(b->fh, 0);
+    for (i = 0; i < b->nops; i++) {
+        if ((write ? lcwrite(b->fh, b->buf, b->size) : lcread(b->fh, b->buf, b->size)) != (int)b->size) {
+            logMessage(LOG_ERROR_LEVEL, "Benchmark %s failed at op %d", write ? "lcwrite" : "lcread", i);
+            exit(-1);
+        }
+    }
+    return b->nops;
+}
+
+// Function     : bench_file_rand
+// Description  : read or write at random offsets of the file
+// Inputs       : arg - the bench_file, size is the op size
+//                write - 1 to write, 0 to read
+// Outputs      : the ops done
+static uint64_t bench_file_rand(bench_file* b, int write)
+{
+    int i;
+
+    for (i = 0; i < b->nops; i++) {
+        lcseek(b->fh, b->offsets[i]);
+        if ((write ? lcwrite(b->fh, b->buf, b->size) : lcread(b->fh, b->buf, b->size)) != (int)b->size) {
+            logMessage(LOG_ERROR_LEVEL, "Benchmark %s failed at op %d", write ? "lcwrite" : "lcread", i);
+            exit(-1);
+        }
+    }
+    return b->nops;
+}
+
+// Function     : bench_lcwrite_seq, bench_lcread_seq, bench_lcwrite_rand,
+//                bench_lcread_rand
+// Description  : the bench_body of each file benchmark
+// Inputs       : arg - the bench_file
+// Outputs      : the ops done
+static uint64_t bench_lcwrite_seq(void* arg) { return bench_file_seq((bench_file*)arg, 1); }
+static uint64_t bench_lcread_seq(void* arg) { return bench_file_seq((bench_file*)arg, 0); }
+static uint64_t bench_lcwrite_rand(void* arg) { return bench_file_rand((bench_file*)arg, 1); }
+static uint64_t bench_lcread_rand(void* arg) { return bench_file_rand((bench_file*)arg, 0); }
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_file_all
+// Description  : Benchmark lcread and lcwrite over the in-memory devices,
+//                whole files in order and small ops at random offsets
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int bench_file_all(void)
+{
+    static const size_t seq_sizes[] = { 256, 4096 };
+    char params[128];
+    bench_file b;
+    int i;
+
+    b.buf = (char*)malloc(LC_BENCH_FILE_SIZE);
+    b.offsets = (size_t*)malloc(LC_BENCH_RAND_OPS * sizeof(size_t));
+    if (b.buf == NULL || b.offsets == NULL) {
+        logMessage(LOG_ERROR_LEVEL, "Failure allocating the file benchmark buffers");
+        free(b.buf);
+        free(b.offsets);
+        return (-1);
+    }
+    memset(b.buf, 'f', LC_BENCH_FILE_SIZE);
+
+    // Create the file in one write, so every benchmark overwrites it in place
+    if ((b.fh = lcopen("bench-file")) == -1 || lcwrite(b.fh, b.buf, LC_BENCH_FILE_SIZE) != LC_BENCH_FILE_SIZE) {
+        logMessage(LOG_ERROR_LEVEL, "Failure creating the benchmark file");
+        free(b.buf);
+        free(b.offsets);
+        return (-1);
+    }
+
+    for (i = 0; i < (int)(sizeof(seq_sizes) / sizeof(size_t)); i++) {
+        b.size = seq_sizes[i];
+        b.nops = LC_BENCH_FILE_SIZE / b.size;
+        snprintf(params, sizeof(params), "\"op_size\": %d, \"file_size\": %d", (int)b.size, LC_BENCH_FILE_SIZE);
+        bench_run("lcwrite_seq", params, bench_lcwrite_seq, &b, b.size);
+        bench_run("lcread_seq", params, bench_lcread_seq, &b, b.size);
+    }
+
+    b.size = 256;
+    b.nops = LC_BENCH_RAND_OPS;
+    for (i = 0; i < b.nops; i++) {
+        b.offsets[i] = bench_random() % (LC_BENCH_FILE_SIZE - b.size + 1);
+    }
+    snprintf(params, sizeof(params), "\"op_size\": %d, \"file_size\": %d", (int)b.size, LC_BENCH_FILE_SIZE);
+    bench_run("lcwrite_rand", params, bench_lcwrite_rand, &b, b.size);
+    bench_run("lcread_rand", params, bench_lcread_rand, &b, b.size);
+
+    lcclose(b.fh);
+    free(b.buf);
+    free(b.offsets);
+    return (0);
+}
+
+// Function     : bench_assoc_find
+// Description  : look up every probe in the association array
+// Inputs       : arg - the bench_assoc
+// Outputs      : the ops done
+static uint64_t bench_assoc_find(void* arg)
+{
+    bench_assoc* b = (bench_assoc*)arg;
+    uintptr_t found = 0;
+    int i;
+
+    for (i = 0; i < b->nprobes; i++) {
+        found += (uintptr_t)find_assoc(&b->arr, b->probes[i]);
+    }
+    bench_sink += found;
+    return b->nprobes;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_assoc_all
+// Description  : Benchmark find_assoc over string keys, small and large
+//                arrays, all lookups hitting
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int bench_assoc_all(void)
+{
+    static const int sizes[] = { 1000, 100000 };
+    char key[32], params[64];
+    bench_assoc b;
+    int s, i;
+
+    b.nprobes = LC_BENCH_ASSOC_OPS;
+    if ((b.probes = (char**)malloc(b.nprobes * sizeof(char*))) == NULL) {
+        logMessage(LOG_ERROR_LEVEL, "Failure allocating the association array probes");
+        return (-1);
+    }
+
+    for (s = 0; s < (int)(sizeof(sizes) / sizeof(int)); s++) {
+        init_assoc(&b.arr, stringCompareCallback, NULL);
+        for (i = 0; i < sizes[s]; i++) {
+            snprintf(key, sizeof(key), "object-%d", i);
+            insert_assoc(&b.arr, strdup(key), (void*)(uintptr_t)(i + 1));
+        }
+        for (i = 0; i < b.nprobes; i++) {
+            snprintf(key, sizeof(key), "object-%d", (int)(bench_random() % sizes[s]));
+            b.probes[i] = strdup(key);
+        }
+        snprintf(params, sizeof(params), "\"elements\": %d", sizes[s]);
+        bench_run("find_assoc", params, bench_assoc_find, &b, 0);
+
+        for (i = 0; i < b.nprobes; i++) {
+            free(b.probes[i]);
+        }
+        clear_assoc(&b.arr, 1, 0);
+    }
+
+    free(b.probes);
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : main
+// Description  : The main function for the LionCloud benchmarks
+//
+// Inputs       : argc - the number of command line parameters
+//                argv - the parameters
+// Outputs      : 0 if successful, -1 if failure
+
+int main(int argc, char* argv[])
+{
+    // Local variables
+    int ch, verbose = 0, log_initialized = 0, rval = 0;
+
+    // Process the command line parameters
+    while ((ch = getopt(argc, argv, LCLOUD_BENCH_ARGUMENTS)) != -1) {
+
+        switch (ch) {
+        case 'h': // Help, print usage
+            fprintf(stderr, USAGE);
+            return (-1);
+
+        case 'v': // Verbose Flag
+            verbose = 1;
+            break;
+
+        case 'l': // Set the log filename
+            initializeLogWithFilename(optarg);
+            log_initialized = 1;
+            break;
+
+        case 'r': // Timed repeats
+            bench_repeats = atoi(optarg);
+            if (bench_repeats < 1 || bench_repeats > LC_BENCH_MAX_REPEATS) {
+                fprintf(stderr, "Bad repeat count (%s), aborting.\n", optarg);
+                return (-1);
+            }
+            break;
+
+        case 'n': // Name filter
+            bench_filter = optarg;
+            break;
+
+        default: // Default (unknown)
+            fprintf(stderr, "Unknown command line option (%c), aborting.\n", ch);
+            return (-1);
+        }
+    }
+
+    // Setup the log as needed, the filesystem logs every block transfer at
+    // the output level, which would be timed too
+    if (!log_initialized) {
+        initializeLogWithFilehandle(CMPSC311_LOG_STDERR);
+    }
+    disableLogLevels(LOG_OUTPUT_LEVEL);
+    if (verbose) {
+        enableLogLevels(LOG_INFO_LEVEL);
+    }
+
+    printf("{\"repeats\": %d, \"benchmarks\": [", bench_repeats);
+    if (bench_cache_all() || bench_regs_all() || bench_file_all() || bench_assoc_all()) {
+        rval = -1;
+    }
+    printf("\n]}\n");
+
+    lcshutdown();
+    return (rval);
+}
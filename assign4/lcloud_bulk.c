@@ -0,0 +1,484 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : lcloud_bulk.c
+//  Description    : This is a tool that copies directory trees between the
+//                   host filesystem and LionCloud files.
+//
+
+// Include Files
+#define _GNU_SOURCE // nftw and MADV_SEQUENTIAL
+#include <cmpsc311_log.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+// Project Includes
+#include <lcloud_filesys.h>
+#include <lcloud_support.h>
+
+// Defines
+#define LCLOUD_BULK_ARGUMENTS "hvl:j:p:"
+#define LC_BULK_THREADS 4 // default number of copying threads
+#define LC_BULK_MAX_THREADS 8 // one stream each, lcstream allows 8 at once
+#define LC_BULK_NAME 1024 // longest LionCloud file name handled
+#define USAGE                                                                  \
+    "USAGE: lcloud_bulk [-h] [-v] [-l <logfile>] [-j <threads>]\n"             \
+    "                   [-p <prefix>] import|export <directory> ...\n"         \
+    "\n"                                                                       \
+    "where:\n"                                                                 \
+    "    -h - help mode (display this message)\n"                              \
+    "    -v - verbose output\n"                                                \
+    "    -l - write log messages to the filename <logfile>\n"                  \
+    "    -j - number of files copied at the same time (default 4, max 8)\n"    \
+    "    -p - prefix of the LionCloud file names (default none)\n"             \
+    "\n"                                                                       \
+    "    import <directory> - copy every file under <directory> into\n"        \
+    "                         LionCloud as <prefix><relative path>\n"          \
+    "    export <directory> - copy every LionCloud file named <prefix>...\n"   \
+    "                         out to <directory>/...\n"                        \
+    "\n"                                                                       \
+    "    Several commands run in order on the same mounted filesystem.\n"      \
+    "\n"
+
+// Type definitions
+typedef struct {
+    char* host; // path on the host
+    char* name; // LionCloud file name
+    size_t size;
+} bulk_file;
+
+//
+// Global Data
+
+// the files to copy, handed out to the threads in order
+bulk_file* bulk_files;
+int bulk_import, bulk_count, bulk_next, bulk_copied, bulk_failed;
+size_t bulk_bytes;
+pthread_mutex_t bulk_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// import walks the tree with nftw, which takes no argument
+const char* bulk_root;
+const char* bulk_prefix = "";
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bulk_add
+// Description  : Add a file to the list of files to copy
+//
+// Inputs       : host - the path on the host
+//                name - the LionCloud file name
+//                size - its size
+// Outputs      : none
+
+void bulk_add(const char* host, const char* name, size_t size)
+{
+    bulk_files = (bulk_file*)realloc(bulk_files, sizeof(bulk_file) * (bulk_count + 1));
+    bulk_files[bulk_count].host = strdup(host);
+    bulk_files[bulk_count].name = strdup(name);
+    bulk_files[bulk_count].size = size;
+    bulk_count++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bulk_take
+// Description  : Hand the next file to a copying thread
+//
+// Inputs       : none
+// Outputs      : the file, NULL when all have been handed out
+
+bulk_file* bulk_take(void)
+{
+    bulk_file* bf = NULL;
+
+    pthread_mutex_lock(&bulk_lock);
+    if (bulk_next < bulk_count) {
+        bf = &bulk_files[bulk_next++];
+    }
+    pthread_mutex_unlock(&bulk_lock);
+    return bf;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bulk_done
+// Description  : Account for a copied file
+//
+// Inputs       : bf - the file
+//                ok - 1 if it was copied
+// Outputs      : none
+
+void bulk_done(bulk_file* bf, int ok)
+{
+    pthread_mutex_lock(&bulk_lock);
+    if (ok) {
+        bulk_copied++;
+        bulk_bytes += bf->size;
+    } else {
+        bulk_failed++;
+    }
+    pthread_mutex_unlock(&bulk_lock);
+    if (ok) {
+        logMessage(LcSimulatorLLevel, "Copied [%s] <-> [%s], %zu bytes", bf->host, bf->name, bf->size);
+    } else {
+        logMessage(LOG_ERROR_LEVEL, "Failed copying [%s] <-> [%s]", bf->host, bf->name);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bulk_collect
+// Description  : nftw callback, adds each regular file under the import root
+//
+// Inputs       : path, st, type, ftw - as passed by nftw
+// Outputs      : 0 to continue the walk
+
+int bulk_collect(const char* path, const struct stat* st, int type, struct FTW* ftw)
+{
+    char name[LC_BULK_NAME];
+    const char* rel = path + strlen(bulk_root);
+
+    if (type != FTW_F || !S_ISREG(st->st_mode)) {
+        return 0;
+    }
+    while (*rel == '/') {
+        rel++;
+    }
+    if (snprintf(name, sizeof(name), "%s%s", bulk_prefix, rel) >= (int)sizeof(name)) {
+        logMessage(LOG_ERROR_LEVEL, "Name too long, skipping [%s]", path);
+        bulk_failed++;
+        return 0;
+    }
+    bulk_add(path, name, st->st_size);
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bulk_make_dirs
+// Description  : Create the missing parent directories of a host path
+//
+// Inputs       : path - the host path of a file
+// Outputs      : 0 if successful, -1 if failure
+
+int bulk_make_dirs(const char* path)
+{
+    char* dir = strdup(path);
+    char* p;
+    int ret = 0;
+
+    for (p = strchr(dir + 1, '/'); p != NULL && ret == 0; p = strchr(p + 1, '/')) {
+        *p = '\0';
+        if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+            ret = -1;
+        }
+        *p = '/';
+    }
+    free(dir);
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bulk_import_file
+// Description  : Map a host file and stream it into LionCloud
+//
+// Inputs       : bf - the file
+// Outputs      : 1 if successful, 0 if failure
+
+int bulk_import_file(bulk_file* bf)
+{
+    char* map = NULL;
+    LcStream s;
+    int fd, ok = 1;
+
+    if ((fd = open(bf->host, O_RDONLY)) == -1) {
+        return 0;
+    }
+    if (bf->size > 0) {
+        map = mmap(NULL, bf->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            close(fd);
+            return 0;
+        }
+        madvise(map, bf->size, MADV_SEQUENTIAL);
+    }
+    if ((s = lcstream_open(bf->name, LC_STREAM_WRITE)) == -1) {
+        ok = 0;
+    } else {
+        if (bf->size > 0 && lcstream_push(s, map, bf->size) != (int)bf->size) {
+            ok = 0;
+        }
+        if (lcstream_finish(s) == -1) {
+            ok = 0;
+        }
+    }
+    if (map) {
+        munmap(map, bf->size);
+    }
+    close(fd);
+    return ok;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bulk_export_file
+// Description  : Stream a LionCloud file into a mapped host file
+//
+// Inputs       : bf - the file
+// Outputs      : 1 if successful, 0 if failure
+
+int bulk_export_file(bulk_file* bf)
+{
+    char* map = NULL;
+    size_t done = 0;
+    LcStream s;
+    int fd, n, ok = 1;
+
+    if (bulk_make_dirs(bf->host) == -1
+        || (fd = open(bf->host, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1) {
+        return 0;
+    }
+    if (bf->size > 0) {
+        if (ftruncate(fd, bf->size) == -1
+            || (map = mmap(NULL, bf->size, PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+            close(fd);
+            return 0;
+        }
+    }
+    if ((s = lcstream_open(bf->name, LC_STREAM_READ)) == -1) {
+        ok = 0;
+    } else {
+        while (done < bf->size && (n = lcstream_pull(s, map + done, bf->size - done)) > 0) {
+            done += n;
+        }
+        if (done != bf->size) {
+            ok = 0;
+        }
+        if (lcstream_finish(s) == -1) {
+            ok = 0;
+        }
+    }
+    if (map) {
+        munmap(map, bf->size);
+    }
+    close(fd);
+    return ok;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bulk_worker
+// Description  : Copying thread, takes files until none are left
+//
+// Inputs       : arg - unused
+// Outputs      : NULL
+
+void* bulk_worker(void* arg)
+{
+    bulk_file* bf;
+
+    while ((bf = bulk_take()) != NULL) {
+        bulk_done(bf, bulk_import ? bulk_import_file(bf) : bulk_export_file(bf));
+    }
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bulk_list_export
+// Description  : List the LionCloud files under the prefix and where each
+//                one goes on the host
+//
+// Inputs       : dir - the host directory to export to
+// Outputs      : 0 if successful, -1 if failure
+
+int bulk_list_export(const char* dir)
+{
+    char name[LC_BULK_NAME];
+    char* host;
+    const char* rel;
+    size_t size, plen = strlen(bulk_prefix);
+    int pos = 0;
+
+    while ((pos = lclist(pos, name, sizeof(name), &size)) != -1) {
+        if (strncmp(name, bulk_prefix, plen) != 0) {
+            continue;
+        }
+        rel = name + plen;
+        // never write outside the export directory
+        if (*rel == '\0' || *rel == '/' || strcmp(rel, "..") == 0 || strncmp(rel, "../", 3) == 0
+            || strstr(rel, "/../") || (strlen(rel) >= 3 && strcmp(rel + strlen(rel) - 3, "/..") == 0)) {
+            logMessage(LOG_ERROR_LEVEL, "Not exporting [%s], bad host path", name);
+            bulk_failed++;
+            continue;
+        }
+        host = (char*)malloc(strlen(dir) + strlen(rel) + 2);
+        sprintf(host, "%s/%s", dir, rel);
+        bulk_add(host, name, size);
+        free(host);
+    }
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bulk_run
+// Description  : Copy a directory tree in or out on a pool of threads and
+//                report the throughput
+//
+// Inputs       : import - 1 to import, 0 to export
+//                dir - the host directory
+//                nthreads - number of copying threads
+// Outputs      : 0 if successful, -1 if failure
+
+int bulk_run(int import, const char* dir, int nthreads)
+{
+    pthread_t threads[LC_BULK_MAX_THREADS];
+    struct timespec start, end;
+    double secs;
+    int i;
+
+    bulk_import = import;
+    bulk_root = dir;
+    bulk_count = bulk_next = bulk_copied = bulk_failed = 0;
+    bulk_bytes = 0;
+
+    // Work out what to copy
+    if (import) {
+        if (nftw(dir, bulk_collect, 16, FTW_PHYS) == -1) {
+            logMessage(LOG_ERROR_LEVEL, "Failed walking [%s]: %s", dir, strerror(errno));
+            return (-1);
+        }
+    } else if (bulk_list_export(dir) == -1) {
+        return (-1);
+    }
+
+    // Copy the files on the threads, overlapping the host and bus I/O
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (nthreads > bulk_count) {
+        nthreads = bulk_count;
+    }
+    for (i = 0; i < nthreads; i++) {
+        if (pthread_create(&threads[i], NULL, bulk_worker, NULL) != 0) {
+            break;
+        }
+    }
+    nthreads = i;
+    if (nthreads == 0) {
+        bulk_worker(NULL);
+    }
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    logMessage(LOG_OUTPUT_LEVEL, "%s %d files, %zu bytes in %.3f s, %.2f MB/s, %d failed",
+        import ? "Imported" : "Exported", bulk_copied, bulk_bytes, secs,
+        secs > 0 ? bulk_bytes / secs / (1024 * 1024) : 0.0, bulk_failed);
+
+    // Drop the list for the next command
+    for (i = 0; i < bulk_count; i++) {
+        free(bulk_files[i].host);
+        free(bulk_files[i].name);
+    }
+    free(bulk_files);
+    bulk_files = NULL;
+    return (bulk_failed ? -1 : 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : main
+// Description  : The main function for the bulk copy tool
+//
+// Inputs       : argc - the number of command line parameters
+//                argv - the parameters
+// Outputs      : 0 if successful, -1 if failure
+
+int main(int argc, char* argv[])
+{
+    // Local variables
+    int ch, i, verbose = 0, log_initialized = 0, nthreads = LC_BULK_THREADS, failed = 0;
+
+    // Process the command line parameters
+    while ((ch = getopt(argc, argv, LCLOUD_BULK_ARGUMENTS)) != -1) {
+
+        switch (ch) {
+        case 'h': // Help, print usage
+            fprintf(stderr, USAGE);
+            return (-1);
+
+        case 'v': // Verbose Flag
+            verbose = 1;
+            break;
+
+        case 'l': // Set the log filename
+            initializeLogWithFilename(optarg);
+            log_initialized = 1;
+            break;
+
+        case 'j': // Set the number of copying threads
+            nthreads = atoi(optarg);
+            if (nthreads < 1 || nthreads > LC_BULK_MAX_THREADS) {
+                fprintf(stderr, "Bad thread count (%s), aborting.\n", optarg);
+                return (-1);
+            }
+            break;
+
+        case 'p': // Set the prefix of the LionCloud names
+            bulk_prefix = optarg;
+            break;
+
+        default: // Default (unknown)
+            fprintf(stderr, "Unknown command line option (%c), aborting.\n", ch);
+            return (-1);
+        }
+    }
+
+    // Setup the log as needed
+    if (!log_initialized) {
+        initializeLogWithFilehandle(CMPSC311_LOG_STDERR);
+    }
+    LcControllerLLevel = registerLogLevel("LCLOUD_CONTROLLER", 0); // Controller log level
+    LcDriverLLevel = registerLogLevel("LCLOUD_DRIVER", 0); // Driver log level
+    LcSimulatorLLevel = registerLogLevel("LCLOUD_SIMULATOR", 0); // Driver log level
+    if (verbose) {
+        enableLogLevels(LOG_INFO_LEVEL);
+        enableLogLevels(LcControllerLLevel | LcDriverLLevel | LcSimulatorLLevel);
+    }
+
+    // Commands and directories should be next, in pairs
+    if (optind == argc || (argc - optind) % 2) {
+        fprintf(stderr, "Missing command line parameters, use -h to see usage, aborting.\n");
+        return (-1);
+    }
+    for (i = optind; i < argc; i += 2) {
+        if (strcmp(argv[i], "import") != 0 && strcmp(argv[i], "export") != 0) {
+            fprintf(stderr, "Unknown command (%s), aborting.\n", argv[i]);
+            return (-1);
+        }
+    }
+
+    // Run the commands in order, shutting down makes the imported files durable
+    for (i = optind; i < argc && failed == 0; i += 2) {
+        failed = bulk_run(strcmp(argv[i], "import") == 0, argv[i + 1], nthreads);
+    }
+    lcshutdown();
+    freeLogRegistrations();
+    return (failed);
+}
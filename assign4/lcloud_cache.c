@@ -12,8 +12,11 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include <cmpsc311_log.h>
 #include <lcloud_cache.h>
+#include <lcloud_hist.h>
+#include <lcloud_trace.h>
 
 //create the storage
 typedef struct {
@@ -21,15 +24,32 @@ typedef struct {
     uint16_t sec;
     uint16_t blk;
     uint16_t lru;
+    uint8_t prefetched; // 1 until a prefetched block is first read
     char data[LC_DEVICE_BLOCK_SIZE];
 } storage;
 
+//decompressed chunks of compressed files, keyed by file id and chunk
+typedef struct {
+    int fid;
+    int chunk;
+    int len;
+    uint16_t lru;
+    char data[LC_CACHE_CHUNK_SIZE];
+} chunk_storage;
+
 // needed cache storage
 storage* cache = NULL;
+chunk_storage* chunks = NULL;
 int max_blocks;
 uint16_t lru = 0;
 int hit_count;
 int miss_count;
+int chunk_hits;
+int chunk_misses;
+int prefetch_count;
+int prefetch_used;
+// serializes lookups/inserts between filesystem threads
+pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
 
 //
 // Functions
@@ -45,6 +65,30 @@ int miss_count;
 // Outputs      : cache block if found (pointer), NULL if not or failure
 
 char* lcloud_getcache(LcDeviceId did, uint16_t sec, uint16_t blk)
+{
+    uint64_t start = lcloud_trace_begin();
+    char* data;
+
+    pthread_mutex_lock(&cache_lock);
+    data = lcloud_findcache(did, sec, blk);
+    pthread_mutex_unlock(&cache_lock);
+    if (start) {
+        lcloud_trace_span(LC_TRACE_CACHE, 0, start, lcloud_hist_now(), did, sec, blk, data != NULL);
+    }
+    return data;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_findcache
+// Description  : Search the cache for a block (caller holds cache_lock)
+//
+// Inputs       : did - device number of block to find
+//                sec - sector number of block to find
+//                blk - block number of block to find
+// Outputs      : cache block if found (pointer), NULL if not or failure
+
+char* lcloud_findcache(LcDeviceId did, uint16_t sec, uint16_t blk)
 {
     int i;
 
@@ -58,6 +102,10 @@ char* lcloud_getcache(LcDeviceId did, uint16_t sec, uint16_t blk)
 		//get into LRU, and return the data 
             cache[i].lru = lru++;
             hit_count++;
+            if (cache[i].prefetched == 1) {
+                cache[i].prefetched = 0;
+                prefetch_used++;
+            }
             return cache[i].data;
         }
     }
@@ -68,6 +116,35 @@ char* lcloud_getcache(LcDeviceId did, uint16_t sec, uint16_t blk)
     return (NULL);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_copycache
+// Description  : Copy a cached block out while holding the cache lock, so a
+//                concurrent eviction cannot change the data under the caller
+//
+// Inputs       : did - device number of block to find
+//                sec - sector number of block to find
+//                blk - block number of block to find
+//                block - buffer of LC_DEVICE_BLOCK_SIZE bytes to copy into
+// Outputs      : 0 if found and copied, -1 if not cached
+
+int lcloud_copycache(LcDeviceId did, uint16_t sec, uint16_t blk, char* block)
+{
+    uint64_t start = lcloud_trace_begin();
+    char* data;
+
+    pthread_mutex_lock(&cache_lock);
+    data = lcloud_findcache(did, sec, blk);
+    if (data) {
+        memcpy(block, data, LC_DEVICE_BLOCK_SIZE);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    if (start) {
+        lcloud_trace_span(LC_TRACE_CACHE, 0, start, lcloud_hist_now(), did, sec, blk, data != NULL);
+    }
+    return (data ? 0 : -1);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : lcloud_putcache
@@ -82,10 +159,50 @@ int lcloud_putcache(LcDeviceId did, uint16_t sec, uint16_t blk, char* block)
 {
     int i, v;
 
+    pthread_mutex_lock(&cache_lock);
     if (cache == NULL) {
+        pthread_mutex_unlock(&cache_lock);
         return -1;
     }
 
+    // if the block is already cached, update it in place
+    for (i = 0; i < max_blocks; i++) {
+        if (cache[i].did == did && cache[i].sec == sec && cache[i].blk == blk) {
+            cache[i].lru = lru++;
+            cache[i].prefetched = 0;
+            memcpy(cache[i].data, block, LC_DEVICE_BLOCK_SIZE);
+            pthread_mutex_unlock(&cache_lock);
+            return (0);
+        }
+    }
+
+    // copy the data to the cache
+    v = lcloud_victimcache();
+    cache[v].did = did;
+    cache[v].sec = sec;
+    cache[v].blk = blk;
+    cache[v].lru = lru++;
+    cache[v].prefetched = 0;
+    memcpy(cache[v].data, block, LC_DEVICE_BLOCK_SIZE);
+    pthread_mutex_unlock(&cache_lock);
+
+    /* Return successfully */
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_victimcache
+// Description  : Pick the cache line for a new block, an empty one or else
+//                the least recently used (caller holds cache_lock)
+//
+// Inputs       : none
+// Outputs      : index of the cache line
+
+int lcloud_victimcache(void)
+{
+    int i, v;
+
 	// select the empty cache (-1 for false, no device means no data in the cache)
     v = -1;
     for (i = 0; i < max_blocks; i++) {
@@ -100,17 +217,201 @@ int lcloud_putcache(LcDeviceId did, uint16_t sec, uint16_t blk, char* block)
             v = i;
         }
     }
-    // copy the data to the cache
+    return (v);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_incache
+// Description  : Check whether a block is cached, without counting a hit or
+//                a miss
+//
+// Inputs       : did - device number of block to find
+//                sec - sector number of block to find
+//                blk - block number of block to find
+// Outputs      : 1 if cached, 0 if not
+
+int lcloud_incache(LcDeviceId did, uint16_t sec, uint16_t blk)
+{
+    int i, found = 0;
+
+    pthread_mutex_lock(&cache_lock);
+    for (i = 0; cache != NULL && i < max_blocks && !found; i++) {
+        found = (cache[i].did == did && cache[i].sec == sec && cache[i].blk == blk);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return (found);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_prefetchcache
+// Description  : Put a prefetched block in the cache unless it is already
+//                there, a newer copy from a write must win
+//
+// Inputs       : did - device number of block to insert
+//                sec - sector number of block to insert
+//                blk - block number of block to insert
+//                block - the data read from the device
+// Outputs      : 0 if inserted, -1 if already cached or failure
+
+int lcloud_prefetchcache(LcDeviceId did, uint16_t sec, uint16_t blk, char* block)
+{
+    int i, v;
+
+    pthread_mutex_lock(&cache_lock);
+    for (i = 0; cache != NULL && i < max_blocks; i++) {
+        if (cache[i].did == did && cache[i].sec == sec && cache[i].blk == blk) {
+            break;
+        }
+    }
+    if (cache == NULL || i < max_blocks) {
+        pthread_mutex_unlock(&cache_lock);
+        return -1;
+    }
+    v = lcloud_victimcache();
     cache[v].did = did;
     cache[v].sec = sec;
     cache[v].blk = blk;
     cache[v].lru = lru++;
+    cache[v].prefetched = 1;
     memcpy(cache[v].data, block, LC_DEVICE_BLOCK_SIZE);
+    prefetch_count++;
+    pthread_mutex_unlock(&cache_lock);
+    return (0);
+}
 
-    /* Return successfully */
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_evictcache
+// Description  : Drop a block from the cache, e.g. when it is freed
+//
+// Inputs       : did - device number of block to drop
+//                sec - sector number of block to drop
+//                blk - block number of block to drop
+// Outputs      : 0 if it was cached, -1 if not
+
+int lcloud_evictcache(LcDeviceId did, uint16_t sec, uint16_t blk)
+{
+    int i;
+
+    pthread_mutex_lock(&cache_lock);
+    for (i = 0; cache != NULL && i < max_blocks; i++) {
+        if (cache[i].did == did && cache[i].sec == sec && cache[i].blk == blk) {
+            memset(&cache[i], -1, sizeof(storage));
+            pthread_mutex_unlock(&cache_lock);
+            return (0);
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return (-1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_getchunk
+// Description  : Copy a decompressed chunk out of the cache
+//
+// Inputs       : fid - file id of the chunk
+//                chunk - chunk number within the file
+//                data - buffer of LC_CACHE_CHUNK_SIZE bytes to copy into
+// Outputs      : length of the chunk if found, -1 if not cached
+
+int lcloud_getchunk(int fid, int chunk, char* data)
+{
+    int i, len = -1;
+
+    pthread_mutex_lock(&cache_lock);
+    for (i = 0; chunks != NULL && i < LC_CACHE_MAXCHUNKS; i++) {
+        if (chunks[i].fid == fid && chunks[i].chunk == chunk) {
+            chunks[i].lru = lru++;
+            len = chunks[i].len;
+            memcpy(data, chunks[i].data, len);
+            break;
+        }
+    }
+    if (len == -1) {
+        chunk_misses++;
+    } else {
+        chunk_hits++;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return (len);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_putchunk
+// Description  : Put a decompressed chunk in the cache
+//
+// Inputs       : fid - file id of the chunk
+//                chunk - chunk number within the file
+//                data - the chunk
+//                len - its length, at most LC_CACHE_CHUNK_SIZE
+// Outputs      : 0 if succesfully inserted, -1 if failure
+
+int lcloud_putchunk(int fid, int chunk, char* data, int len)
+{
+    int i, v = -1;
+
+    pthread_mutex_lock(&cache_lock);
+    if (chunks == NULL || len > LC_CACHE_CHUNK_SIZE) {
+        pthread_mutex_unlock(&cache_lock);
+        return -1;
+    }
+    // reuse the entry of the same chunk, else an empty one, else the oldest
+    for (i = 0; i < LC_CACHE_MAXCHUNKS && v == -1; i++) {
+        if (chunks[i].fid == fid && chunks[i].chunk == chunk) {
+            v = i;
+        }
+    }
+    for (i = 0; i < LC_CACHE_MAXCHUNKS && v == -1; i++) {
+        if (chunks[i].fid == -1) {
+            v = i;
+        }
+    }
+    if (v == -1) {
+        for (v = 0, i = 1; i < LC_CACHE_MAXCHUNKS; i++) {
+            if (lru - chunks[i].lru > lru - chunks[v].lru) {
+                v = i;
+            }
+        }
+    }
+    chunks[v].fid = fid;
+    chunks[v].chunk = chunk;
+    chunks[v].len = len;
+    chunks[v].lru = lru++;
+    memcpy(chunks[v].data, data, len);
+    pthread_mutex_unlock(&cache_lock);
     return (0);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_evictchunks
+// Description  : Drop the chunks of a file from chunk number first onwards,
+//                e.g. when it is truncated or deleted
+//
+// Inputs       : fid - file id of the chunks
+//                first - the first chunk to drop
+// Outputs      : number of chunks dropped
+
+int lcloud_evictchunks(int fid, int first)
+{
+    int i, n = 0;
+
+    pthread_mutex_lock(&cache_lock);
+    for (i = 0; chunks != NULL && i < LC_CACHE_MAXCHUNKS; i++) {
+        if (chunks[i].fid == fid && chunks[i].chunk >= first) {
+            chunks[i].fid = -1;
+            chunks[i].chunk = -1;
+            n++;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return (n);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : lcloud_initcache
@@ -122,17 +423,44 @@ int lcloud_putcache(LcDeviceId did, uint16_t sec, uint16_t blk, char* block)
 int lcloud_initcache(int maxblocks)
 {
     // malloc the catch, and reset the storage
+    pthread_mutex_lock(&cache_lock);
     cache = (storage*)malloc(sizeof(storage) * maxblocks);
     max_blocks = maxblocks;
     lru = 0;
     hit_count = 0;
     miss_count = 0;
+    chunk_hits = 0;
+    chunk_misses = 0;
+    prefetch_count = 0;
+    prefetch_used = 0;
     memset(cache, -1, sizeof(storage) * maxblocks);
+    chunks = (chunk_storage*)malloc(sizeof(chunk_storage) * LC_CACHE_MAXCHUNKS);
+    memset(chunks, -1, sizeof(chunk_storage) * LC_CACHE_MAXCHUNKS);
+    pthread_mutex_unlock(&cache_lock);
 
     /* Return successfully */
     return (0);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_cachestats
+// Description  : Get the block hits and misses counted since the cache was
+//                initialized
+//
+// Inputs       : hits - place for the hits
+//                misses - place for the misses
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_cachestats(int* hits, int* misses)
+{
+    pthread_mutex_lock(&cache_lock);
+    *hits = hit_count;
+    *misses = miss_count;
+    pthread_mutex_unlock(&cache_lock);
+    return (0);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : lcloud_closecache
@@ -146,7 +474,9 @@ int lcloud_closecache(void)
     int total;
     double ratio;
 
+    pthread_mutex_lock(&cache_lock);
     if (cache == NULL) {
+        pthread_mutex_unlock(&cache_lock);
         return -1;
     }
 
@@ -154,8 +484,20 @@ int lcloud_closecache(void)
     ratio = (double)hit_count / total;
     logMessage(LOG_OUTPUT_LEVEL, "Hits/Misses/Total: %d/%d/%d\n", hit_count, miss_count, total);
     logMessage(LOG_OUTPUT_LEVEL, "Hit Ratio: %lf\n", ratio);
+    if (chunk_hits + chunk_misses) {
+        logMessage(LOG_OUTPUT_LEVEL, "Chunk Hits/Misses: %d/%d\n", chunk_hits, chunk_misses);
+    }
+    if (prefetch_count) {
+        // blocks evicted, overwritten or never read count as wasted
+        logMessage(LOG_OUTPUT_LEVEL, "Prefetch Used/Wasted/Total: %d/%d/%d\n", prefetch_used,
+            prefetch_count - prefetch_used, prefetch_count);
+    }
     // free the cache storage
     free(cache);
+    cache = NULL;
+    free(chunks);
+    chunks = NULL;
+    pthread_mutex_unlock(&cache_lock);
 
     /* Return successfully */
     return (0);
@@ -17,6 +17,8 @@
 
 // Defines 
 #define LC_CACHE_MAXBLOCKS 64
+#define LC_CACHE_MAXCHUNKS 32 // decompressed chunks of compressed files
+#define LC_CACHE_CHUNK_SIZE 4096
 
 //
 // Functional Prototypes
@@ -24,12 +26,42 @@
 char * lcloud_getcache( LcDeviceId did, uint16_t sec, uint16_t blk );
     // Search the cache for a block 
 
+char * lcloud_findcache( LcDeviceId did, uint16_t sec, uint16_t blk );
+    // Search the cache for a block (caller must hold the cache lock)
+
+int lcloud_copycache( LcDeviceId did, uint16_t sec, uint16_t blk, char *block );
+    // Copy a cached block out under the cache lock
+
 int lcloud_putcache( LcDeviceId did, uint16_t sec, uint16_t blk, char *block );
     // Put a value in the cache 
 
+int lcloud_victimcache( void );
+    // Pick the cache line for a new block (caller must hold the cache lock)
+
+int lcloud_incache( LcDeviceId did, uint16_t sec, uint16_t blk );
+    // Check whether a block is cached without counting a hit or miss
+
+int lcloud_prefetchcache( LcDeviceId did, uint16_t sec, uint16_t blk, char *block );
+    // Put a prefetched block in the cache unless it is already there
+
+int lcloud_evictcache( LcDeviceId did, uint16_t sec, uint16_t blk );
+    // Drop a block from the cache
+
+int lcloud_getchunk( int fid, int chunk, char *data );
+    // Copy a decompressed chunk out of the cache
+
+int lcloud_putchunk( int fid, int chunk, char *data, int len );
+    // Put a decompressed chunk in the cache
+
+int lcloud_evictchunks( int fid, int first );
+    // Drop the cached chunks of a file from a chunk on
+
 int lcloud_initcache( int maxblocks );
     // Initialze the cache by setting up metadata a cache elements.
 
+int lcloud_cachestats( int *hits, int *misses );
+    // Get the block hits and misses counted since the cache was initialized
+
 int lcloud_closecache( void );
     // Clean up the cache when program is closing.
 
@@ -0,0 +1,398 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : lcloud_check.c
+//  Description    : These are the remount checks of the LionCloud
+//                   filesystem. Each check works on the in-memory devices
+//                   of lcloud_memdev.c, shuts the filesystem down and
+//                   mounts it again, then verifies what came back from the
+//                   checkpoint. One line per check goes to stdout and the
+//                   exit status is nonzero if any failed.
+//
+//   Author        : Tzu Chieh Huang
+//   Last Modified : 18th Oct 2026
+//
+
+// Include Files
+#include <cmpsc311_log.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+// Project Includes
+#include <lcloud_filesys.h>
+
+// Defines
+#define LCLOUD_CHECK_ARGUMENTS "hvl:"
+#define LC_CHECK_DATA 256 // bytes written past each hole
+#define LC_CHECK_NAME 256 // a file name one byte too long
+#define LC_CHECK_FILL 4096 // bytes per write while filling the devices
+#define LC_CHECK_SNAPSHOTS 20 // enough to wrap a block's count if they doubled
+#define LC_CHECK_TAILS 12 // small files closed in turn, several per pack block
+#define LC_CHECK_TAIL 40 // bytes in each of them
+#define USAGE                                                                  \
+    "USAGE: lcloud_check [-h] [-v] [-l <logfile>]\n"                           \
+    "\n"                                                                       \
+    "where:\n"                                                                 \
+    "    -h - help mode (display this message)\n"                              \
+    "    -v - verbose output\n"                                                \
+    "    -l - write log messages to the filename <logfile>\n"                  \
+    "\n"
+
+// Type definitions
+typedef int (*check_body)(void); // returns 0 if the check passed
+
+typedef struct {
+    const char* name;
+    check_body body;
+} check_case;
+
+//
+// Functions
+
+// Function     : check_write_at / check_read_at
+// Description  : write or read one range of a file, opening and closing it
+// Inputs       : path - the file
+//                off - where the range starts
+//                buf, len - the bytes
+// Outputs      : 0 if all len bytes were moved, -1 if not
+static int check_write_at(const char* path, size_t off, char* buf, size_t len)
+{
+    LcFHandle fh;
+    int n = -1;
+
+    if ((fh = lcopen(path)) == -1) {
+        return (-1);
+    }
+    if (lcseek(fh, off) == (int)off) {
+        n = lcwrite(fh, buf, len);
+    }
+    lcclose(fh);
+    return (n == (int)len ? 0 : -1);
+}
+
+static int check_read_at(const char* path, size_t off, char* buf, size_t len)
+{
+    LcFHandle fh;
+    int n = -1;
+
+    if ((fh = lcopen(path)) == -1) {
+        return (-1);
+    }
+    if (lcseek(fh, off) == (int)off) {
+        n = lcread(fh, buf, len);
+    }
+    lcclose(fh);
+    return (n == (int)len ? 0 : -1);
+}
+
+// Function     : check_hole_remount
+// Description  : write past holes of 65536 blocks and more, which the
+//                checkpoint stores as several extents, and read the data
+//                back after a remount
+// Inputs       : none
+// Outputs      : 0 if the check passed, -1 if not
+static int check_hole_remount(void)
+{
+    static const size_t offs[] = { 16777216, 20000000 };
+    char name[16], wbuf[LC_CHECK_DATA], rbuf[LC_CHECK_DATA];
+    int i;
+
+    for (i = 0; i < (int)(sizeof(offs) / sizeof(offs[0])); i++) {
+        snprintf(name, sizeof(name), "hole%d", i);
+        memset(wbuf, 'a' + i, sizeof(wbuf));
+        if (check_write_at(name, offs[i], wbuf, sizeof(wbuf))) {
+            return (-1);
+        }
+    }
+    lcshutdown();
+    for (i = 0; i < (int)(sizeof(offs) / sizeof(offs[0])); i++) {
+        snprintf(name, sizeof(name), "hole%d", i);
+        memset(wbuf, 'a' + i, sizeof(wbuf));
+        if (check_read_at(name, offs[i], rbuf, sizeof(rbuf)) || memcmp(rbuf, wbuf, sizeof(rbuf))) {
+            logMessage(LOG_ERROR_LEVEL, "%s: data past the hole lost at remount", name);
+            return (-1);
+        }
+        // the hole itself still reads as zeros
+        if (check_read_at(name, offs[i] - sizeof(rbuf), rbuf, sizeof(rbuf))
+            || rbuf[0] != 0 || memcmp(rbuf, rbuf + 1, sizeof(rbuf) - 1)) {
+            logMessage(LOG_ERROR_LEVEL, "%s: hole not zero after remount", name);
+            return (-1);
+        }
+    }
+    return (0);
+}
+
+// Function     : check_seek_bound
+// Description  : refuse positions whose file size would not fit an int,
+//                leaving the file as it was
+// Inputs       : none
+// Outputs      : 0 if the check passed, -1 if not
+static int check_seek_bound(void)
+{
+    char wbuf[LC_CHECK_DATA], rbuf[LC_CHECK_DATA];
+    LcFHandle fh;
+    int rval = 0;
+
+    memset(wbuf, 'x', sizeof(wbuf));
+    if ((fh = lcopen("bound")) == -1) {
+        return (-1);
+    }
+    if (lcseek(fh, (size_t)3000000000u) != -1 || lcseek(fh, (size_t)INT_MAX) != -1) {
+        logMessage(LOG_ERROR_LEVEL, "bound: seek past the largest file size allowed");
+        rval = -1;
+    }
+    if (lcseek(fh, 0) != 0 || lcwrite(fh, wbuf, sizeof(wbuf)) != (int)sizeof(wbuf)) {
+        rval = -1;
+    }
+    lcclose(fh);
+    lcshutdown();
+    if (rval == 0 && (check_read_at("bound", 0, rbuf, sizeof(rbuf)) || memcmp(rbuf, wbuf, sizeof(rbuf)))) {
+        rval = -1;
+    }
+    return (rval);
+}
+
+// Function     : check_name_length
+// Description  : refuse names the checkpoint cannot hold, from lcopen,
+//                lcclone and lcsnapshot, and keep the files at remount
+// Inputs       : none
+// Outputs      : 0 if the check passed, -1 if not
+static int check_name_length(void)
+{
+    char wbuf[LC_CHECK_DATA], rbuf[LC_CHECK_DATA], name[LC_CHECK_NAME + 1];
+    LcFHandle fh;
+    int rval = 0;
+
+    memset(wbuf, 'n', sizeof(wbuf));
+    memset(name, 'l', sizeof(name));
+    name[LC_CHECK_NAME] = '\0';
+    if (check_write_at("named", 0, wbuf, sizeof(wbuf))) {
+        return (-1);
+    }
+    if (lcopen(name) != -1 || lcclone("named", name) != -1) {
+        logMessage(LOG_ERROR_LEVEL, "named: %d byte name accepted", LC_CHECK_NAME);
+        rval = -1;
+    }
+    // a name that fits, but not once the snapshot tag is added
+    name[LC_CHECK_NAME - 8] = '\0';
+    if ((fh = lcopen(name)) == -1) {
+        return (-1);
+    }
+    lcclose(fh);
+    if (lcsnapshot("longtag") != -1) {
+        logMessage(LOG_ERROR_LEVEL, "named: snapshot name too long accepted");
+        rval = -1;
+    }
+    lcshutdown();
+    if (check_read_at("named", 0, rbuf, sizeof(rbuf)) || memcmp(rbuf, wbuf, sizeof(rbuf))) {
+        logMessage(LOG_ERROR_LEVEL, "named: file lost at remount");
+        rval = -1;
+    }
+    return (rval);
+}
+
+// Function     : check_snapshot_rollback
+// Description  : fail a snapshot midway, by filling the devices while a
+//                compressed file has a chunk to write, and find none of
+//                its clones, before or after a remount
+// Inputs       : none
+// Outputs      : 0 if the check passed, -1 if not
+static int check_snapshot_rollback(void)
+{
+    char buf[LC_CHECK_FILL], name[LC_CHECK_NAME];
+    LcFHandle comp, fill;
+    uint32_t seed = 1;
+    size_t size;
+    int i, pos, rval = 0;
+
+    // data that does not compress
+    for (i = 0; i < (int)sizeof(buf); i++) {
+        seed = seed * 1103515245 + 12345;
+        buf[i] = seed >> 16;
+    }
+    if (check_write_at("plain", 0, buf, LC_CHECK_DATA)) {
+        return (-1);
+    }
+    lcsetmode(LC_MODE_COMPRESS);
+    comp = lcopen("comp");
+    lcsetmode(LC_MODE_INPLACE);
+    fill = lcopen("fill");
+    if (comp == -1 || fill == -1) {
+        return (-1);
+    }
+    while (lcwrite(fill, buf, sizeof(buf)) == (int)sizeof(buf))
+        ;
+    // the chunk stays in memory until the snapshot clones the file
+    lcwrite(comp, buf, sizeof(buf));
+    if (lcsnapshot("rb") != -1) {
+        logMessage(LOG_ERROR_LEVEL, "rollback: snapshot on full devices succeeded");
+        rval = -1;
+    }
+    lcclose(comp);
+    lcclose(fill);
+    for (i = 0; i < 2; i++) {
+        for (pos = 0; (pos = lclist(pos, name, sizeof(name), &size)) != -1;) {
+            if (strstr(name, "@rb") != NULL) {
+                logMessage(LOG_ERROR_LEVEL, "rollback: %s left by a failed snapshot", name);
+                rval = -1;
+            }
+        }
+        lcshutdown();
+    }
+    lcunlink("fill");
+    return (rval);
+}
+
+// Function     : check_snapshot_repeat
+// Description  : take snapshots one after another, each must copy the
+//                files once and leave the copies of earlier ones alone
+// Inputs       : none
+// Outputs      : 0 if the check passed, -1 if not
+static int check_snapshot_repeat(void)
+{
+    char wbuf[LC_CHECK_DATA], rbuf[LC_CHECK_DATA], name[LC_CHECK_NAME], tag[16];
+    int i, pos, live = 0, copies = 0, rval = 0;
+    size_t size;
+
+    memset(wbuf, 'r', sizeof(wbuf));
+    if (check_write_at("repeat", 0, wbuf, sizeof(wbuf))) {
+        return (-1);
+    }
+    for (pos = 0; (pos = lclist(pos, name, sizeof(name), &size)) != -1;) {
+        live += strchr(name, '@') == NULL;
+    }
+    for (i = 0; i < LC_CHECK_SNAPSHOTS; i++) {
+        snprintf(tag, sizeof(tag), "r%d", i);
+        if (lcsnapshot(tag) != live) {
+            logMessage(LOG_ERROR_LEVEL, "repeat: snapshot %s did not copy %d files", tag, live);
+            return (-1);
+        }
+    }
+    lcshutdown();
+    for (pos = 0; (pos = lclist(pos, name, sizeof(name), &size)) != -1;) {
+        copies += strstr(name, "@r") != NULL;
+        if (strstr(name, "@r") != strrchr(name, '@')) {
+            logMessage(LOG_ERROR_LEVEL, "repeat: %s is a snapshot of a snapshot", name);
+            rval = -1;
+        }
+    }
+    if (copies != live * LC_CHECK_SNAPSHOTS) {
+        logMessage(LOG_ERROR_LEVEL, "repeat: %d copies, expected %d", copies, live * LC_CHECK_SNAPSHOTS);
+        rval = -1;
+    }
+    snprintf(name, sizeof(name), "repeat@r%d", LC_CHECK_SNAPSHOTS - 1);
+    if (check_read_at(name, 0, rbuf, sizeof(rbuf)) || memcmp(rbuf, wbuf, sizeof(rbuf))) {
+        logMessage(LOG_ERROR_LEVEL, "repeat: %s lost at remount", name);
+        rval = -1;
+    }
+    return (rval);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : check_pack_tails
+// Description  : Closes a run of small files so their tails share pack blocks,
+//                each close moving the earlier tails to a fresh block, and
+//                checks every one before and after a remount
+//
+// Inputs       : none
+// Outputs      : 0 if the check passed, -1 otherwise
+
+static int check_pack_tails(void)
+{
+    char name[16], wbuf[LC_CHECK_TAIL], rbuf[LC_CHECK_TAIL];
+    int i, pass;
+
+    for (i = 0; i < LC_CHECK_TAILS; i++) {
+        snprintf(name, sizeof(name), "tail%d", i);
+        memset(wbuf, 'a' + i, sizeof(wbuf));
+        if (check_write_at(name, 0, wbuf, sizeof(wbuf))) {
+            return (-1);
+        }
+    }
+    for (pass = 0; pass < 2; pass++) {
+        for (i = 0; i < LC_CHECK_TAILS; i++) {
+            snprintf(name, sizeof(name), "tail%d", i);
+            memset(wbuf, 'a' + i, sizeof(wbuf));
+            if (check_read_at(name, 0, rbuf, sizeof(rbuf)) || memcmp(rbuf, wbuf, sizeof(rbuf))) {
+                logMessage(LOG_ERROR_LEVEL, "%s: packed tail lost%s", name, pass ? " at remount" : "");
+                return (-1);
+            }
+        }
+        if (pass == 0) {
+            lcshutdown();
+        }
+    }
+    return (0);
+}
+
+// The checks, in the order they run
+check_case check_cases[] = {
+    { "hole_remount", check_hole_remount },
+    { "seek_bound", check_seek_bound },
+    { "name_length", check_name_length },
+    { "snapshot_rollback", check_snapshot_rollback },
+    { "snapshot_repeat", check_snapshot_repeat },
+    { "pack_tails", check_pack_tails },
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : main
+// Description  : The main function for the LionCloud remount checks
+//
+// Inputs       : argc - the number of command line parameters
+//                argv - the parameters
+// Outputs      : 0 if all checks passed, -1 otherwise
+
+int main(int argc, char* argv[])
+{
+    // Local variables
+    int ch, i, verbose = 0, log_initialized = 0, failed = 0;
+
+    // Process the command line parameters
+    while ((ch = getopt(argc, argv, LCLOUD_CHECK_ARGUMENTS)) != -1) {
+
+        switch (ch) {
+        case 'h': // Help, print usage
+            fprintf(stderr, USAGE);
+            return (-1);
+
+        case 'v': // Verbose Flag
+            verbose = 1;
+            break;
+
+        case 'l': // Set the log filename
+            initializeLogWithFilename(optarg);
+            log_initialized = 1;
+            break;
+
+        default: // Default (unknown)
+            fprintf(stderr, "Unknown command line option (%c), aborting.\n", ch);
+            return (-1);
+        }
+    }
+
+    // Setup the log as needed
+    if (!log_initialized) {
+        initializeLogWithFilehandle(CMPSC311_LOG_STDERR);
+    }
+    if (!verbose) {
+        disableLogLevels(LOG_OUTPUT_LEVEL);
+    }
+
+    // the devices keep their blocks across checks, every check uses its own
+    // file names
+    for (i = 0; i < (int)(sizeof(check_cases) / sizeof(check_cases[0])); i++) {
+        if (check_cases[i].body()) {
+            printf("FAIL %s\n", check_cases[i].name);
+            failed++;
+        } else {
+            printf("ok   %s\n", check_cases[i].name);
+        }
+        lcshutdown();
+    }
+    return (failed ? -1 : 0);
+}
@@ -18,14 +18,23 @@
 #include <unistd.h>
 #include <assert.h>
 #include <stdint.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 // Project Include Files
 #include <lcloud_filesys.h>
 #include <cmpsc311_util.h>
 #include <lcloud_network.h>
+#include <lcloud_stats.h>
+#include <lcloud_trace.h>
 #include <cmpsc311_log.h>
 
 int socket_handle = -1;
+// one request/response exchange on the socket at a time
+pthread_mutex_t socket_lock = PTHREAD_MUTEX_INITIALIZER;
+// extra delay per block transfer, in microseconds, per device
+int client_delay_us[16];
 
 //
 // Functions
@@ -57,6 +66,9 @@ int create_connection()
         logMessage(LOG_OUTPUT_LEVEL, "connect error");
         return -1;
     }
+    // requests are small and answered one by one, do not hold them back
+    int one = 1;
+    setsockopt(socket_handle, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
 
     return 0;
 }
@@ -84,19 +96,15 @@ void extract_lcloud_registers2(LCloudRegisterFrame lcloud_reg, int* b0, int* b1,
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : client_lcloud_bus_request
-// Description  : This the client regstateeration that sends a request to the
-//                lion client server.   It will:
-//
-//                1) if INIT make a connection to the server
-//                2) send any request to the server, returning results
-//                3) if CLOSE, will close the connection
+// Function     : client_lcloud_bus_exchange
+// Description  : send one request to the server and read its response, the
+//                caller must hold socket_lock
 //
 // Inputs       : reg - the request reqisters for the command
 //                buf - the block to be read/written from (READ/WRITE)
 // Outputs      : the response structure encoded as needed
 
-LCloudRegisterFrame client_lcloud_bus_request(LCloudRegisterFrame reg, void* buf)
+LCloudRegisterFrame client_lcloud_bus_exchange(LCloudRegisterFrame reg, void* buf)
 {
     if (socket_handle == -1) {
         if (create_connection() == -1) {
@@ -190,3 +198,136 @@ LCloudRegisterFrame client_lcloud_bus_request(LCloudRegisterFrame reg, void* buf
 
     return ntohll64(network_reg);
 }
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_lcloud_bus_request
+// Description  : This the client regstateeration that sends a request to the
+//                lion client server.   It will:
+//
+//                1) if INIT make a connection to the server
+//                2) send any request to the server, returning results
+//                3) if CLOSE, will close the connection
+//
+// Inputs       : reg - the request reqisters for the command
+//                buf - the block to be read/written from (READ/WRITE)
+// Outputs      : the response structure encoded as needed
+
+LCloudRegisterFrame client_lcloud_bus_request(LCloudRegisterFrame reg, void* buf)
+{
+    LCloudRegisterFrame resp;
+    uint64_t start = (lcloud_stats_on || lcloud_trace_on) ? lcloud_hist_now() : 0, end;
+    int opcode, device;
+
+    // the protocol is strictly request/response, so filesystem threads
+    // take turns on the shared connection
+    pthread_mutex_lock(&socket_lock);
+    resp = client_lcloud_bus_exchange(reg, buf);
+    extract_lcloud_registers2(reg, NULL, NULL, &opcode, &device, NULL, NULL, NULL);
+    if (opcode == LC_BLOCK_XFER && device < 16 && client_delay_us[device]) {
+        // the server answers one request at a time, so a slow device holds
+        // up the bus like it would behind a real controller
+        usleep(client_delay_us[device]);
+    }
+    pthread_mutex_unlock(&socket_lock);
+    // the time waiting for the connection counts, the caller waited too
+    if (start) {
+        end = lcloud_hist_now();
+        lcloud_stats_bus(reg, resp, start, end);
+        lcloud_trace_bus(reg, resp, start, end);
+    }
+    return resp;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_lcloud_bus_batch
+// Description  : Send a window of block transfers back to back, then read
+//                their responses in order, so the transfers overlap on the
+//                connection instead of each waiting a round trip
+//
+// Inputs       : regs - the block transfer requests
+//                bufs - the block of each request
+//                resps - set to the response of each request
+//                n - number of requests, a window small enough for the
+//                    socket buffers to hold
+// Outputs      : 0 if successful, -1 if the connection failed
+
+int client_lcloud_bus_batch(LCloudRegisterFrame* regs, void** bufs, LCloudRegisterFrame* resps, int n)
+{
+    char frame[sizeof(LCloudRegisterFrame) + LC_DEVICE_BLOCK_SIZE];
+    LCloudRegisterFrame network_reg;
+    uint64_t start = (lcloud_stats_on || lcloud_trace_on) ? lcloud_hist_now() : 0, end;
+    int i, len, c2, device, one = 1, ret = 0;
+
+    pthread_mutex_lock(&socket_lock);
+    if (socket_handle == -1 && create_connection() == -1) {
+        pthread_mutex_unlock(&socket_lock);
+        return -1;
+    }
+    for (i = 0; i < n && ret == 0; i++) {
+        extract_lcloud_registers2(regs[i], NULL, NULL, NULL, NULL, &c2, NULL, NULL);
+        network_reg = htonll64(regs[i]);
+        memcpy(frame, &network_reg, sizeof(network_reg));
+        len = sizeof(network_reg);
+        if (c2 == LC_XFER_WRITE) {
+            memcpy(frame + len, bufs[i], LC_DEVICE_BLOCK_SIZE);
+            len += LC_DEVICE_BLOCK_SIZE;
+        }
+        if (send(socket_handle, frame, len, 0) != len) {
+            logMessage(LOG_OUTPUT_LEVEL, "send error");
+            ret = -1;
+        }
+    }
+    for (i = 0; i < n && ret == 0; i++) {
+        extract_lcloud_registers2(regs[i], NULL, NULL, NULL, &device, &c2, NULL, NULL);
+#ifdef TCP_QUICKACK
+        // the server sends each response in pieces, acknowledge them right
+        // away rather than holding the next piece back behind a delayed ack
+        setsockopt(socket_handle, IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one));
+#endif
+        if (recv(socket_handle, &network_reg, sizeof(network_reg), MSG_WAITALL) != sizeof(network_reg)
+            || (c2 == LC_XFER_READ
+                && recv(socket_handle, bufs[i], LC_DEVICE_BLOCK_SIZE, MSG_WAITALL) != LC_DEVICE_BLOCK_SIZE)) {
+            logMessage(LOG_OUTPUT_LEVEL, "recv error");
+            ret = -1;
+            break;
+        }
+        resps[i] = ntohll64(network_reg);
+        if (device < 16 && client_delay_us[device]) {
+            usleep(client_delay_us[device]);
+        }
+        // each transfer waited from the start of the window to its response
+        if (start) {
+            end = lcloud_hist_now();
+            lcloud_stats_bus(regs[i], resps[i], start, end);
+            lcloud_trace_bus(regs[i], resps[i], start, end);
+        }
+    }
+    if (ret == -1) {
+        // responses may be left unread, the connection is out of step
+        close(socket_handle);
+        socket_handle = -1;
+    }
+    pthread_mutex_unlock(&socket_lock);
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_lcloud_set_delay
+// Description  : Make every block transfer of a device take longer, to stand
+//                in for devices of different speed
+//
+// Inputs       : device - the device id
+//                usec - the added delay in microseconds
+// Outputs      : 0 if successful, -1 if the device id is invalid
+
+int client_lcloud_set_delay(int device, int usec)
+{
+    if (device < 0 || device >= 16 || usec < 0) {
+        return -1;
+    }
+    client_delay_us[device] = usec;
+    return 0;
+}
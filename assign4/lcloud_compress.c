@@ -0,0 +1,206 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : lcloud_compress.c
+//  Description    : This is the block codec used for compressed files in
+//                   the LionCloud filesystem. It writes the LZ4 block
+//                   format: a sequence of (literals, match) pairs, each led
+//                   by a token whose high nibble is the literal length and
+//                   low nibble the match length minus 4, both extended by
+//                   255-valued bytes, with a 2 byte little-endian offset.
+//                   The final sequence holds only literals.
+//
+//   Author        : Tzu Chieh Huang
+//   Last Modified : 18th Oct 2026
+//
+
+// Includes
+#include <string.h>
+#include <lcloud_compress.h>
+
+// Defines
+#define LC_LZ_MINMATCH 4
+#define LC_LZ_LASTLITERALS 5 // the format ends with at least this many literals
+#define LC_LZ_MFLIMIT 12 // no match starts this close to the end
+#define LC_LZ_HASH_BITS 12
+#define LC_LZ_MAX_OFFSET 65535
+
+//
+// Functions
+
+// Function     : lcloud_lz_read32 / lcloud_lz_hash
+// Description  : load 4 bytes and hash them into the match table
+// Inputs       : p - the bytes / v - the loaded value
+// Outputs      : the value / the table index
+static uint32_t lcloud_lz_read32(const char* p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static int lcloud_lz_hash(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - LC_LZ_HASH_BITS);
+}
+
+// Function     : lcloud_lz_length
+// Description  : write the 255-valued extension bytes of a length
+// Inputs       : op - output cursor, end - end of the output
+//                n - the length beyond the nibble
+// Outputs      : the new cursor, NULL if the output is full
+static char* lcloud_lz_length(char* op, char* end, int n)
+{
+    for (; n >= 255; n -= 255) {
+        if (op >= end) {
+            return NULL;
+        }
+        *op++ = (char)255;
+    }
+    if (op >= end) {
+        return NULL;
+    }
+    *op++ = (char)n;
+    return op;
+}
+
+// Function     : lcloud_lz_sequence
+// Description  : write one sequence, a match length of 0 marks the final
+//                literals-only sequence
+// Inputs       : op, end - output cursor and end
+//                lit, nlit - the literals
+//                offset, mlen - the match
+// Outputs      : the new cursor, NULL if the output is full
+static char* lcloud_lz_sequence(char* op, char* end, const char* lit, int nlit, int offset, int mlen)
+{
+    char* token = op++;
+    int ml = mlen ? mlen - LC_LZ_MINMATCH : 0;
+
+    if (token >= end) {
+        return NULL;
+    }
+    *token = (char)(((nlit < 15 ? nlit : 15) << 4) | (ml < 15 ? ml : 15));
+    if (nlit >= 15 && (op = lcloud_lz_length(op, end, nlit - 15)) == NULL) {
+        return NULL;
+    }
+    if (op + nlit > end) {
+        return NULL;
+    }
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (mlen == 0) {
+        return op;
+    }
+    if (op + 2 > end) {
+        return NULL;
+    }
+    *op++ = (char)(offset & 0xff);
+    *op++ = (char)(offset >> 8);
+    if (ml >= 15 && (op = lcloud_lz_length(op, end, ml - 15)) == NULL) {
+        return NULL;
+    }
+    return op;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_compress
+// Description  : Compress a buffer with a greedy single-probe match search
+//
+// Inputs       : in, len - the data
+//                out, max - the output buffer
+// Outputs      : compressed length, 0 if it would not fit in max bytes
+
+int lcloud_compress(const char* in, int len, char* out, int max)
+{
+    int table[1 << LC_LZ_HASH_BITS];
+    int ip = 0, anchor = 0, ref, h, mlen;
+    char *op = out, *end = out + max;
+
+    memset(table, -1, sizeof(table));
+    while (ip < len - LC_LZ_MFLIMIT) {
+        h = lcloud_lz_hash(lcloud_lz_read32(in + ip));
+        ref = table[h];
+        table[h] = ip;
+        if (ref < 0 || ip - ref > LC_LZ_MAX_OFFSET
+            || lcloud_lz_read32(in + ref) != lcloud_lz_read32(in + ip)) {
+            ip++;
+            continue;
+        }
+        // extend the match, leaving the last literals alone
+        for (mlen = LC_LZ_MINMATCH; ip + mlen < len - LC_LZ_LASTLITERALS && in[ref + mlen] == in[ip + mlen]; mlen++)
+            ;
+        if ((op = lcloud_lz_sequence(op, end, in + anchor, ip - anchor, ip - ref, mlen)) == NULL) {
+            return 0;
+        }
+        ip += mlen;
+        anchor = ip;
+    }
+    if ((op = lcloud_lz_sequence(op, end, in + anchor, len - anchor, 0, 0)) == NULL) {
+        return 0;
+    }
+    return op - out;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_decompress
+// Description  : Expand a buffer written by lcloud_compress
+//
+// Inputs       : in, len - the compressed data
+//                out, max - the output buffer
+// Outputs      : original length, -1 if the input is corrupt or too large
+
+int lcloud_decompress(const char* in, int len, char* out, int max)
+{
+    const char *ip = in, *iend = in + len;
+    char* op = out;
+    int nlit, mlen, offset, b;
+
+    while (ip < iend) {
+        int token = (unsigned char)*ip++;
+        nlit = token >> 4;
+        if (nlit == 15) {
+            do {
+                if (ip >= iend) {
+                    return -1;
+                }
+                b = (unsigned char)*ip++;
+                nlit += b;
+            } while (b == 255);
+        }
+        if (ip + nlit > iend || op + nlit > out + max) {
+            return -1;
+        }
+        memcpy(op, ip, nlit);
+        ip += nlit;
+        op += nlit;
+        if (ip == iend) {
+            // the final sequence has no match
+            break;
+        }
+        if (ip + 2 > iend) {
+            return -1;
+        }
+        offset = (unsigned char)ip[0] | ((unsigned char)ip[1] << 8);
+        ip += 2;
+        mlen = (token & 15) + LC_LZ_MINMATCH;
+        if ((token & 15) == 15) {
+            do {
+                if (ip >= iend) {
+                    return -1;
+                }
+                b = (unsigned char)*ip++;
+                mlen += b;
+            } while (b == 255);
+        }
+        if (offset == 0 || op - out < offset || op + mlen > out + max) {
+            return -1;
+        }
+        // byte by byte, the match may overlap what it produces
+        for (b = 0; b < mlen; b++, op++) {
+            *op = *(op - offset);
+        }
+    }
+    return op - out;
+}
@@ -0,0 +1,26 @@
+#ifndef LCLOUD_COMPRESS_INCLUDED
+#define LCLOUD_COMPRESS_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : lcloud_compress.h
+//  Description    : This is the block codec used for compressed files in
+//                   the LionCloud filesystem.
+//
+//   Author        : Tzu Chieh Huang
+//   Last Modified : 18th Oct 2026
+//
+
+// Includes
+#include <stdint.h>
+
+//
+// Functional Prototypes
+
+int lcloud_compress( const char *in, int len, char *out, int max );
+    // Compress a buffer, returns the compressed length or 0 if it does not fit
+
+int lcloud_decompress( const char *in, int len, char *out, int max );
+    // Expand a compressed buffer, returns the original length or -1 if corrupt
+
+#endif
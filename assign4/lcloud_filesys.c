@@ -9,15 +9,91 @@
 //
 
 // Include files
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <time.h>
 #include <cmpsc311_log.h>
 
 // Project include files
 #include <lcloud_filesys.h>
 #include <lcloud_cache.h>
+#include <lcloud_compress.h>
 #include <lcloud_controller.h>
 #include <lcloud_network.h>
+#include <lcloud_stats.h>
+#include <lcloud_trace.h>
+
+// Defines
+#define LC_META_MAGIC 0x4b53434cu // "LCSK", marks a formatted superblock
+#define LC_META_VERSION 4
+#define LC_META_VERSION_TAILS 3 // first version recording packed tails
+#define LC_META_VERSION_CHUNKS 4 // first version recording compressed chunks
+#define LC_META_MAX_EXTENTS 24 // checkpoint extents that fit in the superblock
+#define LC_META_CKPT_HEADER (8 + 16 * 9) // file count, cursor, per-device state
+#define LC_META_EXTENT_SIZE 7 // device, sector, block, count
+#define LC_META_TAIL_SIZE 9 // device, sector, block, offset, length
+#define LC_META_CHUNKS_SIZE 5 // flags, chunk count, then 2 bytes per chunk
+#define LC_META_MAX_NAME 255 // longest file name the checkpoint decodes
+#define LC_JOURNAL_MAGIC 0x4e524a4cu // "LJRN", marks a journal block
+#define LC_JOURNAL_BLOCKS 32 // size of the journal region
+#define LC_JOURNAL_MAX_EXTENTS 4
+#define LC_JOURNAL_HEADER 18 // magic, checkpoint seq, slot, bytes used, checksum
+#define LC_JOURNAL_MAX_RECORD (LC_DEVICE_BLOCK_SIZE - LC_JOURNAL_HEADER - 2) // fills an empty journal block
+
+// Journal record types
+#define LC_JR_CREATE 1 // fid, name
+#define LC_JR_EXTENT 2 // fid, index, device, sector, block, count
+#define LC_JR_SIZE 3 // fid, size
+#define LC_JR_UNLINK 4 // fid
+#define LC_JR_TRUNCATE 5 // fid, size, block count
+#define LC_JR_TAIL 6 // fid, block count, device, sector, block, offset, length
+#define LC_JR_FLAGS 7 // fid, flags
+#define LC_JR_CHUNK 8 // fid, chunk, stored length
+
+// Compaction
+#define LC_COMPACT_THRESHOLD 64 // freed blocks that wake the compactor
+#define LC_COMPACT_BATCH 32 // blocks moved per pass while holding the files
+#define LC_DEFRAG_RUN 8 // average run length, in blocks, below which a file is fragmented
+
+// Prefetching
+#define LC_PREFETCH_WAYS 4 // successors remembered per file
+#define LC_PREFETCH_SEEN_MAX 15 // saturation of a successor's count
+#define LC_PREFETCH_CONFIDENCE 2 // times a successor is seen before it is prefetched
+#define LC_PREFETCH_BLOCKS 4 // leading blocks of a predicted file to prefetch
+#define LC_PREFETCH_QUEUE 8 // predicted files waiting for the prefetcher
+
+// Tiering
+#define LC_TIER_EWMA 8 // weight of the latency moving average, in transfers
+#define LC_TIER_SAMPLES 16 // transfers timed before a device is ranked
+#define LC_TIER_PERIOD 1024 // block accesses between migration passes
+#define LC_TIER_HOT 64 // heat from which a file's blocks are promoted
+#define LC_TIER_BATCH 32 // blocks moved per pass while holding the files
+#define LC_TIER_PASSES 8 // passes per wakeup at most
+
+// Streams
+#define LC_STREAM_MAX 8 // streams open at once
+#define LC_STREAM_WINDOW 16 // blocks in flight per pipelined exchange
+
+// Tail packing
+#define LC_TAIL_MAX (LC_DEVICE_BLOCK_SIZE / 2) // largest tail packed, two fit a block
+
+// Log-structured writes
+#define LC_LOG_CLEAN_SEGMENTS 2 // empty segments the cleaner keeps in reserve
+#define LC_LOG_CLEAN_PASSES 64 // segments cleaned per wakeup at most
+#define LC_LOG_PENDING_MAX 64 // superseded blocks held before forcing a commit
+
+// Deduplication
+#define LC_DEDUP_PROBES 8 // index slots searched per fingerprint
+
+// Compressed files
+#define LC_FILE_COMPRESSED 1 // file flag, data is stored in compressed chunks
+#define LC_CHUNK_SIZE LC_CACHE_CHUNK_SIZE
+#define LC_CHUNK_BLOCKS (LC_CHUNK_SIZE / LC_DEVICE_BLOCK_SIZE) // block slots per chunk
+#define LC_CHUNK_RAW 0x8000 // stored length flag, the chunk did not compress
+#define LC_HOLE 0xff // device id of a block map slot with no block
+#define LC_MAX_FILE_SIZE (INT_MAX - LC_MAX_OPERATION_SIZE) // positions are int, with room for one operation past
 
 typedef struct block* Block;
 struct block {
@@ -39,7 +115,55 @@ struct file {
     int cur_pos;
     Block blocks;
     int blocks_count;
+    int fid; // index in the file table, names the file in journal records
+    // when tail_len is set, the bytes past the last full block live at
+    // tail_off in a pack block shared with the tails of other files
+    struct block tail;
+    int tail_off;
+    int tail_len;
+    // compressed files keep chunk c in block slots [c * LC_CHUNK_BLOCKS, ...),
+    // unused slots are holes, and chunk_lens[c] is its stored length (0 if
+    // it was never written), the chunk being written is held in chunk
+    int compressed;
+    uint16_t* chunk_lens;
+    int chunks_count;
+    char* chunk;
+    int chunk_idx;
+    int chunk_dirty;
+    // queued for the background defragmenter
+    int defrag;
+    // files opened right after this one and how often, under files_lock
+    int succ[LC_PREFETCH_WAYS];
+    uint8_t succ_seen[LC_PREFETCH_WAYS];
+    // blocks read and written, halved after every migration pass
+    uint32_t heat;
+    // readers share the block map, writers and close take it exclusively
+    pthread_rwlock_t lock;
+    // guards cur_pos, so readers sharing the file lock reserve disjoint ranges
+    pthread_mutex_t pos_lock;
 };
+// a run of consecutive blocks within one sector
+typedef struct {
+    uint8_t device_id;
+    uint8_t pad;
+    uint16_t sector;
+    uint16_t block;
+    uint16_t count;
+} lc_extent;
+
+// block 0 of sector 0 on the metadata device
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t seq; // bumped on every checkpoint
+    uint32_t ckpt_bytes; // length of the checkpoint stream
+    uint32_t ckpt_sum; // checksum of the checkpoint stream
+    uint32_t nextents;
+    lc_extent extents[LC_META_MAX_EXTENTS]; // where the checkpoint is stored
+    uint32_t journal_nextents;
+    lc_extent journal[LC_JOURNAL_MAX_EXTENTS]; // the journal region
+} lc_superblock;
+
 //struct the device in the file
 typedef struct device* Device;
 struct device {
@@ -51,14 +175,143 @@ struct device {
     int cur_block;
     int sectors_count;
     int blocks_count;
+    // references per block (sector * blocks_count + block), 0 when free
+    uint16_t* refs;
+    int free_count;
+    // fingerprint each block is indexed under, 0 when not indexed
+    uint64_t* prints;
+    // block transfer timing, the latency moving average in ns, the number
+    // of transfers and their total time, under alloc_lock
+    uint64_t lat_ns;
+    uint64_t xfers;
+    uint64_t xfer_ns;
 };
 
+// fingerprint index slot, addr is the linear block address
+typedef struct {
+    uint64_t print;
+    int addr;
+} lc_dedup_entry;
+
 int lcloud;
 // there are maximum 16 devices
 struct device devices[16];
 int cur_device;
-struct file* files;
+// the table holds pointers so a growing table never moves a file in use
+File* files;
 int files_count;
+// protects files/files_count, the per-file lock protects each entry
+pthread_rwlock_t files_lock = PTHREAD_RWLOCK_INITIALIZER;
+// serializes the lazy power on/probe in lcopen against lcshutdown
+pthread_mutex_t init_lock = PTHREAD_MUTEX_INITIALIZER;
+// protects devices[] cursors and cur_device
+pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+// device holding the superblock (-1 if none) and the last checkpoint number
+int meta_device = -1;
+uint32_t meta_seq;
+// journal region, the open journal block and the slot it goes to
+lc_extent journal_extents[LC_JOURNAL_MAX_EXTENTS];
+int journal_nextents;
+int journal_blocks;
+int journal_next;
+unsigned char journal_buf[LC_DEVICE_BLOCK_SIZE];
+int journal_used;
+int journal_last; // offset of the last record, for merging
+int journal_dirty; // records not yet written to the slot
+int journal_full; // region used up, waiting for a checkpoint
+pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+// blocks holding the current checkpoint, released by the next one
+lc_extent ckpt_extents[LC_META_MAX_EXTENTS];
+int ckpt_nextents;
+// background compactor, woken once enough blocks have been freed
+pthread_t compact_thread;
+int compact_running;
+int compact_freed;
+// closed files waiting for the background defragmenter, when enabled
+int defrag_mode;
+int defrag_pending;
+pthread_mutex_t compact_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t compact_cond = PTHREAD_COND_INITIALIZER;
+// hot/cold tiering, block accesses since the last migration pass and the
+// request for the next one, under compact_lock
+int tier_mode;
+int tier_accesses;
+int tier_pending;
+// open order predictor, last_open under files_lock, and the background
+// prefetcher with its queue of predicted files under prefetch_lock
+int prefetch_mode;
+int last_open = -1;
+int prefetch_files;
+pthread_t prefetch_thread;
+int prefetch_running;
+int prefetch_queue[LC_PREFETCH_QUEUE];
+int prefetch_head;
+int prefetch_queued;
+pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t prefetch_cond = PTHREAD_COND_INITIALIZER;
+// log-structured mode, the open segment (a sector) and the next block in it,
+// and the superseded blocks waiting for their remap to be committed, all
+// under alloc_lock
+int log_mode;
+int log_device = -1;
+int log_sector;
+int log_block;
+struct block* log_pending;
+int log_pending_count;
+// deduplication switch and fingerprint index, under alloc_lock
+int dedup_mode;
+lc_dedup_entry* dedup_table;
+uint64_t dedup_mask;
+int dedup_hits;
+// new files are created compressed
+int compress_mode;
+// all-zero block writes leave holes
+int sparse_mode;
+// open streams, each with its window from the fixed buffer pool, the
+// table under stream_lock
+typedef struct {
+    int open;
+    LcFHandle fh;
+    int mode;
+    char* pool; // LC_STREAM_WINDOW blocks
+    int used; // bytes waiting to be written, or read into the window
+    int off; // bytes of the window already pulled
+    size_t total; // bytes pushed
+} lc_stream;
+lc_stream streams[LC_STREAM_MAX];
+char stream_pool[LC_STREAM_MAX][LC_STREAM_WINDOW * LC_DEVICE_BLOCK_SIZE];
+pthread_mutex_t stream_lock = PTHREAD_MUTEX_INITIALIZER;
+// the pack block taking new tails, its contents so far and the files whose
+// tails are in it
+struct block pack_block;
+char pack_buf[LC_DEVICE_BLOCK_SIZE];
+int pack_used;
+int pack_open;
+File pack_files[LC_DEVICE_BLOCK_SIZE];
+int pack_count;
+pthread_mutex_t pack_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Functional prototypes
+int lcloud_mount(void);
+int lcloud_checkpoint(void);
+void lcloud_free_extents(lc_extent* ext, int n);
+void lcloud_compact_notify(void);
+void lcloud_dedup_remember(int dev, int sec, int blk, const char* data);
+void lcloud_compact_start(void);
+void lcloud_compact_stop(void);
+int lcloud_defrag_queued(void);
+void lcloud_prefetch_forget(File f);
+void lcloud_prefetch_start(void);
+void lcloud_prefetch_stop(void);
+void lcloud_tier_record(int dev, uint64_t ns);
+void lcloud_tier_touch(File f, size_t len);
+int lcloud_tier(void);
+int lcloud_log_clean(void);
+int lcloud_log_supersede(struct block* b);
+int lcloud_log_block(int* dev, int* sec, int* blk);
+void lcloud_log_commit(void);
+int lcloud_addr_block(int addr, int* dev, int* sec, int* blk);
+int lcloud_block_addr(int dev, int sec, int blk);
 
 // File system interface implementation
 
@@ -172,6 +425,28 @@ int lcloud_io_devices_probe(int* device_ids)
     return 0;
 }
 
+// Function     : lcloud_io_xfer
+// Description  : send a block transfer, timing it for the device's stats
+//
+// Inputs       : lcloud_reg - the transfer request
+//                device - its device
+//                buf - the block
+// Outputs      : 1 if success or 0 if failure
+
+int lcloud_io_xfer(LCloudRegisterFrame lcloud_reg, int device, char* buf)
+{
+    struct timespec t0, t1;
+    int ok;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    ok = lcloud_io_succeed(client_lcloud_bus_request(lcloud_reg, buf));
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if (ok) {
+        lcloud_tier_record(device, (uint64_t)(t1.tv_sec - t0.tv_sec) * 1000000000 + t1.tv_nsec - t0.tv_nsec);
+    }
+    return ok;
+}
+
 // Function     : lcloud_io_read
 // Description  :reading command. Read the file
 //
@@ -187,7 +462,7 @@ int lcloud_io_read(int device, int sector, int block, char* buf)
         0, 0, LC_BLOCK_XFER, device, LC_XFER_READ, sector, block);
 
     // return to command
-    return lcloud_io_succeed(client_lcloud_bus_request(lcloud_reg, buf));
+    return lcloud_io_xfer(lcloud_reg, device, buf);
 }
 
 // Function     : lcloud_io_write
@@ -202,7 +477,38 @@ int lcloud_io_write(int device, int sector, int block, char* buf)
         sector, block);
     LCloudRegisterFrame lcloud_reg = create_lcloud_registers(
         0, 0, LC_BLOCK_XFER, device, LC_XFER_WRITE, sector, block);
-    return lcloud_io_succeed(client_lcloud_bus_request(lcloud_reg, buf));
+    return lcloud_io_xfer(lcloud_reg, device, buf);
+}
+
+// Function     : lcloud_io_batch
+// Description  : transfer a window of blocks with one pipelined exchange
+//
+// Inputs       : b - the blocks
+//                bufs - the data of each block
+//                n - number of blocks, at most LC_STREAM_WINDOW
+//                op - LC_XFER_READ or LC_XFER_WRITE
+// Outputs      : 1 if every transfer succeeded or 0 if failure
+
+int lcloud_io_batch(struct block* b, char** bufs, int n, int op)
+{
+    LCloudRegisterFrame regs[LC_STREAM_WINDOW], resps[LC_STREAM_WINDOW];
+    struct timespec t0, t1;
+    uint64_t ns;
+    int i, ok;
+
+    for (i = 0; i < n; i++) {
+        regs[i] = create_lcloud_registers(0, 0, LC_BLOCK_XFER, b[i].device_id, op, b[i].sector, b[i].block);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    ok = (client_lcloud_bus_batch(regs, (void**)bufs, resps, n) == 0);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    ns = ((uint64_t)(t1.tv_sec - t0.tv_sec) * 1000000000 + t1.tv_nsec - t0.tv_nsec) / (n ? n : 1);
+    for (i = 0; i < n && ok; i++) {
+        ok = lcloud_io_succeed(resps[i]);
+        // the window shares the time, each transfer gets its part
+        lcloud_tier_record(b[i].device_id, ns);
+    }
+    return ok;
 }
 
 // Function     : lcloud_io_device_init
@@ -222,6 +528,9 @@ int lcloud_io_device_init(int device_id)
         devices[device_id].lcloud = 1;
         devices[device_id].sectors_count = d0;
         devices[device_id].blocks_count = d1;
+        devices[device_id].refs = (uint16_t*)calloc(d0 * d1, sizeof(uint16_t));
+        devices[device_id].prints = (uint64_t*)calloc(d0 * d1, sizeof(uint64_t));
+        devices[device_id].free_count = d0 * d1;
         logMessage(LOG_OUTPUT_LEVEL, "Device %d initialized", device_id);
         return 1;
     } else {
@@ -263,6 +572,10 @@ int lcloud_initialization()
     //initialize the chache
     lcloud_initcache(LC_CACHE_MAXBLOCKS);
     //set up the device memory
+    for (int i = 0; i < 16; i++) {
+        free(devices[i].refs);
+        free(devices[i].prints);
+    }
     memset(devices, 0, sizeof(devices));
     cur_device = 0;
 
@@ -277,6 +590,11 @@ int lcloud_initialization()
         return 0;
     }
 
+    // pick up the files left by an earlier session
+    lcloud_mount();
+    lcloud_compact_start();
+    lcloud_prefetch_start();
+
     lcloud = 1;
 
     logMessage(LOG_OUTPUT_LEVEL, "Initialized");
@@ -284,286 +602,4467 @@ int lcloud_initialization()
 }
 
 // Function     : lcloud_get_free_block
-// Description  : get a new free block
+// Description  : get a new free block, scanning forward from where the last
+//                allocation ended so consecutive allocations stay contiguous
 // Inputs       : sector, block
 // Outputs      : 1 if success or 0 if failure
 int lcloud_get_free_block(int* device_id, int* sector, int* block)
 {
-    while (cur_device < 16) {
-        if (devices[cur_device].cur_sector < devices[cur_device].sectors_count) {
-            *device_id = cur_device;
-            // find the right location. since we need to get new block, cur_block++
-            *sector = devices[cur_device].cur_sector;
-            *block = devices[cur_device].cur_block++;
-            if (devices[cur_device].cur_block == devices[cur_device].blocks_count) {
-                devices[cur_device].cur_sector++;
-                devices[cur_device].cur_block = 0;
+    int scanned, d;
+
+    // concurrent writers allocate from the same cursor
+    pthread_mutex_lock(&alloc_lock);
+    for (scanned = 0; scanned <= 16; scanned++) {
+        d = cur_device;
+        if (devices[d].lcloud && devices[d].free_count > 0) {
+            while (devices[d].cur_sector < devices[d].sectors_count) {
+                int idx = devices[d].cur_sector * devices[d].blocks_count + devices[d].cur_block;
+                *device_id = d;
+                // find the right location. since we need to get new block, cur_block++
+                *sector = devices[d].cur_sector;
+                *block = devices[d].cur_block++;
+                if (devices[d].cur_block == devices[d].blocks_count) {
+                    devices[d].cur_sector++;
+                    devices[d].cur_block = 0;
+                }
+                if (devices[d].refs[idx] == 0) {
+                    devices[d].refs[idx] = 1;
+                    devices[d].prints[idx] = 0;
+                    devices[d].free_count--;
+                    pthread_mutex_unlock(&alloc_lock);
+                    return 1;
+                }
             }
-            return 1;
         }
-        cur_device++;
+        // wrap around to the start of the next device
+        devices[d].cur_sector = 0;
+        devices[d].cur_block = 0;
+        cur_device = (d + 1) % 16;
     }
+    pthread_mutex_unlock(&alloc_lock);
     // if all blocks on all devices are used up, then no space.
     return 0;
 }
 
-////////////////////////////////////////////////////////////////////////////////
-//
-// Function     : lcopen
-// Description  : Open the device in file for for reading and writing
-//
-// Inputs       : path - the path/filename of the file to be read
-// Outputs      : file handle i, -1 if failure
-LcFHandle lcopen(const char* path)
+// Function     : lcloud_ref_block
+// Description  : take a reference on a block, marking it in use
+// Inputs       : dev, sec, blk
+// Outputs      : 1 if success or 0 if the count is already at its maximum
+int lcloud_ref_block(int dev, int sec, int blk)
 {
-    // since we have more files and more device, we use device to find the specific location
-    int i;
-    // if there is no register, create a lcreg and cache
-    if (lcloud == 0) {
-        lcloud_initialization();
+    int idx, ok = 1;
+
+    if (dev == LC_HOLE) {
+        return 1;
     }
+    idx = sec * devices[dev].blocks_count + blk;
+    pthread_mutex_lock(&alloc_lock);
+    if (devices[dev].refs[idx] == UINT16_MAX) {
+        ok = 0;
+    } else if (devices[dev].refs[idx]++ == 0) {
+        devices[dev].free_count--;
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    return ok;
+}
 
-    //determine if the files are openned
-    for (i = 0; i < files_count; i++) {
-        if (strcmp(path, files[i].file_name) == 0) {
-            if (files[i].is_open) {
-                logMessage(LOG_OUTPUT_LEVEL, "Already open");
-                return -1;
-            }
-            files[i].cur_pos = 0;
+// Function     : lcloud_free_block
+// Description  : drop a reference on a block, returning it to the allocator
+//                and evicting it from the cache when it was the last one
+// Inputs       : dev, sec, blk
+// Outputs      : none
+void lcloud_free_block(int dev, int sec, int blk)
+{
+    int idx, freed = 0;
 
-            //return the file i
-            return i;
-        }
+    if (dev == LC_HOLE) {
+        return;
+    }
+    idx = sec * devices[dev].blocks_count + blk;
+    pthread_mutex_lock(&alloc_lock);
+    if (devices[dev].refs[idx] > 0 && --devices[dev].refs[idx] == 0) {
+        devices[dev].free_count++;
+        devices[dev].prints[idx] = 0;
+        freed = 1;
     }
+    pthread_mutex_unlock(&alloc_lock);
+    if (freed) {
+        lcloud_evictcache(dev, sec, blk);
+        lcloud_compact_notify();
+    }
+}
 
-    files = (File)realloc(files, sizeof(struct file) * (files_count + 1));
-    // open the file
-    files[i].file_name = strdup(path);
-    files[i].is_open = 1;
-    files[i].file_size = 0;
-    files[i].cur_pos = 0;
-    files[i].blocks = NULL;
-    files[i].blocks_count = 0;
-    files_count++;
-    logMessage(LOG_OUTPUT_LEVEL, "File %d created", i);
-    // return the file handle
-    return i;
+// Function     : lcloud_get_file
+// Description  : look up the file behind a handle
+// Inputs       : fh - file handle
+// Outputs      : the file, NULL if the handle is invalid
+File lcloud_get_file(LcFHandle fh)
+{
+    File f = NULL;
+
+    pthread_rwlock_rdlock(&files_lock);
+    if (fh >= 0 && fh < files_count) {
+        f = files[fh];
+    }
+    pthread_rwlock_unlock(&files_lock);
+    if (!f) {
+        logMessage(LOG_OUTPUT_LEVEL, "Invalid fh");
+    }
+    return f;
+}
+
+// Function     : lcloud_read_block
+// Description  : read a whole block through the cache
+// Inputs       : dev, sec, blk, buf
+// Outputs      : 1 if success or 0 if failure
+int lcloud_read_block(int dev, int sec, int blk, char* buf)
+{
+    // a hole reads as zeros
+    if (dev == LC_HOLE) {
+        memset(buf, 0, LC_DEVICE_BLOCK_SIZE);
+        return 1;
+    }
+    if (lcloud_copycache(dev, sec, blk, buf) == 0) {
+        return 1;
+    }
+    if (!lcloud_io_read(dev, sec, blk, buf)) {
+        return 0;
+    }
+    lcloud_putcache(dev, sec, blk, buf);
+    return 1;
+}
+
+// Function     : lcloud_new_file
+// Description  : allocate an empty, closed file entry
+// Inputs       : path - the file name, NULL for an unlinked slot
+// Outputs      : the new file
+File lcloud_new_file(const char* path)
+{
+    // zeroed, so fields set later such as the tail and fid never reach a
+    // checkpoint as stale bytes
+    File f = (File)calloc(1, sizeof(struct file));
+    // a NULL name is the tombstone left in the table by lcunlink
+    f->file_name = path ? strdup(path) : NULL;
+    f->is_open = 0;
+    f->file_size = 0;
+    f->cur_pos = 0;
+    f->blocks = NULL;
+    f->blocks_count = 0;
+    f->tail_off = 0;
+    f->tail_len = 0;
+    f->compressed = 0;
+    f->chunk_lens = NULL;
+    f->chunks_count = 0;
+    f->chunk = NULL;
+    f->chunk_idx = -1;
+    f->chunk_dirty = 0;
+    f->defrag = 0;
+    f->heat = 0;
+    lcloud_prefetch_forget(f);
+    pthread_rwlock_init(&f->lock, NULL);
+    pthread_mutex_init(&f->pos_lock, NULL);
+    return f;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : lcread
-// Description  : Read data from the file
+// On-device metadata
 //
-// Inputs       : fh - file handle for the file to read from
-//                buf - place to put the data
-//                len - the length of the read
-// Outputs      : number of bytes read, -1 if failure
-int lcread(LcFHandle fh, char* buf, size_t len)
+// The superblock lives in block 0 of sector 0 on the lowest numbered device,
+// which the allocator never hands out. It records where the latest
+// checkpoint is, as a short list of extents, so mounting costs one read for
+// the superblock plus one per checkpoint block. The checkpoint is a byte
+// stream holding the allocator cursors and, per file, its name, size and
+// block map compressed into extents of consecutive blocks.
+//
+// A new checkpoint is written to freshly allocated blocks before the
+// superblock is pointed at it, so a crash mid-way leaves the old one intact.
+
+// Function     : lcloud_meta_sum
+// Description  : FNV-1a checksum used to validate a checkpoint
+// Inputs       : buf, len
+// Outputs      : the checksum
+uint32_t lcloud_meta_sum(const unsigned char* buf, size_t len)
 {
-    char* cache;
-    char tmp[LC_DEVICE_BLOCK_SIZE];
-    int i, dev, sec, blk;
+    uint32_t h = 2166136261u;
+    size_t i;
 
-    // if the file is not valid or not opened, return -1
-    if (fh < 0 || fh >= files_count) {
-        logMessage(LOG_OUTPUT_LEVEL, "Invalid fh");
-        return -1;
+    for (i = 0; i < len; i++) {
+        h ^= buf[i];
+        h *= 16777619u;
     }
-    if (!files[fh].is_open) {
-        logMessage(LOG_OUTPUT_LEVEL, "Not open");
-        return -1;
+    return h;
+}
+
+// Function     : lcloud_meta_put / lcloud_meta_get
+// Description  : little endian field encoding for the checkpoint stream,
+//                the caller sized the buffer up front
+// Inputs       : p - cursor into the buffer, v - value, n - field width
+// Outputs      : the value read (get)
+void lcloud_meta_put(unsigned char** p, uint32_t v, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        *(*p)++ = (v >> (8 * i)) & 0xff;
     }
-    // set up the length to read
-    size_t left = files[fh].file_size - files[fh].cur_pos;
-    if (len > left) {
-        len = left;
+}
+
+uint32_t lcloud_meta_get(const unsigned char** p, const unsigned char* end, int n, int* err)
+{
+    uint32_t v = 0;
+    int i;
+
+    if (*p + n > end) {
+        *err = 1;
+        return 0;
     }
-    // read the lenght n, alread read length n_read
-    unsigned int n_read = 0;
-    unsigned int n;
-    while (n_read < len) {
-        // since write and read cannot over the length of block size
-        // mod the current position by the block size (to get the length)
-        unsigned int begin = files[fh].cur_pos % LC_DEVICE_BLOCK_SIZE;
-        n = LC_DEVICE_BLOCK_SIZE - begin;
-        if (n > len - n_read) {
-            n = len - n_read;
-        }
+    for (i = 0; i < n; i++) {
+        v |= ((uint32_t)*(*p)++) << (8 * i);
+    }
+    return v;
+}
 
-        i = files[fh].cur_pos / LC_DEVICE_BLOCK_SIZE;
-        dev = files[fh].blocks[i].device_id;
-        sec = files[fh].blocks[i].sector;
-        blk = files[fh].blocks[i].block;
-	//read the cache
-        cache = lcloud_getcache(dev, sec, blk);
-        if (!cache) {
-            lcloud_io_read(dev, sec, blk, tmp);
-            lcloud_putcache(dev, sec, blk, tmp);
-            cache = tmp;
-        }
+// Function     : lcloud_block_follows
+// Description  : check whether a block continues a run of blocks, runs of
+//                holes count as one run, a run ends at 0xffff blocks since
+//                the checkpoint stores its length in 2 bytes
+// Inputs       : a - first block of the run
+//                b - the block
+//                n - how far b is from a in the block map
+// Outputs      : 1 if it does, 0 if not
+int lcloud_block_follows(struct block* a, struct block* b, int n)
+{
+    if (n >= 0xffff) {
+        return 0;
+    }
+    if (a->device_id == LC_HOLE || b->device_id == LC_HOLE) {
+        return a->device_id == b->device_id;
+    }
+    return a->device_id == b->device_id && a->sector == b->sector && b->block == a->block + n;
+}
 
-        // copy the file's memory to buffer
-        memcpy(buf + n_read, cache + begin, n);
+// Function     : lcloud_map_runs / lcloud_file_extents
+// Description  : count the runs of consecutive blocks in a block map
+// Inputs       : b, n - the block map and its length / f - the file
+// Outputs      : number of extents
+int lcloud_map_runs(struct block* b, int n)
+{
+    int i, j = 0, runs = 0;
 
-        logMessage(LOG_OUTPUT_LEVEL, "write: %.*s", n, buf + n_read);
-        files[fh].cur_pos += n;
-        n_read += n;
+    // j is where the current run starts
+    for (i = 0; i < n; i++) {
+        if (i == 0 || !lcloud_block_follows(&b[j], &b[i], i - j)) {
+            runs++;
+            j = i;
+        }
     }
-    // return the reading bytes
-    return n_read;
+    return runs;
 }
 
-////////////////////////////////////////////////////////////////////////////////
-//
-// Function     : lcwrite
-// Description  : write data to the file
-//
-// Inputs       : fh - file handle for the file to write to
-//                buf - pointer to data to write
-//                len - the length of the write
-// Outputs      : number of bytes written if successful test, -1 if failure
+int lcloud_file_extents(File f)
+{
+    return lcloud_map_runs(f->blocks, f->blocks_count);
+}
 
-int lcwrite(LcFHandle fh, char* buf, size_t len)
+// Function     : lcloud_checkpoint_size
+// Description  : size in bytes of the checkpoint for the current files
+// Outputs      : the size
+size_t lcloud_checkpoint_size(void)
 {
-    char* cache;
-    char tmp[LC_DEVICE_BLOCK_SIZE];
-    int i, dev, sec, blk;
+    size_t len = LC_META_CKPT_HEADER;
+    int i;
 
-    // check if the file is avalible and valid or not
-    if (fh < 0 || fh >= files_count) {
-        logMessage(LOG_OUTPUT_LEVEL, "Invalid fh");
-        return -1;
-    }
-    if (!files[fh].is_open) {
-        logMessage(LOG_OUTPUT_LEVEL, "Not open");
-        return -1;
+    for (i = 0; i < files_count; i++) {
+        len += 2 + (files[i]->file_name ? strlen(files[i]->file_name) : 0) + 8
+            + LC_META_TAIL_SIZE + LC_META_CHUNKS_SIZE + 2 * files[i]->chunks_count
+            + LC_META_EXTENT_SIZE * lcloud_file_extents(files[i]);
     }
+    return len;
+}
 
-    // write the file (same as the read)
-    unsigned int n_write = 0;
-    unsigned int n;
-    while (n_write < len) {
-        // since write and read cannot over the length of block size
-        // mod the current position by the block size (to get the length)
-        unsigned int begin = files[fh].cur_pos % LC_DEVICE_BLOCK_SIZE;
-        n = LC_DEVICE_BLOCK_SIZE - begin;
-        if (n > len - n_write) {
-            n = len - n_write;
+// Function     : lcloud_checkpoint_encode
+// Description  : serialize the allocator state and file table
+// Inputs       : buf - buffer of lcloud_checkpoint_size() bytes
+// Outputs      : none
+void lcloud_checkpoint_encode(unsigned char* buf)
+{
+    unsigned char* p = buf;
+    int i, j, k, len;
+    File f;
+
+    lcloud_meta_put(&p, files_count, 4);
+    lcloud_meta_put(&p, cur_device, 4);
+    for (i = 0; i < 16; i++) {
+        lcloud_meta_put(&p, devices[i].lcloud, 1);
+        lcloud_meta_put(&p, devices[i].sectors_count, 2);
+        lcloud_meta_put(&p, devices[i].blocks_count, 2);
+        lcloud_meta_put(&p, devices[i].cur_sector, 2);
+        lcloud_meta_put(&p, devices[i].cur_block, 2);
+    }
+    for (i = 0; i < files_count; i++) {
+        f = files[i];
+        len = f->file_name ? strlen(f->file_name) : 0;
+        lcloud_meta_put(&p, len, 2);
+        memcpy(p, f->file_name, len);
+        p += len;
+        lcloud_meta_put(&p, f->file_size, 4);
+        lcloud_meta_put(&p, f->tail.device_id, 1);
+        lcloud_meta_put(&p, f->tail.sector, 2);
+        lcloud_meta_put(&p, f->tail.block, 2);
+        lcloud_meta_put(&p, f->tail_off, 2);
+        lcloud_meta_put(&p, f->tail_len, 2);
+        lcloud_meta_put(&p, f->compressed ? LC_FILE_COMPRESSED : 0, 1);
+        lcloud_meta_put(&p, f->chunks_count, 4);
+        for (j = 0; j < f->chunks_count; j++) {
+            lcloud_meta_put(&p, f->chunk_lens[j], 2);
         }
+        lcloud_meta_put(&p, lcloud_file_extents(f), 4);
+        for (j = 0; j < f->blocks_count; j = k) {
+            for (k = j + 1; k < f->blocks_count; k++) {
+                if (!lcloud_block_follows(&f->blocks[j], &f->blocks[k], k - j)) {
+                    break;
+                }
+            }
+            lcloud_meta_put(&p, f->blocks[j].device_id, 1);
+            lcloud_meta_put(&p, f->blocks[j].sector, 2);
+            lcloud_meta_put(&p, f->blocks[j].block, 2);
+            lcloud_meta_put(&p, k - j, 2);
+        }
+    }
+}
 
-        i = files[fh].cur_pos / LC_DEVICE_BLOCK_SIZE;
+// Function     : lcloud_checkpoint_decode
+// Description  : rebuild the allocator state and file table from a checkpoint
+// Inputs       : buf, len - the checkpoint stream
+//                version - the superblock version that wrote it
+// Outputs      : 1 if success or 0 if the checkpoint does not fit the devices
+int lcloud_checkpoint_decode(const unsigned char* buf, size_t len, int version)
+{
+    const unsigned char* p = buf;
+    const unsigned char* end = buf + len;
+    int err = 0, i, j, c, n, count, nextents, online, sectors, blocks;
+    char name[LC_META_MAX_NAME + 1];
+    File f;
+
+    n = lcloud_meta_get(&p, end, 4, &err);
+    c = lcloud_meta_get(&p, end, 4, &err);
+    struct device saved[16];
+    for (i = 0; i < 16; i++) {
+        online = lcloud_meta_get(&p, end, 1, &err);
+        sectors = lcloud_meta_get(&p, end, 2, &err);
+        blocks = lcloud_meta_get(&p, end, 2, &err);
+        // a different hardware layout means this is not our filesystem
+        if (online != devices[i].lcloud || sectors != devices[i].sectors_count
+            || blocks != devices[i].blocks_count) {
+            logMessage(LOG_OUTPUT_LEVEL, "Checkpoint device %d layout mismatch", i);
+            return 0;
+        }
+        saved[i] = devices[i];
+        saved[i].cur_sector = lcloud_meta_get(&p, end, 2, &err);
+        saved[i].cur_block = lcloud_meta_get(&p, end, 2, &err);
+    }
+    if (err) {
+        return 0;
+    }
 
-        if (i == files[fh].blocks_count) {
-            files[fh].blocks_count++;
-            files[fh].blocks = realloc(files[fh].blocks, sizeof(struct block) * files[fh].blocks_count);
-            if (!lcloud_get_free_block(&files[fh].blocks[i].device_id, &files[fh].blocks[i].sector, &files[fh].blocks[i].block)) {
+    files = (File*)malloc(sizeof(File) * (n ? n : 1));
+    for (files_count = 0; files_count < n && !err; files_count++) {
+        i = lcloud_meta_get(&p, end, 2, &err);
+        if (err || i > LC_META_MAX_NAME || p + i > end) {
+            err = 1;
+            break;
+        }
+        memcpy(name, p, i);
+        name[i] = '\0';
+        p += i;
+        f = lcloud_new_file(i ? name : NULL);
+        f->fid = files_count;
+        files[files_count] = f;
+        f->file_size = lcloud_meta_get(&p, end, 4, &err);
+        if (version >= LC_META_VERSION_TAILS) {
+            f->tail.device_id = lcloud_meta_get(&p, end, 1, &err);
+            f->tail.sector = lcloud_meta_get(&p, end, 2, &err);
+            f->tail.block = lcloud_meta_get(&p, end, 2, &err);
+            f->tail_off = lcloud_meta_get(&p, end, 2, &err);
+            f->tail_len = lcloud_meta_get(&p, end, 2, &err);
+        }
+        if (version >= LC_META_VERSION_CHUNKS) {
+            f->compressed = (lcloud_meta_get(&p, end, 1, &err) & LC_FILE_COMPRESSED) != 0;
+            f->chunks_count = lcloud_meta_get(&p, end, 4, &err);
+            if (err || p + 2 * (size_t)f->chunks_count > end) {
+                // counted, so lcloud_free_files releases it
+                f->chunks_count = 0;
+                files_count++;
+                err = 1;
                 break;
             }
+            f->chunk_lens = (uint16_t*)malloc(sizeof(uint16_t) * (f->chunks_count + 1));
+            for (j = 0; j < f->chunks_count; j++) {
+                f->chunk_lens[j] = lcloud_meta_get(&p, end, 2, &err);
+            }
         }
-        dev = files[fh].blocks[i].device_id;
-        sec = files[fh].blocks[i].sector;
-        blk = files[fh].blocks[i].block;
-
-        cache = lcloud_getcache(dev, sec, blk);
-        // write through cache
-        if (cache) {
-            memcpy(cache + begin, buf + n_write, n);
-            lcloud_io_write(dev, sec, blk, cache);
-        } else {
-            lcloud_io_read(dev, sec, blk, tmp);
-            memcpy(tmp + begin, buf + n_write, n);
-            lcloud_putcache(dev, sec, blk, tmp);
-            lcloud_io_write(dev, sec, blk, tmp);
+        nextents = lcloud_meta_get(&p, end, 4, &err);
+        for (i = 0; i < nextents && !err; i++) {
+            int dev = lcloud_meta_get(&p, end, 1, &err);
+            int sec = lcloud_meta_get(&p, end, 2, &err);
+            int blk = lcloud_meta_get(&p, end, 2, &err);
+            count = lcloud_meta_get(&p, end, 2, &err);
+            if (err) {
+                break;
+            }
+            f->blocks = realloc(f->blocks, sizeof(struct block) * (f->blocks_count + count));
+            for (j = 0; j < count; j++) {
+                f->blocks[f->blocks_count].device_id = dev;
+                f->blocks[f->blocks_count].sector = sec;
+                f->blocks[f->blocks_count].block = dev == LC_HOLE ? blk : blk + j;
+                f->blocks_count++;
+            }
         }
+    }
+    if (err) {
+        logMessage(LOG_OUTPUT_LEVEL, "Checkpoint truncated");
+        return 0;
+    }
+    memcpy(devices, saved, sizeof(devices));
+    cur_device = c;
+    return 1;
+}
 
-        files[fh].cur_pos += n;
-        if (files[fh].cur_pos > files[fh].file_size) {
-            files[fh].file_size = files[fh].cur_pos;
-        }
+// Function     : lcloud_clear_file
+// Description  : turn a file entry into an unlinked slot (memory only)
+// Inputs       : f - the file
+// Outputs      : none
+void lcloud_clear_file(File f)
+{
+    free(f->file_name);
+    free(f->blocks);
+    free(f->chunk_lens);
+    free(f->chunk);
+    f->file_name = NULL;
+    f->blocks = NULL;
+    f->blocks_count = 0;
+    f->tail_len = 0;
+    f->compressed = 0;
+    f->chunk_lens = NULL;
+    f->chunks_count = 0;
+    f->chunk = NULL;
+    f->chunk_idx = -1;
+    f->chunk_dirty = 0;
+    f->defrag = 0;
+    f->heat = 0;
+    lcloud_prefetch_forget(f);
+    f->file_size = 0;
+    f->cur_pos = 0;
+    f->is_open = 0;
+}
 
-        n_write += n;
+// Function     : lcloud_free_files
+// Description  : release the in-memory file table
+// Outputs      : none
+void lcloud_free_files(void)
+{
+    for (int i = 0; i < files_count; i++) {
+        free(files[i]->file_name);
+        free(files[i]->blocks);
+        free(files[i]->chunk_lens);
+        free(files[i]->chunk);
+        pthread_rwlock_destroy(&files[i]->lock);
+        pthread_mutex_destroy(&files[i]->pos_lock);
+        free(files[i]);
     }
-    // return the bytes
-    return n_write;
+    free(files);
+    files = NULL;
+    files_count = 0;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : lcseek
-// Description  : Seek to a specific place in the file
+// Metadata journal
 //
-// Inputs       : fh - the file handle of the file to seek in
-//                off - offset within the file to seek to
-// Outputs      : 0 if successful test, -1 if failure
+// Between checkpoints, metadata changes are appended as small records to an
+// in-memory journal block. The block is written to the next slot of the
+// journal region only when it fills up or a file is closed, so one device
+// write commits the updates of many lcopen/lcwrite calls. Records are
+// idempotent (create, map extent, set size), and records for the same file
+// are merged with the previous record in the block when possible.
+//
+// Every journal block carries the sequence number of the checkpoint it
+// follows, so blocks left from before the last checkpoint are ignored at
+// replay. When the region is full, the next checkpoint absorbs the pending
+// changes and empties the journal.
 
-int lcseek(LcFHandle fh, size_t off)
+// Function     : lcloud_journal_slot
+// Description  : find the device block for a journal slot
+// Inputs       : slot, dev, sec, blk
+// Outputs      : 1 if success or 0 if the slot is outside the region
+int lcloud_journal_slot(int slot, int* dev, int* sec, int* blk)
 {
-    // check if the position is right and the file is valid or not
-    if (fh < 0 || fh >= files_count) {
-        logMessage(LOG_OUTPUT_LEVEL, "Invalid fh");
-        return -1;
-    }
-    if (!files[fh].is_open) {
-        logMessage(LOG_OUTPUT_LEVEL, "Not open");
-        return -1;
-    }
-    if (files[fh].file_size < off) {
-        logMessage(LOG_OUTPUT_LEVEL, "Out of range");
-        return -1;
+    int i;
+
+    for (i = 0; i < journal_nextents; i++) {
+        if (slot < journal_extents[i].count) {
+            *dev = journal_extents[i].device_id;
+            *sec = journal_extents[i].sector;
+            *blk = journal_extents[i].block + slot;
+            return 1;
+        }
+        slot -= journal_extents[i].count;
     }
-    files[fh].cur_pos = off;
-    return (off);
+    return 0;
 }
 
-////////////////////////////////////////////////////////////////////////////////
-//
-// Function     : lcclose
-// Description  : Close the file
-//
-// Inputs       : fh - the file handle of the file to close
-// Outputs      : 0 if successful test, -1 if failure
-
-int lcclose(LcFHandle fh)
+// Function     : lcloud_journal_write
+// Description  : write the open journal block to its slot, the caller
+//                holds journal_lock
+// Outputs      : 1 if success or 0 if failure
+int lcloud_journal_write(void)
 {
-    if (fh < 0 || fh >= files_count) {
-        logMessage(LOG_OUTPUT_LEVEL, "Invalid fh");
-        return -1;
+    unsigned char* p = journal_buf;
+    int dev, sec, blk;
+
+    if (!journal_dirty) {
+        return 1;
     }
-    if (!files[fh].is_open) {
-        logMessage(LOG_OUTPUT_LEVEL, "Not open");
-        return -1;
+    lcloud_meta_put(&p, LC_JOURNAL_MAGIC, 4);
+    lcloud_meta_put(&p, meta_seq, 4);
+    lcloud_meta_put(&p, journal_next, 4);
+    lcloud_meta_put(&p, journal_used, 2);
+    lcloud_meta_put(&p, lcloud_meta_sum(journal_buf + LC_JOURNAL_HEADER,
+                            journal_used - LC_JOURNAL_HEADER), 4);
+    if (!lcloud_journal_slot(journal_next, &dev, &sec, &blk)
+        || !lcloud_io_write(dev, sec, blk, (char*)journal_buf)) {
+        return 0;
     }
-    // close the file, make the position and is_open into 0
-    files[fh].cur_pos = 0;
-    files[fh].is_open = 0;
-    return (0);
+    journal_dirty = 0;
+    return 1;
 }
 
-////////////////////////////////////////////////////////////////////////////////
-//
-// Function     : lcshutdown
-// Description  : Shut down the filesystem
-//
-// Inputs       : none
-// Outputs      : 0 if successful test, -1 if failure
+// Function     : lcloud_journal_reset
+// Description  : start an empty journal after a checkpoint, the caller
+//                holds journal_lock
+// Outputs      : none
+void lcloud_journal_reset(void)
+{
+    memset(journal_buf, 0, sizeof(journal_buf));
+    journal_used = LC_JOURNAL_HEADER;
+    journal_last = 0;
+    journal_next = 0;
+    journal_dirty = 0;
+    journal_full = 0;
+}
 
-int lcshutdown(void)
+// Function     : lcloud_journal_append
+// Description  : add a metadata record to the open journal block
+// Inputs       : type - record type
+//                rec - payload, starting with the 4 byte file id
+//                len - payload length
+// Outputs      : none
+void lcloud_journal_append(int type, const unsigned char* rec, int len)
 {
-    // if the power is off, return -1
-    if (!lcloud_io_power_off()) {
-        return -1;
+    unsigned char* last;
+
+    pthread_mutex_lock(&journal_lock);
+    if (journal_blocks == 0 || journal_full) {
+        pthread_mutex_unlock(&journal_lock);
+        return;
     }
-    // clean the file(return to NULL)
-    char buf[LC_DEVICE_BLOCK_SIZE * 10];
-    memset(buf, 0, LC_DEVICE_BLOCK_SIZE * 10);
-    for (int i = 0; i < files_count; i++) {
-        free(files[i].file_name);
-        free(files[i].blocks);
-        files[i].file_name = NULL;
-        files[i].blocks = NULL;
+    // merge with the previous record when it describes the same thing
+    last = journal_buf + journal_last;
+    if (journal_used > LC_JOURNAL_HEADER && last[0] == type && last[1] == len
+        && memcmp(last + 2, rec, 4) == 0) {
+        if (type == LC_JR_SIZE || (type == LC_JR_CHUNK && memcmp(last + 6, rec + 4, 4) == 0)) {
+            memcpy(last + 2, rec, len);
+            journal_dirty = 1;
+            pthread_mutex_unlock(&journal_lock);
+            return;
+        }
+        if (type == LC_JR_EXTENT) {
+            const unsigned char* q = last + 6;
+            const unsigned char* r = rec + 4;
+            const unsigned char* qend = last + 2 + len;
+            int err = 0;
+            uint32_t idx = lcloud_meta_get(&q, qend, 4, &err);
+            int dev = lcloud_meta_get(&q, qend, 1, &err);
+            int sec = lcloud_meta_get(&q, qend, 2, &err);
+            int blk = lcloud_meta_get(&q, qend, 2, &err);
+            int count = lcloud_meta_get(&q, qend, 2, &err);
+            uint32_t nidx = lcloud_meta_get(&r, rec + len, 4, &err);
+            int ndev = lcloud_meta_get(&r, rec + len, 1, &err);
+            int nsec = lcloud_meta_get(&r, rec + len, 2, &err);
+            int nblk = lcloud_meta_get(&r, rec + len, 2, &err);
+            int ncount = lcloud_meta_get(&r, rec + len, 2, &err);
+            if (!err && nidx == idx + count && ndev == dev
+                && (dev == LC_HOLE || (nsec == sec && nblk == blk + count)) && count + ncount <= 0xffff) {
+                // the count is the last field of the payload
+                unsigned char* w = last + 2 + len - 2;
+                lcloud_meta_put(&w, count + ncount, 2);
+                journal_dirty = 1;
+                pthread_mutex_unlock(&journal_lock);
+                return;
+            }
+        }
     }
+
+    if (journal_used + 2 + len > LC_DEVICE_BLOCK_SIZE) {
+        // group commit, the block is full
+        lcloud_journal_write();
+        memset(journal_buf, 0, sizeof(journal_buf));
+        journal_used = LC_JOURNAL_HEADER;
+        if (++journal_next == journal_blocks) {
+            // the next checkpoint takes over from here
+            journal_full = 1;
+            pthread_mutex_unlock(&journal_lock);
+            return;
+        }
+    }
+    journal_last = journal_used;
+    journal_buf[journal_used++] = type;
+    journal_buf[journal_used++] = len;
+    memcpy(journal_buf + journal_used, rec, len);
+    journal_used += len;
+    journal_dirty = 1;
+    pthread_mutex_unlock(&journal_lock);
+}
+
+// Function     : lcloud_journal_create / extent / holes / size
+// Description  : encode and append the individual record types
+// Inputs       : the file and the changed fields
+// Outputs      : none
+void lcloud_journal_create(File f)
+{
+    unsigned char rec[LC_JOURNAL_MAX_RECORD];
+    unsigned char* p = rec;
+    int len = strlen(f->file_name);
+
+    if (len > LC_JOURNAL_MAX_RECORD - 4) {
+        // too long to journal, let a checkpoint record it
+        pthread_mutex_lock(&journal_lock);
+        journal_full = (journal_blocks != 0);
+        pthread_mutex_unlock(&journal_lock);
+        return;
+    }
+    lcloud_meta_put(&p, f->fid, 4);
+    memcpy(p, f->file_name, len);
+    lcloud_journal_append(LC_JR_CREATE, rec, 4 + len);
+}
+
+void lcloud_journal_extent(File f, int idx)
+{
+    unsigned char rec[15];
+    unsigned char* p = rec;
+
+    lcloud_meta_put(&p, f->fid, 4);
+    lcloud_meta_put(&p, idx, 4);
+    lcloud_meta_put(&p, f->blocks[idx].device_id, 1);
+    lcloud_meta_put(&p, f->blocks[idx].sector, 2);
+    lcloud_meta_put(&p, f->blocks[idx].block, 2);
+    lcloud_meta_put(&p, 1, 2);
+    lcloud_journal_append(LC_JR_EXTENT, rec, sizeof(rec));
+}
+
+void lcloud_journal_holes(File f, int idx, int count)
+{
+    unsigned char rec[15];
+    unsigned char* p;
+    int n;
+
+    // a record covers at most 0xffff blocks
+    for (; count > 0; idx += n, count -= n) {
+        n = count < 0xffff ? count : 0xffff;
+        p = rec;
+        lcloud_meta_put(&p, f->fid, 4);
+        lcloud_meta_put(&p, idx, 4);
+        lcloud_meta_put(&p, LC_HOLE, 1);
+        lcloud_meta_put(&p, 0, 2);
+        lcloud_meta_put(&p, 0, 2);
+        lcloud_meta_put(&p, n, 2);
+        lcloud_journal_append(LC_JR_EXTENT, rec, sizeof(rec));
+    }
+}
+
+void lcloud_journal_size(File f)
+{
+    unsigned char rec[8];
+    unsigned char* p = rec;
+
+    lcloud_meta_put(&p, f->fid, 4);
+    lcloud_meta_put(&p, f->file_size, 4);
+    lcloud_journal_append(LC_JR_SIZE, rec, sizeof(rec));
+}
+
+void lcloud_journal_unlink(File f)
+{
+    unsigned char rec[4];
+    unsigned char* p = rec;
+
+    lcloud_meta_put(&p, f->fid, 4);
+    lcloud_journal_append(LC_JR_UNLINK, rec, sizeof(rec));
+}
+
+void lcloud_journal_flags(File f)
+{
+    unsigned char rec[5];
+    unsigned char* p = rec;
+
+    lcloud_meta_put(&p, f->fid, 4);
+    lcloud_meta_put(&p, f->compressed ? LC_FILE_COMPRESSED : 0, 1);
+    lcloud_journal_append(LC_JR_FLAGS, rec, sizeof(rec));
+}
+
+void lcloud_journal_chunk(File f, int c)
+{
+    unsigned char rec[10];
+    unsigned char* p = rec;
+
+    lcloud_meta_put(&p, f->fid, 4);
+    lcloud_meta_put(&p, c, 4);
+    lcloud_meta_put(&p, f->chunk_lens[c], 2);
+    lcloud_journal_append(LC_JR_CHUNK, rec, sizeof(rec));
+}
+
+void lcloud_journal_tail(File f)
+{
+    unsigned char rec[17];
+    unsigned char* p = rec;
+
+    lcloud_meta_put(&p, f->fid, 4);
+    lcloud_meta_put(&p, f->blocks_count, 4);
+    lcloud_meta_put(&p, f->tail.device_id, 1);
+    lcloud_meta_put(&p, f->tail.sector, 2);
+    lcloud_meta_put(&p, f->tail.block, 2);
+    lcloud_meta_put(&p, f->tail_off, 2);
+    lcloud_meta_put(&p, f->tail_len, 2);
+    lcloud_journal_append(LC_JR_TAIL, rec, sizeof(rec));
+}
+
+void lcloud_journal_truncate(File f)
+{
+    unsigned char rec[12];
+    unsigned char* p = rec;
+
+    lcloud_meta_put(&p, f->fid, 4);
+    lcloud_meta_put(&p, f->file_size, 4);
+    lcloud_meta_put(&p, f->blocks_count, 4);
+    lcloud_journal_append(LC_JR_TRUNCATE, rec, sizeof(rec));
+}
+
+// Function     : lcloud_journal_commit
+// Description  : write out the open journal block if it has new records
+// Outputs      : 1 if success or 0 if failure
+int lcloud_journal_commit(void)
+{
+    int ret;
+
+    pthread_mutex_lock(&journal_lock);
+    ret = lcloud_journal_write();
+    pthread_mutex_unlock(&journal_lock);
+    return ret;
+}
+
+// Function     : lcloud_journal_apply
+// Description  : apply one replayed record to the file table, the caller
+//                holds files_lock
+// Inputs       : type, rec, len
+// Outputs      : 1 if success or 0 if the record is inconsistent
+int lcloud_journal_apply(int type, const unsigned char* rec, int len)
+{
+    const unsigned char* p = rec;
+    const unsigned char* end = rec + len;
+    int err = 0, fid, j;
+    char name[LC_JOURNAL_MAX_RECORD];
+    File f;
+
+    fid = lcloud_meta_get(&p, end, 4, &err);
+    if (err || fid > files_count || (type != LC_JR_CREATE && fid == files_count)) {
+        return 0;
+    }
+    if (type == LC_JR_CREATE) {
+        memcpy(name, p, len - 4);
+        name[len - 4] = '\0';
+        if (fid < files_count) {
+            // the slot may have been unlinked and reused since
+            if (files[fid]->file_name == NULL) {
+                files[fid]->file_name = strdup(name);
+            }
+            return 1;
+        }
+        files = (File*)realloc(files, sizeof(File) * (files_count + 1));
+        f = lcloud_new_file(name);
+        f->fid = files_count;
+        files[files_count++] = f;
+        return 1;
+    }
+    f = files[fid];
+    if (type == LC_JR_SIZE) {
+        f->file_size = lcloud_meta_get(&p, end, 4, &err);
+        return !err;
+    }
+    if (type == LC_JR_UNLINK) {
+        lcloud_clear_file(f);
+        return 1;
+    }
+    if (type == LC_JR_TRUNCATE) {
+        f->file_size = lcloud_meta_get(&p, end, 4, &err);
+        j = lcloud_meta_get(&p, end, 4, &err);
+        if (j < f->blocks_count) {
+            f->blocks_count = j;
+        }
+        j = (f->file_size + LC_CHUNK_SIZE - 1) / LC_CHUNK_SIZE;
+        if (j < f->chunks_count) {
+            f->chunks_count = j;
+        }
+        return !err;
+    }
+    if (type == LC_JR_FLAGS) {
+        f->compressed = (lcloud_meta_get(&p, end, 1, &err) & LC_FILE_COMPRESSED) != 0;
+        return !err;
+    }
+    if (type == LC_JR_CHUNK) {
+        int c = lcloud_meta_get(&p, end, 4, &err);
+        int stored = lcloud_meta_get(&p, end, 2, &err);
+        if (err || c < 0) {
+            return 0;
+        }
+        if (c >= f->chunks_count) {
+            f->chunk_lens = (uint16_t*)realloc(f->chunk_lens, sizeof(uint16_t) * (c + 1));
+            memset(f->chunk_lens + f->chunks_count, 0, sizeof(uint16_t) * (c + 1 - f->chunks_count));
+            f->chunks_count = c + 1;
+        }
+        f->chunk_lens[c] = stored;
+        return 1;
+    }
+    if (type == LC_JR_TAIL) {
+        j = lcloud_meta_get(&p, end, 4, &err);
+        f->tail.device_id = lcloud_meta_get(&p, end, 1, &err);
+        f->tail.sector = lcloud_meta_get(&p, end, 2, &err);
+        f->tail.block = lcloud_meta_get(&p, end, 2, &err);
+        f->tail_off = lcloud_meta_get(&p, end, 2, &err);
+        f->tail_len = lcloud_meta_get(&p, end, 2, &err);
+        if (j < f->blocks_count) {
+            f->blocks_count = j;
+        }
+        return !err;
+    }
+    if (type == LC_JR_EXTENT) {
+        int idx = lcloud_meta_get(&p, end, 4, &err);
+        int dev = lcloud_meta_get(&p, end, 1, &err);
+        int sec = lcloud_meta_get(&p, end, 2, &err);
+        int blk = lcloud_meta_get(&p, end, 2, &err);
+        int count = lcloud_meta_get(&p, end, 2, &err);
+        if (err || idx > f->blocks_count) {
+            return 0;
+        }
+        if (idx + count > f->blocks_count) {
+            f->blocks = realloc(f->blocks, sizeof(struct block) * (idx + count));
+            f->blocks_count = idx + count;
+        }
+        for (j = 0; j < count; j++) {
+            f->blocks[idx + j].device_id = dev;
+            f->blocks[idx + j].sector = sec;
+            f->blocks[idx + j].block = dev == LC_HOLE ? blk : blk + j;
+        }
+        return 1;
+    }
+    return 0;
+}
+
+// Function     : lcloud_journal_replay
+// Description  : reapply the journal blocks written after the mounted
+//                checkpoint, stopping at the first missing or torn block
+// Outputs      : number of journal blocks replayed
+int lcloud_journal_replay(void)
+{
+    unsigned char blk[LC_DEVICE_BLOCK_SIZE];
+    const unsigned char* p;
+    int slot, dev, sec, b, err, used, type, len;
+
+    for (slot = 0; slot < journal_blocks; slot++) {
+        err = 0;
+        p = blk;
+        if (!lcloud_journal_slot(slot, &dev, &sec, &b) || !lcloud_io_read(dev, sec, b, (char*)blk)) {
+            break;
+        }
+        if (lcloud_meta_get(&p, blk + LC_JOURNAL_HEADER, 4, &err) != LC_JOURNAL_MAGIC
+            || lcloud_meta_get(&p, blk + LC_JOURNAL_HEADER, 4, &err) != meta_seq
+            || lcloud_meta_get(&p, blk + LC_JOURNAL_HEADER, 4, &err) != (uint32_t)slot) {
+            break;
+        }
+        used = lcloud_meta_get(&p, blk + LC_JOURNAL_HEADER, 2, &err);
+        if (used < LC_JOURNAL_HEADER || used > LC_DEVICE_BLOCK_SIZE
+            || lcloud_meta_get(&p, blk + LC_JOURNAL_HEADER, 4, &err)
+                != lcloud_meta_sum(blk + LC_JOURNAL_HEADER, used - LC_JOURNAL_HEADER)) {
+            break;
+        }
+        for (p = blk + LC_JOURNAL_HEADER; p + 2 <= blk + used; p += 2 + len) {
+            type = p[0];
+            len = p[1];
+            if (p + 2 + len > blk + used || !lcloud_journal_apply(type, p + 2, len)) {
+                logMessage(LOG_OUTPUT_LEVEL, "Journal slot %d has a bad record", slot);
+                return slot;
+            }
+        }
+    }
+    return slot;
+}
+
+// Function     : lcloud_alloc_extents
+// Description  : allocate blocks and describe them as extents
+// Inputs       : n - number of blocks
+//                ext - extent array to fill
+//                max - capacity of the array
+// Outputs      : number of extents, -1 if out of space or too fragmented
+int lcloud_alloc_extents(int n, lc_extent* ext, int max)
+{
+    int i, nextents = 0, dev, sec, b;
+    lc_extent* e;
+
+    for (i = 0; i < n; i++) {
+        if (!lcloud_get_free_block(&dev, &sec, &b)) {
+            logMessage(LOG_OUTPUT_LEVEL, "No space for metadata");
+            lcloud_free_extents(ext, nextents);
+            return -1;
+        }
+        if (nextents) {
+            e = &ext[nextents - 1];
+            if (e->device_id == dev && e->sector == sec && e->block + e->count == b) {
+                e->count++;
+                continue;
+            }
+        }
+        if (nextents == max) {
+            logMessage(LOG_OUTPUT_LEVEL, "Metadata region too fragmented");
+            lcloud_free_block(dev, sec, b);
+            lcloud_free_extents(ext, nextents);
+            return -1;
+        }
+        e = &ext[nextents++];
+        e->device_id = dev;
+        e->pad = 0;
+        e->sector = sec;
+        e->block = b;
+        e->count = 1;
+    }
+    return nextents;
+}
+
+// Function     : lcloud_free_extents
+// Description  : return the blocks of an extent list to the allocator
+// Inputs       : ext, n - the extents
+// Outputs      : none
+void lcloud_free_extents(lc_extent* ext, int n)
+{
+    int i, j;
+
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < ext[i].count; j++) {
+            lcloud_free_block(ext[i].device_id, ext[i].sector, ext[i].block + j);
+        }
+    }
+}
+
+// Function     : lcloud_rebuild_refs
+// Description  : recount block references from the mounted metadata, the
+//                caller holds files_lock
+// Outputs      : none
+void lcloud_rebuild_refs(void)
+{
+    int d, i, j;
+
+    for (d = 0; d < 16; d++) {
+        if (devices[d].refs) {
+            memset(devices[d].refs, 0, sizeof(uint16_t) * devices[d].sectors_count * devices[d].blocks_count);
+            devices[d].free_count = devices[d].sectors_count * devices[d].blocks_count;
+        }
+    }
+    lcloud_ref_block(meta_device, 0, 0);
+    for (i = 0; i < ckpt_nextents; i++) {
+        for (j = 0; j < ckpt_extents[i].count; j++) {
+            lcloud_ref_block(ckpt_extents[i].device_id, ckpt_extents[i].sector, ckpt_extents[i].block + j);
+        }
+    }
+    for (i = 0; i < journal_nextents; i++) {
+        for (j = 0; j < journal_extents[i].count; j++) {
+            lcloud_ref_block(journal_extents[i].device_id, journal_extents[i].sector, journal_extents[i].block + j);
+        }
+    }
+    for (i = 0; i < files_count; i++) {
+        for (j = 0; j < files[i]->blocks_count; j++) {
+            lcloud_ref_block(files[i]->blocks[j].device_id, files[i]->blocks[j].sector, files[i]->blocks[j].block);
+        }
+        if (files[i]->tail_len) {
+            lcloud_ref_block(files[i]->tail.device_id, files[i]->tail.sector, files[i]->tail.block);
+        }
+    }
+}
+
+// Function     : lcloud_checkpoint
+// Description  : write the file table to the devices, point the superblock
+//                at it and empty the journal, the caller holds files_lock
+// Outputs      : 1 if success or 0 if failure
+int lcloud_checkpoint(void)
+{
+    lc_superblock sb;
+    char blk[LC_DEVICE_BLOCK_SIZE];
+    unsigned char* buf;
+    size_t len, nblocks, i;
+    int b, n, ret = 0;
+    lc_extent* e;
+
+    if (meta_device < 0) {
+        return 0;
+    }
+    // hold every file still while its block map is serialized
+    for (n = 0; n < files_count; n++) {
+        pthread_rwlock_rdlock(&files[n]->lock);
+    }
+    pthread_mutex_lock(&journal_lock);
+
+    // the checkpoint gets new blocks, so the cursors it records cover them
+    len = lcloud_checkpoint_size();
+    nblocks = (len + LC_DEVICE_BLOCK_SIZE - 1) / LC_DEVICE_BLOCK_SIZE;
+    memset(&sb, 0, sizeof(sb));
+    b = lcloud_alloc_extents(nblocks, sb.extents, LC_META_MAX_EXTENTS);
+    if (b < 0) {
+        goto out;
+    }
+    sb.nextents = b;
+
+    buf = (unsigned char*)calloc(nblocks, LC_DEVICE_BLOCK_SIZE);
+    lcloud_checkpoint_encode(buf);
+    unsigned char* p = buf;
+    for (i = 0; i < sb.nextents; i++) {
+        e = &sb.extents[i];
+        for (b = 0; b < e->count; b++) {
+            lcloud_io_write(e->device_id, e->sector, e->block + b, (char*)p);
+            p += LC_DEVICE_BLOCK_SIZE;
+        }
+    }
+
+    // the superblock write is what makes the new checkpoint current
+    sb.magic = LC_META_MAGIC;
+    sb.version = LC_META_VERSION;
+    sb.seq = meta_seq + 1;
+    sb.ckpt_bytes = len;
+    sb.ckpt_sum = lcloud_meta_sum(buf, len);
+    sb.journal_nextents = journal_nextents;
+    memcpy(sb.journal, journal_extents, sizeof(sb.journal));
+    free(buf);
+    memset(blk, 0, sizeof(blk));
+    memcpy(blk, &sb, sizeof(sb));
+    if (!lcloud_io_write(meta_device, 0, 0, blk)) {
+        lcloud_free_extents(sb.extents, sb.nextents);
+        goto out;
+    }
+    // journal blocks tagged with the old sequence number are now stale, and
+    // the blocks of the previous checkpoint can be reused
+    meta_seq = sb.seq;
+    lcloud_journal_reset();
+    lcloud_free_extents(ckpt_extents, ckpt_nextents);
+    memcpy(ckpt_extents, sb.extents, sizeof(ckpt_extents));
+    ckpt_nextents = sb.nextents;
+    logMessage(LOG_OUTPUT_LEVEL, "Checkpoint %u: %d files, %zu bytes", sb.seq, files_count, len);
+    ret = 1;
+
+out:
+    pthread_mutex_unlock(&journal_lock);
+    for (n = 0; n < files_count; n++) {
+        pthread_rwlock_unlock(&files[n]->lock);
+    }
+    return ret;
+}
+
+// Function     : lcloud_maybe_checkpoint
+// Description  : checkpoint once the journal region has filled up, callers
+//                must not hold a file lock
+// Outputs      : none
+void lcloud_maybe_checkpoint(void)
+{
+    int full;
+
+    pthread_mutex_lock(&journal_lock);
+    full = journal_full;
+    pthread_mutex_unlock(&journal_lock);
+    if (full) {
+        pthread_rwlock_wrlock(&files_lock);
+        if (journal_full) {
+            lcloud_checkpoint();
+        }
+        pthread_rwlock_unlock(&files_lock);
+    }
+}
+
+// Function     : lcloud_mount
+// Description  : load the file table from the latest checkpoint and replay
+//                the journal, or start an empty filesystem when the devices
+//                hold none
+// Outputs      : 1 if a checkpoint was loaded, 0 if formatted fresh
+int lcloud_mount(void)
+{
+    lc_superblock sb;
+    char blk[LC_DEVICE_BLOCK_SIZE];
+    unsigned char* buf;
+    size_t nblocks, i, got = 0;
+    int b, loaded = 0, replayed = 0;
+    lc_extent* e;
+
+    for (meta_device = 0; meta_device < 16 && !devices[meta_device].lcloud; meta_device++)
+        ;
+    if (meta_device == 16) {
+        meta_device = -1;
+        return 0;
+    }
+
+    pthread_rwlock_wrlock(&files_lock);
+    lcloud_free_files();
+    meta_seq = 0;
+    journal_nextents = journal_blocks = 0;
+    ckpt_nextents = 0;
+    if (lcloud_io_read(meta_device, 0, 0, blk)) {
+        memcpy(&sb, blk, sizeof(sb));
+    } else {
+        sb.magic = 0;
+    }
+    nblocks = (sb.ckpt_bytes + LC_DEVICE_BLOCK_SIZE - 1) / LC_DEVICE_BLOCK_SIZE;
+    if (sb.magic == LC_META_MAGIC && sb.version >= 2 && sb.version <= LC_META_VERSION
+        && sb.nextents <= LC_META_MAX_EXTENTS && sb.journal_nextents <= LC_JOURNAL_MAX_EXTENTS) {
+        buf = (unsigned char*)calloc(nblocks + 1, LC_DEVICE_BLOCK_SIZE);
+        for (i = 0; i < sb.nextents && got < nblocks; i++) {
+            e = &sb.extents[i];
+            for (b = 0; b < e->count && got < nblocks; b++, got++) {
+                lcloud_io_read(e->device_id, e->sector, e->block + b,
+                    (char*)buf + got * LC_DEVICE_BLOCK_SIZE);
+            }
+        }
+        if (got == nblocks && lcloud_meta_sum(buf, sb.ckpt_bytes) == sb.ckpt_sum
+            && lcloud_checkpoint_decode(buf, sb.ckpt_bytes, sb.version)) {
+            meta_seq = sb.seq;
+            loaded = 1;
+        } else {
+            lcloud_free_files();
+        }
+        free(buf);
+    }
+
+    pthread_mutex_lock(&journal_lock);
+    lcloud_journal_reset();
+    pthread_mutex_unlock(&journal_lock);
+    if (loaded) {
+        journal_nextents = sb.journal_nextents;
+        memcpy(journal_extents, sb.journal, sizeof(journal_extents));
+        for (i = 0; i < journal_nextents; i++) {
+            journal_blocks += journal_extents[i].count;
+        }
+        ckpt_nextents = sb.nextents;
+        memcpy(ckpt_extents, sb.extents, sizeof(ckpt_extents));
+        replayed = lcloud_journal_replay();
+        lcloud_rebuild_refs();
+        logMessage(LOG_OUTPUT_LEVEL, "Mounted checkpoint %u: %d files, %d journal blocks",
+            meta_seq, files_count, replayed);
+    } else {
+        // fresh filesystem, keep the superblock out of the allocator
+        lcloud_rebuild_refs();
+        b = lcloud_alloc_extents(LC_JOURNAL_BLOCKS, journal_extents, LC_JOURNAL_MAX_EXTENTS);
+        if (b > 0) {
+            journal_nextents = b;
+            journal_blocks = LC_JOURNAL_BLOCKS;
+        }
+        logMessage(LOG_OUTPUT_LEVEL, "No checkpoint found, formatted device %d", meta_device);
+    }
+    // a fresh filesystem needs a superblock before the journal is usable,
+    // and replayed records must be folded in before their slots are reused
+    if (!loaded || replayed) {
+        lcloud_checkpoint();
+    }
+    pthread_rwlock_unlock(&files_lock);
+    return loaded;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Free space compaction
+//
+// Deleting and truncating files leaves holes behind the allocation cursor.
+// Once enough blocks have been freed, a background thread slides the live
+// blocks from the end of the address space (devices in id order, then
+// sectors, then blocks) down into the lowest holes, so the free space
+// gathers into one run at the end and new files are allocated contiguously.
+// Each pass moves a bounded batch while holding every file exclusively, then
+// lets the foreground run again. Blocks shared by several files and the
+// metadata blocks stay where they are.
+
+// Function     : lcloud_block_addr / lcloud_addr_block
+// Description  : convert between a device block and its position in the
+//                linear address space used by the compactor
+// Inputs       : dev, sec, blk / addr
+// Outputs      : the address / 1 if the address is valid
+int lcloud_block_addr(int dev, int sec, int blk)
+{
+    int d, addr = 0;
+
+    for (d = 0; d < dev; d++) {
+        addr += devices[d].sectors_count * devices[d].blocks_count;
+    }
+    return addr + sec * devices[dev].blocks_count + blk;
+}
+
+int lcloud_addr_block(int addr, int* dev, int* sec, int* blk)
+{
+    int d, n;
+
+    for (d = 0; d < 16; d++) {
+        n = devices[d].sectors_count * devices[d].blocks_count;
+        if (addr < n) {
+            *dev = d;
+            *sec = addr / devices[d].blocks_count;
+            *blk = addr % devices[d].blocks_count;
+            return 1;
+        }
+        addr -= n;
+    }
+    return 0;
+}
+
+// Function     : lcloud_block_refs
+// Description  : reference count of a block
+// Inputs       : dev, sec, blk
+// Outputs      : the count
+int lcloud_block_refs(int dev, int sec, int blk)
+{
+    int refs;
+
+    if (dev == LC_HOLE) {
+        return 0;
+    }
+    pthread_mutex_lock(&alloc_lock);
+    refs = devices[dev].refs[sec * devices[dev].blocks_count + blk];
+    pthread_mutex_unlock(&alloc_lock);
+    return refs;
+}
+
+// Function     : lcloud_block_claim
+// Description  : reference count of a block about to be overwritten in
+//                place, a block with a single reference is unindexed in the
+//                same step, so dedup cannot share it while it is rewritten
+// Inputs       : dev, sec, blk
+// Outputs      : the count, the block may be overwritten if it is 1
+int lcloud_block_claim(int dev, int sec, int blk)
+{
+    int refs, idx;
+
+    if (dev == LC_HOLE) {
+        return 0;
+    }
+    idx = sec * devices[dev].blocks_count + blk;
+    pthread_mutex_lock(&alloc_lock);
+    if ((refs = devices[dev].refs[idx]) == 1) {
+        devices[dev].prints[idx] = 0;
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    return refs;
+}
+
+// Function     : lcloud_owner_map
+// Description  : map each block owned by exactly one file back to that file
+//                and its place in the block map, the caller holds every file
+// Inputs       : owner - set to the owning file per address, -1 if none and
+//                        -2 if shared
+//                index - set to the block map index per address
+// Outputs      : number of addresses
+int lcloud_owner_map(int** owner, int** index)
+{
+    int total = 0, i, j, d;
+
+    for (d = 0; d < 16; d++) {
+        total += devices[d].sectors_count * devices[d].blocks_count;
+    }
+    *owner = (int*)malloc(sizeof(int) * (total + 1));
+    *index = (int*)malloc(sizeof(int) * (total + 1));
+    for (i = 0; i < total; i++) {
+        (*owner)[i] = -1;
+    }
+    for (i = 0; i < files_count; i++) {
+        for (j = 0; j < files[i]->blocks_count; j++) {
+            struct block* b = &files[i]->blocks[j];
+            if (b->device_id == LC_HOLE) {
+                continue;
+            }
+            int a = lcloud_block_addr(b->device_id, b->sector, b->block);
+            (*owner)[a] = lcloud_block_refs(b->device_id, b->sector, b->block) == 1 ? i : -2;
+            (*index)[a] = j;
+        }
+    }
+    return total;
+}
+
+// Function     : lcloud_compact_pass
+// Description  : move up to LC_COMPACT_BATCH blocks into lower holes
+// Outputs      : number of blocks moved
+int lcloud_compact_pass(void)
+{
+    char data[LC_DEVICE_BLOCK_SIZE];
+    int total, low, high, i, moved = 0;
+    int dev, sec, blk, ndev, nsec, nblk;
+    int *owner, *index;
+    struct block old[LC_COMPACT_BATCH];
+    File f;
+
+    pthread_rwlock_wrlock(&files_lock);
+    for (i = 0; i < files_count; i++) {
+        pthread_rwlock_wrlock(&files[i]->lock);
+    }
+    total = lcloud_owner_map(&owner, &index);
+
+    low = 0;
+    high = total - 1;
+    while (moved < LC_COMPACT_BATCH) {
+        // lowest hole, highest movable block
+        while (low < high && (lcloud_addr_block(low, &ndev, &nsec, &nblk), lcloud_block_refs(ndev, nsec, nblk))) {
+            low++;
+        }
+        while (high > low && owner[high] < 0) {
+            high--;
+        }
+        if (low >= high) {
+            break;
+        }
+        lcloud_addr_block(high, &dev, &sec, &blk);
+        f = files[owner[high]];
+        if (!lcloud_read_block(dev, sec, blk, data) || !lcloud_io_write(ndev, nsec, nblk, data)) {
+            break;
+        }
+        lcloud_ref_block(ndev, nsec, nblk);
+        lcloud_putcache(ndev, nsec, nblk, data);
+        old[moved] = f->blocks[index[high]];
+        f->blocks[index[high]].device_id = ndev;
+        f->blocks[index[high]].sector = nsec;
+        f->blocks[index[high]].block = nblk;
+        // the old copy must not be shared by dedup while it waits to be freed
+        lcloud_dedup_remember(dev, sec, blk, NULL);
+        lcloud_journal_extent(f, index[high]);
+        owner[high] = -1;
+        moved++;
+    }
+
+    // start the next allocation at the first hole after the packed blocks
+    if (moved && lcloud_addr_block(low, &ndev, &nsec, &nblk)) {
+        pthread_mutex_lock(&alloc_lock);
+        cur_device = ndev;
+        devices[ndev].cur_sector = nsec;
+        devices[ndev].cur_block = nblk;
+        pthread_mutex_unlock(&alloc_lock);
+    }
+    free(owner);
+    free(index);
+    for (i = 0; i < files_count; i++) {
+        pthread_rwlock_unlock(&files[i]->lock);
+    }
+    pthread_rwlock_unlock(&files_lock);
+
+    // the new locations must be durable before the old blocks are reused
+    lcloud_journal_commit();
+    lcloud_maybe_checkpoint();
+    for (i = 0; i < moved; i++) {
+        lcloud_free_block(old[i].device_id, old[i].sector, old[i].block);
+    }
+    return moved;
+}
+
+// Function     : lcloud_compact
+// Description  : run compaction passes until the free space is packed
+// Outputs      : number of blocks moved
+int lcloud_compact(void)
+{
+    int n, moved = 0;
+
+    while ((n = lcloud_compact_pass()) > 0) {
+        moved += n;
+    }
+    if (moved) {
+        logMessage(LOG_OUTPUT_LEVEL, "Compacted %d blocks", moved);
+    }
+    return moved;
+}
+
+// Function     : lcloud_compactor
+// Description  : background thread body, compacts, defragments queued
+//                files and migrates hot blocks whenever woken
+// Inputs       : arg - unused
+// Outputs      : NULL
+void* lcloud_compactor(void* arg)
+{
+    int freed, tier;
+
+    pthread_mutex_lock(&compact_lock);
+    while (compact_running) {
+        if (compact_freed < LC_COMPACT_THRESHOLD && !defrag_pending && !tier_pending) {
+            pthread_cond_wait(&compact_cond, &compact_lock);
+            continue;
+        }
+        freed = compact_freed >= LC_COMPACT_THRESHOLD;
+        if (freed) {
+            compact_freed = 0;
+        }
+        defrag_pending = 0;
+        tier = tier_pending;
+        tier_pending = 0;
+        pthread_mutex_unlock(&compact_lock);
+        // in log mode the cleaner frees whole segments instead, and with
+        // tiering blocks are placed by heat rather than packed by address
+        if (freed && log_mode) {
+            lcloud_log_clean();
+        } else if (freed && !tier_mode) {
+            lcloud_compact();
+        }
+        // packed free space first, so the defragmenter finds long runs
+        lcloud_defrag_queued();
+        if (tier) {
+            lcloud_tier();
+        }
+        pthread_mutex_lock(&compact_lock);
+    }
+    pthread_mutex_unlock(&compact_lock);
+    return NULL;
+}
+
+// Function     : lcloud_compact_notify
+// Description  : count a freed block, waking the compactor at the threshold
+// Outputs      : none
+void lcloud_compact_notify(void)
+{
+    pthread_mutex_lock(&compact_lock);
+    if (++compact_freed >= LC_COMPACT_THRESHOLD) {
+        pthread_cond_signal(&compact_cond);
+    }
+    pthread_mutex_unlock(&compact_lock);
+}
+
+// Function     : lcloud_compact_start / lcloud_compact_stop
+// Description  : start the compactor after mount, stop it before shutdown
+// Outputs      : none
+void lcloud_compact_start(void)
+{
+    if (compact_running) {
+        return;
+    }
+    compact_running = 1;
+    compact_freed = 0;
+    if (pthread_create(&compact_thread, NULL, lcloud_compactor, NULL) != 0) {
+        compact_running = 0;
+    }
+}
+
+void lcloud_compact_stop(void)
+{
+    pthread_mutex_lock(&compact_lock);
+    if (!compact_running) {
+        pthread_mutex_unlock(&compact_lock);
+        return;
+    }
+    compact_running = 0;
+    pthread_cond_broadcast(&compact_cond);
+    pthread_mutex_unlock(&compact_lock);
+    pthread_join(compact_thread, NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Defragmentation
+//
+// Files written side by side end up with their blocks interleaved, so a
+// file's block map is a long list of one or two block runs. The
+// defragmenter copies the blocks a file owns alone to freshly allocated
+// blocks, which the next-fit allocator hands out in order, and then swaps
+// the whole map at once while the file is held exclusively, so readers see
+// either the old layout or the new one. Blocks come through the cache and a
+// block that was cached moves its entry to the new location, so hot data is
+// not fetched again. A file is only rewritten when the new layout has fewer
+// runs. It runs on demand through lcdefrag, and with LC_MODE_DEFRAG closing
+// a fragmented file queues it for the background thread.
+
+// Function     : lcloud_defrag_wanted
+// Description  : check whether a file's runs are short on average
+// Inputs       : f - the file
+// Outputs      : 1 if it is fragmented, 0 if not
+int lcloud_defrag_wanted(File f)
+{
+    int runs = lcloud_map_runs(f->blocks, f->blocks_count);
+
+    return runs > 1 && runs * LC_DEFRAG_RUN > f->blocks_count;
+}
+
+// Function     : lcloud_defrag_file
+// Description  : move the blocks a file owns alone into consecutive new
+//                blocks, the caller holds the file exclusively
+// Inputs       : f - the file
+//                logged - take the blocks from the log segment
+// Outputs      : number of blocks moved
+int lcloud_defrag_file(File f, int logged)
+{
+    char data[LC_DEVICE_BLOCK_SIZE];
+    struct block *map, *old;
+    int *idx, i, k, n = 0, got = 1, ok = 1, cached;
+
+    if (lcloud_map_runs(f->blocks, f->blocks_count) < 2) {
+        return 0;
+    }
+    // shared blocks and holes stay where they are
+    idx = (int*)malloc(sizeof(int) * (f->blocks_count + 1));
+    for (i = 0; i < f->blocks_count; i++) {
+        if (f->blocks[i].device_id != LC_HOLE
+            && lcloud_block_refs(f->blocks[i].device_id, f->blocks[i].sector, f->blocks[i].block) == 1) {
+            idx[n++] = i;
+        }
+    }
+    map = (struct block*)malloc(sizeof(struct block) * (f->blocks_count + 1));
+    memcpy(map, f->blocks, sizeof(struct block) * f->blocks_count);
+    for (k = 0; k < n && got; k++) {
+        if (logged) {
+            got = lcloud_log_block(&map[idx[k]].device_id, &map[idx[k]].sector, &map[idx[k]].block);
+        } else {
+            got = lcloud_get_free_block(&map[idx[k]].device_id, &map[idx[k]].sector, &map[idx[k]].block);
+        }
+    }
+    if (!got || lcloud_map_runs(map, f->blocks_count) >= lcloud_map_runs(f->blocks, f->blocks_count)) {
+        // no space, or no better than what is there
+        for (i = 0; i < (got ? k : k - 1); i++) {
+            lcloud_free_block(map[idx[i]].device_id, map[idx[i]].sector, map[idx[i]].block);
+        }
+        free(idx);
+        free(map);
+        return 0;
+    }
+
+    // copy the data over, the file still points at the old blocks
+    for (k = 0; k < n && ok; k++) {
+        old = &f->blocks[idx[k]];
+        cached = (lcloud_copycache(old->device_id, old->sector, old->block, data) == 0);
+        ok = (cached || lcloud_io_read(old->device_id, old->sector, old->block, data))
+            && lcloud_io_write(map[idx[k]].device_id, map[idx[k]].sector, map[idx[k]].block, data);
+        if (ok && cached) {
+            lcloud_putcache(map[idx[k]].device_id, map[idx[k]].sector, map[idx[k]].block, data);
+        }
+    }
+    if (!ok) {
+        for (k = 0; k < n; k++) {
+            lcloud_free_block(map[idx[k]].device_id, map[idx[k]].sector, map[idx[k]].block);
+        }
+        free(idx);
+        free(map);
+        return 0;
+    }
+
+    // swap the map, the old blocks are released once it is committed
+    for (k = 0; k < n; k++) {
+        lcloud_log_supersede(&f->blocks[idx[k]]);
+        f->blocks[idx[k]] = map[idx[k]];
+        lcloud_journal_extent(f, idx[k]);
+    }
+    free(idx);
+    free(map);
+    return n;
+}
+
+// Function     : lcloud_defrag_queued
+// Description  : defragment the closed files queued by lcclose, stopping
+//                early when the background thread is stopped
+// Outputs      : number of blocks moved
+int lcloud_defrag_queued(void)
+{
+    int i, n, moved = 0;
+    File f;
+
+    for (i = 0; compact_running; i++) {
+        pthread_rwlock_rdlock(&files_lock);
+        if (i >= files_count) {
+            pthread_rwlock_unlock(&files_lock);
+            break;
+        }
+        f = files[i];
+        pthread_rwlock_wrlock(&f->lock);
+        n = 0;
+        if (f->defrag && !f->is_open) {
+            f->defrag = 0;
+            n = lcloud_defrag_file(f, log_mode);
+        }
+        pthread_rwlock_unlock(&f->lock);
+        pthread_rwlock_unlock(&files_lock);
+        if (n) {
+            lcloud_log_commit();
+            moved += n;
+        }
+    }
+    if (moved) {
+        logMessage(LOG_OUTPUT_LEVEL, "Defragmented %d blocks", moved);
+    }
+    return moved;
+}
+
+// Function     : lcloud_defrag_notify
+// Description  : queue a closed file for the background defragmenter, the
+//                caller holds the file exclusively
+// Inputs       : f - the file
+// Outputs      : none
+void lcloud_defrag_notify(File f)
+{
+    if (!defrag_mode || !lcloud_defrag_wanted(f)) {
+        return;
+    }
+    f->defrag = 1;
+    pthread_mutex_lock(&compact_lock);
+    defrag_pending = 1;
+    pthread_cond_signal(&compact_cond);
+    pthread_mutex_unlock(&compact_lock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Prefetching
+//
+// Groups of files tend to be opened in the same order again and again.
+// Each file remembers the few files opened right after it with a small
+// saturating count, and once a successor has been seen often enough,
+// opening the file queues that successor for a background thread which
+// reads its first blocks into the cache. The prefetched blocks are marked
+// in the cache, which counts how many were read before being evicted, to
+// tell how well the predictor does. Compressed files are skipped, they are
+// read through the chunk cache.
+
+// Function     : lcloud_prefetch_forget
+// Description  : clear the successors of a new or unlinked file
+// Inputs       : f - the file
+// Outputs      : none
+void lcloud_prefetch_forget(File f)
+{
+    int w;
+
+    for (w = 0; w < LC_PREFETCH_WAYS; w++) {
+        f->succ[w] = -1;
+        f->succ_seen[w] = 0;
+    }
+}
+
+// Function     : lcloud_prefetch_learn
+// Description  : record that a file was opened after the previous one and
+//                queue its likely successor, the caller holds files_lock
+//                exclusively
+// Inputs       : fid - the file opened
+// Outputs      : none
+void lcloud_prefetch_learn(int fid)
+{
+    int w, v = 0, best = -1;
+    File p;
+
+    if (last_open != -1 && last_open < files_count && last_open != fid && files[last_open]->file_name) {
+        p = files[last_open];
+        for (w = 0; w < LC_PREFETCH_WAYS && p->succ[w] != fid; w++) {
+            if (p->succ_seen[w] < p->succ_seen[v]) {
+                v = w;
+            }
+        }
+        if (w < LC_PREFETCH_WAYS) {
+            if (p->succ_seen[w] < LC_PREFETCH_SEEN_MAX) {
+                p->succ_seen[w]++;
+            }
+        } else {
+            // replace the weakest successor
+            p->succ[v] = fid;
+            p->succ_seen[v] = 1;
+        }
+    }
+    last_open = fid;
+    if (!prefetch_mode) {
+        return;
+    }
+
+    p = files[fid];
+    for (w = 0; w < LC_PREFETCH_WAYS; w++) {
+        if (p->succ[w] != -1 && p->succ_seen[w] >= LC_PREFETCH_CONFIDENCE
+            && (best == -1 || p->succ_seen[w] > p->succ_seen[best])) {
+            best = w;
+        }
+    }
+    if (best == -1 || p->succ[best] >= files_count || files[p->succ[best]]->is_open) {
+        return;
+    }
+    pthread_mutex_lock(&prefetch_lock);
+    if (prefetch_queued < LC_PREFETCH_QUEUE) {
+        prefetch_queue[(prefetch_head + prefetch_queued++) % LC_PREFETCH_QUEUE] = p->succ[best];
+        prefetch_files++;
+        pthread_cond_signal(&prefetch_cond);
+    }
+    pthread_mutex_unlock(&prefetch_lock);
+}
+
+// Function     : lcloud_prefetch_file
+// Description  : read the first blocks of a file into the cache
+// Inputs       : fid - the file
+// Outputs      : number of blocks read
+int lcloud_prefetch_file(int fid)
+{
+    char data[LC_DEVICE_BLOCK_SIZE];
+    struct block* b;
+    int i, n = 0;
+    File f;
+
+    pthread_rwlock_rdlock(&files_lock);
+    if (fid >= files_count) {
+        pthread_rwlock_unlock(&files_lock);
+        return 0;
+    }
+    f = files[fid];
+    // holding the file keeps its blocks from being rewritten or freed
+    pthread_rwlock_rdlock(&f->lock);
+    for (i = 0; f->file_name && !f->compressed && i < f->blocks_count && i < LC_PREFETCH_BLOCKS; i++) {
+        b = &f->blocks[i];
+        if (b->device_id == LC_HOLE || lcloud_incache(b->device_id, b->sector, b->block)) {
+            continue;
+        }
+        if (!lcloud_io_read(b->device_id, b->sector, b->block, data)) {
+            break;
+        }
+        n += (lcloud_prefetchcache(b->device_id, b->sector, b->block, data) == 0);
+    }
+    if (i == f->blocks_count && i < LC_PREFETCH_BLOCKS && f->tail_len) {
+        // a pack block is never rewritten, so it is read like any other
+        b = &f->tail;
+        if (!lcloud_incache(b->device_id, b->sector, b->block)
+            && lcloud_io_read(b->device_id, b->sector, b->block, data)) {
+            n += (lcloud_prefetchcache(b->device_id, b->sector, b->block, data) == 0);
+        }
+    }
+    pthread_rwlock_unlock(&f->lock);
+    pthread_rwlock_unlock(&files_lock);
+    return n;
+}
+
+// Function     : lcloud_prefetcher
+// Description  : background thread body, prefetches the queued files
+// Inputs       : arg - unused
+// Outputs      : NULL
+void* lcloud_prefetcher(void* arg)
+{
+    int fid;
+
+    pthread_mutex_lock(&prefetch_lock);
+    while (prefetch_running) {
+        if (prefetch_queued == 0) {
+            pthread_cond_wait(&prefetch_cond, &prefetch_lock);
+            continue;
+        }
+        fid = prefetch_queue[prefetch_head];
+        prefetch_head = (prefetch_head + 1) % LC_PREFETCH_QUEUE;
+        prefetch_queued--;
+        pthread_mutex_unlock(&prefetch_lock);
+        lcloud_prefetch_file(fid);
+        pthread_mutex_lock(&prefetch_lock);
+    }
+    pthread_mutex_unlock(&prefetch_lock);
+    return NULL;
+}
+
+// Function     : lcloud_prefetch_start / lcloud_prefetch_stop
+// Description  : start the prefetcher after mount, stop it before shutdown
+// Outputs      : none
+void lcloud_prefetch_start(void)
+{
+    if (prefetch_running) {
+        return;
+    }
+    prefetch_running = 1;
+    prefetch_head = 0;
+    prefetch_queued = 0;
+    if (pthread_create(&prefetch_thread, NULL, lcloud_prefetcher, NULL) != 0) {
+        prefetch_running = 0;
+    }
+}
+
+void lcloud_prefetch_stop(void)
+{
+    pthread_mutex_lock(&prefetch_lock);
+    if (!prefetch_running) {
+        pthread_mutex_unlock(&prefetch_lock);
+        return;
+    }
+    prefetch_running = 0;
+    prefetch_queued = 0;
+    pthread_cond_signal(&prefetch_cond);
+    pthread_mutex_unlock(&prefetch_lock);
+    pthread_join(prefetch_thread, NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Tiering
+//
+// Devices can differ in speed as well as size. Every block transfer is
+// timed, and each device keeps a moving average of its latency along with
+// its total transfer time, which gives its bandwidth. Files gather heat
+// from the blocks read and written, halved after every migration pass.
+// With LC_MODE_TIER, once enough blocks have been accessed the background
+// thread runs a pass that moves the blocks of the hot files onto the
+// fastest device, hottest first. When that device is full, blocks of files
+// with less than half the heat are moved off it first. Each pass moves a bounded batch while holding every
+// file exclusively, like the compactor. Shared blocks stay where they are.
+
+// Function     : lcloud_tier_record
+// Description  : account one timed block transfer to its device
+// Inputs       : dev - the device
+//                ns - how long the transfer took
+// Outputs      : none
+void lcloud_tier_record(int dev, uint64_t ns)
+{
+    pthread_mutex_lock(&alloc_lock);
+    if (devices[dev].xfers == 0) {
+        devices[dev].lat_ns = ns;
+    } else {
+        devices[dev].lat_ns += ((int64_t)ns - (int64_t)devices[dev].lat_ns) / LC_TIER_EWMA;
+    }
+    devices[dev].xfers++;
+    devices[dev].xfer_ns += ns;
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+// Function     : lcloud_tier_touch
+// Description  : count block accesses to a file, waking the migrator after
+//                every LC_TIER_PERIOD accesses, the caller holds the file
+// Inputs       : f - the file
+//                len - bytes accessed
+// Outputs      : none
+void lcloud_tier_touch(File f, size_t len)
+{
+    int n = (len + LC_DEVICE_BLOCK_SIZE - 1) / LC_DEVICE_BLOCK_SIZE;
+
+    f->heat += n;
+    if (!tier_mode || n == 0) {
+        return;
+    }
+    pthread_mutex_lock(&compact_lock);
+    tier_accesses += n;
+    if (tier_accesses >= LC_TIER_PERIOD) {
+        tier_accesses = 0;
+        tier_pending = 1;
+        pthread_cond_signal(&compact_cond);
+    }
+    pthread_mutex_unlock(&compact_lock);
+}
+
+// Function     : lcloud_tier_fastest
+// Description  : find the device with the lowest latency, provided it is
+//                clearly faster than some other device
+// Outputs      : the device, -1 if there is no faster tier
+int lcloud_tier_fastest(void)
+{
+    int d, fast = -1, slow = -1;
+
+    pthread_mutex_lock(&alloc_lock);
+    for (d = 0; d < 16; d++) {
+        if (!devices[d].lcloud || devices[d].xfers < LC_TIER_SAMPLES) {
+            continue;
+        }
+        if (fast == -1 || devices[d].lat_ns < devices[fast].lat_ns) {
+            fast = d;
+        }
+        if (slow == -1 || devices[d].lat_ns > devices[slow].lat_ns) {
+            slow = d;
+        }
+    }
+    if (fast != -1 && devices[slow].lat_ns * 2 < devices[fast].lat_ns * 3) {
+        fast = -1;
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    return fast;
+}
+
+// Function     : lcloud_tier_alloc
+// Description  : allocate a block on one device, or anywhere but one device
+// Inputs       : dev - the device, or -1 for any
+//                avoid - device to skip, or -1
+//                b - set to the block
+// Outputs      : 1 if success or 0 if failure
+int lcloud_tier_alloc(int dev, int avoid, struct block* b)
+{
+    int d, idx;
+
+    pthread_mutex_lock(&alloc_lock);
+    for (d = 0; d < 16; d++) {
+        if ((dev != -1 && d != dev) || d == avoid || !devices[d].lcloud || devices[d].free_count == 0) {
+            continue;
+        }
+        for (idx = 0; idx < devices[d].sectors_count * devices[d].blocks_count; idx++) {
+            if (devices[d].refs[idx] == 0) {
+                devices[d].refs[idx] = 1;
+                devices[d].prints[idx] = 0;
+                devices[d].free_count--;
+                b->device_id = d;
+                b->sector = idx / devices[d].blocks_count;
+                b->block = idx % devices[d].blocks_count;
+                pthread_mutex_unlock(&alloc_lock);
+                return 1;
+            }
+        }
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    return 0;
+}
+
+// Function     : lcloud_tier_move
+// Description  : copy a block of a file to a new block and remap it, the
+//                caller holds the file exclusively
+// Inputs       : f - the file
+//                i - the block map slot
+//                b - the new block, released on failure
+// Outputs      : 1 if success or 0 if failure
+int lcloud_tier_move(File f, int i, struct block* b)
+{
+    char data[LC_DEVICE_BLOCK_SIZE];
+    struct block* old = &f->blocks[i];
+    int cached;
+
+    cached = (lcloud_copycache(old->device_id, old->sector, old->block, data) == 0);
+    if ((!cached && !lcloud_io_read(old->device_id, old->sector, old->block, data))
+        || !lcloud_io_write(b->device_id, b->sector, b->block, data)) {
+        lcloud_free_block(b->device_id, b->sector, b->block);
+        return 0;
+    }
+    if (cached) {
+        lcloud_putcache(b->device_id, b->sector, b->block, data);
+    }
+    lcloud_log_supersede(old);
+    *old = *b;
+    lcloud_journal_extent(f, i);
+    return 1;
+}
+
+// Function     : lcloud_tier_heat_cmp
+// Description  : qsort order of file ids, hottest first
+// Inputs       : a, b - pointers to file ids
+// Outputs      : the comparison
+int lcloud_tier_heat_cmp(const void* a, const void* b)
+{
+    uint32_t ha = files[*(const int*)a]->heat, hb = files[*(const int*)b]->heat;
+
+    return (ha < hb) - (ha > hb);
+}
+
+// Function     : lcloud_tier_pass
+// Description  : move up to LC_TIER_BATCH blocks of the hottest files onto
+//                the fastest device, or colder blocks off it to make room
+// Inputs       : fast - the fastest device
+// Outputs      : number of blocks moved
+int lcloud_tier_pass(int fast)
+{
+    struct block b;
+    int *order, i, j, k = 0, c, ok = 1, moved = 0;
+    File f, cold = NULL;
+
+    pthread_rwlock_wrlock(&files_lock);
+    for (i = 0; i < files_count; i++) {
+        pthread_rwlock_wrlock(&files[i]->lock);
+    }
+    order = (int*)malloc(sizeof(int) * (files_count + 1));
+    for (i = 0; i < files_count; i++) {
+        order[i] = i;
+    }
+    qsort(order, files_count, sizeof(int), lcloud_tier_heat_cmp);
+
+    // c walks up from the coldest file looking for blocks to demote
+    c = files_count - 1;
+    for (i = 0; i < files_count && ok && moved < LC_TIER_BATCH; i++) {
+        f = files[order[i]];
+        for (j = 0; f->heat >= LC_TIER_HOT && j < f->blocks_count && ok && moved < LC_TIER_BATCH; j++) {
+            if (f->blocks[j].device_id == LC_HOLE || f->blocks[j].device_id == fast
+                || lcloud_block_refs(f->blocks[j].device_id, f->blocks[j].sector, f->blocks[j].block) != 1) {
+                continue;
+            }
+            if (lcloud_tier_alloc(fast, -1, &b)) {
+                ok = lcloud_tier_move(f, j, &b);
+                moved += ok;
+                continue;
+            }
+            // the device is full, move a colder block down a tier, the hot
+            // block follows in the next pass once the space is released
+            for (; c > i; c--, k = 0) {
+                cold = files[order[c]];
+                while (k < cold->blocks_count && (cold->blocks[k].device_id != fast
+                           || lcloud_block_refs(fast, cold->blocks[k].sector, cold->blocks[k].block) != 1)) {
+                    k++;
+                }
+                if (k < cold->blocks_count && cold->heat * 2 < f->heat) {
+                    break;
+                }
+            }
+            ok = c > i && lcloud_tier_alloc(-1, fast, &b) && lcloud_tier_move(cold, k, &b);
+            moved += ok;
+        }
+    }
+    free(order);
+    for (i = 0; i < files_count; i++) {
+        pthread_rwlock_unlock(&files[i]->lock);
+    }
+    pthread_rwlock_unlock(&files_lock);
+
+    // the old blocks are freed once the new maps are durable
+    lcloud_log_commit();
+    return moved;
+}
+
+// Function     : lcloud_tier
+// Description  : run migration passes until the hot blocks are in place,
+//                then let the heat of past accesses fade
+// Outputs      : number of blocks moved
+int lcloud_tier(void)
+{
+    int i, n, fast, moved = 0;
+
+    if ((fast = lcloud_tier_fastest()) != -1) {
+        for (i = 0; i < LC_TIER_PASSES && (n = lcloud_tier_pass(fast)) > 0; i++) {
+            moved += n;
+        }
+    }
+    pthread_rwlock_rdlock(&files_lock);
+    for (i = 0; i < files_count; i++) {
+        pthread_rwlock_wrlock(&files[i]->lock);
+        files[i]->heat /= 2;
+        pthread_rwlock_unlock(&files[i]->lock);
+    }
+    pthread_rwlock_unlock(&files_lock);
+    if (moved) {
+        logMessage(LOG_OUTPUT_LEVEL, "Tiered %d blocks around device %d", moved, fast);
+    }
+    return moved;
+}
+
+// Function     : lcloud_tier_report
+// Description  : log the latency and bandwidth measured for each device
+// Outputs      : none
+void lcloud_tier_report(void)
+{
+    int d;
+
+    pthread_mutex_lock(&alloc_lock);
+    for (d = 0; d < 16; d++) {
+        if (devices[d].xfers) {
+            logMessage(LOG_OUTPUT_LEVEL, "Device %d: %lu transfers, %lu us latency, %lu KB/s", d,
+                (unsigned long)devices[d].xfers, (unsigned long)(devices[d].lat_ns / 1000),
+                (unsigned long)(devices[d].xfers * LC_DEVICE_BLOCK_SIZE * 1000000000ull / 1024
+                    / (devices[d].xfer_ns + 1)));
+        }
+    }
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Log-structured writes
+//
+// In LC_MODE_LOG each block an lcwrite touches is written to the next free
+// block of the open segment (one sector of a device) and the file's block
+// map is remapped to it, so scattered overwrites turn into sequential
+// appends. Blocks already in the open segment are rewritten where they are.
+// The old copy keeps its reference until the remap is committed, then it is
+// freed like any other block.
+//
+// New segments are only opened on sectors with no live blocks. The cleaner
+// runs on the background thread in place of the compactor. It keeps a few
+// such sectors in reserve by moving the live blocks out of the segment that
+// holds the least live data.
+
+// Function     : lcloud_sector_live
+// Description  : count the blocks in use in a sector, the caller holds
+//                alloc_lock
+// Inputs       : dev, sec
+// Outputs      : the count
+int lcloud_sector_live(int dev, int sec)
+{
+    int b, live = 0;
+    uint16_t* refs = devices[dev].refs + sec * devices[dev].blocks_count;
+
+    for (b = 0; b < devices[dev].blocks_count; b++) {
+        live += (refs[b] != 0);
+    }
+    return live;
+}
+
+// Function     : lcloud_log_open_segment
+// Description  : open the next empty sector in device order as the log
+//                segment, the caller holds alloc_lock
+// Outputs      : 1 if success or 0 if no sector is empty
+int lcloud_log_open_segment(void)
+{
+    int d, s, scanned;
+
+    d = log_device < 0 ? cur_device : log_device;
+    s = log_device < 0 ? 0 : log_sector + 1;
+    for (scanned = 0; scanned <= 16; scanned++) {
+        for (; devices[d].lcloud && s < devices[d].sectors_count; s++) {
+            if (lcloud_sector_live(d, s) == 0) {
+                log_device = d;
+                log_sector = s;
+                log_block = 0;
+                return 1;
+            }
+        }
+        d = (d + 1) % 16;
+        s = 0;
+    }
+    return 0;
+}
+
+// Function     : lcloud_log_block
+// Description  : get the next free block of the open segment
+// Inputs       : dev, sec, blk - set to the block
+// Outputs      : 1 if success or 0 if failure
+int lcloud_log_block(int* dev, int* sec, int* blk)
+{
+    Device d;
+    int idx;
+
+    pthread_mutex_lock(&alloc_lock);
+    do {
+        if (log_device < 0) {
+            continue;
+        }
+        d = &devices[log_device];
+        while (log_block < d->blocks_count) {
+            idx = log_sector * d->blocks_count + log_block++;
+            if (d->refs[idx] == 0) {
+                d->refs[idx] = 1;
+                d->prints[idx] = 0;
+                d->free_count--;
+                *dev = log_device;
+                *sec = log_sector;
+                *blk = log_block - 1;
+                pthread_mutex_unlock(&alloc_lock);
+                return 1;
+            }
+        }
+    } while (lcloud_log_open_segment());
+    pthread_mutex_unlock(&alloc_lock);
+    // no sector is empty, fill the holes instead
+    return lcloud_get_free_block(dev, sec, blk);
+}
+
+// Function     : lcloud_log_in_segment
+// Description  : check whether a block lies in the open segment
+// Inputs       : dev, sec
+// Outputs      : 1 if it does, 0 if not
+int lcloud_log_in_segment(int dev, int sec)
+{
+    int ret;
+
+    pthread_mutex_lock(&alloc_lock);
+    ret = (dev == log_device && sec == log_sector);
+    pthread_mutex_unlock(&alloc_lock);
+    return ret;
+}
+
+// Function     : lcloud_log_supersede
+// Description  : hold a block replaced by a remap until the next commit
+// Inputs       : b - the old location
+// Outputs      : number of blocks now held
+int lcloud_log_supersede(struct block* b)
+{
+    int n;
+
+    pthread_mutex_lock(&alloc_lock);
+    log_pending = realloc(log_pending, sizeof(struct block) * (log_pending_count + 1));
+    log_pending[log_pending_count++] = *b;
+    n = log_pending_count;
+    pthread_mutex_unlock(&alloc_lock);
+    return n;
+}
+
+// Function     : lcloud_log_commit
+// Description  : commit the journal and free the blocks superseded before
+//                it, callers must not hold a file lock
+// Outputs      : none
+void lcloud_log_commit(void)
+{
+    struct block* held;
+    int i, n;
+
+    // only the remaps journaled so far are covered by this commit
+    pthread_mutex_lock(&alloc_lock);
+    held = log_pending;
+    n = log_pending_count;
+    log_pending = NULL;
+    log_pending_count = 0;
+    pthread_mutex_unlock(&alloc_lock);
+
+    lcloud_journal_commit();
+    lcloud_maybe_checkpoint();
+    for (i = 0; i < n; i++) {
+        lcloud_free_block(held[i].device_id, held[i].sector, held[i].block);
+    }
+    free(held);
+}
+
+// Function     : lcloud_log_free_segments
+// Description  : count the sectors with no live blocks
+// Outputs      : the count
+int lcloud_log_free_segments(void)
+{
+    int d, s, n = 0;
+
+    pthread_mutex_lock(&alloc_lock);
+    for (d = 0; d < 16; d++) {
+        for (s = 0; devices[d].lcloud && s < devices[d].sectors_count; s++) {
+            n += (lcloud_sector_live(d, s) == 0);
+        }
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    return n;
+}
+
+// Function     : lcloud_log_clean_pass
+// Description  : empty the segment with the least live data by appending
+//                its blocks to the log
+// Outputs      : number of blocks moved, -1 if no segment can be cleaned
+int lcloud_log_clean_pass(void)
+{
+    char data[LC_DEVICE_BLOCK_SIZE];
+    int i, d, s, b, a, live, movable, base = 0, victim = -1, best = 0;
+    int vdev = 0, vsec = 0, dev, sec, blk, moved = -1;
+    int *owner, *index;
+    File f;
+
+    pthread_rwlock_wrlock(&files_lock);
+    for (i = 0; i < files_count; i++) {
+        pthread_rwlock_wrlock(&files[i]->lock);
+    }
+    lcloud_owner_map(&owner, &index);
+
+    // a segment qualifies when every live block in it has a single owning
+    // file, so metadata and shared blocks pin their segment in place
+    for (d = 0; d < 16; d++) {
+        for (s = 0; s < devices[d].sectors_count; s++, base += devices[d].blocks_count) {
+            if (d == log_device && s == log_sector) {
+                continue;
+            }
+            live = 0;
+            movable = 1;
+            for (b = 0; b < devices[d].blocks_count; b++) {
+                if (lcloud_block_refs(d, s, b)) {
+                    live++;
+                    movable &= (owner[base + b] >= 0);
+                }
+            }
+            if (movable && live > 0 && live < devices[d].blocks_count && (victim < 0 || live < best)) {
+                victim = base;
+                best = live;
+                vdev = d;
+                vsec = s;
+            }
+        }
+    }
+
+    // the live blocks fit in the open segment plus one empty one
+    if (victim >= 0 && lcloud_log_free_segments() > 0) {
+        for (moved = 0, b = 0; b < devices[vdev].blocks_count; b++) {
+            a = victim + b;
+            if (owner[a] < 0) {
+                continue;
+            }
+            f = files[owner[a]];
+            if (!lcloud_read_block(vdev, vsec, b, data) || !lcloud_log_block(&dev, &sec, &blk)) {
+                break;
+            }
+            if (!lcloud_io_write(dev, sec, blk, data)) {
+                lcloud_free_block(dev, sec, blk);
+                break;
+            }
+            lcloud_putcache(dev, sec, blk, data);
+            lcloud_log_supersede(&f->blocks[index[a]]);
+            f->blocks[index[a]].device_id = dev;
+            f->blocks[index[a]].sector = sec;
+            f->blocks[index[a]].block = blk;
+            lcloud_journal_extent(f, index[a]);
+            moved++;
+        }
+        logMessage(LOG_OUTPUT_LEVEL, "Cleaned segment %d/%d, %d live blocks moved", vdev, vsec, moved);
+    }
+    free(owner);
+    free(index);
+    for (i = 0; i < files_count; i++) {
+        pthread_rwlock_unlock(&files[i]->lock);
+    }
+    pthread_rwlock_unlock(&files_lock);
+    lcloud_log_commit();
+    return moved;
+}
+
+// Function     : lcloud_log_clean
+// Description  : clean segments until enough of them are empty
+// Outputs      : number of segments cleaned
+int lcloud_log_clean(void)
+{
+    int cleaned = 0;
+
+    while (cleaned < LC_LOG_CLEAN_PASSES && lcloud_log_free_segments() < LC_LOG_CLEAN_SEGMENTS
+        && lcloud_log_clean_pass() > 0) {
+        cleaned++;
+    }
+    return cleaned;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Tail packing
+//
+// Most small files end in a partial block. When a file is closed, a tail of
+// up to LC_TAIL_MAX bytes leaves its own block and is appended to the open
+// pack block, which collects the tails of many files. The file then records
+// the tail as (block, offset, length), so reading a run of small files
+// touches and caches far fewer blocks. A pack block holds one reference per
+// tail, plus one of its own while new tails still go into it. A write or
+// truncate that reaches a packed tail first moves it back into a block of
+// its own.
+//
+// Tails already committed are never rewritten in place, where a torn write
+// would take them with it. Each new tail is written with the open block's
+// contents to a fresh block, from the log segment in log mode, and the
+// tails of the old block move over with one journal record each. A tail
+// whose file is busy, or which a clone shares, stays in the old block,
+// which keeps its contents until its last reference goes.
+
+// Function     : lcloud_pack_tail
+// Description  : move the partial last block of a file into the pack block,
+//                the caller holds the file exclusively
+// Inputs       : f - the file
+// Outputs      : 1 if the tail was packed, 0 if not
+int lcloud_pack_tail(File f)
+{
+    char data[LC_DEVICE_BLOCK_SIZE];
+    int len = f->file_size % LC_DEVICE_BLOCK_SIZE;
+    struct block last, old, b;
+    int i, n, got;
+    File g;
+
+    if (f->compressed || f->tail_len || len == 0 || len > LC_TAIL_MAX
+        || f->blocks_count != f->file_size / LC_DEVICE_BLOCK_SIZE + 1) {
+        return 0;
+    }
+    last = f->blocks[f->blocks_count - 1];
+    if (lcloud_block_refs(last.device_id, last.sector, last.block) != 1
+        || !lcloud_read_block(last.device_id, last.sector, last.block, data)) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&pack_lock);
+    if (pack_open && pack_used + len > LC_DEVICE_BLOCK_SIZE) {
+        // retire the full block, its tails keep it alive
+        lcloud_free_block(pack_block.device_id, pack_block.sector, pack_block.block);
+        pack_open = 0;
+    }
+    if (!pack_open) {
+        pack_used = 0;
+        pack_count = 0;
+        memset(pack_buf, 0, sizeof(pack_buf));
+    }
+    if (log_mode) {
+        got = lcloud_log_block(&b.device_id, &b.sector, &b.block);
+    } else {
+        got = lcloud_get_free_block(&b.device_id, &b.sector, &b.block);
+    }
+    memcpy(pack_buf + pack_used, data, len);
+    if (!got || !lcloud_io_write(b.device_id, b.sector, b.block, pack_buf)) {
+        if (got) {
+            lcloud_free_block(b.device_id, b.sector, b.block);
+        }
+        pthread_mutex_unlock(&pack_lock);
+        return 0;
+    }
+    lcloud_putcache(b.device_id, b.sector, b.block, pack_buf);
+
+    // the old block goes once the moves are committed, busy files skip the
+    // move rather than wait while this file is held
+    if (pack_open) {
+        old = pack_block;
+        for (i = 0, n = 0; i < pack_count; i++) {
+            g = pack_files[i];
+            if (g == f || pthread_rwlock_trywrlock(&g->lock) != 0) {
+                continue;
+            }
+            if (g->tail_len && g->tail.device_id == old.device_id && g->tail.sector == old.sector
+                && g->tail.block == old.block && lcloud_ref_block(b.device_id, b.sector, b.block)) {
+                g->tail = b;
+                lcloud_journal_tail(g);
+                lcloud_log_supersede(&old);
+                pack_files[n++] = g;
+            }
+            pthread_rwlock_unlock(&g->lock);
+        }
+        pack_count = n;
+        lcloud_log_supersede(&old);
+    }
+    pack_block = b;
+    pack_open = 1;
+    lcloud_ref_block(b.device_id, b.sector, b.block);
+    f->tail = b;
+    f->tail_off = pack_used;
+    f->tail_len = len;
+    pack_files[pack_count++] = f;
+    pack_used += len;
+    pthread_mutex_unlock(&pack_lock);
+
+    // the old block is freed once the move is committed
+    f->blocks_count--;
+    lcloud_journal_tail(f);
+    lcloud_log_supersede(&last);
+    return 1;
+}
+
+// Function     : lcloud_unpack_tail
+// Description  : move a packed tail back into a block of its own, the
+//                caller holds the file exclusively
+// Inputs       : f - the file
+//                logged - take the block from the log segment
+// Outputs      : 1 if success or 0 if failure
+int lcloud_unpack_tail(File f, int logged)
+{
+    char data[LC_DEVICE_BLOCK_SIZE], tmp[LC_DEVICE_BLOCK_SIZE];
+    struct block* b;
+    int got;
+
+    if (!f->tail_len) {
+        return 1;
+    }
+    if (!lcloud_read_block(f->tail.device_id, f->tail.sector, f->tail.block, data)) {
+        return 0;
+    }
+    f->blocks = realloc(f->blocks, sizeof(struct block) * (f->blocks_count + 1));
+    b = &f->blocks[f->blocks_count];
+    if (logged) {
+        got = lcloud_log_block(&b->device_id, &b->sector, &b->block);
+    } else {
+        got = lcloud_get_free_block(&b->device_id, &b->sector, &b->block);
+    }
+    if (!got) {
+        return 0;
+    }
+    memset(tmp, 0, sizeof(tmp));
+    memcpy(tmp, data + f->tail_off, f->tail_len);
+    if (!lcloud_io_write(b->device_id, b->sector, b->block, tmp)) {
+        lcloud_free_block(b->device_id, b->sector, b->block);
+        return 0;
+    }
+    lcloud_putcache(b->device_id, b->sector, b->block, tmp);
+    f->blocks_count++;
+    lcloud_journal_extent(f, f->blocks_count - 1);
+    lcloud_log_supersede(&f->tail);
+    f->tail_len = 0;
+    lcloud_journal_tail(f);
+    return 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Block deduplication
+//
+// With LC_MODE_DEDUP, every block an lcwrite fills completely is fingerprinted
+// with a 64 bit FNV-1a hash and looked up in an in-memory index. When a block
+// with the same contents is already stored, the file's block map points at
+// it and takes a reference instead of writing a copy. A candidate is
+// compared byte for byte before it is shared, so a hash collision only
+// costs a read. Each block remembers the fingerprint it was indexed under,
+// which is cleared when the block is freed or written without one, so stale
+// index entries are never followed. Shared blocks are copied on write. The
+// index only covers blocks written since the devices were mounted.
+
+// Function     : lcloud_block_print
+// Description  : fingerprint the contents of a block
+// Inputs       : data - the block
+// Outputs      : the fingerprint, never 0
+uint64_t lcloud_block_print(const char* data)
+{
+    uint64_t h = 14695981039346656037ull;
+    int i;
+
+    for (i = 0; i < LC_DEVICE_BLOCK_SIZE; i++) {
+        h ^= (unsigned char)data[i];
+        h *= 1099511628211ull;
+    }
+    return h ? h : 1;
+}
+
+// Function     : lcloud_dedup_find
+// Description  : find a stored block with the given contents and take a
+//                reference on it
+// Inputs       : print - fingerprint of data
+//                data - the block contents
+//                b - set to the block found
+// Outputs      : 1 if found or 0 if not
+int lcloud_dedup_find(uint64_t print, const char* data, struct block* b)
+{
+    char stored[LC_DEVICE_BLOCK_SIZE];
+    int probe, idx, found = 0;
+    lc_dedup_entry* e;
+    Device d;
+
+    pthread_mutex_lock(&alloc_lock);
+    for (probe = 0; dedup_table && probe < LC_DEDUP_PROBES && !found; probe++) {
+        e = &dedup_table[(print + probe) & dedup_mask];
+        if (e->print != print || !lcloud_addr_block(e->addr, &b->device_id, &b->sector, &b->block)) {
+            continue;
+        }
+        d = &devices[b->device_id];
+        idx = b->sector * d->blocks_count + b->block;
+        if (d->prints[idx] == print && d->refs[idx] > 0 && d->refs[idx] < UINT16_MAX) {
+            // pin it while the contents are compared
+            d->refs[idx]++;
+            found = 1;
+        }
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    if (!found) {
+        return 0;
+    }
+    if (!lcloud_read_block(b->device_id, b->sector, b->block, stored)
+        || memcmp(stored, data, LC_DEVICE_BLOCK_SIZE) != 0) {
+        lcloud_free_block(b->device_id, b->sector, b->block);
+        return 0;
+    }
+    return 1;
+}
+
+// Function     : lcloud_dedup_remember
+// Description  : record what was just written to a block
+// Inputs       : dev, sec, blk - the block
+//                data - its contents to index, NULL to leave it unindexed
+// Outputs      : none
+void lcloud_dedup_remember(int dev, int sec, int blk, const char* data)
+{
+    uint64_t print = data ? lcloud_block_print(data) : 0;
+    int probe, slot, total, d, i;
+    lc_dedup_entry* e;
+
+    pthread_mutex_lock(&alloc_lock);
+    devices[dev].prints[sec * devices[dev].blocks_count + blk] = print;
+    if (print && !dedup_table) {
+        for (total = 0, d = 0; d < 16; d++) {
+            total += devices[d].sectors_count * devices[d].blocks_count;
+        }
+        for (i = 1; i < 2 * total; i <<= 1)
+            ;
+        dedup_table = (lc_dedup_entry*)calloc(i, sizeof(lc_dedup_entry));
+        dedup_mask = i - 1;
+    }
+    if (print) {
+        // take a free, stale or matching slot near home, else evict home
+        slot = print & dedup_mask;
+        for (probe = 0; probe < LC_DEDUP_PROBES; probe++) {
+            int dd, ss, bb;
+            e = &dedup_table[(print + probe) & dedup_mask];
+            if (e->print == 0 || e->print == print || !lcloud_addr_block(e->addr, &dd, &ss, &bb)
+                || devices[dd].prints[ss * devices[dd].blocks_count + bb] != e->print) {
+                slot = (print + probe) & dedup_mask;
+                break;
+            }
+        }
+        dedup_table[slot].print = print;
+        dedup_table[slot].addr = lcloud_block_addr(dev, sec, blk);
+    }
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+// Function     : lcloud_dedup_write
+// Description  : point block i of a file at a stored copy of data, the
+//                caller holds the file exclusively
+// Inputs       : f - the file
+//                i - the block index, at most blocks_count
+//                data - the new contents of the whole block
+//                held - set to the superseded blocks held, when one is
+// Outputs      : 1 if the block is shared, 0 if it must be written
+int lcloud_dedup_write(File f, int i, const char* data, int* held)
+{
+    struct block b;
+
+    if (!lcloud_dedup_find(lcloud_block_print(data), data, &b)) {
+        return 0;
+    }
+    if (i < f->blocks_count) {
+        if (f->blocks[i].device_id == b.device_id && f->blocks[i].sector == b.sector
+            && f->blocks[i].block == b.block) {
+            // rewritten with what it already holds
+            lcloud_free_block(b.device_id, b.sector, b.block);
+            return 1;
+        }
+        *held = lcloud_log_supersede(&f->blocks[i]);
+    } else {
+        f->blocks = realloc(f->blocks, sizeof(struct block) * (f->blocks_count + 1));
+        f->blocks_count++;
+    }
+    f->blocks[i] = b;
+    lcloud_journal_extent(f, i);
+    dedup_hits++;
+    return 1;
+}
+
+// Function     : lcloud_relocate_block
+// Description  : give block i of a file a new location, for a log append
+//                or a copy of a shared block, the caller holds the file
+//                exclusively and writes the new location next
+// Inputs       : f - the file
+//                i - the block index
+//                logged - take the block from the log segment
+// Outputs      : superseded blocks held, 0 if no block is free
+int lcloud_relocate_block(File f, int i, int logged)
+{
+    struct block b;
+    int got, held;
+
+    if (logged) {
+        got = lcloud_log_block(&b.device_id, &b.sector, &b.block);
+    } else {
+        got = lcloud_get_free_block(&b.device_id, &b.sector, &b.block);
+    }
+    if (!got) {
+        return 0;
+    }
+    // the old copy is released once the new mapping is committed
+    held = lcloud_log_supersede(&f->blocks[i]);
+    f->blocks[i] = b;
+    lcloud_journal_extent(f, i);
+    return held;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Compressed files
+//
+// With LC_MODE_COMPRESS, new files are stored as LC_CHUNK_SIZE chunks, each
+// compressed on its own so a read only has to decompress the chunks it
+// touches. Chunk c owns the LC_CHUNK_BLOCKS slots of the block map starting
+// at c * LC_CHUNK_BLOCKS, of which it uses as many as its stored length
+// needs, the rest being holes. A chunk that does not shrink is stored raw.
+// The chunk being written is kept in memory until the writer moves to
+// another chunk or closes the file, and is then written to new blocks as a
+// whole. In log mode, or when the blocks are shared, it goes to new blocks
+// and the old copy stays valid until the new one is committed, otherwise it
+// overwrites the blocks it owns like any in place write. The cache keeps
+// decompressed chunks, not their blocks.
+
+// Function     : lcloud_chunk_len
+// Description  : number of file bytes in a chunk
+// Inputs       : f - the file
+//                c - the chunk
+// Outputs      : the length
+int lcloud_chunk_len(File f, int c)
+{
+    int len = f->file_size - c * LC_CHUNK_SIZE;
+
+    if (len < 0) {
+        return 0;
+    }
+    return len > LC_CHUNK_SIZE ? LC_CHUNK_SIZE : len;
+}
+
+// Function     : lcloud_chunk_read
+// Description  : get the decompressed contents of a chunk, the caller holds
+//                the file
+// Inputs       : f - the file
+//                c - the chunk
+//                data - LC_CHUNK_SIZE bytes to fill
+// Outputs      : 1 if success or 0 if failure
+int lcloud_chunk_read(File f, int c, char* data)
+{
+    char stored[LC_CHUNK_SIZE];
+    struct block* b;
+    int len, i;
+
+    if (f->chunk && f->chunk_idx == c) {
+        memcpy(data, f->chunk, LC_CHUNK_SIZE);
+        return 1;
+    }
+    memset(data, 0, LC_CHUNK_SIZE);
+    if (c >= f->chunks_count || f->chunk_lens[c] == 0) {
+        // never written, reads as zeros
+        return 1;
+    }
+    if (lcloud_getchunk(f->fid, c, data) != -1) {
+        return 1;
+    }
+    len = f->chunk_lens[c] & ~LC_CHUNK_RAW;
+    for (i = 0; i * LC_DEVICE_BLOCK_SIZE < len; i++) {
+        b = &f->blocks[c * LC_CHUNK_BLOCKS + i];
+        if (!lcloud_io_read(b->device_id, b->sector, b->block, stored + i * LC_DEVICE_BLOCK_SIZE)) {
+            return 0;
+        }
+    }
+    if (f->chunk_lens[c] & LC_CHUNK_RAW) {
+        memcpy(data, stored, len);
+    } else if (lcloud_decompress(stored, len, data, LC_CHUNK_SIZE) < 0) {
+        logMessage(LOG_OUTPUT_LEVEL, "File %d chunk %d is corrupt", f->fid, c);
+        return 0;
+    }
+    lcloud_putchunk(f->fid, c, data, LC_CHUNK_SIZE);
+    return 1;
+}
+
+// Function     : lcloud_chunk_flush
+// Description  : compress the chunk being written and store it, the caller
+//                holds the file exclusively
+// Inputs       : f - the file
+//                logged - take the blocks from the log segment
+//                held - set to the superseded blocks held
+// Outputs      : 1 if success or 0 if failure
+int lcloud_chunk_flush(File f, int logged, int* held)
+{
+    char stored[LC_CHUNK_SIZE];
+    int c = f->chunk_idx, plain, len, nblocks, got, i;
+    struct block nb[LC_CHUNK_BLOCKS];
+
+    if (!f->chunk || !f->chunk_dirty) {
+        return 1;
+    }
+    plain = lcloud_chunk_len(f, c);
+    for (i = 0; sparse_mode && i < plain && f->chunk[i] == 0; i++)
+        ;
+    if (sparse_mode && i == plain) {
+        // a chunk of zeros is stored as holes, like a chunk never written
+        len = 0;
+    } else if ((len = lcloud_compress(f->chunk, plain, stored, plain - 1)) == 0) {
+        memcpy(stored, f->chunk, plain);
+        len = plain;
+    }
+    nblocks = (len + LC_DEVICE_BLOCK_SIZE - 1) / LC_DEVICE_BLOCK_SIZE;
+
+    if (f->blocks_count < (c + 1) * LC_CHUNK_BLOCKS) {
+        f->blocks = realloc(f->blocks, sizeof(struct block) * (c + 1) * LC_CHUNK_BLOCKS);
+        for (i = f->blocks_count; i < (c + 1) * LC_CHUNK_BLOCKS; i++) {
+            f->blocks[i].device_id = LC_HOLE;
+            f->blocks[i].sector = 0;
+            f->blocks[i].block = 0;
+        }
+        f->blocks_count = (c + 1) * LC_CHUNK_BLOCKS;
+    }
+    if (c >= f->chunks_count) {
+        f->chunk_lens = (uint16_t*)realloc(f->chunk_lens, sizeof(uint16_t) * (c + 1));
+        memset(f->chunk_lens + f->chunks_count, 0, sizeof(uint16_t) * (c + 1 - f->chunks_count));
+        f->chunks_count = c + 1;
+    }
+
+    // new blocks are written first, so a failure leaves the old copy in
+    // place, in place mode overwrites the blocks the chunk owns alone
+    for (i = 0; i < LC_CHUNK_BLOCKS; i++) {
+        struct block* b = &f->blocks[c * LC_CHUNK_BLOCKS + i];
+        nb[i].device_id = LC_HOLE;
+        nb[i].sector = 0;
+        nb[i].block = 0;
+        if (i >= nblocks) {
+            continue;
+        }
+        if (!logged && b->device_id != LC_HOLE && lcloud_block_claim(b->device_id, b->sector, b->block) == 1) {
+            nb[i] = *b;
+            continue;
+        }
+        if (logged) {
+            got = lcloud_log_block(&nb[i].device_id, &nb[i].sector, &nb[i].block);
+        } else {
+            got = lcloud_get_free_block(&nb[i].device_id, &nb[i].sector, &nb[i].block);
+        }
+        if (!got || !lcloud_io_write(nb[i].device_id, nb[i].sector, nb[i].block, stored + i * LC_DEVICE_BLOCK_SIZE)) {
+            for (nblocks = got ? i + 1 : i; nblocks > 0; nblocks--) {
+                b = &nb[nblocks - 1];
+                if (memcmp(b, &f->blocks[c * LC_CHUNK_BLOCKS + nblocks - 1], sizeof(struct block)) != 0) {
+                    lcloud_free_block(b->device_id, b->sector, b->block);
+                }
+            }
+            logMessage(LOG_OUTPUT_LEVEL, "No space to store file %d chunk %d", f->fid, c);
+            return 0;
+        }
+    }
+
+    // the previous copy is released once the new mapping is committed
+    for (i = 0; i < LC_CHUNK_BLOCKS; i++) {
+        struct block* b = &f->blocks[c * LC_CHUNK_BLOCKS + i];
+        if (memcmp(b, &nb[i], sizeof(struct block)) == 0) {
+            if (b->device_id != LC_HOLE) {
+                // the compactor may have cached the old contents on a move
+                lcloud_io_write(b->device_id, b->sector, b->block, stored + i * LC_DEVICE_BLOCK_SIZE);
+                lcloud_evictcache(b->device_id, b->sector, b->block);
+            }
+            continue;
+        }
+        if (b->device_id != LC_HOLE) {
+            *held = lcloud_log_supersede(b);
+        }
+        *b = nb[i];
+        lcloud_journal_extent(f, c * LC_CHUNK_BLOCKS + i);
+    }
+    f->chunk_lens[c] = len && len == plain ? (len | LC_CHUNK_RAW) : len;
+    lcloud_journal_chunk(f, c);
+    lcloud_journal_size(f);
+    lcloud_putchunk(f->fid, c, f->chunk, LC_CHUNK_SIZE);
+    f->chunk_dirty = 0;
+    return 1;
+}
+
+// Function     : lcloud_chunk_write
+// Description  : copy data into a chunk, making it the chunk being written,
+//                the caller holds the file exclusively
+// Inputs       : f - the file
+//                pos - file position, the data does not cross a chunk
+//                data, len - the data
+//                logged - take blocks from the log segment
+//                held - set to the superseded blocks held
+// Outputs      : 1 if success or 0 if failure
+int lcloud_chunk_write(File f, int pos, const char* data, int len, int logged, int* held)
+{
+    int c = pos / LC_CHUNK_SIZE;
+
+    if (f->chunk_idx != c || !f->chunk) {
+        if (!lcloud_chunk_flush(f, logged, held)) {
+            return 0;
+        }
+        if (!f->chunk) {
+            f->chunk = (char*)malloc(LC_CHUNK_SIZE);
+        }
+        // load into a detached buffer, it is no longer the chunk at chunk_idx
+        f->chunk_idx = -1;
+        if (!lcloud_chunk_read(f, c, f->chunk)) {
+            return 0;
+        }
+        f->chunk_idx = c;
+    }
+    memcpy(f->chunk + pos % LC_CHUNK_SIZE, data, len);
+    f->chunk_dirty = 1;
+    return 1;
+}
+
+// Function     : lcloud_chunk_truncate
+// Description  : cut a compressed file to len bytes, or zero fill it to
+//                len, the caller holds the file exclusively
+// Inputs       : f - the file
+//                len - the new size
+//                dropped, n_dropped - collects the blocks to free
+// Outputs      : 1 if success or 0 if failure
+int lcloud_chunk_truncate(File f, size_t len, struct block** dropped, int* n_dropped)
+{
+    int nchunks = (len + LC_CHUNK_SIZE - 1) / LC_CHUNK_SIZE, held = 0, i;
+    size_t end = len < (size_t)f->file_size ? len : (size_t)f->file_size;
+
+    if (!lcloud_chunk_flush(f, log_mode, &held)) {
+        return 0;
+    }
+    if (f->blocks_count > nchunks * LC_CHUNK_BLOCKS) {
+        *dropped = (struct block*)malloc(sizeof(struct block) * (f->blocks_count - nchunks * LC_CHUNK_BLOCKS));
+        for (i = nchunks * LC_CHUNK_BLOCKS; i < f->blocks_count; i++) {
+            if (f->blocks[i].device_id != LC_HOLE) {
+                (*dropped)[(*n_dropped)++] = f->blocks[i];
+            }
+        }
+        f->blocks_count = nchunks * LC_CHUNK_BLOCKS;
+    }
+    if (f->chunks_count > nchunks) {
+        f->chunks_count = nchunks;
+    }
+    if (f->chunk_idx >= nchunks) {
+        f->chunk_idx = -1;
+    }
+    lcloud_evictchunks(f->fid, nchunks);
+    f->file_size = len;
+
+    // the chunk holding the old or new end keeps nothing past it
+    if (end % LC_CHUNK_SIZE && (int)(end / LC_CHUNK_SIZE) < f->chunks_count
+        && f->chunk_lens[end / LC_CHUNK_SIZE]) {
+        if (!f->chunk) {
+            f->chunk = (char*)malloc(LC_CHUNK_SIZE);
+        }
+        f->chunk_idx = -1;
+        if (!lcloud_chunk_read(f, end / LC_CHUNK_SIZE, f->chunk)) {
+            return 0;
+        }
+        memset(f->chunk + end % LC_CHUNK_SIZE, 0, LC_CHUNK_SIZE - end % LC_CHUNK_SIZE);
+        f->chunk_idx = end / LC_CHUNK_SIZE;
+        f->chunk_dirty = 1;
+        if (!lcloud_chunk_flush(f, log_mode, &held)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Sparse files
+//
+// A block map slot may be a hole (device LC_HOLE) with no block behind it.
+// Holes read as zeros without touching a device. Seeking past the end of a
+// file and writing there, or growing it with lctruncate, maps holes over
+// the gap instead of writing zeroed blocks. With LC_MODE_SPARSE, a write
+// that fills a whole block with zeros also leaves a hole, releasing the
+// block it replaces.
+
+// Function     : lcloud_block_zero
+// Description  : check whether a block holds only zeros
+// Inputs       : data - the block
+// Outputs      : 1 if it does, 0 if not
+int lcloud_block_zero(const char* data)
+{
+    int i;
+
+    for (i = 0; i < LC_DEVICE_BLOCK_SIZE; i++) {
+        if (data[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Function     : lcloud_punch_block
+// Description  : make block i of a file a hole, the caller holds the file
+//                exclusively
+// Inputs       : f - the file
+//                i - the block index, at most blocks_count
+//                held - set to the superseded blocks held, when one is
+// Outputs      : none
+void lcloud_punch_block(File f, int i, int* held)
+{
+    if (i == f->blocks_count) {
+        f->blocks = realloc(f->blocks, sizeof(struct block) * (f->blocks_count + 1));
+        f->blocks_count++;
+    } else if (f->blocks[i].device_id == LC_HOLE) {
+        return;
+    } else {
+        // the old block is released once the hole is committed
+        *held = lcloud_log_supersede(&f->blocks[i]);
+    }
+    f->blocks[i].device_id = LC_HOLE;
+    f->blocks[i].sector = 0;
+    f->blocks[i].block = 0;
+    lcloud_journal_extent(f, i);
+}
+
+// Function     : lcloud_extend_file
+// Description  : grow a file to len bytes of zeros, the caller holds the
+//                file exclusively and has unpacked its tail
+// Inputs       : f - the file
+//                len - the new size, past the current one
+//                logged - take blocks from the log segment
+// Outputs      : 1 if success or 0 if failure
+int lcloud_extend_file(File f, size_t len, int logged)
+{
+    char tmp[LC_DEVICE_BLOCK_SIZE];
+    int i, nblocks = (len + LC_DEVICE_BLOCK_SIZE - 1) / LC_DEVICE_BLOCK_SIZE;
+    struct block* b;
+
+    // bytes past the old end may be stale, zero them
+    if (f->file_size % LC_DEVICE_BLOCK_SIZE && f->blocks_count
+        && f->blocks[f->blocks_count - 1].device_id != LC_HOLE) {
+        b = &f->blocks[f->blocks_count - 1];
+        int begin = f->file_size % LC_DEVICE_BLOCK_SIZE;
+        lcloud_read_block(b->device_id, b->sector, b->block, tmp);
+        memset(tmp + begin, 0, LC_DEVICE_BLOCK_SIZE - begin);
+        if (lcloud_block_claim(b->device_id, b->sector, b->block) > 1
+            && !lcloud_relocate_block(f, f->blocks_count - 1, logged)) {
+            return 0;
+        }
+        lcloud_putcache(b->device_id, b->sector, b->block, tmp);
+        lcloud_io_write(b->device_id, b->sector, b->block, tmp);
+        lcloud_dedup_remember(b->device_id, b->sector, b->block, NULL);
+    }
+    // the rest is holes, the block map grows once to its new length
+    if (nblocks > f->blocks_count) {
+        if ((b = (struct block*)realloc(f->blocks, sizeof(struct block) * nblocks)) == NULL) {
+            return 0;
+        }
+        f->blocks = b;
+        for (i = f->blocks_count; i < nblocks; i++) {
+            f->blocks[i].device_id = LC_HOLE;
+            f->blocks[i].sector = 0;
+            f->blocks[i].block = 0;
+        }
+        lcloud_journal_holes(f, f->blocks_count, nblocks - f->blocks_count);
+        f->blocks_count = nblocks;
+    }
+    f->file_size = len;
+    return 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Clones and snapshots
+//
+// A clone is a new file whose block map, packed tail and chunk table are
+// copies of the source's, with one more reference taken on every block. No
+// data is read or written, only the new file's metadata is journaled. The
+// writers already copy a block with more than one reference before changing
+// it, so the source and the clone drift apart one block at a time. A
+// snapshot clones every file at once while the file table is held, giving a
+// consistent view of the whole namespace under "<name>@<tag>". Names with an
+// '@' are earlier snapshots and are not cloned again, so snapshots add one
+// reference per block each rather than doubling. A block's count stops at
+// UINT16_MAX, and a clone that would pass it fails.
+
+// Function     : lcloud_find_file
+// Description  : look up a file by name, the caller holds files_lock
+// Inputs       : path - the file name
+// Outputs      : the file id, -1 if there is no such file
+int lcloud_find_file(const char* path)
+{
+    int i;
+
+    for (i = 0; i < files_count; i++) {
+        if (files[i]->file_name && strcmp(path, files[i]->file_name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Function     : lcloud_clone_file
+// Description  : create a file sharing the blocks of another, the caller
+//                holds files_lock exclusively and the source exclusively
+// Inputs       : src - the source file
+//                path - name of the new file, which must not exist
+//                held - set to the superseded blocks held
+// Outputs      : the new file id, -1 if failure
+int lcloud_clone_file(File src, const char* path, int* held)
+{
+    int i, slot = -1;
+    File f;
+
+    // the chunk being written is part of what gets cloned
+    if (!lcloud_chunk_flush(src, log_mode, held)) {
+        return -1;
+    }
+    for (i = 0; i < files_count; i++) {
+        if (files[i]->file_name == NULL) {
+            slot = i;
+            break;
+        }
+    }
+    if (slot == -1) {
+        files = (File*)realloc(files, sizeof(File) * (files_count + 1));
+        f = lcloud_new_file(NULL);
+        f->fid = files_count;
+        files[files_count++] = f;
+        slot = f->fid;
+    }
+    f = files[slot];
+    pthread_rwlock_wrlock(&f->lock);
+    f->file_name = strdup(path);
+    f->file_size = src->file_size;
+    f->compressed = src->compressed;
+    f->blocks_count = src->blocks_count;
+    f->blocks = (struct block*)malloc(sizeof(struct block) * (src->blocks_count + 1));
+    memcpy(f->blocks, src->blocks, sizeof(struct block) * src->blocks_count);
+    f->chunks_count = src->chunks_count;
+    f->chunk_lens = (uint16_t*)malloc(sizeof(uint16_t) * (src->chunks_count + 1));
+    memcpy(f->chunk_lens, src->chunk_lens, sizeof(uint16_t) * src->chunks_count);
+    f->tail = src->tail;
+    f->tail_off = src->tail_off;
+    f->tail_len = src->tail_len;
+
+    for (i = 0; i < f->blocks_count; i++) {
+        if (!lcloud_ref_block(f->blocks[i].device_id, f->blocks[i].sector, f->blocks[i].block)) {
+            break;
+        }
+    }
+    if (i < f->blocks_count
+        || (f->tail_len && !lcloud_ref_block(f->tail.device_id, f->tail.sector, f->tail.block))) {
+        // a block is shared as often as its count allows, nothing is
+        // journaled yet so the slot just goes back to being unlinked
+        logMessage(LOG_OUTPUT_LEVEL, "Too many copies of a block of %s", src->file_name);
+        while (i-- > 0) {
+            lcloud_free_block(f->blocks[i].device_id, f->blocks[i].sector, f->blocks[i].block);
+        }
+        lcloud_clear_file(f);
+        pthread_rwlock_unlock(&f->lock);
+        return -1;
+    }
+
+    lcloud_journal_create(f);
+    if (f->compressed) {
+        lcloud_journal_flags(f);
+    }
+    for (i = 0; i < f->blocks_count; i++) {
+        lcloud_journal_extent(f, i);
+    }
+    for (i = 0; i < f->chunks_count; i++) {
+        lcloud_journal_chunk(f, i);
+    }
+    if (f->tail_len) {
+        lcloud_journal_tail(f);
+    }
+    lcloud_journal_size(f);
+    pthread_rwlock_unlock(&f->lock);
+    return slot;
+}
+
+// Function     : lcloud_drop_file
+// Description  : unlink a file, leaving its slot as a tombstone so other
+//                file ids do not shift, the caller holds files_lock and the
+//                file exclusively
+// Inputs       : f - the file
+//                n_dropped - set to the number of blocks it referenced
+// Outputs      : those blocks, to free once the unlink is committed
+struct block* lcloud_drop_file(File f, int* n_dropped)
+{
+    struct block* dropped = f->blocks;
+
+    *n_dropped = f->blocks_count;
+    f->blocks = NULL;
+    if (f->tail_len) {
+        dropped = realloc(dropped, sizeof(struct block) * (*n_dropped + 1));
+        dropped[(*n_dropped)++] = f->tail;
+    }
+    if (f->compressed) {
+        lcloud_evictchunks(f->fid, 0);
+    }
+    lcloud_journal_unlink(f);
+    lcloud_clear_file(f);
+    return dropped;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Streams
+//
+// A stream moves a whole object through a window of LC_STREAM_WINDOW
+// blocks, taken from a fixed pool when the stream is opened. Each time the
+// window fills up (or runs dry when reading), its blocks go out in one
+// pipelined exchange, so a large object costs one round trip per window
+// rather than one per block. Writes start at the beginning of the file.
+// Blocks the file owns alone are overwritten in place and the rest are
+// allocated as in lcwrite, and the file is cut to the streamed length when
+// the stream finishes. The data bypasses the block cache, so a bulk
+// transfer does not flush out the working set. Compressed files, partial
+// blocks and packed tails use lcread and lcwrite instead, as do writes
+// while dedup or sparse mode is on.
+
+// Function     : lcloud_stream_write_blocks
+// Description  : write whole blocks at the file position in one window, the
+//                caller holds the file exclusively
+// Inputs       : f - the file
+//                data - the blocks
+//                n - number of blocks, at most LC_STREAM_WINDOW
+// Outputs      : 1 if success or 0 if failure
+int lcloud_stream_write_blocks(File f, char* data, int n)
+{
+    struct block b[LC_STREAM_WINDOW];
+    char* bufs[LC_STREAM_WINDOW];
+    int i, k, first = f->cur_pos / LC_DEVICE_BLOCK_SIZE, got = 1;
+
+    for (k = 0; k < n && got; k++) {
+        i = first + k;
+        bufs[k] = data + k * LC_DEVICE_BLOCK_SIZE;
+        if (i < f->blocks_count && !log_mode && f->blocks[i].device_id != LC_HOLE
+            && lcloud_block_claim(f->blocks[i].device_id, f->blocks[i].sector, f->blocks[i].block) == 1) {
+            // overwritten in place, drop the old contents from the cache
+            b[k] = f->blocks[i];
+            lcloud_evictcache(b[k].device_id, b[k].sector, b[k].block);
+            continue;
+        }
+        if (log_mode) {
+            got = lcloud_log_block(&b[k].device_id, &b[k].sector, &b[k].block);
+        } else {
+            got = lcloud_get_free_block(&b[k].device_id, &b[k].sector, &b[k].block);
+        }
+        if (!got) {
+            logMessage(LOG_OUTPUT_LEVEL, "No space to write stream");
+            break;
+        }
+        if (i < f->blocks_count) {
+            // shared blocks and old log blocks are released after the commit
+            lcloud_log_supersede(&f->blocks[i]);
+        } else {
+            f->blocks = realloc(f->blocks, sizeof(struct block) * (i + 1));
+            f->blocks_count = i + 1;
+        }
+        f->blocks[i] = b[k];
+        lcloud_journal_extent(f, i);
+    }
+    n = k;
+    if (!lcloud_io_batch(b, bufs, n, LC_XFER_WRITE)) {
+        return 0;
+    }
+    f->cur_pos += (size_t)n * LC_DEVICE_BLOCK_SIZE;
+    if (f->cur_pos > f->file_size) {
+        f->file_size = f->cur_pos;
+        lcloud_journal_size(f);
+    }
+    lcloud_tier_touch(f, (size_t)n * LC_DEVICE_BLOCK_SIZE);
+    return got;
+}
+
+// Function     : lcloud_stream_read_blocks
+// Description  : read a window of whole blocks from the file position, the
+//                caller holds the file shared
+// Inputs       : f - the file
+//                data - room for LC_STREAM_WINDOW blocks
+// Outputs      : number of bytes read, -1 if failure, 0 if the window would
+//                reach the packed tail
+int lcloud_stream_read_blocks(File f, char* data)
+{
+    struct block b[LC_STREAM_WINDOW];
+    char* bufs[LC_STREAM_WINDOW];
+    int i, k, n = 0, first, nblocks;
+    size_t pos, len;
+
+    pthread_mutex_lock(&f->pos_lock);
+    pos = f->cur_pos;
+    len = pos < f->file_size ? f->file_size - pos : 0;
+    if (len > LC_STREAM_WINDOW * LC_DEVICE_BLOCK_SIZE) {
+        len = LC_STREAM_WINDOW * LC_DEVICE_BLOCK_SIZE;
+    }
+    first = pos / LC_DEVICE_BLOCK_SIZE;
+    nblocks = (len + LC_DEVICE_BLOCK_SIZE - 1) / LC_DEVICE_BLOCK_SIZE;
+    if (f->tail_len && first + nblocks > f->blocks_count) {
+        pthread_mutex_unlock(&f->pos_lock);
+        return 0;
+    }
+    f->cur_pos += len;
+    lcloud_tier_touch(f, len);
+    pthread_mutex_unlock(&f->pos_lock);
+
+    for (k = 0; k < nblocks; k++) {
+        i = first + k;
+        if (i >= f->blocks_count || f->blocks[i].device_id == LC_HOLE) {
+            memset(data + k * LC_DEVICE_BLOCK_SIZE, 0, LC_DEVICE_BLOCK_SIZE);
+        } else if (lcloud_copycache(f->blocks[i].device_id, f->blocks[i].sector, f->blocks[i].block,
+                       data + k * LC_DEVICE_BLOCK_SIZE) != 0) {
+            b[n] = f->blocks[i];
+            bufs[n++] = data + k * LC_DEVICE_BLOCK_SIZE;
+        }
+    }
+    if (!lcloud_io_batch(b, bufs, n, LC_XFER_READ)) {
+        return -1;
+    }
+    return len;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_setmode
+// Description  : Choose how writes place blocks on the devices
+//
+// Inputs       : mode - LC_MODE_INPLACE or LC_MODE_LOG, plus LC_MODE_DEDUP,
+//                       LC_MODE_COMPRESS and LC_MODE_SPARSE
+// Outputs      : 0 if successful test, -1 if failure
+
+int lcloud_setmode(int mode)
+{
+    if (mode & ~(LC_MODE_LOG | LC_MODE_DEDUP | LC_MODE_COMPRESS | LC_MODE_SPARSE | LC_MODE_DEFRAG
+                 | LC_MODE_PREFETCH | LC_MODE_TIER)) {
+        logMessage(LOG_OUTPUT_LEVEL, "Bad write mode %d", mode);
+        return -1;
+    }
+    pthread_mutex_lock(&alloc_lock);
+    log_mode = (mode & LC_MODE_LOG) != 0;
+    dedup_mode = (mode & LC_MODE_DEDUP) != 0;
+    compress_mode = (mode & LC_MODE_COMPRESS) != 0;
+    sparse_mode = (mode & LC_MODE_SPARSE) != 0;
+    defrag_mode = (mode & LC_MODE_DEFRAG) != 0;
+    prefetch_mode = (mode & LC_MODE_PREFETCH) != 0;
+    tier_mode = (mode & LC_MODE_TIER) != 0;
+    pthread_mutex_unlock(&alloc_lock);
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_open
+// Description  : Open the device in file for for reading and writing
+//
+// Inputs       : path - the path/filename of the file to be read
+// Outputs      : file handle i, -1 if failure
+LcFHandle lcloud_open(const char* path)
+{
+    // since we have more files and more device, we use device to find the specific location
+    int i, slot = -1;
+    File f;
+    // a name the checkpoint cannot hold back would lose the filesystem
+    if (strlen(path) > LC_META_MAX_NAME) {
+        logMessage(LOG_OUTPUT_LEVEL, "Name too long");
+        return -1;
+    }
+    // if there is no register, create a lcreg and cache
+    pthread_mutex_lock(&init_lock);
+    if (lcloud == 0) {
+        lcloud_initialization();
+    }
+    pthread_mutex_unlock(&init_lock);
+
+    pthread_rwlock_wrlock(&files_lock);
+    //determine if the files are openned
+    for (i = 0; i < files_count; i++) {
+        if (files[i]->file_name == NULL) {
+            // remember an unlinked slot to reuse
+            if (slot == -1) {
+                slot = i;
+            }
+            continue;
+        }
+        if (strcmp(path, files[i]->file_name) == 0) {
+            f = files[i];
+            pthread_rwlock_wrlock(&f->lock);
+            if (f->is_open) {
+                pthread_rwlock_unlock(&f->lock);
+                pthread_rwlock_unlock(&files_lock);
+                logMessage(LOG_OUTPUT_LEVEL, "Already open");
+                return -1;
+            }
+            f->is_open = 1;
+            f->cur_pos = 0;
+            pthread_rwlock_unlock(&f->lock);
+            lcloud_prefetch_learn(i);
+            pthread_rwlock_unlock(&files_lock);
+
+            //return the file i
+            return i;
+        }
+    }
+
+    if (slot != -1) {
+        i = slot;
+        f = files[i];
+        pthread_rwlock_wrlock(&f->lock);
+        f->file_name = strdup(path);
+        f->is_open = 1;
+        f->compressed = compress_mode;
+        pthread_rwlock_unlock(&f->lock);
+    } else {
+        files = (File*)realloc(files, sizeof(File) * (files_count + 1));
+        // open the file
+        f = lcloud_new_file(path);
+        f->is_open = 1;
+        f->fid = i;
+        f->compressed = compress_mode;
+        files[i] = f;
+        files_count++;
+    }
+    lcloud_journal_create(f);
+    if (f->compressed) {
+        lcloud_journal_flags(f);
+    }
+    lcloud_prefetch_learn(i);
+    pthread_rwlock_unlock(&files_lock);
+    logMessage(LOG_OUTPUT_LEVEL, "File %d created", i);
+    // return the file handle
+    return i;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_read
+// Description  : Read data from the file
+//
+// Inputs       : fh - file handle for the file to read from
+//                buf - place to put the data
+//                len - the length of the read
+// Outputs      : number of bytes read, -1 if failure
+int lcloud_read(LcFHandle fh, char* buf, size_t len)
+{
+    char tmp[LC_DEVICE_BLOCK_SIZE], chunk[LC_CHUNK_SIZE];
+    int i, dev, sec, blk, pos, shift;
+    File f;
+
+    // if the file is not valid or not opened, return -1
+    if ((f = lcloud_get_file(fh)) == NULL) {
+        return -1;
+    }
+    // reads only share the block map, so other readers may run alongside
+    pthread_rwlock_rdlock(&f->lock);
+    if (!f->is_open) {
+        pthread_rwlock_unlock(&f->lock);
+        logMessage(LOG_OUTPUT_LEVEL, "Not open");
+        return -1;
+    }
+    // set up the length to read, and claim the range from the cursor
+    pthread_mutex_lock(&f->pos_lock);
+    size_t left = f->cur_pos < f->file_size ? f->file_size - f->cur_pos : 0;
+    if (len > left) {
+        len = left;
+    }
+    pos = f->cur_pos;
+    f->cur_pos += len;
+    lcloud_tier_touch(f, len);
+    pthread_mutex_unlock(&f->pos_lock);
+
+    // read the lenght n, alread read length n_read
+    unsigned int n_read = 0;
+    unsigned int n;
+    while (f->compressed && n_read < len) {
+        // a compressed file is read a chunk at a time
+        unsigned int begin = pos % LC_CHUNK_SIZE;
+        n = LC_CHUNK_SIZE - begin;
+        if (n > len - n_read) {
+            n = len - n_read;
+        }
+        if (!lcloud_chunk_read(f, pos / LC_CHUNK_SIZE, chunk)) {
+            break;
+        }
+        memcpy(buf + n_read, chunk + begin, n);
+        pos += n;
+        n_read += n;
+    }
+    while (!f->compressed && n_read < len) {
+        // since write and read cannot over the length of block size
+        // mod the current position by the block size (to get the length)
+        unsigned int begin = pos % LC_DEVICE_BLOCK_SIZE;
+        n = LC_DEVICE_BLOCK_SIZE - begin;
+        if (n > len - n_read) {
+            n = len - n_read;
+        }
+
+        i = pos / LC_DEVICE_BLOCK_SIZE;
+        if (i < f->blocks_count) {
+            dev = f->blocks[i].device_id;
+            sec = f->blocks[i].sector;
+            blk = f->blocks[i].block;
+            shift = 0;
+        } else if (!f->tail_len) {
+            // past the mapped blocks, a hole
+            dev = LC_HOLE;
+            sec = blk = shift = 0;
+        } else {
+            // the rest of the file is a packed tail
+            dev = f->tail.device_id;
+            sec = f->tail.sector;
+            blk = f->tail.block;
+            shift = f->tail_off;
+        }
+        //read the cache
+        lcloud_read_block(dev, sec, blk, tmp);
+
+        // copy the file's memory to buffer
+        memcpy(buf + n_read, tmp + shift + begin, n);
+
+        logMessage(LOG_OUTPUT_LEVEL, "write: %.*s", n, buf + n_read);
+        pos += n;
+        n_read += n;
+    }
+    pthread_rwlock_unlock(&f->lock);
+    // return the reading bytes
+    return n_read;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_write
+// Description  : write data to the file
+//
+// Inputs       : fh - file handle for the file to write to
+//                buf - pointer to data to write
+//                len - the length of the write
+// Outputs      : number of bytes written if successful test, -1 if failure
+
+int lcloud_write(LcFHandle fh, char* buf, size_t len)
+{
+    char tmp[LC_DEVICE_BLOCK_SIZE];
+    int i, dev, sec, blk, size, fresh, full, logged = log_mode, deduped = dedup_mode, held = 0;
+    int sparse = sparse_mode;
+    File f;
+
+    // check if the file is avalible and valid or not
+    if ((f = lcloud_get_file(fh)) == NULL) {
+        return -1;
+    }
+    // writers may grow the block map, so they hold the file exclusively
+    pthread_rwlock_wrlock(&f->lock);
+    if (!f->is_open) {
+        pthread_rwlock_unlock(&f->lock);
+        logMessage(LOG_OUTPUT_LEVEL, "Not open");
+        return -1;
+    }
+    // the file must still fit an int afterwards
+    if (len > (size_t)(INT_MAX - f->cur_pos)) {
+        pthread_rwlock_unlock(&f->lock);
+        logMessage(LOG_OUTPUT_LEVEL, "Write past the largest file size");
+        return -1;
+    }
+    lcloud_tier_touch(f, len);
+    // a packed tail goes back to a block of its own before it is written
+    if (f->tail_len && f->cur_pos + len > (size_t)f->blocks_count * LC_DEVICE_BLOCK_SIZE
+        && !lcloud_unpack_tail(f, logged)) {
+        pthread_rwlock_unlock(&f->lock);
+        return -1;
+    }
+
+    // writing past the end leaves a hole over the gap
+    size = f->file_size;
+    if (!f->compressed && f->cur_pos > f->file_size && !lcloud_extend_file(f, f->cur_pos, logged)) {
+        pthread_rwlock_unlock(&f->lock);
+        return -1;
+    }
+
+    // write the file (same as the read)
+    unsigned int n_write = 0;
+    unsigned int n;
+    while (f->compressed && n_write < len) {
+        // a compressed file is written a chunk at a time
+        unsigned int begin = f->cur_pos % LC_CHUNK_SIZE;
+        n = LC_CHUNK_SIZE - begin;
+        if (n > len - n_write) {
+            n = len - n_write;
+        }
+        if (!lcloud_chunk_write(f, f->cur_pos, buf + n_write, n, logged, &held)) {
+            break;
+        }
+        f->cur_pos += n;
+        if (f->cur_pos > f->file_size) {
+            f->file_size = f->cur_pos;
+        }
+        n_write += n;
+    }
+    while (!f->compressed && n_write < len) {
+        // since write and read cannot over the length of block size
+        // mod the current position by the block size (to get the length)
+        unsigned int begin = f->cur_pos % LC_DEVICE_BLOCK_SIZE;
+        n = LC_DEVICE_BLOCK_SIZE - begin;
+        if (n > len - n_write) {
+            n = len - n_write;
+        }
+
+        i = f->cur_pos / LC_DEVICE_BLOCK_SIZE;
+
+        // a whole block already stored elsewhere is shared, not written
+        full = (n == LC_DEVICE_BLOCK_SIZE);
+        if (deduped && full && lcloud_dedup_write(f, i, buf + n_write, &held)) {
+            goto written;
+        }
+        // and a block of zeros is not stored at all
+        if (sparse && full && lcloud_block_zero(buf + n_write)) {
+            lcloud_punch_block(f, i, &held);
+            goto written;
+        }
+
+        // a new block at the end, or one filling a hole
+        fresh = (i == f->blocks_count || f->blocks[i].device_id == LC_HOLE);
+        if (fresh) {
+            struct block b;
+            if (logged) {
+                fresh = lcloud_log_block(&b.device_id, &b.sector, &b.block);
+            } else {
+                fresh = lcloud_get_free_block(&b.device_id, &b.sector, &b.block);
+            }
+            if (!fresh) {
+                break;
+            }
+            if (i == f->blocks_count) {
+                f->blocks = realloc(f->blocks, sizeof(struct block) * (f->blocks_count + 1));
+                f->blocks_count++;
+            }
+            f->blocks[i] = b;
+            lcloud_journal_extent(f, i);
+        }
+        dev = f->blocks[i].device_id;
+        sec = f->blocks[i].sector;
+        blk = f->blocks[i].block;
+
+        // write through cache, a new block starts out as zeros
+        if (fresh) {
+            memset(tmp, 0, sizeof(tmp));
+        } else {
+            lcloud_read_block(dev, sec, blk, tmp);
+        }
+        memcpy(tmp + begin, buf + n_write, n);
+        if (!fresh && ((logged && !lcloud_log_in_segment(dev, sec)) || lcloud_block_claim(dev, sec, blk) > 1)) {
+            // append the new copy to the log, or copy a block other files share
+            if (!(held = lcloud_relocate_block(f, i, logged))) {
+                break;
+            }
+            dev = f->blocks[i].device_id;
+            sec = f->blocks[i].sector;
+            blk = f->blocks[i].block;
+        }
+        lcloud_putcache(dev, sec, blk, tmp);
+        lcloud_io_write(dev, sec, blk, tmp);
+        lcloud_dedup_remember(dev, sec, blk, deduped && full ? tmp : NULL);
+
+    written:
+        f->cur_pos += n;
+        if (f->cur_pos > f->file_size) {
+            f->file_size = f->cur_pos;
+        }
+
+        n_write += n;
+    }
+    // one size record per call, the journal keeps only the latest, a
+    // compressed file records it when its chunk is stored
+    if (size != f->file_size && !f->compressed) {
+        lcloud_journal_size(f);
+    }
+    pthread_rwlock_unlock(&f->lock);
+    if (held >= LC_LOG_PENDING_MAX) {
+        lcloud_log_commit();
+    }
+    lcloud_maybe_checkpoint();
+    // return the bytes
+    return n_write;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_seek
+// Description  : Seek to a specific place in the file
+//
+// Inputs       : fh - the file handle of the file to seek in
+//                off - offset within the file to seek to
+// Outputs      : 0 if successful test, -1 if failure
+
+int lcloud_seek(LcFHandle fh, size_t off)
+{
+    File f;
+
+    // check if the position is right and the file is valid or not
+    if ((f = lcloud_get_file(fh)) == NULL) {
+        return -1;
+    }
+    pthread_rwlock_rdlock(&f->lock);
+    if (!f->is_open) {
+        pthread_rwlock_unlock(&f->lock);
+        logMessage(LOG_OUTPUT_LEVEL, "Not open");
+        return -1;
+    }
+    // a position past the end is allowed, the next write leaves a hole, but
+    // an operation there must not overflow the position
+    if (off > LC_MAX_FILE_SIZE) {
+        pthread_rwlock_unlock(&f->lock);
+        logMessage(LOG_OUTPUT_LEVEL, "Seek past the largest file size");
+        return -1;
+    }
+    pthread_mutex_lock(&f->pos_lock);
+    f->cur_pos = off;
+    pthread_mutex_unlock(&f->pos_lock);
+    pthread_rwlock_unlock(&f->lock);
+    return (off);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_truncate
+// Description  : Set the size of a file, freeing the blocks past the new
+//                end or adding a hole to reach it
+//
+// Inputs       : fh - the file handle of the file to truncate
+//                len - the new size
+// Outputs      : 0 if successful test, -1 if failure
+
+int lcloud_truncate(LcFHandle fh, size_t len)
+{
+    struct block* dropped = NULL;
+    int i, n_dropped = 0, nblocks, ret = 0;
+    File f;
+
+    if ((f = lcloud_get_file(fh)) == NULL || len > LC_MAX_FILE_SIZE) {
+        return -1;
+    }
+    pthread_rwlock_wrlock(&f->lock);
+    if (!f->is_open) {
+        pthread_rwlock_unlock(&f->lock);
+        logMessage(LOG_OUTPUT_LEVEL, "Not open");
+        return -1;
+    }
+    if (!lcloud_unpack_tail(f, log_mode)) {
+        pthread_rwlock_unlock(&f->lock);
+        return -1;
+    }
+
+    nblocks = (len + LC_DEVICE_BLOCK_SIZE - 1) / LC_DEVICE_BLOCK_SIZE;
+    if (f->compressed) {
+        if (!lcloud_chunk_truncate(f, len, &dropped, &n_dropped)) {
+            len = f->file_size;
+            ret = -1;
+        }
+    } else if (nblocks < f->blocks_count) {
+        // hand the tail back once the new size is durable
+        n_dropped = f->blocks_count - nblocks;
+        dropped = (struct block*)malloc(sizeof(struct block) * n_dropped);
+        memcpy(dropped, f->blocks + nblocks, sizeof(struct block) * n_dropped);
+        f->blocks_count = nblocks;
+    } else if (len > (size_t)f->file_size) {
+        // grow with a hole
+        if (!lcloud_extend_file(f, len, log_mode)) {
+            pthread_rwlock_unlock(&f->lock);
+            return -1;
+        }
+    }
+    f->file_size = len;
+    pthread_mutex_lock(&f->pos_lock);
+    if (f->cur_pos > f->file_size) {
+        f->cur_pos = f->file_size;
+    }
+    pthread_mutex_unlock(&f->pos_lock);
+    lcloud_journal_truncate(f);
+    pthread_rwlock_unlock(&f->lock);
+
+    lcloud_log_commit();
+    for (i = 0; i < n_dropped; i++) {
+        lcloud_free_block(dropped[i].device_id, dropped[i].sector, dropped[i].block);
+    }
+    free(dropped);
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_unlink
+// Description  : Delete a closed file and return its blocks
+//
+// Inputs       : path - the path/filename of the file to delete
+// Outputs      : 0 if successful test, -1 if failure
+
+int lcloud_unlink(const char* path)
+{
+    struct block* dropped = NULL;
+    int i, n_dropped = 0;
+    File f = NULL;
+
+    pthread_mutex_lock(&init_lock);
+    if (lcloud == 0) {
+        lcloud_initialization();
+    }
+    pthread_mutex_unlock(&init_lock);
+
+    pthread_rwlock_wrlock(&files_lock);
+    for (i = 0; i < files_count; i++) {
+        if (files[i]->file_name && strcmp(path, files[i]->file_name) == 0) {
+            f = files[i];
+            break;
+        }
+    }
+    if (f == NULL) {
+        pthread_rwlock_unlock(&files_lock);
+        logMessage(LOG_OUTPUT_LEVEL, "No such file");
+        return -1;
+    }
+    pthread_rwlock_wrlock(&f->lock);
+    if (f->is_open) {
+        pthread_rwlock_unlock(&f->lock);
+        pthread_rwlock_unlock(&files_lock);
+        logMessage(LOG_OUTPUT_LEVEL, "Still open");
+        return -1;
+    }
+    dropped = lcloud_drop_file(f, &n_dropped);
+    pthread_rwlock_unlock(&f->lock);
+    pthread_rwlock_unlock(&files_lock);
+
+    lcloud_journal_commit();
+    lcloud_maybe_checkpoint();
+    for (i = 0; i < n_dropped; i++) {
+        lcloud_free_block(dropped[i].device_id, dropped[i].sector, dropped[i].block);
+    }
+    free(dropped);
+    logMessage(LOG_OUTPUT_LEVEL, "File %s deleted", path);
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_clone
+// Description  : Create a copy of a file that shares its blocks until
+//                either one is written
+//
+// Inputs       : src - the path/filename of the file to copy
+//                dst - the path/filename of the copy, which must not exist
+// Outputs      : 0 if successful test, -1 if failure
+
+int lcloud_clone(const char* src, const char* dst)
+{
+    int i, held = 0;
+    File f;
+
+    if (strlen(dst) > LC_META_MAX_NAME) {
+        logMessage(LOG_OUTPUT_LEVEL, "Name too long");
+        return -1;
+    }
+    pthread_mutex_lock(&init_lock);
+    if (lcloud == 0) {
+        lcloud_initialization();
+    }
+    pthread_mutex_unlock(&init_lock);
+
+    pthread_rwlock_wrlock(&files_lock);
+    if ((i = lcloud_find_file(src)) == -1) {
+        pthread_rwlock_unlock(&files_lock);
+        logMessage(LOG_OUTPUT_LEVEL, "No such file");
+        return -1;
+    }
+    if (lcloud_find_file(dst) != -1) {
+        pthread_rwlock_unlock(&files_lock);
+        logMessage(LOG_OUTPUT_LEVEL, "File exists");
+        return -1;
+    }
+    f = files[i];
+    pthread_rwlock_wrlock(&f->lock);
+    i = lcloud_clone_file(f, dst, &held);
+    pthread_rwlock_unlock(&f->lock);
+    pthread_rwlock_unlock(&files_lock);
+
+    lcloud_log_commit();
+    lcloud_maybe_checkpoint();
+    if (i == -1) {
+        return -1;
+    }
+    logMessage(LOG_OUTPUT_LEVEL, "File %s cloned to %s", src, dst);
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_snapshot
+// Description  : Clone every file at the same point in time, naming each
+//                copy <path>@<tag>, except the copies of earlier snapshots
+//
+// Inputs       : tag - the snapshot name
+// Outputs      : number of files in the snapshot, -1 if failure
+
+int lcloud_snapshot(const char* tag)
+{
+    struct block *dropped = NULL, *d;
+    int i, k, n = 0, made = 0, n_dropped = 0, held = 0, ret = 0;
+    int* clones;
+    File* live;
+    char* name;
+
+    pthread_mutex_lock(&init_lock);
+    if (lcloud == 0) {
+        lcloud_initialization();
+    }
+    pthread_mutex_unlock(&init_lock);
+
+    pthread_rwlock_wrlock(&files_lock);
+    // pick the files and check the names up front, so a snapshot is taken
+    // whole or not at all and never includes its own clones
+    live = (File*)malloc(sizeof(File) * (files_count + 1));
+    clones = (int*)malloc(sizeof(int) * (files_count + 1));
+    for (i = 0; i < files_count && ret == 0; i++) {
+        // earlier snapshots are not snapshotted again
+        if (files[i]->file_name == NULL || strchr(files[i]->file_name, '@') != NULL) {
+            continue;
+        }
+        name = (char*)malloc(strlen(files[i]->file_name) + strlen(tag) + 2);
+        sprintf(name, "%s@%s", files[i]->file_name, tag);
+        if (strlen(name) > LC_META_MAX_NAME) {
+            logMessage(LOG_OUTPUT_LEVEL, "Snapshot name %s too long", name);
+            ret = -1;
+        } else if (lcloud_find_file(name) != -1) {
+            logMessage(LOG_OUTPUT_LEVEL, "Snapshot %s exists", tag);
+            ret = -1;
+        }
+        free(name);
+        live[n++] = files[i];
+    }
+    for (i = 0; i < n && ret == 0; i++) {
+        name = (char*)malloc(strlen(live[i]->file_name) + strlen(tag) + 2);
+        sprintf(name, "%s@%s", live[i]->file_name, tag);
+        pthread_rwlock_wrlock(&live[i]->lock);
+        if ((clones[made] = lcloud_clone_file(live[i], name, &held)) == -1) {
+            ret = -1;
+        } else {
+            made++;
+        }
+        pthread_rwlock_unlock(&live[i]->lock);
+        free(name);
+    }
+    // a clone failing midway leaves nothing of its own, so dropping the
+    // ones made before it leaves no part of the snapshot behind
+    for (i = 0; i < made && ret == -1; i++) {
+        pthread_rwlock_wrlock(&files[clones[i]]->lock);
+        d = lcloud_drop_file(files[clones[i]], &k);
+        pthread_rwlock_unlock(&files[clones[i]]->lock);
+        dropped = realloc(dropped, sizeof(struct block) * (n_dropped + k + 1));
+        memcpy(dropped + n_dropped, d, sizeof(struct block) * k);
+        n_dropped += k;
+        free(d);
+    }
+    free(clones);
+    free(live);
+    pthread_rwlock_unlock(&files_lock);
+
+    lcloud_log_commit();
+    lcloud_maybe_checkpoint();
+    if (ret == -1) {
+        // the clones' references go once their unlinks are committed
+        for (i = 0; i < n_dropped; i++) {
+            lcloud_free_block(dropped[i].device_id, dropped[i].sector, dropped[i].block);
+        }
+        free(dropped);
+        return -1;
+    }
+    logMessage(LOG_OUTPUT_LEVEL, "Snapshot %s of %d files", tag, n);
+    return (n);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_defrag
+// Description  : Move the blocks of a file, or of every file, into as few
+//                runs as the free space allows
+//
+// Inputs       : path - the path/filename of the file, NULL for all files
+// Outputs      : number of blocks moved, -1 if failure
+
+int lcloud_defrag(const char* path)
+{
+    int i, moved = 0;
+
+    pthread_mutex_lock(&init_lock);
+    if (lcloud == 0) {
+        lcloud_initialization();
+    }
+    pthread_mutex_unlock(&init_lock);
+
+    pthread_rwlock_rdlock(&files_lock);
+    if (path && (i = lcloud_find_file(path)) == -1) {
+        pthread_rwlock_unlock(&files_lock);
+        logMessage(LOG_OUTPUT_LEVEL, "No such file");
+        return -1;
+    }
+    for (i = path ? i : 0; i < files_count; i++) {
+        if (files[i]->file_name) {
+            pthread_rwlock_wrlock(&files[i]->lock);
+            files[i]->defrag = 0;
+            moved += lcloud_defrag_file(files[i], log_mode);
+            pthread_rwlock_unlock(&files[i]->lock);
+        }
+        if (path) {
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&files_lock);
+
+    // the old blocks are freed once the new maps are durable
+    lcloud_log_commit();
+    logMessage(LOG_OUTPUT_LEVEL, "Defragmented %d blocks", moved);
+    return (moved);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_list
+// Description  : Walk the file table, one file per call
+//
+// Inputs       : pos - 0 to start, then the value returned by the last call
+//                name - place to put the file name
+//                len - size of name
+//                size - place to put the file size, or NULL
+// Outputs      : the position to pass next time, -1 at the end
+
+int lcloud_list(int pos, char* name, size_t len, size_t* size)
+{
+    pthread_mutex_lock(&init_lock);
+    if (lcloud == 0) {
+        lcloud_initialization();
+    }
+    pthread_mutex_unlock(&init_lock);
+
+    pthread_rwlock_rdlock(&files_lock);
+    // deleted files leave tombstones in the table, skip them
+    while (pos >= 0 && pos < files_count && files[pos]->file_name == NULL) {
+        pos++;
+    }
+    if (pos < 0 || pos >= files_count) {
+        pthread_rwlock_unlock(&files_lock);
+        return -1;
+    }
+    pthread_rwlock_rdlock(&files[pos]->lock);
+    snprintf(name, len, "%s", files[pos]->file_name);
+    if (size) {
+        *size = files[pos]->file_size;
+    }
+    pthread_rwlock_unlock(&files[pos]->lock);
+    pthread_rwlock_unlock(&files_lock);
+    return (pos + 1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_close
+// Description  : Close the file
+//
+// Inputs       : fh - the file handle of the file to close
+// Outputs      : 0 if successful test, -1 if failure
+
+int lcloud_close(LcFHandle fh)
+{
+    int held = 0, ret = 0;
+    File f;
+
+    if ((f = lcloud_get_file(fh)) == NULL) {
+        return -1;
+    }
+    pthread_rwlock_wrlock(&f->lock);
+    if (!f->is_open) {
+        pthread_rwlock_unlock(&f->lock);
+        logMessage(LOG_OUTPUT_LEVEL, "Not open");
+        return -1;
+    }
+    // store the chunk being written, the cache still has it decompressed
+    if (!lcloud_chunk_flush(f, log_mode, &held)) {
+        ret = -1;
+    }
+    free(f->chunk);
+    f->chunk = NULL;
+    f->chunk_idx = -1;
+    f->chunk_dirty = 0;
+    // close the file, make the position and is_open into 0
+    f->cur_pos = 0;
+    f->is_open = 0;
+    lcloud_pack_tail(f);
+    lcloud_defrag_notify(f);
+    pthread_rwlock_unlock(&f->lock);
+    // closing makes the file's metadata durable
+    lcloud_log_commit();
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_get_stream
+// Description  : look up an open stream of the given direction
+//
+// Inputs       : s - the stream handle
+//                mode - LC_STREAM_READ or LC_STREAM_WRITE
+// Outputs      : the stream, NULL if the handle is invalid
+
+lc_stream* lcloud_get_stream(LcStream s, int mode)
+{
+    lc_stream* st = NULL;
+
+    pthread_mutex_lock(&stream_lock);
+    if (s >= 0 && s < LC_STREAM_MAX && streams[s].open && streams[s].mode == mode) {
+        st = &streams[s];
+    }
+    pthread_mutex_unlock(&stream_lock);
+    if (st == NULL) {
+        logMessage(LOG_OUTPUT_LEVEL, "Bad stream %d", s);
+    }
+    return st;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_stream_flush
+// Description  : Write out the blocks waiting in a write stream's window
+//
+// Inputs       : st - the stream
+//                final - also write a partial last block
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_stream_flush(lc_stream* st, int final)
+{
+    int nblocks = st->used / LC_DEVICE_BLOCK_SIZE, len = st->used, ret = 0;
+    File f;
+
+    if ((f = lcloud_get_file(st->fh)) == NULL) {
+        return -1;
+    }
+    pthread_rwlock_wrlock(&f->lock);
+    if (!f->compressed && !f->tail_len && !dedup_mode && !sparse_mode) {
+        if (!lcloud_stream_write_blocks(f, st->pool, nblocks)) {
+            ret = -1;
+        }
+        len -= nblocks * LC_DEVICE_BLOCK_SIZE;
+    }
+    pthread_rwlock_unlock(&f->lock);
+    // whatever the window could not take goes through lcwrite
+    if (ret == 0 && (final || len >= LC_DEVICE_BLOCK_SIZE) && len > 0
+        && lcloud_write(st->fh, st->pool + st->used - len, len) != len) {
+        ret = -1;
+    }
+    st->used = 0;
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_stream_open
+// Description  : Open a file as a stream, for reading it from the start or
+//                for writing a new version of it
+//
+// Inputs       : path - the path/filename of the file
+//                mode - LC_STREAM_READ or LC_STREAM_WRITE
+// Outputs      : the stream handle if successful, -1 if failure
+
+LcStream lcloud_stream_open(const char* path, int mode)
+{
+    LcFHandle fh;
+    int s;
+
+    if (mode != LC_STREAM_READ && mode != LC_STREAM_WRITE) {
+        logMessage(LOG_OUTPUT_LEVEL, "Bad stream mode %d", mode);
+        return -1;
+    }
+    if ((fh = lcloud_open(path)) == -1) {
+        return -1;
+    }
+    pthread_mutex_lock(&stream_lock);
+    for (s = 0; s < LC_STREAM_MAX && streams[s].open; s++) {
+    }
+    if (s == LC_STREAM_MAX) {
+        pthread_mutex_unlock(&stream_lock);
+        lcloud_close(fh);
+        logMessage(LOG_OUTPUT_LEVEL, "Too many streams");
+        return -1;
+    }
+    streams[s].open = 1;
+    streams[s].fh = fh;
+    streams[s].mode = mode;
+    streams[s].pool = stream_pool[s];
+    streams[s].used = 0;
+    streams[s].off = 0;
+    streams[s].total = 0;
+    pthread_mutex_unlock(&stream_lock);
+    return s;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_stream_push
+// Description  : Add data to a write stream, writing out each full window
+//
+// Inputs       : s - the stream handle
+//                buf - the data
+//                len - its length, any size
+// Outputs      : number of bytes taken, -1 if failure
+
+int lcloud_stream_push(LcStream s, const char* buf, size_t len)
+{
+    lc_stream* st;
+    size_t done = 0, n;
+
+    if ((st = lcloud_get_stream(s, LC_STREAM_WRITE)) == NULL) {
+        return -1;
+    }
+    while (done < len) {
+        n = LC_STREAM_WINDOW * LC_DEVICE_BLOCK_SIZE - st->used;
+        if (n > len - done) {
+            n = len - done;
+        }
+        memcpy(st->pool + st->used, buf + done, n);
+        st->used += n;
+        st->total += n;
+        done += n;
+        if (st->used == LC_STREAM_WINDOW * LC_DEVICE_BLOCK_SIZE && lcloud_stream_flush(st, 0) == -1) {
+            return -1;
+        }
+    }
+    return (done);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_stream_pull
+// Description  : Take the next data from a read stream, reading a window
+//                ahead each time the last one runs out
+//
+// Inputs       : s - the stream handle
+//                buf - place to put the data
+//                len - how much to take, any size
+// Outputs      : number of bytes read, 0 at the end, -1 if failure
+
+int lcloud_stream_pull(LcStream s, char* buf, size_t len)
+{
+    lc_stream* st;
+    size_t done = 0, n;
+    int got;
+    File f;
+
+    if ((st = lcloud_get_stream(s, LC_STREAM_READ)) == NULL) {
+        return -1;
+    }
+    while (done < len) {
+        if (st->off == st->used) {
+            if ((f = lcloud_get_file(st->fh)) == NULL) {
+                return -1;
+            }
+            pthread_rwlock_rdlock(&f->lock);
+            got = f->compressed ? 0 : lcloud_stream_read_blocks(f, st->pool);
+            pthread_rwlock_unlock(&f->lock);
+            if (got == 0) {
+                // compressed or reaching the tail, or at the end
+                got = lcloud_read(st->fh, st->pool, LC_STREAM_WINDOW * LC_DEVICE_BLOCK_SIZE);
+            }
+            if (got <= 0) {
+                return (got == 0 || done ? (int)done : -1);
+            }
+            st->used = got;
+            st->off = 0;
+        }
+        n = st->used - st->off;
+        if (n > len - done) {
+            n = len - done;
+        }
+        memcpy(buf + done, st->pool + st->off, n);
+        st->off += n;
+        done += n;
+    }
+    return (done);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_stream_finish
+// Description  : Close a stream, writing out the rest of a write stream and
+//                cutting the file to the streamed length
+//
+// Inputs       : s - the stream handle
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_stream_finish(LcStream s)
+{
+    lc_stream* st;
+    int ret = 0;
+
+    pthread_mutex_lock(&stream_lock);
+    st = (s >= 0 && s < LC_STREAM_MAX && streams[s].open) ? &streams[s] : NULL;
+    pthread_mutex_unlock(&stream_lock);
+    if (st == NULL) {
+        logMessage(LOG_OUTPUT_LEVEL, "Bad stream %d", s);
+        return -1;
+    }
+    if (st->mode == LC_STREAM_WRITE
+        && (lcloud_stream_flush(st, 1) == -1 || lcloud_truncate(st->fh, st->total) == -1)) {
+        ret = -1;
+    }
+    if (lcloud_close(st->fh) == -1) {
+        ret = -1;
+    }
+    pthread_mutex_lock(&stream_lock);
+    st->open = 0;
+    pthread_mutex_unlock(&stream_lock);
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_shutdown
+// Description  : Shut down the filesystem
+//
+// Inputs       : none
+// Outputs      : 0 if successful test, -1 if failure
+
+int lcloud_shutdown(void)
+{
+    pthread_mutex_lock(&init_lock);
+    lcloud_compact_stop();
+    lcloud_prefetch_stop();
+    // persist the file table while the devices are still powered
+    pthread_rwlock_wrlock(&files_lock);
+    if (lcloud) {
+        for (int i = 0, held = 0; i < files_count; i++) {
+            lcloud_chunk_flush(files[i], log_mode, &held);
+        }
+        lcloud_checkpoint();
+    }
+    // if the power is off, return -1
+    if (!lcloud_io_power_off()) {
+        pthread_rwlock_unlock(&files_lock);
+        pthread_mutex_unlock(&init_lock);
+        return -1;
+    }
+    // clean the file(return to NULL)
+    lcloud_free_files();
+    pthread_rwlock_unlock(&files_lock);
+    // superseded blocks are free on the devices once the checkpoint is down
+    pthread_mutex_lock(&alloc_lock);
+    free(log_pending);
+    log_pending = NULL;
+    log_pending_count = 0;
+    log_device = -1;
+    pthread_mutex_unlock(&alloc_lock);
+    pthread_mutex_lock(&pack_lock);
+    pack_open = 0;
+    pack_count = 0;
+    pthread_mutex_unlock(&pack_lock);
+    pthread_mutex_lock(&alloc_lock);
+    if (dedup_hits) {
+        logMessage(LOG_OUTPUT_LEVEL, "Dedup: %d block writes shared", dedup_hits);
+    }
+    free(dedup_table);
+    dedup_table = NULL;
+    dedup_hits = 0;
+    pthread_mutex_unlock(&alloc_lock);
+    if (prefetch_files) {
+        logMessage(LOG_OUTPUT_LEVEL, "Prefetch: %d predicted opens", prefetch_files);
+    }
+    lcloud_tier_report();
+    prefetch_files = 0;
+    last_open = -1;
     lcloud_closecache();
+    lcloud = 0;
+    pthread_mutex_unlock(&init_lock);
     return (0);
 }
+
+//
+// Instrumented interface
+
+// Function     : lcloud_call_begin / lcloud_call_end
+// Description  : bracket one call of the filesystem interface, so it is
+//                counted and timed while the statistics are on, and is
+//                the parent span of its cache lookups and bus requests
+//                while tracing
+// Inputs       : call - the call, LC_CALL_*
+//                start - from lcloud_call_begin
+//                ret - what the call returned, -1 is a failure
+//                bytes - bytes the call read or wrote
+// Outputs      : the start time / none
+static uint64_t lcloud_call_begin(int call)
+{
+    return (lcloud_stats_on || lcloud_trace_on) ? lcloud_hist_now() : 0;
+}
+
+static void lcloud_call_end(int call, uint64_t start, int ret, uint64_t bytes)
+{
+    if (start == 0) {
+        return;
+    }
+    lcloud_stats_call(call, start, ret == -1, bytes);
+    lcloud_trace_span(LC_TRACE_CALL, call, start, lcloud_hist_now(), -1, 0, 0, bytes);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcsetmode, lcopen, lcread, lcwrite, lcseek, lctruncate,
+//                lcunlink, lcclone, lcsnapshot, lcdefrag, lclist, lcclose,
+//                lcstream_open, lcstream_push, lcstream_pull,
+//                lcstream_finish, lcshutdown
+// Description  : The filesystem interface. Each one calls the lcloud_*
+//                function of the same name above between lcloud_call_begin
+//                and lcloud_call_end. Streams call the lcloud_* functions
+//                directly, so their work is only counted once.
+//
+// Inputs       : as the lcloud_* function
+// Outputs      : as the lcloud_* function
+
+int lcsetmode(int mode)
+{
+    uint64_t start = lcloud_call_begin(LC_CALL_SETMODE);
+    int ret = lcloud_setmode(mode);
+    lcloud_call_end(LC_CALL_SETMODE, start, ret, 0);
+    return (ret);
+}
+
+LcFHandle lcopen(const char* path)
+{
+    uint64_t start = lcloud_call_begin(LC_CALL_OPEN);
+    LcFHandle ret = lcloud_open(path);
+    lcloud_call_end(LC_CALL_OPEN, start, ret, 0);
+    return (ret);
+}
+
+int lcread(LcFHandle fh, char* buf, size_t len)
+{
+    uint64_t start = lcloud_call_begin(LC_CALL_READ);
+    int ret = lcloud_read(fh, buf, len);
+    lcloud_call_end(LC_CALL_READ, start, ret, ret > 0 ? ret : 0);
+    return (ret);
+}
+
+int lcwrite(LcFHandle fh, char* buf, size_t len)
+{
+    uint64_t start = lcloud_call_begin(LC_CALL_WRITE);
+    int ret = lcloud_write(fh, buf, len);
+    lcloud_call_end(LC_CALL_WRITE, start, ret, ret > 0 ? ret : 0);
+    return (ret);
+}
+
+int lcseek(LcFHandle fh, size_t off)
+{
+    uint64_t start = lcloud_call_begin(LC_CALL_SEEK);
+    int ret = lcloud_seek(fh, off);
+    lcloud_call_end(LC_CALL_SEEK, start, ret, 0);
+    return (ret);
+}
+
+int lctruncate(LcFHandle fh, size_t len)
+{
+    uint64_t start = lcloud_call_begin(LC_CALL_TRUNCATE);
+    int ret = lcloud_truncate(fh, len);
+    lcloud_call_end(LC_CALL_TRUNCATE, start, ret, 0);
+    return (ret);
+}
+
+int lcunlink(const char* path)
+{
+    uint64_t start = lcloud_call_begin(LC_CALL_UNLINK);
+    int ret = lcloud_unlink(path);
+    lcloud_call_end(LC_CALL_UNLINK, start, ret, 0);
+    return (ret);
+}
+
+int lcclone(const char* src, const char* dst)
+{
+    uint64_t start = lcloud_call_begin(LC_CALL_CLONE);
+    int ret = lcloud_clone(src, dst);
+    lcloud_call_end(LC_CALL_CLONE, start, ret, 0);
+    return (ret);
+}
+
+int lcsnapshot(const char* tag)
+{
+    uint64_t start = lcloud_call_begin(LC_CALL_SNAPSHOT);
+    int ret = lcloud_snapshot(tag);
+    lcloud_call_end(LC_CALL_SNAPSHOT, start, ret, 0);
+    return (ret);
+}
+
+int lcdefrag(const char* path)
+{
+    uint64_t start = lcloud_call_begin(LC_CALL_DEFRAG);
+    int ret = lcloud_defrag(path);
+    lcloud_call_end(LC_CALL_DEFRAG, start, ret, 0);
+    return (ret);
+}
+
+int lclist(int pos, char* name, size_t len, size_t* size)
+{
+    uint64_t start = lcloud_call_begin(LC_CALL_LIST);
+    int ret = lcloud_list(pos, name, len, size);
+    lcloud_call_end(LC_CALL_LIST, start, ret, 0);
+    return (ret);
+}
+
+int lcclose(LcFHandle fh)
+{
+    uint64_t start = lcloud_call_begin(LC_CALL_CLOSE);
+    int ret = lcloud_close(fh);
+    lcloud_call_end(LC_CALL_CLOSE, start, ret, 0);
+    return (ret);
+}
+
+LcStream lcstream_open(const char* path, int mode)
+{
+    uint64_t start = lcloud_call_begin(LC_CALL_STREAM_OPEN);
+    LcStream ret = lcloud_stream_open(path, mode);
+    lcloud_call_end(LC_CALL_STREAM_OPEN, start, ret, 0);
+    return (ret);
+}
+
+int lcstream_push(LcStream s, const char* buf, size_t len)
+{
+    uint64_t start = lcloud_call_begin(LC_CALL_STREAM_PUSH);
+    int ret = lcloud_stream_push(s, buf, len);
+    lcloud_call_end(LC_CALL_STREAM_PUSH, start, ret, ret > 0 ? ret : 0);
+    return (ret);
+}
+
+int lcstream_pull(LcStream s, char* buf, size_t len)
+{
+    uint64_t start = lcloud_call_begin(LC_CALL_STREAM_PULL);
+    int ret = lcloud_stream_pull(s, buf, len);
+    lcloud_call_end(LC_CALL_STREAM_PULL, start, ret, ret > 0 ? ret : 0);
+    return (ret);
+}
+
+int lcstream_finish(LcStream s)
+{
+    uint64_t start = lcloud_call_begin(LC_CALL_STREAM_FINISH);
+    int ret = lcloud_stream_finish(s);
+    lcloud_call_end(LC_CALL_STREAM_FINISH, start, ret, 0);
+    return (ret);
+}
+
+int lcshutdown(void)
+{
+    uint64_t start = lcloud_call_begin(LC_CALL_SHUTDOWN);
+    int ret = lcloud_shutdown();
+    lcloud_call_end(LC_CALL_SHUTDOWN, start, ret, 0);
+    return (ret);
+}
@@ -16,9 +16,20 @@
 #include <stdint.h>
 
 // Defines 
+#define LC_MODE_INPLACE 0 // overwrite blocks where they are (default)
+#define LC_MODE_LOG 1 // append written blocks to a log of segments
+#define LC_MODE_DEDUP 2 // share identical blocks, combines with either mode
+#define LC_MODE_COMPRESS 4 // store new files compressed, combines with either mode
+#define LC_MODE_SPARSE 8 // leave holes for all-zero blocks, combines with either mode
+#define LC_MODE_DEFRAG 16 // defragment files in the background as they are closed
+#define LC_MODE_PREFETCH 32 // prefetch the file usually opened next
+#define LC_MODE_TIER 64 // migrate the blocks of hot files to the fastest device
+#define LC_STREAM_READ 0 // stream a file out from its start
+#define LC_STREAM_WRITE 1 // stream a new version of a file in
 
 // Type definitions
 typedef int32_t LcFHandle;
+typedef int32_t LcStream;
 
 // File system interface definitions
 
@@ -32,11 +43,47 @@ int lcwrite( LcFHandle fh, char *buf, size_t len );
     // Write data to the file
 
 int lcseek( LcFHandle fh, size_t off );
-    // Seek to a specific place in the file
+    // Seek to a specific place in the file, past the end leaves a hole
+
+int lctruncate( LcFHandle fh, size_t len );
+    // Set the size of the file, freeing or zero filling blocks
+
+int lcunlink( const char *path );
+    // Delete a closed file and free its blocks
+
+int lcclone( const char *src, const char *dst );
+    // Copy a file by sharing its blocks, copying them only when written
+
+int lcsnapshot( const char *tag );
+    // Clone every file to <path>@<tag> at the same point in time, files
+    // already named with an @ (earlier snapshots) are left out
+
+int lcdefrag( const char *path );
+    // Move a file's blocks (every file's if path is NULL) into long runs
+
+int lclist( int pos, char *name, size_t len, size_t *size );
+    // Get the next file name and size from pos (0 to start), -1 at the end
 
 int lcclose( LcFHandle fh );
     // Close the file
 
+LcStream lcstream_open( const char *path, int mode );
+    // Open a file as a stream, LC_STREAM_READ or LC_STREAM_WRITE
+
+int lcstream_push( LcStream s, const char *buf, size_t len );
+    // Add data of any size to a write stream
+
+int lcstream_pull( LcStream s, char *buf, size_t len );
+    // Take data of any size from a read stream, 0 at the end
+
+int lcstream_finish( LcStream s );
+    // Close a stream, a written file is cut to the streamed length
+
+int lcsetmode( int mode );
+    // Choose how writes place blocks, LC_MODE_INPLACE or LC_MODE_LOG,
+    // optionally with LC_MODE_DEDUP, LC_MODE_COMPRESS, LC_MODE_SPARSE,
+    // LC_MODE_DEFRAG, LC_MODE_PREFETCH and LC_MODE_TIER
+
 int lcshutdown( void );
     // Shut down the filesystem
 
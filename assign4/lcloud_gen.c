@@ -0,0 +1,530 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : lcloud_gen.c
+//  Description    : This is a generator of large synthetic workloads for the
+//                   LionCloud simulator, in the CMPSC311 text format or the
+//                   compiled binary one. Every object is written in full
+//                   first, then read and rewritten with the chosen access
+//                   pattern. Contents are a function of the object, the
+//                   64 byte granule and how often that granule has been
+//                   written, so every read can be checked without holding
+//                   the data.
+//
+
+// Include Files
+#include <cmpsc311_log.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Project Includes
+#include <cmpsc311_workload.h>
+#include <lcloud_workload.h>
+
+// Defines
+#define LCLOUD_GEN_ARGUMENTS "hvl:o:n:s:S:a:z:H:r:x:bp:"
+#define LC_GEN_GRANULE 64 // unit of writes and of the content versions
+#define LC_GEN_SCRAMBLE 2654435761u // prime spreading zipf ranks over the data
+#define LC_GEN_OUTBUF (1 << 20) // text output buffer
+#define USAGE                                                                  \
+    "USAGE: lcloud_gen [-h] [-v] [-l <logfile>] [-o <objects>] [-n <ops>]\n"   \
+    "                  [-s <min>:<max>] [-S <min>:<max>] [-a <access>]\n"      \
+    "                  [-z <theta>] [-H <hot>:<share>] [-r <percent>]\n"       \
+    "                  [-x <seed>] [-b] [-p <prefix>] <workload-file>\n"       \
+    "\n"                                                                       \
+    "where:\n"                                                                 \
+    "    -h - help mode (display this message)\n"                              \
+    "    -v - verbose output\n"                                                \
+    "    -l - write log messages to the filename <logfile>\n"                  \
+    "    -o - number of objects (default 16)\n"                                \
+    "    -n - number of operations after the objects are written (default\n"   \
+    "         10000)\n"                                                        \
+    "    -s - object sizes in bytes, uniform between min and max (default\n"   \
+    "         4096:65536)\n"                                                   \
+    "    -S - operation sizes in bytes, uniform between min and max, at\n"     \
+    "         most 10240 (default 1:1024)\n"                                   \
+    "    -a - access pattern, zipf (default), uniform, sequential or\n"        \
+    "         hotspot\n"                                                       \
+    "    -z - zipf skew, between 0 and 1 exclusive (default 0.99)\n"           \
+    "    -H - hotspot, the share of the data that is hot and the share of\n"   \
+    "         the operations going to it (default 0.2:0.8)\n"                  \
+    "    -r - percentage of the operations that are reads (default 50)\n"      \
+    "    -x - random seed, the same seed gives the same workload\n"            \
+    "         (default 1)\n"                                                   \
+    "    -b - write the compiled binary format instead of text\n"              \
+    "    -p - prefix of the object names (default gen)\n"                      \
+    "\n"                                                                       \
+    "    <workload-file> - file to write the workload to\n"                    \
+    "\n"
+
+// Type definitions
+typedef enum {
+    GEN_ZIPF = 0,
+    GEN_UNIFORM = 1,
+    GEN_SEQUENTIAL = 2,
+    GEN_HOTSPOT = 3,
+} gen_access;
+
+//
+// Global Data
+
+// the parameters
+uint32_t gen_objects = 16, gen_obj_min = 4096, gen_obj_max = 65536;
+uint32_t gen_op_min = 1, gen_op_max = 1024, gen_read_pct = 50;
+uint64_t gen_ops = 10000, gen_seed = 1;
+gen_access gen_pattern = GEN_ZIPF;
+double gen_theta = 0.99, gen_hot = 0.2, gen_hot_share = 0.8;
+const char* gen_prefix = "gen";
+
+// the objects, laid end to end in granules, and the write count of each
+// granule
+char** gen_names;
+uint32_t* gen_sizes;
+uint64_t* gen_starts; // first granule of each object, then the total
+uint8_t* gen_versions;
+uint64_t gen_granules, gen_cursor;
+
+// the zipf constants
+double gen_zetan, gen_alpha, gen_eta;
+
+// the output, text or binary
+FILE* gen_text;
+lc_wl_writer gen_bin;
+
+//
+// Functions
+
+// Function     : gen_random / gen_uniform
+// Description  : the next pseudo random number (splitmix64), as is / as a
+//                fraction in [0, 1)
+// Inputs       : none
+// Outputs      : the number
+static uint64_t gen_random(void)
+{
+    uint64_t z = (gen_seed += 0x9e3779b97f4a7c15ull);
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+static double gen_uniform(void)
+{
+    return (gen_random() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Function     : gen_range
+// Description  : parse a <min>:<max> pair
+// Inputs       : arg - the text
+//                lo, hi - the values
+//                limit - the largest value allowed
+// Outputs      : 0 if successful, -1 if failure
+static int gen_range(const char* arg, uint32_t* lo, uint32_t* hi, uint32_t limit)
+{
+    if (sscanf(arg, "%u:%u", lo, hi) != 2 || *lo == 0 || *lo > *hi || *hi > limit) {
+        fprintf(stderr, "Bad range (%s), aborting.\n", arg);
+        return (-1);
+    }
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : gen_zipf_init / gen_zipf
+// Description  : Draw zipf distributed ranks over the granules, rank 0 the
+//                most popular, with the method of Gray et al. (SIGMOD '94)
+//                that takes constant time per draw
+//
+// Inputs       : none
+// Outputs      : none / the rank
+
+void gen_zipf_init(void)
+{
+    double zeta2 = 1.0 + pow(0.5, gen_theta);
+    uint64_t i;
+
+    gen_zetan = 0;
+    for (i = 1; i <= gen_granules; i++) {
+        gen_zetan += 1.0 / pow((double)i, gen_theta);
+    }
+    gen_alpha = 1.0 / (1.0 - gen_theta);
+    gen_eta = (1.0 - pow(2.0 / gen_granules, 1.0 - gen_theta)) / (1.0 - zeta2 / gen_zetan);
+}
+
+uint64_t gen_zipf(void)
+{
+    double u = gen_uniform(), uz = u * gen_zetan;
+    uint64_t rank;
+
+    if (uz < 1.0) {
+        return 0;
+    }
+    if (uz < 1.0 + pow(0.5, gen_theta)) {
+        return 1 % gen_granules;
+    }
+    rank = (uint64_t)(gen_granules * pow(gen_eta * u - gen_eta + 1.0, gen_alpha));
+    return rank < gen_granules ? rank : gen_granules - 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : gen_pick
+// Description  : Choose the granule the next operation starts at
+//
+// Inputs       : size - the size of the operation
+// Outputs      : the granule, over all objects
+
+uint64_t gen_pick(uint32_t size)
+{
+    uint64_t hot, g;
+
+    switch (gen_pattern) {
+    case GEN_ZIPF:
+        // popular ranks land all over the data, not at its start
+        return (gen_zipf() * LC_GEN_SCRAMBLE) % gen_granules;
+
+    case GEN_SEQUENTIAL:
+        g = gen_cursor;
+        gen_cursor = (gen_cursor + (size + LC_GEN_GRANULE - 1) / LC_GEN_GRANULE) % gen_granules;
+        return g;
+
+    case GEN_HOTSPOT:
+        hot = (uint64_t)(gen_granules * gen_hot);
+        hot = hot ? hot : 1;
+        if (hot == gen_granules || gen_uniform() < gen_hot_share) {
+            return gen_random() % hot;
+        }
+        return hot + gen_random() % (gen_granules - hot);
+
+    default:
+        return gen_random() % gen_granules;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : gen_fill
+// Description  : Produce the current contents of part of an object
+//
+// Inputs       : obj - the object
+//                pos - the offset in it
+//                len - the length
+//                buf - the place for the contents
+// Outputs      : none
+
+void gen_fill(uint32_t obj, uint32_t pos, uint32_t len, char* buf)
+{
+    char granule[LC_GEN_GRANULE];
+    uint64_t g, z;
+    uint32_t off, n, i;
+
+    while (len > 0) {
+        g = gen_starts[obj] + pos / LC_GEN_GRANULE;
+        z = (g << 8 | gen_versions[g]) * 0x9e3779b97f4a7c15ull + 0x2545f4914f6cdd1dull;
+        for (i = 0; i < LC_GEN_GRANULE; i++) {
+            if (i % 8 == 0) {
+                z ^= z >> 29;
+                z *= 0xbf58476d1ce4e5b9ull;
+                z ^= z >> 32;
+            }
+            // printable, no spaces, as the text format wants
+            granule[i] = '!' + (char)(((z >> (i % 8 * 8)) & 0xff) % 94);
+        }
+        off = pos % LC_GEN_GRANULE;
+        n = LC_GEN_GRANULE - off < len ? LC_GEN_GRANULE - off : len;
+        memcpy(buf, granule + off, n);
+        buf += n;
+        pos += n;
+        len -= n;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : gen_emit
+// Description  : Write one operation to the workload
+//
+// Inputs       : op - the operation
+//                obj - the object
+//                pos, size, data - the payload of a read or write
+// Outputs      : none
+
+void gen_emit(int op, uint32_t obj, uint32_t pos, uint32_t size, const char* data)
+{
+    if (gen_text == NULL) {
+        lcloud_wl_add(&gen_bin, op, op == WL_EOF ? NULL : gen_names[obj], pos, size, data);
+    } else if (op == WL_READ || op == WL_WRITE) {
+        fprintf(gen_text, "%s %s %u %u %.*s\n", gen_names[obj], workload_operations_strings[op], pos, size,
+            (int)size, data);
+    } else if (op != WL_EOF) {
+        fprintf(gen_text, "%s %s\n", gen_names[obj], workload_operations_strings[op]);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : gen_run
+// Description  : Generate the whole workload
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int gen_run(void)
+{
+    char buf[CMPSC311_MAX_OPSIZE_MAXIMUM];
+    uint64_t i, g, reads = 0, writes = 0, bytes = 0;
+    uint32_t obj, pos, size, chunk, lo, hi;
+
+    // Lay the objects out, each a whole number of granules
+    gen_names = (char**)calloc(gen_objects, sizeof(char*));
+    gen_sizes = (uint32_t*)calloc(gen_objects, sizeof(uint32_t));
+    gen_starts = (uint64_t*)calloc(gen_objects + 1, sizeof(uint64_t));
+    for (obj = 0; obj < gen_objects; obj++) {
+        gen_names[obj] = (char*)malloc(strlen(gen_prefix) + 16);
+        sprintf(gen_names[obj], "%s-%u", gen_prefix, obj);
+        size = gen_obj_min + (uint32_t)(gen_random() % (gen_obj_max - gen_obj_min + 1));
+        gen_sizes[obj] = (size + LC_GEN_GRANULE - 1) / LC_GEN_GRANULE * LC_GEN_GRANULE;
+        gen_starts[obj + 1] = gen_starts[obj] + gen_sizes[obj] / LC_GEN_GRANULE;
+    }
+    gen_granules = gen_starts[gen_objects];
+    gen_versions = (uint8_t*)calloc(gen_granules, 1);
+    if (gen_pattern == GEN_ZIPF) {
+        gen_zipf_init();
+    }
+    if (gen_text) {
+        fprintf(gen_text, "# LionCloud synthetic workload\n");
+        fprintf(gen_text, "# Objects : %u, %llu bytes\n", gen_objects,
+            (unsigned long long)gen_granules * LC_GEN_GRANULE);
+        fprintf(gen_text, "# Ops     : %llu, %u%% reads, sizes %u:%u\n", (unsigned long long)gen_ops,
+            gen_read_pct, gen_op_min, gen_op_max);
+    }
+
+    // Open every object and write it in full
+    chunk = (gen_op_max + LC_GEN_GRANULE - 1) / LC_GEN_GRANULE * LC_GEN_GRANULE;
+    chunk = chunk > CMPSC311_MAX_OPSIZE_MAXIMUM ? CMPSC311_MAX_OPSIZE_MAXIMUM : chunk;
+    for (obj = 0; obj < gen_objects; obj++) {
+        gen_emit(WL_OPEN, obj, 0, 0, NULL);
+        for (pos = 0; pos < gen_sizes[obj]; pos += size) {
+            size = gen_sizes[obj] - pos < chunk ? gen_sizes[obj] - pos : chunk;
+            gen_fill(obj, pos, size, buf);
+            gen_emit(WL_WRITE, obj, pos, size, buf);
+            writes++;
+            bytes += size;
+        }
+    }
+
+    // Then read and rewrite them
+    for (i = 0; i < gen_ops; i++) {
+        size = gen_op_min + (uint32_t)(gen_random() % (gen_op_max - gen_op_min + 1));
+        g = gen_pick(size);
+        for (lo = 0, hi = gen_objects; hi - lo > 1;) {
+            obj = (lo + hi) / 2;
+            if (gen_starts[obj] <= g) {
+                lo = obj;
+            } else {
+                hi = obj;
+            }
+        }
+        obj = lo;
+        pos = (uint32_t)(g - gen_starts[obj]) * LC_GEN_GRANULE;
+        if (gen_random() % 100 < gen_read_pct) {
+            // reads need not start on a granule
+            pos += (uint32_t)(gen_random() % LC_GEN_GRANULE);
+            size = gen_sizes[obj] - pos < size ? gen_sizes[obj] - pos : size;
+            gen_fill(obj, pos, size, buf);
+            gen_emit(WL_READ, obj, pos, size, buf);
+            reads++;
+        } else {
+            // writes cover whole granules, each one gets new contents
+            size = (size + LC_GEN_GRANULE - 1) / LC_GEN_GRANULE * LC_GEN_GRANULE;
+            size = size > chunk ? chunk : size;
+            size = gen_sizes[obj] - pos < size ? gen_sizes[obj] - pos : size;
+            for (g = 0; g < size / LC_GEN_GRANULE; g++) {
+                gen_versions[gen_starts[obj] + pos / LC_GEN_GRANULE + g]++;
+            }
+            gen_fill(obj, pos, size, buf);
+            gen_emit(WL_WRITE, obj, pos, size, buf);
+            writes++;
+        }
+        bytes += size;
+    }
+
+    // Close everything
+    for (obj = 0; obj < gen_objects; obj++) {
+        gen_emit(WL_CLOSE, obj, 0, 0, NULL);
+    }
+    gen_emit(WL_EOF, 0, 0, 0, NULL);
+    logMessage(LOG_OUTPUT_LEVEL, "Generated %u objects (%llu bytes), %llu reads and %llu writes moving %llu bytes",
+        gen_objects, (unsigned long long)gen_granules * LC_GEN_GRANULE, (unsigned long long)reads,
+        (unsigned long long)writes, (unsigned long long)bytes);
+
+    for (obj = 0; obj < gen_objects; obj++) {
+        free(gen_names[obj]);
+    }
+    free(gen_names);
+    free(gen_sizes);
+    free(gen_starts);
+    free(gen_versions);
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : main
+// Description  : The main function for the workload generator
+//
+// Inputs       : argc - the number of command line parameters
+//                argv - the parameters
+// Outputs      : 0 if successful, -1 if failure
+
+int main(int argc, char* argv[])
+{
+    // Local variables
+    int ch, verbose = 0, log_initialized = 0, binary = 0, ret;
+    char* outbuf = NULL;
+
+    // Process the command line parameters
+    while ((ch = getopt(argc, argv, LCLOUD_GEN_ARGUMENTS)) != -1) {
+
+        switch (ch) {
+        case 'h': // Help, print usage
+            fprintf(stderr, USAGE);
+            return (-1);
+
+        case 'v': // Verbose Flag
+            verbose = 1;
+            break;
+
+        case 'l': // Set the log filename
+            initializeLogWithFilename(optarg);
+            log_initialized = 1;
+            break;
+
+        case 'o': // Number of objects
+            if ((gen_objects = atoi(optarg)) < 1 || gen_objects > WL_MAX_OBJS) {
+                fprintf(stderr, "Bad object count (%s), aborting.\n", optarg);
+                return (-1);
+            }
+            break;
+
+        case 'n': // Number of operations
+            gen_ops = strtoull(optarg, NULL, 10);
+            break;
+
+        case 's': // Object sizes
+            if (gen_range(optarg, &gen_obj_min, &gen_obj_max, UINT32_MAX - LC_GEN_GRANULE)) {
+                return (-1);
+            }
+            break;
+
+        case 'S': // Operation sizes
+            if (gen_range(optarg, &gen_op_min, &gen_op_max, CMPSC311_MAX_OPSIZE_MAXIMUM)) {
+                return (-1);
+            }
+            break;
+
+        case 'a': // Access pattern
+            if (strcmp(optarg, "zipf") == 0) {
+                gen_pattern = GEN_ZIPF;
+            } else if (strcmp(optarg, "uniform") == 0) {
+                gen_pattern = GEN_UNIFORM;
+            } else if (strcmp(optarg, "sequential") == 0) {
+                gen_pattern = GEN_SEQUENTIAL;
+            } else if (strcmp(optarg, "hotspot") == 0) {
+                gen_pattern = GEN_HOTSPOT;
+            } else {
+                fprintf(stderr, "Unknown access pattern (%s), aborting.\n", optarg);
+                return (-1);
+            }
+            break;
+
+        case 'z': // Zipf skew
+            gen_theta = atof(optarg);
+            if (gen_theta <= 0.0 || gen_theta >= 1.0) {
+                fprintf(stderr, "Bad zipf skew (%s), aborting.\n", optarg);
+                return (-1);
+            }
+            break;
+
+        case 'H': // Hotspot
+            if (sscanf(optarg, "%lf:%lf", &gen_hot, &gen_hot_share) != 2 || gen_hot <= 0.0 || gen_hot > 1.0
+                || gen_hot_share < 0.0 || gen_hot_share > 1.0) {
+                fprintf(stderr, "Bad hotspot (%s), aborting.\n", optarg);
+                return (-1);
+            }
+            break;
+
+        case 'r': // Read percentage
+            if ((gen_read_pct = atoi(optarg)) > 100) {
+                fprintf(stderr, "Bad read percentage (%s), aborting.\n", optarg);
+                return (-1);
+            }
+            break;
+
+        case 'x': // Seed
+            gen_seed = strtoull(optarg, NULL, 10);
+            break;
+
+        case 'b': // Binary output
+            binary = 1;
+            break;
+
+        case 'p': // Prefix of the object names
+            if (strlen(optarg) > 100) {
+                fprintf(stderr, "Prefix too long (%s), aborting.\n", optarg);
+                return (-1);
+            }
+            gen_prefix = optarg;
+            break;
+
+        default: // Default (unknown)
+            fprintf(stderr, "Unknown command line option (%c), aborting.\n", ch);
+            return (-1);
+        }
+    }
+
+    // Setup the log as needed
+    if (!log_initialized) {
+        initializeLogWithFilehandle(CMPSC311_LOG_STDERR);
+    }
+    if (verbose) {
+        enableLogLevels(LOG_INFO_LEVEL);
+    }
+
+    // The output file should be the next option
+    if (argv[optind] == NULL) {
+        fprintf(stderr, "Missing command line parameters, use -h to see usage, aborting.\n");
+        return (-1);
+    }
+
+    // Open the output, generate and close it
+    if (binary) {
+        if (lcloud_wl_begin(&gen_bin, argv[optind])) {
+            return (-1);
+        }
+    } else {
+        if ((gen_text = fopen(argv[optind], "w")) == NULL) {
+            logMessage(LOG_ERROR_LEVEL, "Failed creating [%s]", argv[optind]);
+            return (-1);
+        }
+        outbuf = (char*)malloc(LC_GEN_OUTBUF);
+        setvbuf(gen_text, outbuf, _IOFBF, LC_GEN_OUTBUF);
+    }
+    ret = gen_run();
+    if (binary) {
+        ret = lcloud_wl_end(&gen_bin, ret == 0);
+    } else {
+        if (ferror(gen_text) || fclose(gen_text) != 0) {
+            logMessage(LOG_ERROR_LEVEL, "Failed writing [%s]", argv[optind]);
+            ret = -1;
+        }
+        free(outbuf);
+    }
+
+    // Do some cleanup
+    freeLogRegistrations();
+    return (ret);
+}
@@ -0,0 +1,158 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : lcloud_hist.c
+//  Description    : This is the latency histogram used to measure the
+//                   LionCloud filesystem. Values below 32 have a bucket
+//                   each. Above that, every power of two is split into 32
+//                   equal buckets, so the relative error is bounded and
+//                   the whole 64 bit range fits in a fixed array.
+//
+//   Author        : Tzu Chieh Huang
+//   Last Modified : 18th Oct 2026
+//
+
+// Includes
+#include <string.h>
+#include <time.h>
+#include <lcloud_hist.h>
+
+//
+// Functions
+
+// Function     : lcloud_hist_bucket / lcloud_hist_value
+// Description  : map a value to its bucket / a bucket to the highest value
+//                it holds
+// Inputs       : v - the value / i - the bucket
+// Outputs      : the bucket / the value
+static int lcloud_hist_bucket(uint64_t v)
+{
+    int msb;
+
+    if (v < (1 << LC_HIST_SUB_BITS)) {
+        return (int)v;
+    }
+    msb = 63 - __builtin_clzll(v);
+    return ((msb - LC_HIST_SUB_BITS + 1) << LC_HIST_SUB_BITS)
+        + (int)((v >> (msb - LC_HIST_SUB_BITS)) & ((1 << LC_HIST_SUB_BITS) - 1));
+}
+
+static uint64_t lcloud_hist_value(int i)
+{
+    int range = i >> LC_HIST_SUB_BITS;
+    uint64_t sub = i & ((1 << LC_HIST_SUB_BITS) - 1);
+
+    if (range == 0) {
+        return sub;
+    }
+    return (((1 << LC_HIST_SUB_BITS) + sub + 1) << (range - 1)) - 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_hist_now
+// Description  : Read the monotonic clock
+//
+// Inputs       : none
+// Outputs      : the time in nanoseconds
+
+uint64_t lcloud_hist_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_hist_init
+// Description  : Empty a histogram
+//
+// Inputs       : h - the histogram
+// Outputs      : none
+
+void lcloud_hist_init(lc_hist* h)
+{
+    memset(h, 0, sizeof(*h));
+    h->min = UINT64_MAX;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_hist_record
+// Description  : Count one value
+//
+// Inputs       : h - the histogram
+//                v - the value
+// Outputs      : none
+
+void lcloud_hist_record(lc_hist* h, uint64_t v)
+{
+    h->buckets[lcloud_hist_bucket(v)]++;
+    h->count++;
+    h->total += v;
+    if (v < h->min) {
+        h->min = v;
+    }
+    if (v > h->max) {
+        h->max = v;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_hist_merge
+// Description  : Add the values of one histogram to another
+//
+// Inputs       : to - the histogram to add to
+//                from - the histogram to add
+// Outputs      : none
+
+void lcloud_hist_merge(lc_hist* to, const lc_hist* from)
+{
+    int i;
+
+    for (i = 0; i < LC_HIST_BUCKETS; i++) {
+        to->buckets[i] += from->buckets[i];
+    }
+    to->count += from->count;
+    to->total += from->total;
+    if (from->min < to->min) {
+        to->min = from->min;
+    }
+    if (from->max > to->max) {
+        to->max = from->max;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_hist_percentile
+// Description  : Find the value at or below which a share of the values fall
+//
+// Inputs       : h - the histogram
+//                p - the share, in percent
+// Outputs      : the value, 0 if the histogram is empty
+
+uint64_t lcloud_hist_percentile(const lc_hist* h, double p)
+{
+    uint64_t want, seen = 0, v;
+    int i;
+
+    if (h->count == 0) {
+        return 0;
+    }
+    want = (uint64_t)(p / 100.0 * h->count);
+    if (want < p / 100.0 * h->count || want == 0) {
+        want++;
+    }
+    for (i = 0; i < LC_HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= want) {
+            // report no more than what was actually seen
+            v = lcloud_hist_value(i);
+            return v > h->max ? h->max : v;
+        }
+    }
+    return h->max;
+}
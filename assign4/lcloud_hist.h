@@ -0,0 +1,49 @@
+#ifndef LCLOUD_HIST_INCLUDED
+#define LCLOUD_HIST_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : lcloud_hist.h
+//  Description    : This is the latency histogram used to measure the
+//                   LionCloud filesystem.
+//
+//   Author        : Tzu Chieh Huang
+//   Last Modified : 18th Oct 2026
+//
+
+// Includes
+#include <stdint.h>
+
+// Defines
+#define LC_HIST_SUB_BITS 5 // 32 buckets per power of two, within about 3%
+#define LC_HIST_RANGES 60 // enough powers of two for any 64 bit value
+#define LC_HIST_BUCKETS (LC_HIST_RANGES << LC_HIST_SUB_BITS)
+
+// Type definitions
+typedef struct {
+    uint64_t count;
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[LC_HIST_BUCKETS];
+} lc_hist;
+
+//
+// Functional Prototypes
+
+uint64_t lcloud_hist_now( void );
+    // Monotonic time in nanoseconds
+
+void lcloud_hist_init( lc_hist *h );
+    // Empty a histogram
+
+void lcloud_hist_record( lc_hist *h, uint64_t v );
+    // Count one value
+
+void lcloud_hist_merge( lc_hist *to, const lc_hist *from );
+    // Add the values of one histogram to another
+
+uint64_t lcloud_hist_percentile( const lc_hist *h, double p );
+    // The value at or below which p percent of the values fall, 0 if empty
+
+#endif
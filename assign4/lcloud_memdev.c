@@ -0,0 +1,159 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : lcloud_memdev.c
+//  Description    : This is an in-memory stand-in for the LionCloud bus. It
+//                   implements the client API of lcloud_network.h without
+//                   a server, so the filesystem can be measured on its own.
+//                   Linked instead of lcloud_client.c.
+//
+//   Author        : Tzu Chieh Huang
+//   Last Modified : 18th Oct 2026
+//
+
+// Includes
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <lcloud_network.h>
+#include <lcloud_stats.h>
+#include <lcloud_trace.h>
+
+// Defines
+#define LC_MEMDEV_FIRST 3 // the devices, ids 3 and 4
+#define LC_MEMDEV_COUNT 2
+#define LC_MEMDEV_SECTORS 64
+#define LC_MEMDEV_BLOCKS 128
+
+//
+// Global Data
+
+// the blocks of every device, allocated at the first power on and kept
+// across power cycles like real devices
+char* memdev_store;
+int memdev_delay_us[16];
+pthread_mutex_t memdev_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//
+// Functions
+
+// Function     : memdev_response
+// Description  : build a successful response to a request
+// Inputs       : opcode - the request's opcode
+//                d0, d1 - the data registers
+// Outputs      : the response
+static LCloudRegisterFrame memdev_response(int opcode, int d0, int d1)
+{
+    return ((LCloudRegisterFrame)1 << 60) | ((LCloudRegisterFrame)1 << 56) | ((LCloudRegisterFrame)opcode << 48)
+        | ((LCloudRegisterFrame)(d0 & 0xffff) << 16) | (LCloudRegisterFrame)(d1 & 0xffff);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_lcloud_bus_request
+// Description  : Carry out a bus request on the in-memory devices
+//
+// Inputs       : reg - the request registers
+//                buf - the block read or written (XFER)
+// Outputs      : the response, 0 if the request fails
+
+LCloudRegisterFrame client_lcloud_bus_request(LCloudRegisterFrame reg, void* buf)
+{
+    int opcode = (reg >> 48) & 0xff, device = (reg >> 40) & 0xff, op = (reg >> 32) & 0xff;
+    int sector = (reg >> 16) & 0xffff, block = reg & 0xffff;
+    LCloudRegisterFrame resp = 0;
+    uint64_t start = (lcloud_stats_on || lcloud_trace_on) ? lcloud_hist_now() : 0, end;
+    char* data;
+
+    pthread_mutex_lock(&memdev_lock);
+    switch (opcode) {
+    case LC_POWER_ON:
+        if (memdev_store == NULL) {
+            memdev_store = (char*)calloc((size_t)LC_MEMDEV_COUNT * LC_MEMDEV_SECTORS * LC_MEMDEV_BLOCKS,
+                LC_DEVICE_BLOCK_SIZE);
+        }
+        resp = memdev_store ? memdev_response(opcode, 0, 0) : 0;
+        break;
+
+    case LC_DEVPROBE:
+        resp = memdev_response(opcode, ((1 << LC_MEMDEV_COUNT) - 1) << LC_MEMDEV_FIRST, 0);
+        break;
+
+    case LC_DEVINIT:
+        if (device >= LC_MEMDEV_FIRST && device < LC_MEMDEV_FIRST + LC_MEMDEV_COUNT) {
+            resp = memdev_response(opcode, LC_MEMDEV_SECTORS, LC_MEMDEV_BLOCKS);
+        }
+        break;
+
+    case LC_BLOCK_XFER:
+        if (memdev_store == NULL || buf == NULL || device < LC_MEMDEV_FIRST
+            || device >= LC_MEMDEV_FIRST + LC_MEMDEV_COUNT || sector >= LC_MEMDEV_SECTORS
+            || block >= LC_MEMDEV_BLOCKS) {
+            break;
+        }
+        data = memdev_store
+            + ((size_t)((device - LC_MEMDEV_FIRST) * LC_MEMDEV_SECTORS + sector) * LC_MEMDEV_BLOCKS + block)
+                * LC_DEVICE_BLOCK_SIZE;
+        if (op == LC_XFER_READ) {
+            memcpy(buf, data, LC_DEVICE_BLOCK_SIZE);
+        } else {
+            memcpy(data, buf, LC_DEVICE_BLOCK_SIZE);
+        }
+        if (memdev_delay_us[device]) {
+            usleep(memdev_delay_us[device]);
+        }
+        resp = memdev_response(opcode, 0, 0);
+        break;
+
+    default: // power off and anything else just succeeds
+        resp = memdev_response(opcode, 0, 0);
+        break;
+    }
+    pthread_mutex_unlock(&memdev_lock);
+    if (start) {
+        end = lcloud_hist_now();
+        lcloud_stats_bus(reg, resp, start, end);
+        lcloud_trace_bus(reg, resp, start, end);
+    }
+    return resp;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_lcloud_bus_batch
+// Description  : Carry out a window of block transfers in order
+//
+// Inputs       : regs - the block transfer requests
+//                bufs - the block of each request
+//                resps - set to the response of each request
+//                n - number of requests
+// Outputs      : 0 if successful, -1 if failure
+
+int client_lcloud_bus_batch(LCloudRegisterFrame* regs, void** bufs, LCloudRegisterFrame* resps, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        resps[i] = client_lcloud_bus_request(regs[i], bufs[i]);
+    }
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_lcloud_set_delay
+// Description  : Make every block transfer of a device take longer
+//
+// Inputs       : device - the device id
+//                usec - the added delay in microseconds
+// Outputs      : 0 if successful, -1 if the device id is invalid
+
+int client_lcloud_set_delay(int device, int usec)
+{
+    if (device < 0 || device >= 16 || usec < 0) {
+        return -1;
+    }
+    memdev_delay_us[device] = usec;
+    return 0;
+}
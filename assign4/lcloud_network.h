@@ -31,5 +31,14 @@ LCloudRegisterFrame client_lcloud_bus_request(LCloudRegisterFrame reg, void *buf
 	// This is the implementation of the client operation, as implemented 
 	//  by the 311 student code.
 
+int client_lcloud_bus_batch(LCloudRegisterFrame *regs, void **bufs,
+	LCloudRegisterFrame *resps, int n);
+	// Send a window of block transfers back to back and read their
+	//  responses in order.
+
+int client_lcloud_set_delay(int device, int usec);
+	// Add a delay to every block transfer of a device, to emulate a
+	//  slower device.
+
 
 #endif
@@ -15,6 +15,9 @@
 #include <cmpsc311_workload.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
@@ -25,29 +28,133 @@
 // Project Includes
 #include <lcloud_controller.h>
 #include <lcloud_filesys.h>
+#include <lcloud_hist.h>
+#include <lcloud_network.h>
+#include <lcloud_stats.h>
+#include <lcloud_trace.h>
 #include <lcloud_support.h>
+#include <lcloud_workload.h>
 
 // Defines
-#define LCLOUD_ARGUMENTS "hvl:x:"
-#define USAGE                                                       \
-    "USAGE: lcloud_sim [-h] [-v] [-l <logfile>] <workload-file>\n"  \
-    "\n"                                                            \
-    "where:\n"                                                      \
-    "    -h - help mode (display this message)\n"                   \
-    "    -v - verbose output\n"                                     \
-    "    -l - write log messages to the filename <logfile>\n"       \
-    "\n"                                                            \
-    "    <workload-file> - file contain the workload to simulate\n" \
+#define LCLOUD_ARGUMENTS "hvl:w:x:d:br:u:t:c:ps:T:"
+#define USAGE                                                                  \
+    "USAGE: lcloud_sim [-h] [-v] [-l <logfile>] [-w <mode>] [-d <delays>]\n"   \
+    "                  [-b] [-r <repeats>] [-u <warmups>] [-t <threads>]\n"    \
+    "                  [-p] [-s <stats-file>] [-T <trace-file>]\n"             \
+    "                  [-c <compiled-file>] <workload-file> ...\n"             \
+    "\n"                                                                       \
+    "where:\n"                                                                 \
+    "    -h - help mode (display this message)\n"                              \
+    "    -v - verbose output\n"                                                \
+    "    -l - write log messages to the filename <logfile>\n"                  \
+    "    -w - write modes, inplace (default) or log, optionally with dedup,\n" \
+    "         compress, sparse, defrag, prefetch and tier\n"                   \
+    "    -d - slow down devices, a comma separated list of <device>:<usec>\n"  \
+    "         added to each block transfer\n"                                  \
+    "    -b - benchmark mode, time every operation and print the throughput\n" \
+    "         and latency percentiles as JSON\n"                               \
+    "    -r - number of measured runs of the workload (default 1)\n"           \
+    "    -u - number of unmeasured warm-up runs before them (default 0)\n"     \
+    "    -t - number of threads replaying at the same time, each one with\n"   \
+    "         its own files (default one per workload file)\n"                 \
+    "    -p - pipelined replay, each thread parses and verifies on two more\n" \
+    "         threads so that it only issues the filesystem calls\n"           \
+    "    -s - count and time every filesystem call, bus request and device\n"  \
+    "         transfer, and write the statistics to <stats-file> as JSON\n"    \
+    "    -T - trace every filesystem call, cache lookup and bus request,\n"    \
+    "         and write the spans to <trace-file> in Chrome trace format\n"    \
+    "    -c - compile the workload into <compiled-file> and exit, compiled\n"  \
+    "         files replay without parsing and are accepted as workloads\n"    \
+    "\n"                                                                       \
+    "    <workload-file> - file contain the workload to simulate, with\n"      \
+    "                      several files the threads take them in turn\n"      \
     "\n"
 
+#define SIM_OPEN 0 // operation types timed in benchmark mode
+#define SIM_READ 1
+#define SIM_WRITE 2
+#define SIM_SEEK 3
+#define SIM_CLOSE 4
+#define SIM_OPS 5
+#define SIM_MAX_THREADS 64
+#define SIM_PIPE_SLOTS 64 // operations in flight between the pipeline stages
+#define SIM_PIPE_SPINS 1000 // polls before a waiting stage starts yielding
+
+// Type definitions
+typedef struct {
+    lc_hist ops[SIM_OPS]; // latency in nanoseconds per operation type
+} sim_bench;
+
+typedef struct {
+    int op; // WL_OPEN, WL_WRITE, WL_READ, WL_CLOSE or WL_EOF
+    const char* objname;
+    int pos;
+    int size;
+    const char* data; // points into the parsed line or the compiled file
+} sim_op;
+
+typedef struct {
+    char* filename;
+    LcFHandle fhandle;
+    int pos;
+} fsysdata;
+
+typedef struct {
+    int binary; // compiled, replayed from the mapping
+    lc_workload wl;
+    uint32_t next; // next compiled operation
+    workload_state state; // text parser state
+} sim_source;
+
+typedef struct {
+    workload_operation operation; // parsed text operation
+    sim_op op;
+    char buf[LC_MAX_OPERATION_SIZE]; // data read, for the verifier
+} sim_slot;
+
+// The stages share one ring of slots. Each stage publishes how many
+// operations it has finished and only the stage behind it reads that, so
+// every counter has one writer and no locks are needed.
+typedef struct {
+    sim_slot slots[SIM_PIPE_SLOTS];
+    sim_source* src;
+    atomic_uint_fast64_t parsed;
+    atomic_uint_fast64_t executed;
+    atomic_uint_fast64_t verified;
+    atomic_int failed;
+} sim_pipe;
+
+typedef struct {
+    char* wload; // the workload file
+    char prefix[16]; // put in front of object names, keeps threads apart
+    sim_bench* bench; // latency statistics, NULL when not measuring
+    int counts[SIM_OPS]; // operations done per type
+    uint64_t ops; // operations done
+    uint64_t bytes; // bytes read and written
+    uint64_t elapsed; // nanoseconds taken
+    int ret; // result of the simulation
+} sim_thread;
+
 //
 // Global Data
 int verbose;
+const char* sim_op_names[SIM_OPS] = { "open", "read", "write", "seek", "close" };
+pthread_mutex_t sim_parse_lock = PTHREAD_MUTEX_INITIALIZER;
+int sim_pipelined = 0; // parse and verify on their own threads
 
 //
 // Functional Prototypes
 
-int simulateLionCloud(char* wload); // LionCloud simulation
+int simulateLionCloud(sim_thread* t); // LionCloud simulation
+int replayLionCloud(char** wloads, int nwloads, sim_thread* threads, int nthreads, int measure); // one parallel run
+int benchmarkLionCloud(char** wloads, int nwloads, int nthreads, int warmups, int repeats); // timed simulation
+void simTime(sim_thread* t, int op, uint64_t start, int bytes); // record an operation
+int simSourceOpen(sim_source* src, char* wload); // open a workload, text or compiled
+int simSourceNext(sim_source* src, workload_operation* operation, sim_op* op); // next operation
+void simSourceClose(sim_source* src); // close a workload
+int simExecute(sim_thread* t, AssocArray* fhTable, sim_op* op, char* buf); // do one operation
+int simVerify(sim_op* op, char* buf); // check the data of a read
+int simPipeline(sim_thread* t, sim_source* src, AssocArray* fhTable); // pipelined replay
 
 //
 // Functions
@@ -65,7 +172,11 @@ int main(int argc, char* argv[])
 {
 
     // Local variables
-    int ch, verbose = 0, log_initialized = 0;
+    int ch, verbose = 0, log_initialized = 0, mode = LC_MODE_INPLACE;
+    int benchmark = 0, repeats = 1, warmups = 0, nthreads = 0, ret, i;
+    sim_thread* threads;
+    char *opt, *compile = NULL, *stats = NULL, *trace = NULL;
+    FILE* out;
 
     // Process the command line parameters
     while ((ch = getopt(argc, argv, LCLOUD_ARGUMENTS)) != -1) {
@@ -84,6 +195,84 @@ int main(int argc, char* argv[])
             log_initialized = 1;
             break;
 
+        case 'w': // Set the write mode, a comma separated list
+            for (opt = strtok(optarg, ","); opt != NULL; opt = strtok(NULL, ",")) {
+                if (strcmp(opt, "log") == 0) {
+                    mode |= LC_MODE_LOG;
+                } else if (strcmp(opt, "dedup") == 0) {
+                    mode |= LC_MODE_DEDUP;
+                } else if (strcmp(opt, "compress") == 0) {
+                    mode |= LC_MODE_COMPRESS;
+                } else if (strcmp(opt, "sparse") == 0) {
+                    mode |= LC_MODE_SPARSE;
+                } else if (strcmp(opt, "defrag") == 0) {
+                    mode |= LC_MODE_DEFRAG;
+                } else if (strcmp(opt, "prefetch") == 0) {
+                    mode |= LC_MODE_PREFETCH;
+                } else if (strcmp(opt, "tier") == 0) {
+                    mode |= LC_MODE_TIER;
+                } else if (strcmp(opt, "inplace") != 0) {
+                    fprintf(stderr, "Unknown write mode (%s), aborting.\n", opt);
+                    return (-1);
+                }
+            }
+            lcsetmode(mode);
+            break;
+
+        case 'd': // Slow down devices, a comma separated list of device:usec
+            for (opt = strtok(optarg, ","); opt != NULL; opt = strtok(NULL, ",")) {
+                int device, usec;
+                if (sscanf(opt, "%d:%d", &device, &usec) != 2
+                    || client_lcloud_set_delay(device, usec) != 0) {
+                    fprintf(stderr, "Bad device delay (%s), aborting.\n", opt);
+                    return (-1);
+                }
+            }
+            break;
+
+        case 'b': // Benchmark mode
+            benchmark = 1;
+            break;
+
+        case 'r': // Number of measured runs
+            if ((repeats = atoi(optarg)) < 1) {
+                fprintf(stderr, "Bad repeat count (%s), aborting.\n", optarg);
+                return (-1);
+            }
+            break;
+
+        case 'p': // Pipelined replay
+            sim_pipelined = 1;
+            break;
+
+        case 's': // Record and write the statistics
+            stats = optarg;
+            lcloud_stats_enable(1);
+            break;
+
+        case 'T': // Record and write the trace
+            trace = optarg;
+            lcloud_trace_enable(1);
+            break;
+
+        case 'c': // Compile the workload
+            compile = optarg;
+            break;
+
+        case 't': // Number of replaying threads
+            if ((nthreads = atoi(optarg)) < 1 || nthreads > SIM_MAX_THREADS) {
+                fprintf(stderr, "Bad thread count (%s), aborting.\n", optarg);
+                return (-1);
+            }
+            break;
+
+        case 'u': // Number of warm-up runs
+            if ((warmups = atoi(optarg)) < 0) {
+                fprintf(stderr, "Bad warm-up count (%s), aborting.\n", optarg);
+                return (-1);
+            }
+            break;
+
         default: // Default (unknown)
             fprintf(stderr, "Unknown command line option (%c), aborting.\n", ch);
             return (-1);
@@ -108,8 +297,62 @@ int main(int argc, char* argv[])
         return (-1);
     }
 
+    // Compile the workload instead of running it
+    if (compile) {
+        ret = lcloud_wl_convert(argv[optind], compile);
+        freeLogRegistrations();
+        return (ret);
+    }
+
+    // One thread per workload file unless told otherwise
+    if (nthreads == 0) {
+        nthreads = argc - optind < SIM_MAX_THREADS ? argc - optind : SIM_MAX_THREADS;
+    }
+
     // Run the simulation
-    if (simulateLionCloud(argv[optind]) == 0) {
+    if (benchmark) {
+        ret = benchmarkLionCloud(argv + optind, argc - optind, nthreads, warmups, repeats);
+    } else {
+        threads = calloc(nthreads, sizeof(sim_thread));
+        for (ret = 0; ret == 0 && repeats-- > 0;) {
+            ret = replayLionCloud(argv + optind, argc - optind, threads, nthreads, 0);
+        }
+        if (ret == 0 && nthreads > 1) {
+            uint64_t ops = 0, bytes = 0, elapsed = 0;
+            for (i = 0; i < nthreads; i++) {
+                logMessage(LOG_OUTPUT_LEVEL, "Thread %d: %llu ops, %.3f s, %.1f ops/s, %.3f MB/s", i,
+                    (unsigned long long)threads[i].ops, threads[i].elapsed / 1e9,
+                    threads[i].ops / (threads[i].elapsed / 1e9),
+                    threads[i].bytes / (threads[i].elapsed / 1e9) / (1024 * 1024));
+                ops += threads[i].ops;
+                bytes += threads[i].bytes;
+                elapsed = threads[i].elapsed > elapsed ? threads[i].elapsed : elapsed;
+            }
+            logMessage(LOG_OUTPUT_LEVEL, "All %d threads: %llu ops, %.3f s, %.1f ops/s, %.3f MB/s",
+                nthreads, (unsigned long long)ops, elapsed / 1e9, ops / (elapsed / 1e9),
+                bytes / (elapsed / 1e9) / (1024 * 1024));
+        }
+        free(threads);
+    }
+    if (stats) {
+        if ((out = fopen(stats, "w")) == NULL || lcloud_stats_dump(out) != 0) {
+            logMessage(LOG_ERROR_LEVEL, "Failure writing the statistics to %s", stats);
+            ret = -1;
+        }
+        if (out) {
+            fclose(out);
+        }
+    }
+    if (trace) {
+        if ((out = fopen(trace, "w")) == NULL || lcloud_trace_dump(out) != 0) {
+            logMessage(LOG_ERROR_LEVEL, "Failure writing the trace to %s", trace);
+            ret = -1;
+        }
+        if (out) {
+            fclose(out);
+        }
+    }
+    if (ret == 0) {
         logMessage(LOG_INFO_LEVEL, "LionCloud simulation completed successfully!!!\n\n");
     } else {
         logMessage(LOG_INFO_LEVEL, "LionCloud simulation failed.\n\n");
@@ -128,196 +371,712 @@ int main(int argc, char* argv[])
 // Description  : The main control loop for the processing of the LionCloud
 //                simulation (which calls the student code).
 //
-// Inputs       : wload - the name of the workload file
+// Inputs       : t - the workload file, the prefix for its object names
+//                      and where to keep the statistics
 // Outputs      : 0 if successful test, -1 if failure
 
-int simulateLionCloud(char* wload)
+int simulateLionCloud(sim_thread* t)
 {
 
-    /* Local types */
-    typedef struct {
-        char* filename;
-        LcFHandle fhandle;
-        int pos;
-    } fsysdata;
-
     /* Local variables */
-    workload_state state;
     workload_operation operation;
-    LcFHandle fh;
+    sim_source src;
+    sim_op op;
     AssocArray fhTable;
     char buf[LC_MAX_OPERATION_SIZE];
-    int opens, reads, writes, seeks, closes;
-    fsysdata* fdata;
 
-    /* Init fh table, open the workload for processing */
+    /* Init fh table, open the workload for processing, compiled or text */
     init_assoc(&fhTable, stringCompareCallback, pointerCompareCallback);
-    if (openCmpsc311Workload(&state, wload)) {
-        logMessage(LOG_ERROR_LEVEL, "CMPSC311 lcloud workload: failed opening workload [%s]", wload);
+    if (simSourceOpen(&src, t->wload)) {
         return (-1);
     }
 
     /* Loop until we are done with the workload */
-    logMessage(LcSimulatorLLevel, "CMPSC311 lcloud : executing workload [%s]", state.filename);
-    do {
-
-        /* Get the next operation to process */
-        if (readCmpsc311Workload(&state, &operation)) {
-            logMessage(LOG_ERROR_LEVEL, "CMPSC311 workload unit test failed at line %d, get op", state.lineno);
+    logMessage(LcSimulatorLLevel, "CMPSC311 lcloud : executing workload [%s]", t->wload);
+    if (sim_pipelined) {
+        if (simPipeline(t, &src, &fhTable)) {
             return (-1);
         }
+    } else {
+        do {
 
-        /* Verbose log the operation */
-        if ((operation.op == WL_READ) || (operation.op == WL_WRITE)) {
-            logMessage(LcSimulatorLLevel, "CMPSCS311 workload op: %s %s off=%d, sz=%d [%.20s]", operation.objname,
-                workload_operations_strings[operation.op], operation.pos, operation.size, operation.data);
-        } else {
-            logMessage(LcSimulatorLLevel, "CMPSCS311 workload op: %s %s", operation.objname,
-                workload_operations_strings[operation.op]);
-        }
+            /* Get the next operation, execute it and check what it read */
+            if (simSourceNext(&src, &operation, &op) || simExecute(t, &fhTable, &op, buf)
+                || (op.op == WL_READ && simVerify(&op, buf))) {
+                return (-1);
+            }
 
-        /* Switch on the operation type */
-        switch (operation.op) {
+        } while (op.op < WL_EOF);
+    }
 
-        case WL_OPEN: /* Open the file for reading/writing, check error */
+    /* Log, close workload and delete the local file, return successfully  */
+    logMessage(LcSimulatorLLevel, "Processed %d opens, %d reads, %d writes, %d seeks, %d closes",
+        t->counts[SIM_OPEN], t->counts[SIM_READ], t->counts[SIM_WRITE], t->counts[SIM_SEEK],
+        t->counts[SIM_CLOSE]);
+    simSourceClose(&src);
+    return (0);
+}
 
-            /* Open the file for reading */
-            if ((fh = lcopen(operation.objname)) == -1) {
-                logMessage(LOG_ERROR_LEVEL, "CMPSC311 error opening file [%s], aborting", operation.objname);
-                return (-1);
-            }
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simSourceOpen
+// Description  : Open a workload for replay, mapping it if it is compiled
+//
+// Inputs       : src - the source to set up
+//                wload - the name of the workload file
+// Outputs      : 0 if successful, -1 if failure
 
-            /* Setup the structure */
-            fdata = malloc(sizeof(fsysdata));
-            fdata->filename = strdup(operation.objname);
-            fdata->fhandle = fh;
-            fdata->pos = 0;
+int simSourceOpen(sim_source* src, char* wload)
+{
+    int ret;
 
-            /* Insert the file into the table */
-            insert_assoc(&fhTable, fdata->filename, fdata);
-            logMessage(LcSimulatorLLevel, "Open file [%s]", fdata->filename);
-            opens++;
-            break;
+    src->next = 0;
+    if ((ret = lcloud_wl_open(&src->wl, wload)) == 0) {
+        src->binary = 1;
+        return (0);
+    }
+    src->binary = 0;
+    if (ret == 1) {
+        pthread_mutex_lock(&sim_parse_lock);
+        ret = openCmpsc311Workload(&src->state, wload);
+        pthread_mutex_unlock(&sim_parse_lock);
+    }
+    if (ret) {
+        logMessage(LOG_ERROR_LEVEL, "CMPSC311 lcloud workload: failed opening workload [%s]", wload);
+        return (-1);
+    }
+    return (0);
+}
 
-        case WL_READ: /* Read a block of data from the file */
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simSourceNext
+// Description  : Get the next operation, in place from a compiled workload or
+//                parsed into the caller's buffer
+//
+// Inputs       : src - the source
+//                operation - buffer for a parsed text operation
+//                op - the operation view to fill in
+// Outputs      : 0 if successful, -1 if failure
 
-            /* Find the file for processing */
-            if ((fdata = find_assoc(&fhTable, operation.objname)) == NULL) {
-                logMessage(LOG_ERROR_LEVEL, "CMPSC311 error reading unknown file [%s], aborting",
-                    operation.objname);
-                return (-1);
-            }
+int simSourceNext(sim_source* src, workload_operation* operation, sim_op* op)
+{
+    const lc_wl_op* wop;
+    int ret;
 
-            /* If the position within the file is not a read location, seek */
-            if (fdata->pos != operation.pos) {
-                if (lcseek(fdata->fhandle, operation.pos) != operation.pos) {
-                    logMessage(LOG_ERROR_LEVEL, "CMPSC311 error seek failed [%s, pos=%d], aborting",
-                        operation.objname, operation.pos);
-                    return (-1);
-                }
-                fdata->pos = operation.pos;
-                seeks++;
-            }
+    if (src->binary) {
+        wop = &src->wl.ops[src->next++];
+        op->op = wop->op;
+        op->objname = wop->op == WL_EOF ? "" : lcloud_wl_name(&src->wl, wop);
+        op->pos = wop->pos;
+        op->size = wop->size;
+        op->data = lcloud_wl_data(&src->wl, wop);
+        return (0);
+    }
 
-            /* Now do the read from the file */
-            if (lcread(fdata->fhandle, buf, operation.size) != operation.size) {
-                logMessage(LOG_ERROR_LEVEL, "CMPSC311 error read failed [%s, pos=%d, size=%d], aborting",
-                    operation.objname, operation.pos, operation.size);
-                return (-1);
-            }
+    /* The parser is not reentrant */
+    pthread_mutex_lock(&sim_parse_lock);
+    ret = readCmpsc311Workload(&src->state, operation);
+    pthread_mutex_unlock(&sim_parse_lock);
+    if (ret) {
+        logMessage(LOG_ERROR_LEVEL, "CMPSC311 workload unit test failed at line %d, get op", src->state.lineno);
+        return (-1);
+    }
+    op->op = operation->op;
+    op->objname = operation->objname;
+    op->pos = operation->pos;
+    op->size = operation->size;
+    op->data = operation->data;
+    return (0);
+}
 
-            /* Compare the data read with that in the workload data */
-            if (strncmp(buf, operation.data, operation.size) != 0) {
-                logMessage(LOG_ERROR_LEVEL, "CMPSC311 read data compare failed, aborting");
-                logMessage(LOG_ERROR_LEVEL, "Read data     : [%s]", buf);
-                logMessage(LOG_ERROR_LEVEL, "Expected data : [%s]", operation.data);
-                return (-1);
-            }
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simSourceClose
+// Description  : Close a workload after replay
+//
+// Inputs       : src - the source
+// Outputs      : none
 
-            /* Now increment the file position, log the data */
-            fdata->pos += operation.size;
-            logMessage(LcControllerLLevel, "Correctly read from [%s], %d bytes at position %d",
-                fdata->filename, operation.size, operation.pos);
-            reads++;
-            break;
+void simSourceClose(sim_source* src)
+{
+    if (src->binary) {
+        lcloud_wl_close(&src->wl);
+    } else {
+        pthread_mutex_lock(&sim_parse_lock);
+        closeCmpsc311Workload(&src->state);
+        pthread_mutex_unlock(&sim_parse_lock);
+    }
+}
 
-        case WL_WRITE: /* Write a block of data to the file */
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simExecute
+// Description  : Issue the filesystem calls of one workload operation
+//
+// Inputs       : t - the replaying thread
+//                fhTable - the open files of the thread
+//                op - the operation
+//                buf - place for the data of a read, checked by the caller
+// Outputs      : 0 if successful test, -1 if failure
 
-            /* Find the file for processing */
-            if ((fdata = find_assoc(&fhTable, operation.objname)) == NULL) {
-                logMessage(LOG_ERROR_LEVEL, "CMPSC311 error writing unknown file [%s], aborting",
-                    operation.objname);
-                return (-1);
-            }
+int simExecute(sim_thread* t, AssocArray* fhTable, sim_op* op, char* buf)
+{
 
-            /* If the position within the file is not a read location, seek */
-            if (fdata->pos != operation.pos) {
-                if (lcseek(fdata->fhandle, operation.pos) != operation.pos) {
-                    logMessage(LOG_ERROR_LEVEL, "CMPSC311 error seek failed [%s, pos=%d], aborting",
-                        operation.objname, operation.pos);
-                    return (-1);
-                }
-                fdata->pos = operation.pos;
-                seeks++;
-            }
+    /* Local variables */
+    char name[sizeof(t->prefix) + sizeof(((workload_operation*)0)->objname)];
+    uint64_t start = 0;
+    fsysdata* fdata;
+    LcFHandle fh;
+    int ret;
 
-            /* Now do the write to the file */
-            if (lcwrite(fdata->fhandle, operation.data, operation.size) != operation.size) {
-                logMessage(LOG_ERROR_LEVEL, "CMPSC311 error write failed [%s, pos=%d, size=%d], aborting",
-                    operation.objname, operation.pos, operation.size);
-                return (-1);
-            }
+    /* Verbose log the operation */
+    if ((op->op == WL_READ) || (op->op == WL_WRITE)) {
+        logMessage(LcSimulatorLLevel, "CMPSCS311 workload op: %s %s off=%d, sz=%d [%.*s]", op->objname,
+            workload_operations_strings[op->op], op->pos, op->size, op->size < 20 ? op->size : 20, op->data);
+    } else if (op->op <= WL_EOF) {
+        logMessage(LcSimulatorLLevel, "CMPSCS311 workload op: %s %s", op->objname,
+            workload_operations_strings[op->op]);
+    }
 
-            /* Now increment the file position, log the data */
-            fdata->pos += operation.size;
-            logMessage(LcControllerLLevel, "Wrote data to file [%s], %d bytes at position %d",
-                fdata->filename, operation.size, operation.pos);
-            writes++;
-            break;
+    /* Switch on the operation type */
+    switch (op->op) {
+
+    case WL_OPEN: /* Open the file for reading/writing, check error */
 
-        case WL_CLOSE:
+        /* Open the file for reading */
+        snprintf(name, sizeof(name), "%s%s", t->prefix, op->objname);
+        start = t->bench ? lcloud_hist_now() : 0;
+        fh = lcopen(name);
+        simTime(t, SIM_OPEN, start, 0);
+        if (fh == -1) {
+            logMessage(LOG_ERROR_LEVEL, "CMPSC311 error opening file [%s], aborting", op->objname);
+            return (-1);
+        }
 
-            /* Find the file for processing */
-            if ((fdata = find_assoc(&fhTable, operation.objname)) == NULL) {
-                logMessage(LOG_ERROR_LEVEL, "CMPSC311 error closing unknown file [%s], aborting",
-                    operation.objname);
+        /* Setup the structure */
+        fdata = malloc(sizeof(fsysdata));
+        fdata->filename = strdup(op->objname);
+        fdata->fhandle = fh;
+        fdata->pos = 0;
+
+        /* Insert the file into the table */
+        insert_assoc(fhTable, fdata->filename, fdata);
+        logMessage(LcSimulatorLLevel, "Open file [%s]", fdata->filename);
+        break;
+
+    case WL_READ: /* Read a block of data from the file */
+
+        /* Find the file for processing */
+        if ((fdata = find_assoc(fhTable, (char*)op->objname)) == NULL) {
+            logMessage(LOG_ERROR_LEVEL, "CMPSC311 error reading unknown file [%s], aborting",
+                op->objname);
+            return (-1);
+        }
+
+        /* If the position within the file is not a read location, seek */
+        if (fdata->pos != op->pos) {
+            start = t->bench ? lcloud_hist_now() : 0;
+            ret = lcseek(fdata->fhandle, op->pos);
+            simTime(t, SIM_SEEK, start, 0);
+            if (ret != op->pos) {
+                logMessage(LOG_ERROR_LEVEL, "CMPSC311 error seek failed [%s, pos=%d], aborting",
+                    op->objname, op->pos);
                 return (-1);
             }
+            fdata->pos = op->pos;
+        }
+
+        /* Now do the read from the file */
+        start = t->bench ? lcloud_hist_now() : 0;
+        ret = lcread(fdata->fhandle, buf, op->size);
+        simTime(t, SIM_READ, start, op->size);
+        if (ret != op->size) {
+            logMessage(LOG_ERROR_LEVEL, "CMPSC311 error read failed [%s, pos=%d, size=%d], aborting",
+                op->objname, op->pos, op->size);
+            return (-1);
+        }
+
+        /* Now increment the file position, the data is checked by the caller */
+        fdata->pos += op->size;
+        break;
+
+    case WL_WRITE: /* Write a block of data to the file */
+
+        /* Find the file for processing */
+        if ((fdata = find_assoc(fhTable, (char*)op->objname)) == NULL) {
+            logMessage(LOG_ERROR_LEVEL, "CMPSC311 error writing unknown file [%s], aborting",
+                op->objname);
+            return (-1);
+        }
 
-            /* Now close the file */
-            if (lcclose(fdata->fhandle) != 0) {
-                logMessage(LOG_ERROR_LEVEL, "CMPSC311 error write failed [%s, pos=%d, size=%d], aborting",
-                    operation.objname, operation.pos, operation.size);
+        /* If the position within the file is not a read location, seek */
+        if (fdata->pos != op->pos) {
+            start = t->bench ? lcloud_hist_now() : 0;
+            ret = lcseek(fdata->fhandle, op->pos);
+            simTime(t, SIM_SEEK, start, 0);
+            if (ret != op->pos) {
+                logMessage(LOG_ERROR_LEVEL, "CMPSC311 error seek failed [%s, pos=%d], aborting",
+                    op->objname, op->pos);
                 return (-1);
             }
+            fdata->pos = op->pos;
+        }
 
-            /* Remove file from file handle table, clean up structures, log */
-            logMessage(LcSimulatorLLevel, "Closed file [%s].", fdata->filename);
-            delete_assoc(&fhTable, fdata->filename);
-            free(fdata->filename);
-            free(fdata);
-            closes++;
-            break;
+        /* Now do the write to the file */
+        start = t->bench ? lcloud_hist_now() : 0;
+        ret = lcwrite(fdata->fhandle, (char*)op->data, op->size);
+        simTime(t, SIM_WRITE, start, op->size);
+        if (ret != op->size) {
+            logMessage(LOG_ERROR_LEVEL, "CMPSC311 error write failed [%s, pos=%d, size=%d], aborting",
+                op->objname, op->pos, op->size);
+            return (-1);
+        }
 
-        case WL_EOF: // End of the workload file
-            lcshutdown();
-            logMessage(LcSimulatorLLevel, "End of the workload file (processed)");
-            break;
+        /* Now increment the file position, log the data */
+        fdata->pos += op->size;
+        logMessage(LcControllerLLevel, "Wrote data to file [%s], %d bytes at position %d",
+            fdata->filename, op->size, op->pos);
+        break;
 
-        default: /* Unknown oepration type, bailout */
-            logMessage(LOG_ERROR_LEVEL, "CMPSC311 lion clound bad operation type [%d]", operation.op);
+    case WL_CLOSE:
+
+        /* Find the file for processing */
+        if ((fdata = find_assoc(fhTable, (char*)op->objname)) == NULL) {
+            logMessage(LOG_ERROR_LEVEL, "CMPSC311 error closing unknown file [%s], aborting",
+                op->objname);
             return (-1);
         }
 
-        /* Sanity check the operation state */
-        if (operation.op > WL_EOF) {
-            logMessage(LOG_ERROR_LEVEL, "CMPSC311 lion clound bad POST HOC op code [%d]", operation.op);
+        /* Now close the file */
+        start = t->bench ? lcloud_hist_now() : 0;
+        ret = lcclose(fdata->fhandle);
+        simTime(t, SIM_CLOSE, start, 0);
+        if (ret != 0) {
+            logMessage(LOG_ERROR_LEVEL, "CMPSC311 error write failed [%s, pos=%d, size=%d], aborting",
+                op->objname, op->pos, op->size);
             return (-1);
         }
 
-    } while (operation.op < WL_EOF);
+        /* Remove file from file handle table, clean up structures, log */
+        logMessage(LcSimulatorLLevel, "Closed file [%s].", fdata->filename);
+        delete_assoc(fhTable, fdata->filename);
+        free(fdata->filename);
+        free(fdata);
+        break;
 
-    /* Log, close workload and delete the local file, return successfully  */
-    closeCmpsc311Workload(&state);
+    case WL_EOF: // End of the workload file, the caller shuts down
+        logMessage(LcSimulatorLLevel, "End of the workload file (processed)");
+        break;
+
+    default: /* Unknown oepration type, bailout */
+        logMessage(LOG_ERROR_LEVEL, "CMPSC311 lion clound bad operation type [%d]", op->op);
+        return (-1);
+    }
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simVerify
+// Description  : Compare the data of a read with that in the workload
+//
+// Inputs       : op - the read operation
+//                buf - the data read
+// Outputs      : 0 if it matches, -1 if not
+
+int simVerify(sim_op* op, char* buf)
+{
+    if (strncmp(buf, op->data, op->size) != 0) {
+        logMessage(LOG_ERROR_LEVEL, "CMPSC311 read data compare failed, aborting");
+        logMessage(LOG_ERROR_LEVEL, "Read data     : [%.*s]", op->size, buf);
+        logMessage(LOG_ERROR_LEVEL, "Expected data : [%.*s]", op->size, op->data);
+        return (-1);
+    }
+    logMessage(LcControllerLLevel, "Correctly read from [%s], %d bytes at position %d",
+        op->objname, op->size, op->pos);
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simPipeWait
+// Description  : Wait for the stage ahead to pass a sequence number
+//
+// Inputs       : p - the pipeline
+//                ahead - the sequence of the stage ahead
+//                want - the number it must reach
+// Outputs      : 0 once it has, -1 if another stage failed
+
+int simPipeWait(sim_pipe* p, atomic_uint_fast64_t* ahead, uint64_t want)
+{
+    int spins = 0;
+
+    while (atomic_load_explicit(ahead, memory_order_acquire) < want) {
+        if (atomic_load_explicit(&p->failed, memory_order_relaxed)) {
+            return (-1);
+        }
+        if (++spins > SIM_PIPE_SPINS) {
+            sched_yield();
+        }
+    }
     return (0);
 }
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simPipeParser / simPipeVerifier
+// Description  : Thread bodies of the first and last pipeline stages. The
+//                parser fills free slots with the next operations, the
+//                verifier checks the reads once they are executed.
+//
+// Inputs       : arg - the pipeline
+// Outputs      : NULL
+
+void* simPipeParser(void* arg)
+{
+    sim_pipe* p = (sim_pipe*)arg;
+    sim_slot* slot;
+    uint64_t seq;
+
+    for (seq = 0;; seq++) {
+        // a slot is free again once the verifier is done with it
+        if (seq >= SIM_PIPE_SLOTS && simPipeWait(p, &p->verified, seq - SIM_PIPE_SLOTS + 1)) {
+            return NULL;
+        }
+        slot = &p->slots[seq % SIM_PIPE_SLOTS];
+        if (simSourceNext(p->src, &slot->operation, &slot->op)) {
+            atomic_store(&p->failed, 1);
+            return NULL;
+        }
+        atomic_store_explicit(&p->parsed, seq + 1, memory_order_release);
+        if (slot->op.op >= WL_EOF) {
+            return NULL;
+        }
+    }
+}
+
+void* simPipeVerifier(void* arg)
+{
+    sim_pipe* p = (sim_pipe*)arg;
+    sim_slot* slot;
+    uint64_t seq;
+
+    for (seq = 0;; seq++) {
+        if (simPipeWait(p, &p->executed, seq + 1)) {
+            return NULL;
+        }
+        slot = &p->slots[seq % SIM_PIPE_SLOTS];
+        if (slot->op.op == WL_READ && simVerify(&slot->op, slot->buf)) {
+            atomic_store(&p->failed, 1);
+            return NULL;
+        }
+        atomic_store_explicit(&p->verified, seq + 1, memory_order_release);
+        if (slot->op.op >= WL_EOF) {
+            return NULL;
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simPipeline
+// Description  : Replay a workload as a three stage pipeline, parsing and
+//                verifying on their own threads while this one only issues
+//                the filesystem calls
+//
+// Inputs       : t - the replaying thread
+//                src - the open workload
+//                fhTable - the open files of the thread
+// Outputs      : 0 if successful test, -1 if failure
+
+int simPipeline(sim_thread* t, sim_source* src, AssocArray* fhTable)
+{
+    pthread_t parser, verifier;
+    sim_pipe* p;
+    sim_slot* slot;
+    uint64_t seq;
+    int ret = 0;
+
+    p = (sim_pipe*)malloc(sizeof(sim_pipe));
+    p->src = src;
+    atomic_init(&p->parsed, 0);
+    atomic_init(&p->executed, 0);
+    atomic_init(&p->verified, 0);
+    atomic_init(&p->failed, 0);
+    if (pthread_create(&parser, NULL, simPipeParser, p) != 0) {
+        free(p);
+        return (-1);
+    }
+    if (pthread_create(&verifier, NULL, simPipeVerifier, p) != 0) {
+        atomic_store(&p->failed, 1);
+        pthread_join(parser, NULL);
+        free(p);
+        return (-1);
+    }
+
+    // the executing stage, each slot is handed on once its calls are done
+    for (seq = 0;; seq++) {
+        if (simPipeWait(p, &p->parsed, seq + 1)) {
+            ret = -1;
+            break;
+        }
+        slot = &p->slots[seq % SIM_PIPE_SLOTS];
+        if (simExecute(t, fhTable, &slot->op, slot->buf)) {
+            atomic_store(&p->failed, 1);
+            ret = -1;
+            break;
+        }
+        atomic_store_explicit(&p->executed, seq + 1, memory_order_release);
+        if (slot->op.op >= WL_EOF) {
+            break;
+        }
+    }
+    pthread_join(parser, NULL);
+    pthread_join(verifier, NULL);
+    if (atomic_load(&p->failed)) {
+        ret = -1;
+    }
+    free(p);
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simTime
+// Description  : Count an operation, recording its latency in benchmark mode
+//
+// Inputs       : t - the replaying thread
+//                op - the operation type
+//                start - when it started
+//                bytes - bytes it moved
+// Outputs      : none
+
+void simTime(sim_thread* t, int op, uint64_t start, int bytes)
+{
+    t->counts[op]++;
+    t->ops++;
+    t->bytes += bytes;
+    if (t->bench) {
+        lcloud_hist_record(&t->bench->ops[op], lcloud_hist_now() - start);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simThread
+// Description  : Thread body, replays one workload and times it
+//
+// Inputs       : arg - the thread's sim_thread
+// Outputs      : NULL
+
+void* simThread(void* arg)
+{
+    sim_thread* t = (sim_thread*)arg;
+    uint64_t start = lcloud_hist_now();
+
+    t->ret = simulateLionCloud(t);
+    t->elapsed = lcloud_hist_now() - start;
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : replayLionCloud
+// Description  : Replay the workloads on a number of threads at the same
+//                time, then shut down the filesystem
+//
+// Inputs       : wloads - the workload files, taken by the threads in turn
+//                nwloads - number of workload files
+//                threads - per thread state, filled in with the results
+//                nthreads - number of threads
+//                measure - record latencies in each thread's bench
+// Outputs      : 0 if successful test, -1 if failure
+
+int replayLionCloud(char** wloads, int nwloads, sim_thread* threads, int nthreads, int measure)
+{
+    pthread_t tids[SIM_MAX_THREADS];
+    int i, op, started, ret = 0;
+
+    for (i = 0; i < nthreads; i++) {
+        threads[i].wload = wloads[i % nwloads];
+        // each thread works on its own copy of the objects
+        threads[i].prefix[0] = '\0';
+        if (nthreads > 1) {
+            snprintf(threads[i].prefix, sizeof(threads[i].prefix), "t%d/", i);
+        }
+        threads[i].ops = threads[i].bytes = threads[i].elapsed = 0;
+        memset(threads[i].counts, 0, sizeof(threads[i].counts));
+        if (measure) {
+            for (op = 0; op < SIM_OPS; op++) {
+                lcloud_hist_init(&threads[i].bench->ops[op]);
+            }
+        }
+    }
+    if (nthreads == 1) {
+        simThread(&threads[0]);
+        started = 1;
+    } else {
+        for (started = 0; started < nthreads; started++) {
+            if (pthread_create(&tids[started], NULL, simThread, &threads[started]) != 0) {
+                logMessage(LOG_ERROR_LEVEL, "CMPSC311 error starting replay thread %d", started);
+                ret = -1;
+                break;
+            }
+        }
+        for (i = 0; i < started; i++) {
+            pthread_join(tids[i], NULL);
+        }
+    }
+    for (i = 0; i < started; i++) {
+        if (threads[i].ret != 0) {
+            ret = -1;
+        }
+    }
+    lcshutdown();
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simJsonString
+// Description  : Print a string as a JSON string literal
+//
+// Inputs       : str - the string
+// Outputs      : none
+
+void simJsonString(const char* str)
+{
+    putchar('"');
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\') {
+            printf("\\%c", *str);
+        } else if ((unsigned char)*str < 0x20) {
+            printf("\\u%04x", *str);
+        } else {
+            putchar(*str);
+        }
+    }
+    putchar('"');
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simJsonRate
+// Description  : Print the time, operations and throughput of a run or a
+//                thread as JSON fields
+//
+// Inputs       : elapsed - nanoseconds taken
+//                ops - operations done
+//                bytes - bytes read and written
+// Outputs      : none
+
+void simJsonRate(uint64_t elapsed, uint64_t ops, uint64_t bytes)
+{
+    double secs = elapsed / 1e9;
+
+    printf("\"seconds\": %.6f, \"ops\": %llu, \"bytes\": %llu, \"ops_per_sec\": %.1f, \"mb_per_sec\": %.3f",
+        secs, (unsigned long long)ops, (unsigned long long)bytes, secs > 0 ? ops / secs : 0.0,
+        secs > 0 ? bytes / secs / (1024 * 1024) : 0.0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : benchmarkLionCloud
+// Description  : Replay the workloads several times, timing every operation
+//                of the measured runs, and print the results as JSON
+//
+// Inputs       : wloads - the workload files
+//                nwloads - number of workload files
+//                nthreads - number of replaying threads
+//                warmups - number of runs before measuring
+//                repeats - number of measured runs
+// Outputs      : 0 if successful test, -1 if failure
+
+int benchmarkLionCloud(char** wloads, int nwloads, int nthreads, int warmups, int repeats)
+{
+    sim_thread* threads = calloc(nthreads, sizeof(sim_thread));
+    sim_bench* all = malloc(sizeof(sim_bench));
+    uint64_t start, elapsed, total = 0, ops, bytes, all_ops = 0, all_bytes = 0;
+    int i, t, op, ret = 0;
+
+    // warm up the server, caches and page cache without measuring
+    for (i = 0; i < warmups && ret == 0; i++) {
+        ret = replayLionCloud(wloads, nwloads, threads, nthreads, 0);
+    }
+    if (ret != 0) {
+        free(threads);
+        free(all);
+        return (-1);
+    }
+
+    for (t = 0; t < nthreads; t++) {
+        threads[t].bench = malloc(sizeof(sim_bench));
+    }
+    for (op = 0; op < SIM_OPS; op++) {
+        lcloud_hist_init(&all->ops[op]);
+    }
+
+    printf("{\n  \"workloads\": [");
+    for (i = 0; i < nwloads; i++) {
+        printf(i ? ", " : " ");
+        simJsonString(wloads[i]);
+    }
+    printf(" ],\n  \"threads\": %d,\n  \"warmups\": %d,\n  \"repeats\": %d,\n  \"runs\": [",
+        nthreads, warmups, repeats);
+    for (i = 0; i < repeats && ret == 0; i++) {
+        start = lcloud_hist_now();
+        ret = replayLionCloud(wloads, nwloads, threads, nthreads, 1);
+        elapsed = lcloud_hist_now() - start;
+        if (ret != 0) {
+            break;
+        }
+
+        // one line per run, to see the spread between them
+        for (t = 0, ops = 0, bytes = 0; t < nthreads; t++) {
+            ops += threads[t].ops;
+            bytes += threads[t].bytes;
+            for (op = 0; op < SIM_OPS; op++) {
+                lcloud_hist_merge(&all->ops[op], &threads[t].bench->ops[op]);
+            }
+        }
+        all_ops += ops;
+        all_bytes += bytes;
+        total += elapsed;
+        printf("%s\n    { ", i ? "," : "");
+        simJsonRate(elapsed, ops, bytes);
+        if (nthreads > 1) {
+            printf(",\n      \"per_thread\": [");
+            for (t = 0; t < nthreads; t++) {
+                printf("%s\n        { ", t ? "," : "");
+                simJsonRate(threads[t].elapsed, threads[t].ops, threads[t].bytes);
+                printf(" }");
+            }
+            printf("\n      ]");
+        }
+        printf(" }");
+    }
+    if (ret != 0) {
+        printf("\n  ]\n}\n");
+    } else {
+        printf("\n  ],\n  \"total\": { ");
+        simJsonRate(total, all_ops, all_bytes);
+        printf(" },\n  \"latency_us\": {");
+        for (op = 0; op < SIM_OPS; op++) {
+            lc_hist* h = &all->ops[op];
+            printf("%s\n    \"%s\": { \"count\": %llu, \"mean\": %.3f, \"min\": %.3f, \"p50\": %.3f, "
+                   "\"p99\": %.3f, \"p999\": %.3f, \"max\": %.3f }",
+                op ? "," : "", sim_op_names[op], (unsigned long long)h->count,
+                h->count ? h->total / 1e3 / h->count : 0.0, h->count ? h->min / 1e3 : 0.0,
+                lcloud_hist_percentile(h, 50) / 1e3, lcloud_hist_percentile(h, 99) / 1e3,
+                lcloud_hist_percentile(h, 99.9) / 1e3, h->max / 1e3);
+        }
+        printf("\n  }\n}\n");
+    }
+    for (t = 0; t < nthreads; t++) {
+        free(threads[t].bench);
+    }
+    free(threads);
+    free(all);
+    return (ret);
+}
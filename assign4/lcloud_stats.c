@@ -0,0 +1,311 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : lcloud_stats.c
+//  Description    : These are the operation counters and latency histograms
+//                   of the LionCloud filesystem. lcloud_filesys.c records
+//                   every lc* call and lcloud_client.c every bus request,
+//                   only while recording is on, so an idle build only pays
+//                   for a flag test.
+//
+//   Author        : Tzu Chieh Huang
+//   Last Modified : 18th Oct 2026
+//
+
+// Includes
+#include <pthread.h>
+#include <string.h>
+#include <lcloud_cache.h>
+#include <lcloud_stats.h>
+
+//
+// Global Data
+
+int lcloud_stats_on = 0;
+int stats_ready = 0;
+lc_stat stats_calls[LC_CALLS];
+lc_stat stats_bus[LC_BUS_OPS];
+lc_stat stats_devices[LC_STATS_DEVICES];
+// one lock per kind, the calls and the bus requests are recorded apart
+pthread_mutex_t stats_locks[3] = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_MUTEX_INITIALIZER };
+
+const char* stats_call_names[LC_CALLS] = { "lcsetmode", "lcopen", "lcread", "lcwrite", "lcseek",
+    "lctruncate", "lcunlink", "lcclone", "lcsnapshot", "lcdefrag", "lclist", "lcclose", "lcstream_open",
+    "lcstream_push", "lcstream_pull", "lcstream_finish", "lcshutdown" };
+const char* stats_bus_names[LC_BUS_OPS] = { "power_on", "devprobe", "devinit", "xfer_read", "xfer_write",
+    "power_off", "other" };
+
+//
+// Functions
+
+// Function     : lcloud_stats_add
+// Description  : count one operation in a statistic, under its kind's lock
+// Inputs       : kind - LC_STATS_CALL, LC_STATS_BUS or LC_STATS_DEVICE
+//                st - the statistic
+//                ns - the operation's latency
+//                failed - nonzero if the operation failed
+//                bytes - bytes it moved
+// Outputs      : none
+static void lcloud_stats_add(int kind, lc_stat* st, uint64_t ns, int failed, uint64_t bytes)
+{
+    pthread_mutex_lock(&stats_locks[kind]);
+    st->count++;
+    st->errors += failed != 0;
+    st->bytes += bytes;
+    lcloud_hist_record(&st->latency, ns);
+    pthread_mutex_unlock(&stats_locks[kind]);
+}
+
+// Function     : lcloud_stats_table
+// Description  : find the statistics of a kind
+// Inputs       : kind - LC_STATS_CALL, LC_STATS_BUS or LC_STATS_DEVICE
+//                n - set to the number of statistics of that kind
+// Outputs      : the statistics, NULL if the kind is unknown
+static lc_stat* lcloud_stats_table(int kind, int* n)
+{
+    switch (kind) {
+    case LC_STATS_CALL:
+        *n = LC_CALLS;
+        return stats_calls;
+    case LC_STATS_BUS:
+        *n = LC_BUS_OPS;
+        return stats_bus;
+    case LC_STATS_DEVICE:
+        *n = LC_STATS_DEVICES;
+        return stats_devices;
+    }
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_stats_enable
+// Description  : Start or stop recording operations, what was recorded is
+//                kept either way
+//
+// Inputs       : on - nonzero to record
+// Outputs      : whether recording was on before
+
+int lcloud_stats_enable(int on)
+{
+    int was = lcloud_stats_on;
+
+    // the histograms need setting up before the first recording
+    if (on && !stats_ready) {
+        lcloud_stats_reset();
+        stats_ready = 1;
+    }
+    lcloud_stats_on = on != 0;
+    return (was);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_stats_start
+// Description  : Take the start time of an operation
+//
+// Inputs       : none
+// Outputs      : the time in nanoseconds, 0 if nothing is recorded
+
+uint64_t lcloud_stats_start(void)
+{
+    return lcloud_stats_on ? lcloud_hist_now() : 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_stats_call
+// Description  : Record an lc* call
+//
+// Inputs       : call - the call, LC_CALL_*
+//                start - from lcloud_stats_start when the call began
+//                failed - nonzero if the call failed
+//                bytes - bytes read or written by the call
+// Outputs      : none
+
+void lcloud_stats_call(int call, uint64_t start, int failed, uint64_t bytes)
+{
+    // calls begun before recording started have no start time
+    if (!lcloud_stats_on || start == 0 || call < 0 || call >= LC_CALLS) {
+        return;
+    }
+    lcloud_stats_add(LC_STATS_CALL, &stats_calls[call], lcloud_hist_now() - start, failed, bytes);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_stats_bus
+// Description  : Record a bus request, and for a block transfer its device
+//
+// Inputs       : reg - the request registers
+//                resp - the response, -1 if the exchange failed
+//                start, end - when the request was sent and answered
+// Outputs      : none
+
+void lcloud_stats_bus(LCloudRegisterFrame reg, LCloudRegisterFrame resp, uint64_t start, uint64_t end)
+{
+    int device = (reg >> 40) & 0xff, xfer = ((reg >> 48) & 0xff) == LC_BLOCK_XFER;
+    int failed = resp == (LCloudRegisterFrame)-1 || ((resp >> 60) & 0xf) != 1 || ((resp >> 56) & 0xf) != 1;
+
+    if (!lcloud_stats_on || start == 0) {
+        return;
+    }
+    lcloud_stats_add(LC_STATS_BUS, &stats_bus[lcloud_stats_bus_op(reg)], end - start, failed,
+        xfer ? LC_DEVICE_BLOCK_SIZE : 0);
+    if (xfer && device < LC_STATS_DEVICES) {
+        lcloud_stats_add(LC_STATS_DEVICE, &stats_devices[device], end - start, failed, LC_DEVICE_BLOCK_SIZE);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_stats_bus_op
+// Description  : Classify a bus request, block transfers by direction
+//
+// Inputs       : reg - the request registers
+// Outputs      : the request type, LC_BUS_*
+
+int lcloud_stats_bus_op(LCloudRegisterFrame reg)
+{
+    switch ((reg >> 48) & 0xff) {
+    case LC_POWER_ON:
+        return LC_BUS_POWER_ON;
+    case LC_DEVPROBE:
+        return LC_BUS_DEVPROBE;
+    case LC_DEVINIT:
+        return LC_BUS_DEVINIT;
+    case LC_BLOCK_XFER:
+        return ((reg >> 32) & 0xff) == LC_XFER_WRITE ? LC_BUS_XFER_WRITE : LC_BUS_XFER_READ;
+    case LC_POWER_OFF:
+        return LC_BUS_POWER_OFF;
+    }
+    return LC_BUS_OTHER;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_stats_get
+// Description  : Copy out one statistic, while operations go on
+//
+// Inputs       : kind - LC_STATS_CALL, LC_STATS_BUS or LC_STATS_DEVICE
+//                idx - the call, bus request type or device id
+//                st - where to copy it
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_stats_get(int kind, int idx, lc_stat* st)
+{
+    lc_stat* table;
+    int n;
+
+    if ((table = lcloud_stats_table(kind, &n)) == NULL || idx < 0 || idx >= n) {
+        return (-1);
+    }
+    pthread_mutex_lock(&stats_locks[kind]);
+    memcpy(st, &table[idx], sizeof(lc_stat));
+    pthread_mutex_unlock(&stats_locks[kind]);
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_stats_name
+// Description  : Name a call or bus request type
+//
+// Inputs       : kind - LC_STATS_CALL or LC_STATS_BUS
+//                idx - the call or bus request type
+// Outputs      : the name, NULL if there is none
+
+const char* lcloud_stats_name(int kind, int idx)
+{
+    if (kind == LC_STATS_CALL && idx >= 0 && idx < LC_CALLS) {
+        return stats_call_names[idx];
+    }
+    if (kind == LC_STATS_BUS && idx >= 0 && idx < LC_BUS_OPS) {
+        return stats_bus_names[idx];
+    }
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_stats_reset
+// Description  : Empty all the statistics
+//
+// Inputs       : none
+// Outputs      : none
+
+void lcloud_stats_reset(void)
+{
+    lc_stat* table;
+    int kind, i, n;
+
+    for (kind = LC_STATS_CALL; kind <= LC_STATS_DEVICE; kind++) {
+        table = lcloud_stats_table(kind, &n);
+        pthread_mutex_lock(&stats_locks[kind]);
+        for (i = 0; i < n; i++) {
+            table[i].count = table[i].errors = table[i].bytes = 0;
+            lcloud_hist_init(&table[i].latency);
+        }
+        pthread_mutex_unlock(&stats_locks[kind]);
+    }
+}
+
+// Function     : lcloud_stats_json
+// Description  : write one statistic as a JSON member, latencies in us
+// Inputs       : out - where to write
+//                first - nonzero for the first member of its object
+//                name - the member name
+//                st - the statistic
+// Outputs      : none
+static void lcloud_stats_json(FILE* out, int first, const char* name, const lc_stat* st)
+{
+    const lc_hist* h = &st->latency;
+
+    fprintf(out,
+        "%s\n    \"%s\": { \"count\": %llu, \"errors\": %llu, \"bytes\": %llu, \"latency_us\": { \"mean\": %.3f, "
+        "\"min\": %.3f, \"p50\": %.3f, \"p99\": %.3f, \"p999\": %.3f, \"max\": %.3f } }",
+        first ? "" : ",", name, (unsigned long long)st->count, (unsigned long long)st->errors,
+        (unsigned long long)st->bytes, h->count ? h->total / 1e3 / h->count : 0.0, h->count ? h->min / 1e3 : 0.0,
+        lcloud_hist_percentile(h, 50) / 1e3, lcloud_hist_percentile(h, 99) / 1e3,
+        lcloud_hist_percentile(h, 99.9) / 1e3, h->max / 1e3);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_stats_dump
+// Description  : Write all the statistics as one JSON object, every call and
+//                bus request type and the devices that were used, with the
+//                block cache's hits and misses
+//
+// Inputs       : out - where to write
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_stats_dump(FILE* out)
+{
+    int i, first, hits, misses;
+    char name[8];
+    lc_stat st;
+
+    fprintf(out, "{\n  \"calls\": {");
+    for (i = 0; i < LC_CALLS; i++) {
+        lcloud_stats_get(LC_STATS_CALL, i, &st);
+        lcloud_stats_json(out, i == 0, stats_call_names[i], &st);
+    }
+    fprintf(out, "\n  },\n  \"bus\": {");
+    for (i = 0; i < LC_BUS_OPS; i++) {
+        lcloud_stats_get(LC_STATS_BUS, i, &st);
+        lcloud_stats_json(out, i == 0, stats_bus_names[i], &st);
+    }
+    fprintf(out, "\n  },\n  \"devices\": {");
+    for (i = 0, first = 1; i < LC_STATS_DEVICES; i++) {
+        lcloud_stats_get(LC_STATS_DEVICE, i, &st);
+        if (st.count) {
+            snprintf(name, sizeof(name), "%d", i);
+            lcloud_stats_json(out, first, name, &st);
+            first = 0;
+        }
+    }
+    lcloud_cachestats(&hits, &misses);
+    fprintf(out, "\n  },\n  \"cache\": { \"hits\": %d, \"misses\": %d }\n}\n", hits, misses);
+    return (ferror(out) ? -1 : 0);
+}
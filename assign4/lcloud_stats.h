@@ -0,0 +1,99 @@
+#ifndef LCLOUD_STATS_INCLUDED
+#define LCLOUD_STATS_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : lcloud_stats.h
+//  Description    : These are the operation counters and latency histograms
+//                   of the LionCloud filesystem, per lc* call, per bus
+//                   request type and per device.
+//
+//   Author        : Tzu Chieh Huang
+//   Last Modified : 18th Oct 2026
+//
+
+// Includes
+#include <stdint.h>
+#include <stdio.h>
+#include <lcloud_controller.h>
+#include <lcloud_hist.h>
+
+// Defines
+#define LC_STATS_CALL 0 // the kinds of statistics
+#define LC_STATS_BUS 1
+#define LC_STATS_DEVICE 2
+
+#define LC_CALL_SETMODE 0 // the lc* calls
+#define LC_CALL_OPEN 1
+#define LC_CALL_READ 2
+#define LC_CALL_WRITE 3
+#define LC_CALL_SEEK 4
+#define LC_CALL_TRUNCATE 5
+#define LC_CALL_UNLINK 6
+#define LC_CALL_CLONE 7
+#define LC_CALL_SNAPSHOT 8
+#define LC_CALL_DEFRAG 9
+#define LC_CALL_LIST 10
+#define LC_CALL_CLOSE 11
+#define LC_CALL_STREAM_OPEN 12
+#define LC_CALL_STREAM_PUSH 13
+#define LC_CALL_STREAM_PULL 14
+#define LC_CALL_STREAM_FINISH 15
+#define LC_CALL_SHUTDOWN 16
+#define LC_CALLS 17
+
+#define LC_BUS_POWER_ON 0 // the bus requests, block transfers split by direction
+#define LC_BUS_DEVPROBE 1
+#define LC_BUS_DEVINIT 2
+#define LC_BUS_XFER_READ 3
+#define LC_BUS_XFER_WRITE 4
+#define LC_BUS_POWER_OFF 5
+#define LC_BUS_OTHER 6
+#define LC_BUS_OPS 7
+
+#define LC_STATS_DEVICES 16 // block transfers by device id
+
+// Type definitions
+typedef struct {
+    uint64_t count; // operations
+    uint64_t errors; // operations that failed
+    uint64_t bytes; // bytes read or written
+    lc_hist latency; // nanoseconds per operation
+} lc_stat;
+
+//
+// Global Data
+
+extern int lcloud_stats_on; // nonzero while operations are being recorded
+
+//
+// Functional Prototypes
+
+int lcloud_stats_enable( int on );
+    // Start or stop recording, returns whether it was on
+
+uint64_t lcloud_stats_start( void );
+    // The start time of an operation, 0 if nothing is recorded
+
+void lcloud_stats_call( int call, uint64_t start, int failed, uint64_t bytes );
+    // Record an lc* call begun at start
+
+void lcloud_stats_bus( LCloudRegisterFrame reg, LCloudRegisterFrame resp, uint64_t start, uint64_t end );
+    // Record a bus request and its device
+
+int lcloud_stats_bus_op( LCloudRegisterFrame reg );
+    // The bus request type of a request, LC_BUS_*
+
+int lcloud_stats_get( int kind, int idx, lc_stat *st );
+    // Copy out the statistics of a call, bus request type or device
+
+const char * lcloud_stats_name( int kind, int idx );
+    // The name of a call or bus request type
+
+void lcloud_stats_reset( void );
+    // Empty all the statistics
+
+int lcloud_stats_dump( FILE *out );
+    // Write all the statistics as JSON
+
+#endif
@@ -0,0 +1,249 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : lcloud_trace.c
+//  Description    : This is the span tracer of the LionCloud filesystem.
+//                   Every lc* call, block cache lookup and bus request is
+//                   a span, kept in a ring of the thread that made it, so
+//                   recording takes no lock. The rings are written out in
+//                   the Chrome trace event format, where a call's cache
+//                   lookups and transfers show nested under it.
+//
+//   Author        : Tzu Chieh Huang
+//   Last Modified : 18th Oct 2026
+//
+
+// Includes
+#include <pthread.h>
+#include <stdlib.h>
+#include <lcloud_hist.h>
+#include <lcloud_stats.h>
+#include <lcloud_trace.h>
+
+// Type definitions
+typedef struct trace_ring trace_ring;
+struct trace_ring {
+    lc_span spans[LC_TRACE_RING_SPANS];
+    uint64_t count; // spans ever recorded, the newest is at (count - 1) % size
+    int tid; // thread using the ring
+    int in_use; // zero once that thread has exited
+    trace_ring* next;
+};
+
+//
+// Global Data
+
+int lcloud_trace_on = 0;
+uint64_t trace_epoch; // when tracing started, spans are timed from it
+trace_ring* trace_rings = NULL; // every ring, a ring is reused after its thread exits
+int trace_threads = 0; // thread ids handed out
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_key_t trace_key;
+pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+
+//
+// Functions
+
+// Function     : trace_release
+// Description  : give a thread's ring back when the thread exits
+// Inputs       : arg - the ring
+// Outputs      : none
+static void trace_release(void* arg)
+{
+    pthread_mutex_lock(&trace_lock);
+    ((trace_ring*)arg)->in_use = 0;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+// Function     : trace_key_create
+// Description  : create the key holding each thread's ring, once
+// Inputs       : none
+// Outputs      : none
+static void trace_key_create(void)
+{
+    pthread_key_create(&trace_key, trace_release);
+}
+
+// Function     : trace_ring_get
+// Description  : find the calling thread's ring, taking a free one or
+//                allocating one the first time the thread records a span
+// Inputs       : none
+// Outputs      : the ring, NULL if none could be allocated
+static trace_ring* trace_ring_get(void)
+{
+    trace_ring* ring;
+
+    pthread_once(&trace_once, trace_key_create);
+    if ((ring = (trace_ring*)pthread_getspecific(trace_key)) != NULL) {
+        return ring;
+    }
+
+    // spans already in a reused ring keep the id of the thread that made them
+    pthread_mutex_lock(&trace_lock);
+    for (ring = trace_rings; ring != NULL && ring->in_use; ring = ring->next)
+        ;
+    if (ring == NULL && (ring = (trace_ring*)calloc(1, sizeof(trace_ring))) != NULL) {
+        ring->next = trace_rings;
+        trace_rings = ring;
+    }
+    if (ring != NULL) {
+        ring->in_use = 1;
+        ring->tid = ++trace_threads;
+    }
+    pthread_mutex_unlock(&trace_lock);
+    if (ring != NULL) {
+        pthread_setspecific(trace_key, ring);
+    }
+    return ring;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_trace_enable
+// Description  : Start or stop recording spans, recorded spans are kept
+//
+// Inputs       : on - nonzero to record
+// Outputs      : whether recording was on before
+
+int lcloud_trace_enable(int on)
+{
+    int was = lcloud_trace_on;
+
+    if (on && trace_epoch == 0) {
+        trace_epoch = lcloud_hist_now();
+    }
+    lcloud_trace_on = on != 0;
+    return (was);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_trace_begin
+// Description  : Take the start time of a span
+//
+// Inputs       : none
+// Outputs      : the time in nanoseconds, 0 if nothing is recorded
+
+uint64_t lcloud_trace_begin(void)
+{
+    return lcloud_trace_on ? lcloud_hist_now() : 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_trace_span
+// Description  : Record a finished span in the calling thread's ring,
+//                overwriting the oldest once the ring is full
+//
+// Inputs       : kind - LC_TRACE_CALL, LC_TRACE_CACHE or LC_TRACE_BUS
+//                op - the call or bus request type
+//                start, end - when the span began and ended
+//                device, sector, block - the block involved, device -1 if
+//                                        none
+//                value - bytes of a call, 1 for a cache hit or bus success
+// Outputs      : none
+
+void lcloud_trace_span(int kind, int op, uint64_t start, uint64_t end, int device, int sector, int block,
+    int64_t value)
+{
+    trace_ring* ring;
+    lc_span* sp;
+
+    // spans begun before tracing started have no start time
+    if (!lcloud_trace_on || start == 0 || (ring = trace_ring_get()) == NULL) {
+        return;
+    }
+    sp = &ring->spans[ring->count % LC_TRACE_RING_SPANS];
+    sp->start = start;
+    sp->end = end;
+    sp->value = value;
+    sp->tid = ring->tid;
+    sp->kind = kind;
+    sp->op = op;
+    sp->device = device;
+    sp->sector = sector;
+    sp->block = block;
+    ring->count++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_trace_bus
+// Description  : Record a bus request span, naming the block of a transfer
+//
+// Inputs       : reg - the request registers
+//                resp - the response, -1 if the exchange failed
+//                start, end - when the request was sent and answered
+// Outputs      : none
+
+void lcloud_trace_bus(LCloudRegisterFrame reg, LCloudRegisterFrame resp, uint64_t start, uint64_t end)
+{
+    int xfer = ((reg >> 48) & 0xff) == LC_BLOCK_XFER;
+    int ok = resp != (LCloudRegisterFrame)-1 && ((resp >> 60) & 0xf) == 1 && ((resp >> 56) & 0xf) == 1;
+
+    if (!lcloud_trace_on) {
+        return;
+    }
+    lcloud_trace_span(LC_TRACE_BUS, lcloud_stats_bus_op(reg), start, end, xfer ? (int)((reg >> 40) & 0xff) : -1,
+        (reg >> 16) & 0xffff, reg & 0xffff, ok);
+}
+
+// Function     : trace_json
+// Description  : write one span as a complete ("X") trace event
+// Inputs       : out - where to write
+//                sp - the span
+// Outputs      : none
+static void trace_json(FILE* out, const lc_span* sp)
+{
+    static const char* cats[] = { "call", "cache", "bus" };
+    const char* name = sp->kind == LC_TRACE_CALL ? lcloud_stats_name(LC_STATS_CALL, sp->op)
+        : sp->kind == LC_TRACE_BUS              ? lcloud_stats_name(LC_STATS_BUS, sp->op)
+                                                : "cache_lookup";
+
+    fprintf(out, ",\n    { \"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": 1, "
+                 "\"tid\": %d, \"args\": { ",
+        name, cats[sp->kind], (sp->start - trace_epoch) / 1e3, (sp->end - sp->start) / 1e3, sp->tid);
+    if (sp->device >= 0) {
+        fprintf(out, "\"device\": %d, \"sector\": %d, \"block\": %d, ", sp->device, sp->sector, sp->block);
+    }
+    if (sp->kind == LC_TRACE_CALL) {
+        fprintf(out, "\"bytes\": %lld } }", (long long)sp->value);
+    } else {
+        fprintf(out, "\"%s\": %d } }", sp->kind == LC_TRACE_CACHE ? "hit" : "ok", (int)sp->value);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_trace_dump
+// Description  : Write the spans of every thread as Chrome trace event JSON,
+//                which Perfetto and chrome://tracing open. The traced
+//                threads should be done, rings are read without a lock.
+//
+// Inputs       : out - where to write
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_trace_dump(FILE* out)
+{
+    uint64_t i, first, dropped = 0;
+    trace_ring* ring;
+    int tid;
+
+    pthread_mutex_lock(&trace_lock);
+    fprintf(out, "{\n  \"displayTimeUnit\": \"ns\",\n  \"traceEvents\": [\n");
+    fprintf(out, "    { \"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": { \"name\": \"lcloud\" } }");
+    for (tid = 1; tid <= trace_threads; tid++) {
+        fprintf(out, ",\n    { \"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+                     "\"args\": { \"name\": \"thread %d\" } }",
+            tid, tid);
+    }
+    for (ring = trace_rings; ring != NULL; ring = ring->next) {
+        first = ring->count > LC_TRACE_RING_SPANS ? ring->count - LC_TRACE_RING_SPANS : 0;
+        dropped += first;
+        for (i = first; i < ring->count; i++) {
+            trace_json(out, &ring->spans[i % LC_TRACE_RING_SPANS]);
+        }
+    }
+    fprintf(out, "\n  ],\n  \"otherData\": { \"dropped_spans\": %llu }\n}\n", (unsigned long long)dropped);
+    pthread_mutex_unlock(&trace_lock);
+    return (ferror(out) ? -1 : 0);
+}
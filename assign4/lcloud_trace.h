@@ -0,0 +1,61 @@
+#ifndef LCLOUD_TRACE_INCLUDED
+#define LCLOUD_TRACE_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : lcloud_trace.h
+//  Description    : This is the span tracer of the LionCloud filesystem,
+//                   written out in the Chrome trace event format.
+//
+//   Author        : Tzu Chieh Huang
+//   Last Modified : 18th Oct 2026
+//
+
+// Includes
+#include <stdint.h>
+#include <stdio.h>
+#include <lcloud_controller.h>
+
+// Defines
+#define LC_TRACE_RING_SPANS 65536 // spans kept per thread, older ones are overwritten
+#define LC_TRACE_CALL 0 // the kinds of spans, an lc* call (op is LC_CALL_*),
+#define LC_TRACE_CACHE 1 // a block cache lookup
+#define LC_TRACE_BUS 2 // and a bus request (op is LC_BUS_*)
+
+// Type definitions
+typedef struct {
+    uint64_t start; // nanoseconds, monotonic clock
+    uint64_t end;
+    int64_t value; // bytes of a call, 1 for a cache hit, 1 for a bus success
+    uint16_t tid; // the thread, numbered as threads start tracing
+    uint8_t kind; // LC_TRACE_*
+    uint8_t op;
+    int16_t device; // -1 for calls and bus requests that name no block
+    uint16_t sector;
+    uint16_t block;
+} lc_span;
+
+//
+// Global Data
+
+extern int lcloud_trace_on; // nonzero while spans are being recorded
+
+//
+// Functional Prototypes
+
+int lcloud_trace_enable( int on );
+    // Start or stop recording spans, returns whether it was on
+
+uint64_t lcloud_trace_begin( void );
+    // The start time of a span, 0 if nothing is recorded
+
+void lcloud_trace_span( int kind, int op, uint64_t start, uint64_t end, int device, int sector, int block, int64_t value );
+    // Record a span in the calling thread's ring
+
+void lcloud_trace_bus( LCloudRegisterFrame reg, LCloudRegisterFrame resp, uint64_t start, uint64_t end );
+    // Record a bus request span, with its block for a transfer
+
+int lcloud_trace_dump( FILE *out );
+    // Write the spans of every thread as Chrome trace event JSON
+
+#endif
@@ -0,0 +1,484 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : lcloud_whatif.c
+//  Description    : This is an offline what-if simulator for the LionCloud
+//                   block cache. It turns a workload into the block cache
+//                   accesses lcloud_filesys.c would make (in place mode) and
+//                   replays them through caches of many sizes and policies,
+//                   with no server. LRU comes from one pass of stack
+//                   distances, which gives the whole curve at once.
+//
+
+// Include Files
+#include <cmpsc311_log.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Project Includes
+#include <cmpsc311_assocarr.h>
+#include <cmpsc311_workload.h>
+#include <lcloud_cache.h>
+#include <lcloud_workload.h>
+
+// Defines
+#define LCLOUD_WHATIF_ARGUMENTS "hvl:s:p:c:"
+#define LC_WHATIF_MAX_SIZES 64
+#define LC_WHATIF_MAX_AUTO 65536 // largest cache in the default sweep
+#define USAGE                                                                  \
+    "USAGE: lcloud_whatif [-h] [-v] [-l <logfile>] [-s <sizes>]\n"             \
+    "                     [-p <policies>] [-c <curve-file>] <workload-file>\n" \
+    "\n"                                                                       \
+    "where:\n"                                                                 \
+    "    -h - help mode (display this message)\n"                              \
+    "    -v - verbose output\n"                                                \
+    "    -l - write log messages to the filename <logfile>\n"                  \
+    "    -s - comma separated cache sizes in blocks (default powers of two\n"  \
+    "         up to the blocks the workload touches)\n"                        \
+    "    -p - comma separated policies, lru, lcloud (lcloud_cache.c\n"         \
+    "         itself), fifo and clock (default all)\n"                         \
+    "    -c - write the whole LRU curve to <curve-file> as CSV\n"              \
+    "\n"                                                                       \
+    "    <workload-file> - workload, text or compiled, to replay\n"            \
+    "\n"
+
+#define WI_LOOKUP 0 // a block read through the cache, counts a hit or miss
+#define WI_PUT 1 // a block written into the cache
+#define WI_LRU 0 // the policies
+#define WI_LCLOUD 1
+#define WI_FIFO 2
+#define WI_CLOCK 3
+#define WI_POLICIES 4
+
+// Type definitions
+typedef struct {
+    uint32_t id; // the block, numbered in order of creation
+    uint8_t type; // WI_LOOKUP or WI_PUT
+} wi_access;
+
+typedef struct {
+    char* name;
+    uint32_t* ids; // the block number of each block of the file
+    uint32_t count;
+} wi_file;
+
+typedef struct {
+    uint32_t size; // blocks
+    uint64_t hits[WI_POLICIES];
+} wi_size;
+
+//
+// Global Data
+
+const char* wi_policy_names[WI_POLICIES] = { "lru", "lcloud", "fifo", "clock" };
+wi_access* wi_trace;
+uint64_t wi_count, wi_lookups;
+uint32_t wi_blocks;
+
+//
+// Functions
+
+// Function     : wi_add
+// Description  : append a cache access to the trace
+// Inputs       : id - the block
+//                type - WI_LOOKUP or WI_PUT
+// Outputs      : none
+static void wi_add(uint32_t id, uint8_t type)
+{
+    static uint64_t cap;
+
+    if (wi_count == cap) {
+        cap = cap ? cap * 2 : 4096;
+        wi_trace = (wi_access*)realloc(wi_trace, sizeof(wi_access) * cap);
+    }
+    wi_trace[wi_count].id = id;
+    wi_trace[wi_count].type = type;
+    wi_count++;
+    wi_lookups += (type == WI_LOOKUP);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : wi_load
+// Description  : Turn a workload into block cache accesses. A read looks up
+//                each block it covers. A write puts each block, looking it
+//                up first unless it is new, as lcwrite does.
+//
+// Inputs       : wload - the workload file, text or compiled
+// Outputs      : 0 if successful, -1 if failure
+
+int wi_load(const char* wload)
+{
+    workload_state state;
+    workload_operation* operation = NULL;
+    lc_workload wl;
+    AssocArray files;
+    wi_file* f;
+    const char* name;
+    uint32_t next = 0, i, first, last;
+    int binary, ret, op, pos, size;
+
+    // Open the workload, compiled or text
+    if ((ret = lcloud_wl_open(&wl, wload)) == 1) {
+        ret = openCmpsc311Workload(&state, wload);
+        operation = (workload_operation*)malloc(sizeof(workload_operation));
+    }
+    if (ret) {
+        logMessage(LOG_ERROR_LEVEL, "Failed opening workload [%s]", wload);
+        free(operation);
+        return (-1);
+    }
+    binary = (operation == NULL);
+    init_assoc(&files, stringCompareCallback, pointerCompareCallback);
+
+    for (;;) {
+        if (binary) {
+            op = wl.ops[next].op;
+            name = op == WL_EOF ? "" : lcloud_wl_name(&wl, &wl.ops[next]);
+            pos = wl.ops[next].pos;
+            size = wl.ops[next].size;
+            next++;
+        } else {
+            if (readCmpsc311Workload(&state, operation)) {
+                logMessage(LOG_ERROR_LEVEL, "Failed parsing workload [%s] at line %d", wload, state.lineno);
+                ret = -1;
+                break;
+            }
+            op = operation->op;
+            name = operation->objname;
+            pos = operation->pos;
+            size = operation->size;
+        }
+        if (op >= WL_EOF) {
+            break;
+        }
+
+        // Files keep their blocks across closes
+        if ((f = find_assoc(&files, (char*)name)) == NULL) {
+            f = (wi_file*)calloc(1, sizeof(wi_file));
+            f->name = strdup(name);
+            insert_assoc(&files, f->name, f);
+        }
+        if ((op != WL_READ && op != WL_WRITE) || size == 0) {
+            continue;
+        }
+        first = pos / LC_DEVICE_BLOCK_SIZE;
+        last = (pos + size - 1) / LC_DEVICE_BLOCK_SIZE;
+        for (i = first; i <= last; i++) {
+            if (op == WL_READ) {
+                // blocks past the end are holes, read without the cache
+                if (i < f->count) {
+                    wi_add(f->ids[i], WI_LOOKUP);
+                }
+            } else if (i < f->count) {
+                wi_add(f->ids[i], WI_LOOKUP);
+                wi_add(f->ids[i], WI_PUT);
+            } else {
+                f->ids = (uint32_t*)realloc(f->ids, sizeof(uint32_t) * (i + 1));
+                while (f->count <= i) {
+                    f->ids[f->count++] = wi_blocks++;
+                }
+                wi_add(f->ids[i], WI_PUT);
+            }
+        }
+    }
+
+    // Clean up the files and the workload
+    for (nextIterator(&files, (void**)&name, (void**)&f, 1); f != NULL; nextIterator(&files, (void**)&name, (void**)&f, 0)) {
+        free(f->ids);
+        free(f->name);
+        free(f);
+    }
+    clear_assoc(&files, 0, 0);
+    if (binary) {
+        lcloud_wl_close(&wl);
+    } else {
+        closeCmpsc311Workload(&state);
+        free(operation);
+    }
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : wi_lru
+// Description  : Find the LRU stack distance of every lookup in one pass. A
+//                Fenwick tree over the trace marks the last access of each
+//                block, so the distinct blocks seen since the previous access
+//                of a block are a prefix sum.
+//
+// Inputs       : dist - the lookups at each distance, index 0 for those
+//                       that miss at any size
+// Outputs      : none
+
+void wi_lru(uint64_t* dist)
+{
+    uint32_t* tree = (uint32_t*)calloc(wi_count + 1, sizeof(uint32_t));
+    int64_t* prev = (int64_t*)malloc(sizeof(int64_t) * (wi_blocks ? wi_blocks : 1));
+    uint64_t t, k, above;
+
+    memset(prev, 0xff, sizeof(int64_t) * wi_blocks);
+    for (t = 0; t < wi_count; t++) {
+        wi_access* a = &wi_trace[t];
+        if (prev[a->id] >= 0) {
+            // distinct blocks used after the previous access, plus this one
+            above = 0;
+            for (k = t; k > 0; k -= k & -k) {
+                above += tree[k];
+            }
+            for (k = prev[a->id] + 1; k > 0; k -= k & -k) {
+                above -= tree[k];
+            }
+            if (a->type == WI_LOOKUP) {
+                dist[above + 1]++;
+            }
+            for (k = prev[a->id] + 1; k <= wi_count; k += k & -k) {
+                tree[k]--;
+            }
+        } else if (a->type == WI_LOOKUP) {
+            dist[0]++;
+        }
+        for (k = t + 1; k <= wi_count; k += k & -k) {
+            tree[k]++;
+        }
+        prev[a->id] = t;
+    }
+    free(tree);
+    free(prev);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : wi_lcloud
+// Description  : Replay the trace through lcloud_cache.c itself
+//
+// Inputs       : size - the cache size in blocks
+// Outputs      : the lookups that hit
+
+uint64_t wi_lcloud(uint32_t size)
+{
+    char block[LC_DEVICE_BLOCK_SIZE];
+    uint64_t t;
+    int hits, misses;
+
+    memset(block, 0, sizeof(block));
+    lcloud_initcache(size);
+    for (t = 0; t < wi_count; t++) {
+        // the block number stands in for the sector and block
+        uint32_t id = wi_trace[t].id;
+        if (wi_trace[t].type == WI_PUT || lcloud_copycache(0, id >> 16, id & 0xffff, block) != 0) {
+            lcloud_putcache(0, id >> 16, id & 0xffff, block);
+        }
+    }
+    lcloud_cachestats(&hits, &misses);
+    disableLogLevels(LOG_OUTPUT_LEVEL);
+    lcloud_closecache();
+    enableLogLevels(LOG_OUTPUT_LEVEL);
+    return (uint64_t)hits;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : wi_queue
+// Description  : Replay the trace through a FIFO or CLOCK cache. FIFO evicts
+//                the oldest block, CLOCK the first one the hand finds not
+//                used since it last passed.
+//
+// Inputs       : size - the cache size in blocks
+//                clock - 1 for CLOCK, 0 for FIFO
+// Outputs      : the lookups that hit
+
+uint64_t wi_queue(uint32_t size, int clock)
+{
+    int32_t* slot = (int32_t*)malloc(sizeof(int32_t) * (wi_blocks ? wi_blocks : 1));
+    uint32_t* held = (uint32_t*)malloc(sizeof(uint32_t) * size);
+    uint8_t* used = (uint8_t*)calloc(size, 1);
+    uint32_t hand = 0, filled = 0;
+    uint64_t t, hits = 0;
+
+    memset(slot, 0xff, sizeof(int32_t) * wi_blocks);
+    for (t = 0; t < wi_count; t++) {
+        uint32_t id = wi_trace[t].id;
+        if (slot[id] >= 0) {
+            hits += (wi_trace[t].type == WI_LOOKUP);
+            used[slot[id]] = 1;
+            continue;
+        }
+        // a miss, or a new block, takes a slot
+        if (filled < size) {
+            hand = filled++;
+        } else {
+            while (clock && used[hand]) {
+                used[hand] = 0;
+                hand = (hand + 1) % size;
+            }
+            slot[held[hand]] = -1;
+        }
+        held[hand] = id;
+        slot[id] = hand;
+        used[hand] = 0;
+        hand = (hand + 1) % size;
+    }
+    free(slot);
+    free(held);
+    free(used);
+    return (hits);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : main
+// Description  : The main function for the cache what-if simulator
+//
+// Inputs       : argc - the number of command line parameters
+//                argv - the parameters
+// Outputs      : 0 if successful, -1 if failure
+
+int main(int argc, char* argv[])
+{
+    // Local variables
+    int ch, verbose = 0, log_initialized = 0, policies = 0, nsizes = 0, i, p;
+    wi_size sizes[LC_WHATIF_MAX_SIZES];
+    uint64_t *dist, hits;
+    char *opt, *curve = NULL;
+    FILE* out;
+
+    // Process the command line parameters
+    while ((ch = getopt(argc, argv, LCLOUD_WHATIF_ARGUMENTS)) != -1) {
+
+        switch (ch) {
+        case 'h': // Help, print usage
+            fprintf(stderr, USAGE);
+            return (-1);
+
+        case 'v': // Verbose Flag
+            verbose = 1;
+            break;
+
+        case 'l': // Set the log filename
+            initializeLogWithFilename(optarg);
+            log_initialized = 1;
+            break;
+
+        case 's': // Cache sizes, a comma separated list
+            for (opt = strtok(optarg, ","); opt != NULL; opt = strtok(NULL, ",")) {
+                if (nsizes == LC_WHATIF_MAX_SIZES || atoi(opt) < 1) {
+                    fprintf(stderr, "Bad cache size (%s), aborting.\n", opt);
+                    return (-1);
+                }
+                sizes[nsizes++].size = atoi(opt);
+            }
+            break;
+
+        case 'p': // Policies, a comma separated list
+            for (opt = strtok(optarg, ","); opt != NULL; opt = strtok(NULL, ",")) {
+                for (p = 0; p < WI_POLICIES && strcmp(opt, wi_policy_names[p]) != 0; p++)
+                    ;
+                if (p == WI_POLICIES) {
+                    fprintf(stderr, "Unknown policy (%s), aborting.\n", opt);
+                    return (-1);
+                }
+                policies |= 1 << p;
+            }
+            break;
+
+        case 'c': // Write the LRU curve
+            curve = optarg;
+            break;
+
+        default: // Default (unknown)
+            fprintf(stderr, "Unknown command line option (%c), aborting.\n", ch);
+            return (-1);
+        }
+    }
+
+    // Setup the log as needed
+    if (!log_initialized) {
+        initializeLogWithFilehandle(CMPSC311_LOG_STDERR);
+    }
+    if (verbose) {
+        enableLogLevels(LOG_INFO_LEVEL);
+    }
+
+    // The workload should be the next option
+    if (argv[optind] == NULL) {
+        fprintf(stderr, "Missing command line parameters, use -h to see usage, aborting.\n");
+        return (-1);
+    }
+    if (wi_load(argv[optind])) {
+        return (-1);
+    }
+    policies = policies ? policies : (1 << WI_POLICIES) - 1;
+    if (nsizes == 0) {
+        for (i = 1; nsizes < LC_WHATIF_MAX_SIZES && i <= LC_WHATIF_MAX_AUTO; i *= 2) {
+            sizes[nsizes++].size = i;
+            if ((uint32_t)i >= wi_blocks) {
+                break;
+            }
+        }
+    }
+
+    // The LRU distances give every size at once
+    dist = (uint64_t*)calloc(wi_blocks + 2, sizeof(uint64_t));
+    wi_lru(dist);
+    for (i = 0; i < nsizes; i++) {
+        memset(sizes[i].hits, 0, sizeof(sizes[i].hits));
+        for (hits = 0, p = 1; p <= (int)wi_blocks && (uint32_t)p <= sizes[i].size; p++) {
+            hits += dist[p];
+        }
+        sizes[i].hits[WI_LRU] = hits;
+        if (policies & (1 << WI_LCLOUD)) {
+            sizes[i].hits[WI_LCLOUD] = wi_lcloud(sizes[i].size);
+        }
+        if (policies & (1 << WI_FIFO)) {
+            sizes[i].hits[WI_FIFO] = wi_queue(sizes[i].size, 0);
+        }
+        if (policies & (1 << WI_CLOCK)) {
+            sizes[i].hits[WI_CLOCK] = wi_queue(sizes[i].size, 1);
+        }
+    }
+
+    // Print the table of hit ratios
+    printf("# %s: %llu lookups, %llu accesses, %u blocks, %llu cold misses\n", argv[optind],
+        (unsigned long long)wi_lookups, (unsigned long long)wi_count, wi_blocks, (unsigned long long)dist[0]);
+    printf("%8s", "blocks");
+    for (p = 0; p < WI_POLICIES; p++) {
+        if (policies & (1 << p)) {
+            printf(" %8s", wi_policy_names[p]);
+        }
+    }
+    printf("\n");
+    for (i = 0; i < nsizes; i++) {
+        printf("%7u%c", sizes[i].size, sizes[i].size == LC_CACHE_MAXBLOCKS ? '*' : ' ');
+        for (p = 0; p < WI_POLICIES; p++) {
+            if (policies & (1 << p)) {
+                printf(" %8.4f", wi_lookups ? (double)sizes[i].hits[p] / wi_lookups : 0.0);
+            }
+        }
+        printf("\n");
+    }
+
+    // And the LRU curve, at every size where it changes
+    if (curve) {
+        if ((out = fopen(curve, "w")) == NULL) {
+            logMessage(LOG_ERROR_LEVEL, "Failed creating [%s]", curve);
+            return (-1);
+        }
+        fprintf(out, "blocks,hits,hit_ratio\n");
+        for (hits = 0, i = 1; i <= (int)wi_blocks; i++) {
+            if (dist[i]) {
+                hits += dist[i];
+                fprintf(out, "%d,%llu,%.6f\n", i, (unsigned long long)hits, (double)hits / wi_lookups);
+            }
+        }
+        fclose(out);
+    }
+
+    // Do some cleanup
+    free(dist);
+    free(wi_trace);
+    freeLogRegistrations();
+    return (0);
+}
@@ -0,0 +1,334 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : lcloud_workload.c
+//  Description    : This is the compiled form of the CMPSC311 workload
+//                   files. Conversion parses the text once. Replay maps
+//                   the result read-only and hands out operations and
+//                   payloads in place, so nothing is parsed or copied per
+//                   operation.
+//
+//   Author        : Tzu Chieh Huang
+//   Last Modified : 18th Oct 2026
+//
+
+// Includes
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cmpsc311_assocarr.h>
+#include <cmpsc311_log.h>
+#include <cmpsc311_workload.h>
+#include <lcloud_workload.h>
+
+//
+// Functions
+
+// Function     : lcloud_wl_pad
+// Description  : pad the output to the next 8 byte boundary
+// Inputs       : out - the output file
+// Outputs      : the new offset
+static uint64_t lcloud_wl_pad(FILE* out)
+{
+    static const char zeros[8];
+    long off = ftell(out);
+
+    if (off % 8) {
+        fwrite(zeros, 1, 8 - off % 8, out);
+        off += 8 - off % 8;
+    }
+    return (uint64_t)off;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_wl_begin
+// Description  : Start writing a binary workload
+//
+// Inputs       : w - the writer to set up
+//                bin - the binary file to write
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_wl_begin(lc_wl_writer* w, const char* bin)
+{
+    memset(w, 0, sizeof(*w));
+    if ((w->out = fopen(bin, "wb")) == NULL) {
+        logMessage(LOG_ERROR_LEVEL, "Failed creating [%s]", bin);
+        return (-1);
+    }
+    w->path = strdup(bin);
+    init_assoc(&w->index, stringCompareCallback, pointerCompareCallback);
+
+    // the header is written last, once the sections are placed
+    fwrite(&w->hdr, sizeof(w->hdr), 1, w->out);
+    w->hdr.data_off = lcloud_wl_pad(w->out);
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_wl_add
+// Description  : Append one operation to a binary workload, its payload goes
+//                out now and its record once the workload is complete
+//
+// Inputs       : w - the writer
+//                op - the operation, WL_OPEN to WL_EOF
+//                objname - the object, ignored for WL_EOF
+//                pos, size, data - the payload of a read or write
+// Outputs      : none
+
+void lcloud_wl_add(lc_wl_writer* w, int op, const char* objname, uint32_t pos, uint32_t size, const char* data)
+{
+    lc_wl_op* rec;
+    void* found;
+
+    if (w->nops == w->cap) {
+        w->cap = w->cap ? w->cap * 2 : 1024;
+        w->ops = (lc_wl_op*)realloc(w->ops, sizeof(lc_wl_op) * w->cap);
+    }
+    rec = &w->ops[w->nops++];
+    memset(rec, 0, sizeof(lc_wl_op));
+    rec->op = op;
+    if (op != WL_EOF) {
+        // objects are numbered in order of first use
+        if ((found = find_assoc(&w->index, (char*)objname)) == NULL) {
+            w->names = (char**)realloc(w->names, sizeof(char*) * (w->nobjs + 1));
+            w->names[w->nobjs] = strdup(objname);
+            found = (void*)(uintptr_t)(++w->nobjs);
+            insert_assoc(&w->index, w->names[w->nobjs - 1], found);
+        }
+        rec->obj = (uint32_t)(uintptr_t)found - 1;
+    }
+    if (op == WL_READ || op == WL_WRITE) {
+        rec->pos = pos;
+        rec->size = size;
+        rec->data = w->data_len;
+        fwrite(data, 1, size, w->out);
+        w->data_len += size;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_wl_end
+// Description  : Finish a binary workload, writing the names, the operations
+//                and the header, or throw it away
+//
+// Inputs       : w - the writer
+//                ok - 0 to throw the file away
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_wl_end(lc_wl_writer* w, int ok)
+{
+    uint64_t name_off;
+    uint32_t i;
+    int ret = ok ? 0 : -1;
+
+    if (ret == 0) {
+        // name offsets, then the names themselves
+        w->hdr.names_off = lcloud_wl_pad(w->out);
+        name_off = w->hdr.names_off + sizeof(uint64_t) * w->nobjs;
+        for (i = 0; i < w->nobjs; i++) {
+            fwrite(&name_off, sizeof(name_off), 1, w->out);
+            name_off += strlen(w->names[i]) + 1;
+        }
+        for (i = 0; i < w->nobjs; i++) {
+            fwrite(w->names[i], 1, strlen(w->names[i]) + 1, w->out);
+        }
+        w->hdr.ops_off = lcloud_wl_pad(w->out);
+        fwrite(w->ops, sizeof(lc_wl_op), w->nops, w->out);
+        w->hdr.magic = LC_WL_MAGIC;
+        w->hdr.version = LC_WL_VERSION;
+        w->hdr.nops = w->nops;
+        w->hdr.nobjs = w->nobjs;
+        w->hdr.size = ftell(w->out);
+        fseek(w->out, 0, SEEK_SET);
+        fwrite(&w->hdr, sizeof(w->hdr), 1, w->out);
+        if (ferror(w->out)) {
+            logMessage(LOG_ERROR_LEVEL, "Failed writing [%s]", w->path);
+            ret = -1;
+        }
+    }
+    if (fclose(w->out) != 0) {
+        ret = -1;
+    }
+    if (ret != 0) {
+        unlink(w->path);
+    }
+
+    clear_assoc(&w->index, 0, 0);
+    for (i = 0; i < w->nobjs; i++) {
+        free(w->names[i]);
+    }
+    free(w->names);
+    free(w->ops);
+    free(w->path);
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_wl_convert
+// Description  : Compile a text workload into the binary format
+//
+// Inputs       : text - the text workload file
+//                bin - the binary file to write
+// Outputs      : 0 if successful, -1 if failure
+
+int lcloud_wl_convert(const char* text, const char* bin)
+{
+    workload_state state;
+    workload_operation* operation;
+    lc_wl_writer w;
+    int ok = 1, ret;
+
+    if (openCmpsc311Workload(&state, text)) {
+        logMessage(LOG_ERROR_LEVEL, "Failed opening workload [%s]", text);
+        return (-1);
+    }
+    if (lcloud_wl_begin(&w, bin)) {
+        closeCmpsc311Workload(&state);
+        return (-1);
+    }
+    operation = (workload_operation*)malloc(sizeof(workload_operation));
+    do {
+        if (readCmpsc311Workload(&state, operation)) {
+            logMessage(LOG_ERROR_LEVEL, "Failed parsing workload [%s] at line %d", text, state.lineno);
+            ok = 0;
+            break;
+        }
+        lcloud_wl_add(&w, operation->op, operation->objname, operation->pos, operation->size,
+            operation->data);
+    } while (operation->op < WL_EOF);
+
+    if (ok) {
+        logMessage(LOG_OUTPUT_LEVEL, "Compiled [%s]: %u operations, %u objects, %llu payload bytes", text,
+            w.nops, w.nobjs, (unsigned long long)w.data_len);
+    }
+    ret = lcloud_wl_end(&w, ok);
+    free(operation);
+    closeCmpsc311Workload(&state);
+    return (ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_wl_check
+// Description  : Check that every section, name and operation of a mapped
+//                workload is in bounds, so replay can trust it
+//
+// Inputs       : wl - the mapped workload
+// Outputs      : 1 if it is sound, 0 if not
+
+static int lcloud_wl_check(lc_workload* wl)
+{
+    const lc_wl_header* h = wl->hdr;
+    uint64_t names_end, data_len;
+    uint32_t i;
+
+    if (h->version != LC_WL_VERSION || h->size != wl->size || h->nops == 0
+        || h->data_off < sizeof(lc_wl_header) || h->names_off < h->data_off || h->ops_off < h->names_off
+        || h->names_off % 8 || h->ops_off % 8
+        || (h->size - h->ops_off) / sizeof(lc_wl_op) < h->nops
+        || (h->ops_off - h->names_off) / sizeof(uint64_t) < h->nobjs) {
+        return 0;
+    }
+    wl->ops = (const lc_wl_op*)(wl->base + h->ops_off);
+    wl->names = (const uint64_t*)(wl->base + h->names_off);
+    names_end = h->names_off + sizeof(uint64_t) * h->nobjs;
+    for (i = 0; i < h->nobjs; i++) {
+        if (wl->names[i] < names_end || wl->names[i] >= h->ops_off
+            || memchr(wl->base + wl->names[i], '\0', h->ops_off - wl->names[i]) == NULL) {
+            return 0;
+        }
+    }
+    data_len = h->names_off - h->data_off;
+    for (i = 0; i < h->nops; i++) {
+        const lc_wl_op* op = &wl->ops[i];
+        if (op->op > WL_EOF || (op->op == WL_EOF) != (i == h->nops - 1)
+            || (op->op != WL_EOF && op->obj >= h->nobjs)
+            || op->size > CMPSC311_MAX_OPSIZE_MAXIMUM || op->data > data_len
+            || op->size > data_len - op->data) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_wl_open
+// Description  : Map a binary workload and check it
+//
+// Inputs       : wl - the workload to fill in
+//                path - the file
+// Outputs      : 0 if successful, 1 if the file is not a binary workload,
+//                -1 if it cannot be read or is corrupt
+
+int lcloud_wl_open(lc_workload* wl, const char* path)
+{
+    struct stat st;
+    uint32_t magic;
+    void* map;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) == -1) {
+        return (-1);
+    }
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(lc_wl_header)
+        || pread(fd, &magic, sizeof(magic), 0) != sizeof(magic) || magic != LC_WL_MAGIC) {
+        close(fd);
+        return (1);
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return (-1);
+    }
+    madvise(map, st.st_size, MADV_WILLNEED);
+    wl->base = (const char*)map;
+    wl->size = st.st_size;
+    wl->hdr = (const lc_wl_header*)map;
+    if (!lcloud_wl_check(wl)) {
+        logMessage(LOG_ERROR_LEVEL, "Corrupt binary workload [%s]", path);
+        lcloud_wl_close(wl);
+        return (-1);
+    }
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_wl_close
+// Description  : Unmap a binary workload
+//
+// Inputs       : wl - the workload
+// Outputs      : none
+
+void lcloud_wl_close(lc_workload* wl)
+{
+    munmap((void*)wl->base, wl->size);
+    memset(wl, 0, sizeof(*wl));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lcloud_wl_name / lcloud_wl_data
+// Description  : The object name / payload of an operation, in the mapping
+//
+// Inputs       : wl - the workload
+//                op - the operation
+// Outputs      : the name / the payload
+
+const char* lcloud_wl_name(const lc_workload* wl, const lc_wl_op* op)
+{
+    return wl->base + wl->names[op->obj];
+}
+
+const char* lcloud_wl_data(const lc_workload* wl, const lc_wl_op* op)
+{
+    return wl->base + wl->hdr->data_off + op->data;
+}
@@ -0,0 +1,96 @@
+#ifndef LCLOUD_WORKLOAD_INCLUDED
+#define LCLOUD_WORKLOAD_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : lcloud_workload.h
+//  Description    : This is the compiled form of the CMPSC311 workload
+//                   files, replayed in place from a read-only mapping.
+//
+//   Author        : Tzu Chieh Huang
+//   Last Modified : 18th Oct 2026
+//
+
+// Includes
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <cmpsc311_assocarr.h>
+
+// Defines
+#define LC_WL_MAGIC 0x4c57434c // "LCWL" on disk
+#define LC_WL_VERSION 1
+
+// Type definitions
+
+// The file is the header, the payloads, the name table and then the
+// operation index, each section starting on an 8 byte boundary. All the
+// offsets are from the start of the file.
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nops; // operations, the last one is WL_EOF
+    uint32_t nobjs; // object names
+    uint64_t data_off; // payloads, back to back
+    uint64_t names_off; // nobjs name offsets, then the names
+    uint64_t ops_off; // nops lc_wl_op records
+    uint64_t size; // length of the file
+} lc_wl_header;
+
+typedef struct {
+    uint8_t op; // WL_OPEN, WL_WRITE, WL_READ, WL_CLOSE or WL_EOF
+    uint8_t pad[3];
+    uint32_t obj; // index into the name table
+    uint32_t pos;
+    uint32_t size;
+    uint64_t data; // payload offset from data_off
+} lc_wl_op;
+
+typedef struct {
+    const char* base; // the mapping
+    size_t size;
+    const lc_wl_header* hdr;
+    const lc_wl_op* ops;
+    const uint64_t* names;
+} lc_workload;
+
+typedef struct {
+    FILE* out;
+    char* path;
+    lc_wl_header hdr;
+    lc_wl_op* ops; // records, written at the end
+    uint32_t nops, cap;
+    char** names; // object names in order of first use
+    uint32_t nobjs;
+    AssocArray index; // name to its number plus one
+    uint64_t data_len;
+} lc_wl_writer;
+
+//
+// Functional Prototypes
+
+int lcloud_wl_begin( lc_wl_writer *w, const char *bin );
+    // Start writing a binary workload
+
+void lcloud_wl_add( lc_wl_writer *w, int op, const char *objname, uint32_t pos, uint32_t size, const char *data );
+    // Append one operation, with its payload if it is a read or write
+
+int lcloud_wl_end( lc_wl_writer *w, int ok );
+    // Finish a binary workload, or remove it if not ok
+
+int lcloud_wl_convert( const char *text, const char *bin );
+    // Compile a text workload into the binary format
+
+int lcloud_wl_open( lc_workload *wl, const char *path );
+    // Map and check a binary workload, 1 if the file is not one, -1 if bad
+
+void lcloud_wl_close( lc_workload *wl );
+    // Unmap a binary workload
+
+const char *lcloud_wl_name( const lc_workload *wl, const lc_wl_op *op );
+    // The object name of an operation
+
+const char *lcloud_wl_data( const lc_workload *wl, const lc_wl_op *op );
+    // The payload of an operation, in place in the mapping
+
+#endif